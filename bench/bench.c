@@ -0,0 +1,603 @@
+/*
+    Benchmark driver for the simulation core. It sweeps the ball count, the
+    radius and the collision backend, times every phase of every step, and
+    prints the median and 99th percentile nanoseconds per step of each phase
+    as CSV on stdout.
+
+    The core is compiled into this file with its main left out, so the
+    benchmark calls the very same functions as the program.
+
+    With --compare it instead checks every backend against the naive one on
+    the same seeded scene: the pairs each backend bounces in the first step
+    must be exactly the pairs the naive backend bounces, and the positions
+    after the given number of steps are compared within --tolerance pixels.
+    Since backends resolve the contacts of a ball in different orders, the
+    positions are allowed to drift apart and are only reported; a backend
+    that misses or invents a pair makes the run fail.
+    The collision events of the first step are checked along the way:
+    every event must name a pair the backend bounced, with a unit normal
+    and an impulse other than 0, and a backend with events that do not,
+    or that lost any, fails the run too.
+
+    --cell-block <cells> runs the grid like --cell-block does the program,
+    visiting the subspaces in square blocks of that many a side, and is
+    printed with every line so runs of different block sizes can be put
+    side by side.
+
+    --placement <name[:params]> scatters the balls like --placement does
+    the program, so the backends are timed on the lattices, gases and
+    fronts of load testing as well as on the uniform scene, and is printed
+    with every line too. Scenes a placement cannot fit are run with the
+    balls it placed.
+
+    Usage: balls_bench [--threads count] [--max-balls count] [--seconds s]
+                       [--compare steps] [--balls count] [--radius r]
+                       [--tolerance px] [--cell-block cells]
+                       [--placement name[:params]]
+*/
+#define BALLS_NO_MAIN
+#include "../src/balls.c"
+
+#define BENCH_WARMUP_STEPS 3
+#define BENCH_MIN_STEPS 5
+#define BENCH_MAX_STEPS 200
+#define BENCH_SEED 12345
+
+typedef enum BenchPhase {
+    BENCH_ASSIGN,
+    BENCH_COLLIDE,
+    BENCH_INTEGRATE,
+    BENCH_STEP,
+    BENCH_PHASE_COUNT
+} BenchPhase;
+
+const char *bench_phase_names[BENCH_PHASE_COUNT] = { "assign", "collide", "integrate", "step" };
+
+/*
+    The backends being compared. The naive backend is the all-pairs test of
+    renderBalls without the drawing, and like sweep and prune it is only run
+    up to the ball count where one step still takes a reasonable time.
+    Center is the grid with --binning center, and verlet the neighbour
+    lists of --verlet with a skin of one radius.
+*/
+typedef enum BenchBackend {
+    BACKEND_NAIVE,
+    BACKEND_GRID,
+    BACKEND_SWEEP,
+    BACKEND_QUADTREE,
+    BACKEND_HASH,
+    BACKEND_HGRID,
+    BACKEND_CENTER,
+    BACKEND_VERLET,
+    BACKEND_COUNT
+} BenchBackend;
+
+const char *backend_names[BACKEND_COUNT] = { "naive", "grid", "sweep", "quadtree", "hash", "hgrid", "center", "verlet" };
+const int backend_max_balls[BACKEND_COUNT] = { 10000, 1000000, 100000, 1000000, 1000000, 1000000, 1000000, 1000000 };
+
+const int ball_counts[] = { 1000, 10000, 100000, 1000000 };
+const int radii[] = { 1, 3 };
+
+/*
+    Samples of one phase, in nanoseconds.
+*/
+typedef struct PhaseSamples {
+    double  ns[BENCH_MAX_STEPS];
+    int     count;
+} PhaseSamples;
+
+double nanoseconds(Uint64 ticks) {
+    return (double) ticks * 1e9 / SDL_GetPerformanceFrequency();
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double da = *(const double*) a;
+    double db = *(const double*) b;
+    return (da > db) - (da < db);
+}
+
+/*
+    Returns the sample below which the given fraction of the samples lie.
+    Sorts the samples in place.
+*/
+double percentile(PhaseSamples *samples, double fraction) {
+    qsort(samples->ns, samples->count, sizeof(double), compareDoubles);
+    int index = (int) (fraction * (samples->count - 1) + 0.5);
+    return samples->ns[index];
+}
+
+void collideNaive(BallStore *balls) {
+    for (int i = 0; i < balls->count; i++) {
+        for (int j = i + 1; j < balls->count; j++) {
+            if (overlaps(balls, i, j)) {
+                bounce(balls, i, j);
+            }
+        }
+    }
+}
+
+/*
+    Runs one step of the backend, adding the time of every phase to the
+    samples.
+*/
+void benchStep(BenchBackend backend, BallStore *balls, PhaseSamples *samples, bool record) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    Uint64 assigned = start;
+
+    switch (backend) {
+        case BACKEND_NAIVE :
+            collideNaive(balls);
+            break;
+
+        case BACKEND_GRID :
+        case BACKEND_CENTER :
+            assignSubspaces(balls);
+            assigned = SDL_GetPerformanceCounter();
+            if (workerCount() > 1) {
+                collideBallsParallel(balls);
+            }
+            else {
+                collideBalls(balls);
+            }
+            break;
+
+        case BACKEND_SWEEP :
+            sweepBalls(balls);
+            break;
+
+        case BACKEND_QUADTREE :
+            collideQuadtree(balls);
+            break;
+
+        case BACKEND_HASH :
+            assignSpatialHash(balls);
+            assigned = SDL_GetPerformanceCounter();
+            collideSpatialHash(balls);
+            break;
+
+        case BACKEND_HGRID :
+            assignHierarchicalGrid(balls);
+            assigned = SDL_GetPerformanceCounter();
+            collideHierarchicalGrid(balls);
+            break;
+
+        case BACKEND_VERLET :
+            if (verletListsStale(balls)) {
+                rebuildVerletLists(balls);
+            }
+            assigned = SDL_GetPerformanceCounter();
+            collideVerletLists(balls);
+            break;
+
+        default :
+            break;
+    }
+
+    Uint64 collided = SDL_GetPerformanceCounter();
+    moveBalls(balls);
+    Uint64 end = SDL_GetPerformanceCounter();
+
+    if (!record) {
+        return;
+    }
+
+    if (backend == BACKEND_GRID || backend == BACKEND_HASH || backend == BACKEND_HGRID || backend == BACKEND_CENTER ||
+        backend == BACKEND_VERLET) {
+        samples[BENCH_ASSIGN].ns[samples[BENCH_ASSIGN].count++] = nanoseconds(assigned - start);
+    }
+    samples[BENCH_COLLIDE].ns[samples[BENCH_COLLIDE].count++] = nanoseconds(collided - assigned);
+    samples[BENCH_INTEGRATE].ns[samples[BENCH_INTEGRATE].count++] = nanoseconds(end - collided);
+    samples[BENCH_STEP].ns[samples[BENCH_STEP].count++] = nanoseconds(end - start);
+}
+
+// The placement as given on the command line, for the CSV.
+const char *placement_spec = "uniform";
+
+/*
+    Creates the balls of one configuration, always from the same seed.
+*/
+void placeBalls(BallStore *balls, int amnt, int radius) {
+    srand(BENCH_SEED);
+    scatterBalls(balls, amnt, radius, NULL);
+}
+
+/*
+    Allocates and places the balls of one configuration, with everything
+    the backends need.
+    Returns 0 on success and 1 if an allocation failed.
+*/
+int setUpConfiguration(BenchBackend backend, BallStore *balls, int amnt, int radius) {
+    configureSubspaces(radius * 2 * subspace_balls);
+    min_subspace_size = radius * 2;
+    centerBinning = backend == BACKEND_CENTER;
+    verlet_skin = backend == BACKEND_VERLET ? radius : 0;
+
+    if (initBallStore(balls, amnt) != 0) {
+        return 1;
+    }
+    placeBalls(balls, amnt, radius);
+    selectCellKernel(uniformRadius(balls));
+
+    // a placement may fit fewer balls than were asked for
+    amnt = balls->count;
+    if (initSubspaceGrid(amnt) != 0 || initSubspaceBuckets(amnt) != 0 || initSweepOrder(amnt) != 0 ||
+        initQuadtree(amnt) != 0 || initSpatialHash(amnt) != 0 ||
+        (backend == BACKEND_VERLET && initVerletLists(amnt) != 0)) {
+        return 1;
+    }
+
+    // the levels of the hierarchical grid follow the radii of the balls
+    if (initHierarchicalGrid(balls, amnt) != 0) {
+        return 1;
+    }
+
+    // the sweep keeps its order from step to step, so sort it up front the
+    // way a running simulation has it instead of timing the first sort
+    if (backend == BACKEND_SWEEP) {
+        sortSweepOrder(balls);
+    }
+    return 0;
+}
+
+void tearDownConfiguration(BallStore *balls) {
+    freeBallStore(balls);
+    freeSubspaceGrid();
+    freeQuadtree();
+    freeSpatialHash();
+    freeHierarchicalGrid();
+    freeVerletLists();
+    free(sweepOrder);
+}
+
+/*
+    Benchmarks one configuration and prints a CSV line per phase.
+    Returns 0 on success and 1 if the configuration could not be set up.
+*/
+int benchConfiguration(BenchBackend backend, int amnt, int radius, double seconds) {
+    BallStore balls;
+    if (setUpConfiguration(backend, &balls, amnt, radius) != 0) {
+        return 1;
+    }
+
+    PhaseSamples *samples = calloc(BENCH_PHASE_COUNT, sizeof(PhaseSamples));
+    if (samples == NULL) {
+        return 1;
+    }
+
+    for (int step = 0; step < BENCH_WARMUP_STEPS; step++) {
+        benchStep(backend, &balls, samples, false);
+    }
+
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 deadline = SDL_GetPerformanceCounter() + (Uint64) (seconds * frequency);
+    int steps = 0;
+    while (steps < BENCH_MAX_STEPS && (steps < BENCH_MIN_STEPS || SDL_GetPerformanceCounter() < deadline)) {
+        benchStep(backend, &balls, samples, true);
+        steps++;
+    }
+
+    for (int phase = 0; phase < BENCH_PHASE_COUNT; phase++) {
+        if (samples[phase].count == 0) {
+            continue;
+        }
+        double median = percentile(&samples[phase], 0.5);
+        double p99 = percentile(&samples[phase], 0.99);
+        printf("%s,%s,%d,%d,%d,%d,%s,%d,%.0f,%.0f\n", backend_names[backend], placement_spec, balls.count, radius,
+            workerCount(), cell_block, bench_phase_names[phase], samples[phase].count, median, p99);
+        fflush(stdout);
+    }
+
+    free(samples);
+    tearDownConfiguration(&balls);
+    return 0;
+}
+
+/*
+    The pairs bounced during one step, each as the lower index in the upper
+    half and the higher index in the lower half, so sorting them orders the
+    pairs.
+*/
+typedef struct PairSet {
+    Uint64          *pairs;
+    int             count;
+    int             capacity;
+    SDL_SpinLock    lock;
+} PairSet;
+
+PairSet observedPairs;
+
+/*
+    Adds the pair of balls a and b to the set. The parallel collision
+    passes add from several threads at once.
+*/
+void addPair(PairSet *set, int a, int b) {
+    Uint64 pair = a < b ? ((Uint64) a << 32) | b : ((Uint64) b << 32) | a;
+
+    SDL_AtomicLock(&set->lock);
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity > 0 ? set->capacity * 2 : 1024;
+        set->pairs = realloc(set->pairs, sizeof(Uint64) * set->capacity);
+        if (set->pairs == NULL) {
+            fprintf(stderr, "Could not grow the observed pairs!\n");
+            exit(1);
+        }
+    }
+    set->pairs[set->count++] = pair;
+    SDL_AtomicUnlock(&set->lock);
+}
+
+void observePair(int a, int b) {
+    addPair(&observedPairs, a, b);
+}
+
+int comparePairs(const void *a, const void *b) {
+    Uint64 pa = *(const Uint64*) a;
+    Uint64 pb = *(const Uint64*) b;
+    return (pa > pb) - (pa < pb);
+}
+
+/*
+    Sorts the observed pairs and drops the ones bounced more than once.
+*/
+void sortPairs(PairSet *set) {
+    qsort(set->pairs, set->count, sizeof(Uint64), comparePairs);
+
+    int unique = 0;
+    for (int i = 0; i < set->count; i++) {
+        if (unique == 0 || set->pairs[i] != set->pairs[unique - 1]) {
+            set->pairs[unique++] = set->pairs[i];
+        }
+    }
+    set->count = unique;
+}
+
+/*
+    Counts the pairs of the reference missing from the set, and the pairs of
+    the set the reference does not have. Both must be sorted.
+*/
+void diffPairs(PairSet *reference, PairSet *set, int *missing, int *extra) {
+    *missing = 0;
+    *extra = 0;
+
+    int i = 0;
+    int j = 0;
+    while (i < reference->count || j < set->count) {
+        if (j == set->count || (i < reference->count && reference->pairs[i] < set->pairs[j])) {
+            (*missing)++;
+            i++;
+        }
+        else if (i == reference->count || set->pairs[j] < reference->pairs[i]) {
+            (*extra)++;
+            j++;
+        }
+        else {
+            i++;
+            j++;
+        }
+    }
+}
+
+/*
+    The pairs of the collision events of one step, how many events there
+    were, and how many of them were lost or malformed.
+*/
+typedef struct FeedCheck {
+    PairSet pairs;
+    int     events;
+    int     lost;
+    int     malformed;
+} FeedCheck;
+
+FeedCheck feedCheck;
+
+void checkCollisionFeed(const CollisionBatch *batch, void *data) {
+    (void) data;
+    feedCheck.events += batch->count;
+    feedCheck.lost += batch->lost;
+    for (int k = 0; k < batch->count; k++) {
+        const CollisionEvent *event = &batch->events[k];
+        double length = sqrt((double) event->nx * event->nx + (double) event->ny * event->ny);
+        if (fabs(length - 1) > 1e-3 || event->impulse == 0 || !isfinite(event->impulse)) {
+            feedCheck.malformed++;
+        }
+        addPair(&feedCheck.pairs, event->a, event->b);
+    }
+}
+
+/*
+    Runs every backend on the same scene for the given number of steps and
+    prints a CSV line comparing it with the naive backend.
+    Returns 0 if every backend bounced the same pairs as the naive one in the
+    first step and had sound collision events for them, and 1 otherwise or
+    if a backend could not be set up.
+*/
+int compareBackends(int amnt, int radius, int steps, double tolerance) {
+    PairSet reference = { 0 };
+    real *reference_x = malloc(sizeof(real) * amnt);
+    real *reference_y = malloc(sizeof(real) * amnt);
+    if (reference_x == NULL || reference_y == NULL) {
+        return 1;
+    }
+
+    double reference_ns = 0;
+    int failed = 0;
+
+    printf("backend,placement,balls,radius,threads,steps,pairs,missing,extra,events,bad_events,max_error,diverged,ns_per_step,speedup\n");
+
+    for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+        BallStore balls;
+        if (setUpConfiguration(backend, &balls, amnt, radius) != 0) {
+            fprintf(stderr, "Could not set up %s with %d balls!\n", backend_names[backend], amnt);
+            return 1;
+        }
+
+        // only the pairs of the first step are watched
+        Uint64 start = SDL_GetPerformanceCounter();
+        observedPairs.count = 0;
+        feedCheck = (FeedCheck) { .pairs = feedCheck.pairs };
+        feedCheck.pairs.count = 0;
+        if (subscribeCollisions(checkCollisionFeed, NULL) != 0) {
+            fprintf(stderr, "Could not subscribe to the collision events!\n");
+            return 1;
+        }
+        for (int step = 0; step < steps; step++) {
+            bounceObserver = step == 0 ? observePair : NULL;
+            if (step == 0) {
+                reserveCollisions(balls.count * COLLISION_EVENTS_PER_BALL);
+            }
+            benchStep(backend, &balls, NULL, false);
+            if (step == 0) {
+                deliverCollisions();
+                unsubscribeCollisions(checkCollisionFeed, NULL);
+            }
+        }
+        bounceObserver = NULL;
+        double ns = nanoseconds(SDL_GetPerformanceCounter() - start) / steps;
+        sortPairs(&observedPairs);
+        sortPairs(&feedCheck.pairs);
+
+        if (backend == BACKEND_NAIVE) {
+            reference = observedPairs;
+            observedPairs = (PairSet) { 0 };
+            memcpy(reference_x, balls.pos_x, sizeof(real) * balls.count);
+            memcpy(reference_y, balls.pos_y, sizeof(real) * balls.count);
+            reference_ns = ns;
+        }
+
+        int missing;
+        int extra;
+        diffPairs(&reference, backend == BACKEND_NAIVE ? &reference : &observedPairs, &missing, &extra);
+        if (missing > 0 || extra > 0) {
+            failed = 1;
+        }
+
+        // the events may skip pairs that passed no momentum, but nothing else
+        int unused;
+        int stray;
+        diffPairs(backend == BACKEND_NAIVE ? &reference : &observedPairs, &feedCheck.pairs, &unused, &stray);
+        int bad_events = stray + feedCheck.lost + feedCheck.malformed;
+        if (bad_events > 0 || (feedCheck.events == 0 && reference.count > 0)) {
+            failed = 1;
+        }
+
+        double max_error = 0;
+        int diverged = 0;
+        for (int i = 0; i < balls.count; i++) {
+            double error = fmax(fabs(balls.pos_x[i] - reference_x[i]), fabs(balls.pos_y[i] - reference_y[i]));
+            max_error = fmax(max_error, error);
+            if (error > tolerance) {
+                diverged++;
+            }
+        }
+
+        printf("%s,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%.6g,%d,%.0f,%.2f\n", backend_names[backend], placement_spec,
+            balls.count, radius, workerCount(),
+            steps, backend == BACKEND_NAIVE ? reference.count : observedPairs.count, missing, extra,
+            feedCheck.events, bad_events, max_error, diverged, ns, reference_ns / ns);
+        fflush(stdout);
+
+        tearDownConfiguration(&balls);
+    }
+
+    free(reference.pairs);
+    free(observedPairs.pairs);
+    observedPairs = (PairSet) { 0 };
+    free(feedCheck.pairs.pairs);
+    feedCheck = (FeedCheck) { 0 };
+    free(reference_x);
+    free(reference_y);
+    return failed;
+}
+
+int main(int argc, char* argv[]) {
+    int thread_count = 1;
+    int max_balls = 1000000;
+    double seconds = 2;
+    int compare_steps = 0;
+    int compare_balls = 5000;
+    int compare_radius = 3;
+    double tolerance = 0.01;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--max-balls") == 0 && i + 1 < argc) {
+            max_balls = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            compare_steps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--balls") == 0 && i + 1 < argc) {
+            compare_balls = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc) {
+            compare_radius = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--cell-block") == 0 && i + 1 < argc) {
+            cell_block = atoi(argv[++i]);
+            if (cell_block < 0 || cell_block > CELL_BLOCK_MAX) {
+                fprintf(stderr, "The cell block must be 0 to %d subspaces!\n", CELL_BLOCK_MAX);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--placement") == 0 && i + 1 < argc) {
+            placement_spec = argv[++i];
+            if (parsePlacement(placement_spec, &placement) != 0) {
+                fprintf(stderr, "Unknown placement or parameters: %s\n", placement_spec);
+                return 1;
+            }
+        }
+        else {
+            fprintf(stderr, "Usage: %s [--threads count] [--max-balls count] [--seconds s] [--compare steps] [--balls count] [--radius r] [--tolerance px] [--cell-block cells] [--placement name[:params]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    selectOverlapKernel();
+    selectIntegrateKernel();
+    selectBinKernel();
+
+    if (startWorkers(thread_count) != 0) {
+        fprintf(stderr, "Could not start the worker threads!\n");
+        return 1;
+    }
+
+    if (compare_steps > 0) {
+        if (compare_balls > backend_max_balls[BACKEND_NAIVE] || compare_balls < 1 || compare_radius < 1) {
+            fprintf(stderr, "The naive reference runs with 1 to %d balls of radius 1 or more!\n",
+                backend_max_balls[BACKEND_NAIVE]);
+            return 1;
+        }
+        int failed = compareBackends(compare_balls, compare_radius, compare_steps, tolerance);
+        stopWorkers();
+        return failed;
+    }
+
+    printf("backend,placement,balls,radius,threads,cell_block,phase,steps,median_ns,p99_ns\n");
+
+    for (int c = 0; c < (int) (sizeof(ball_counts) / sizeof(ball_counts[0])); c++) {
+        for (int r = 0; r < (int) (sizeof(radii) / sizeof(radii[0])); r++) {
+            for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+                int amnt = ball_counts[c];
+                if (amnt > max_balls || amnt > backend_max_balls[backend]) {
+                    continue;
+                }
+
+                if (benchConfiguration(backend, amnt, radii[r], seconds) != 0) {
+                    fprintf(stderr, "Could not set up %s with %d balls!\n", backend_names[backend], amnt);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    stopWorkers();
+    return 0;
+}
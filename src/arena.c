@@ -0,0 +1,159 @@
+#include <SDL2/SDL.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "arena.h"
+#include "memtrack.h"
+
+// Size of the huge pages asked for on Linux, which are 2 MiB on x86-64.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+size_t arenaSize(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+}
+
+/*
+    Tries to map a block backed by huge pages, and stores the size that was
+    actually mapped in arena->mapped. Returns NULL if the OS would not
+    hand out huge pages.
+*/
+static char* mapHugePages(Arena *arena, size_t size) {
+#if defined(_WIN32)
+    SIZE_T page = GetLargePageMinimum();
+    if (page == 0) {
+        return NULL;
+    }
+
+    // large pages need the lock pages privilege, so this fails for most users
+    size_t mapped = (size + page - 1) / page * page;
+    char *block = VirtualAlloc(NULL, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (block != NULL) {
+        arena->mapped = mapped;
+    }
+    return block;
+#elif defined(__linux__)
+    size_t mapped = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+    void *block = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // explicit huge pages only exist if the admin reserved some
+    block = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (block == MAP_FAILED) {
+        // otherwise ask for transparent huge pages on a normal mapping
+        block = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(block, mapped, MADV_HUGEPAGE);
+#endif
+    }
+
+    arena->mapped = mapped;
+    return block;
+#else
+    (void) arena;
+    (void) size;
+    return NULL;
+#endif
+}
+
+int initArena(Arena *arena, size_t size, bool huge) {
+    // keep the block non-empty so an arena with no arrays is still valid
+    if (size == 0) {
+        size = ARENA_ALIGNMENT;
+    }
+
+    arena->size = size;
+    arena->used = 0;
+    arena->mapped = 0;
+    arena->base = huge ? mapHugePages(arena, size) : NULL;
+
+    if (arena->base == NULL) {
+        if (huge) {
+            fprintf(stderr, "Huge pages are not available, using normal pages\n");
+        }
+        arena->base = SDL_SIMDAlloc(size);
+    }
+
+    return arena->base == NULL ? 1 : 0;
+}
+
+int mapArenaFile(Arena *arena, const char *path, size_t offset, size_t size) {
+#if defined(__linux__)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+
+    // touching a page past the end of the file would raise SIGBUS later on
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < offset + size) {
+        close(fd);
+        return 1;
+    }
+
+    void *block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t) offset);
+    close(fd);
+    if (block == MAP_FAILED) {
+        return 1;
+    }
+
+    arena->base = block;
+    arena->size = size;
+    arena->used = 0;
+    arena->mapped = size;
+    return 0;
+#else
+    (void) arena;
+    (void) path;
+    (void) offset;
+    (void) size;
+    return 1;
+#endif
+}
+
+void* arenaAlloc(Arena *arena, size_t size) {
+    size = arenaSize(size);
+    if (size > arena->size - arena->used) {
+        return NULL;
+    }
+
+    void *block = arena->base + arena->used;
+    arena->used += size;
+    return block;
+}
+
+void freeArena(Arena *arena) {
+    if (arena->base == NULL) {
+        return;
+    }
+
+    if (arena->mapped == 0) {
+        SDL_SIMDFree(arena->base);
+    }
+    else {
+#if defined(_WIN32)
+        VirtualFree(arena->base, 0, MEM_RELEASE);
+#elif defined(__linux__)
+        munmap(arena->base, arena->mapped);
+#endif
+    }
+
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+    arena->mapped = 0;
+}
@@ -0,0 +1,60 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+    A single contiguous block of memory that a set of arrays is carved out
+    of, so that creating all of them takes one allocator call and freeing
+    them takes one more. Array sizes are rounded up to ARENA_ALIGNMENT
+    bytes, so every array starts as aligned as the block itself, which is
+    enough for the widest SIMD loads the CPU has.
+    The block can be backed by huge pages, which saves TLB misses when the
+    arrays are large.
+*/
+#define ARENA_ALIGNMENT 64
+
+typedef struct Arena {
+    char*   base;
+    size_t  size;
+    size_t  used;
+    size_t  mapped;
+} Arena;
+
+/*
+    Rounds a size up to the alignment of the arrays of an arena. The size of
+    an arena holding several arrays is the sum of their rounded sizes.
+*/
+size_t arenaSize(size_t size);
+
+/*
+    Allocates the block of the arena, with room for size bytes. With huge
+    set it first tries to get huge pages from the OS, and falls back to
+    normal pages if none are available.
+    Returns 0 on success and 1 if the block could not be allocated.
+*/
+int initArena(Arena *arena, size_t size, bool huge);
+
+/*
+    Makes size bytes of the file at the given path, starting at offset, the
+    block of the arena. The file is mapped privately, so the arrays can be
+    used and changed in place without reading them first, and no change
+    ever reaches the file. The offset must be a multiple of the page size.
+    Returns 0 on success and 1 if the file could not be mapped, which is
+    always the case outside of Linux.
+*/
+int mapArenaFile(Arena *arena, const char *path, size_t offset, size_t size);
+
+/*
+    Carves the next size bytes out of the arena.
+    Returns NULL if the arena does not have that much room left.
+*/
+void* arenaAlloc(Arena *arena, size_t size);
+
+/*
+    Releases the block of the arena along with every array carved out of it.
+*/
+void freeArena(Arena *arena);
+
+#endif
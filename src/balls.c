@@ -1,24 +1,141 @@
 #include <SDL2/SDL.h>
+#include <SDL2/SDL_bits.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <time.h>
 #include <math.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define BALLS_X86 1
+#include <immintrin.h>
+#endif
+
+#include "arena.h"
+#include "bouncy.h"
+#include "capture.h"
+#include "glcompute.h"
+#include "glrender.h"
+#include "latency.h"
+#include "log.h"
+#include "memtrack.h"
+#include "net.h"
+#include "share.h"
+#include "topology.h"
+#include "trace.h"
+#include "workers.h"
+
+/*
+    The scalar type of the simulation core. Building with
+    -DBALLS_SINGLE_PRECISION (make PRECISION=float) runs the physics in
+    floats, which doubles the SIMD width and halves the memory traffic.
+    The default double build is kept for validation.
+*/
+#ifdef BALLS_SINGLE_PRECISION
+typedef float real;
+#define real_sqrt sqrtf
+#define real_fmin fminf
+#define real_fmax fmaxf
+#define REAL_NAME "float"
+#else
+typedef double real;
+#define real_sqrt sqrt
+#define real_fmin fmin
+#define real_fmax fmax
+#define REAL_NAME "double"
+#endif
+
+/*
+    Contacts are normalized with the reciprocal square root of the CPU,
+    an estimate good to 12 bits, refined by Newton steps to about the
+    precision of real: one step for floats, two for doubles, which start
+    from the float estimate. Building with -DBALLS_EXACT_MATH
+    (make EXACT_MATH=1) takes the square root and divides instead, exactly
+    as libm would, for validating the fast path against. The vector
+    kernels refine their estimates by the same steps in the same order, so
+    a lane comes out bitwise the same as real_rsqrt.
+*/
+#if defined(__x86_64__) && !defined(BALLS_EXACT_MATH)
+#define BALLS_FAST_RSQRT 1
+#define MATH_NAME "reciprocal square root"
+#else
+#define MATH_NAME "exact square root"
+#endif
+
+/*
+    Returns 1 / sqrt(x), for x above 0.
+*/
+static inline real real_rsqrt(real x) {
+#ifdef BALLS_FAST_RSQRT
+    real estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss((float) x)));
+    estimate = estimate * ((real) 1.5 - (real) 0.5 * x * estimate * estimate);
+#ifndef BALLS_SINGLE_PRECISION
+    estimate = estimate * ((real) 1.5 - (real) 0.5 * x * estimate * estimate);
+#endif
+    return estimate;
+#else
+    return 1 / real_sqrt(x);
+#endif
+}
 
 #define SCREEN_WIDTH 1200
 #define SCREEN_HEIGHT 1200
 #define FPS 24
 #define BALLS_PER_SUBSPACE 4
 #define BALL_CORNER_COUNT 4
-#define FRAME_DELAY (1000 / FPS)
-#define pyth(a, b) (sqrt(pow(a, 2) + pow(b, 2)))
+#define ADAPTIVE_MIN_MEAN 2.0
+#define ADAPTIVE_MAX_MEAN 8.0
+#define ADAPTIVE_TARGET_MEAN 4.0
+#define ADAPTIVE_MAX_PEAK 32
+#define TILE_SUBSPACES 2
+#define BALL_TASK_GRAIN 1024
+#define OVERLAP_BATCH 32
+
+/*
+    The size of the window, the rate of the simulation in frames per
+    second, and how many of the largest balls a subspace is across. They
+    are set once at startup, by --window, --tick-rate and --cell-balls or
+    the lines of a --config file, and the macros above are their defaults.
+    Nothing that runs every step depends on them directly: they size the
+    grid and the buffers, and the kernels are picked for the sizes that
+    come out of them.
+*/
+int screen_width = SCREEN_WIDTH;
+int screen_height = SCREEN_HEIGHT;
+int tick_rate = FPS;
+int subspace_balls = BALLS_PER_SUBSPACE;
+
+// Most balls a subspace may be across with --cell-balls.
+#define CELL_BALLS_MAX 64
+
+/*
+    Size of the world the balls bounce around in. It is the size of the
+    window unless --world makes it larger, and the camera then shows a part
+    of it.
+*/
+int world_width = SCREEN_WIDTH;
+int world_height = SCREEN_HEIGHT;
+
+// Largest world side, which keeps positions within the fixed-point engine
+// and the 16 bit coordinates of recordings.
+#define WORLD_MAX_SIZE 32000
 
 int subspace_size_x;
 int subspace_size_y;
 int subspace_count;
 
+// Subspaces per row and per column, and the reciprocals of the subspace
+// sizes, which binning multiplies by instead of dividing.
+int subspace_columns;
+int subspace_rows;
+real subspace_scale_x;
+real subspace_scale_y;
+
+// The smallest subspace the adaptive mode may pick, one ball diameter.
+int min_subspace_size;
+
 /*
     A simple vector for storing two dimensional data.
     Uses integers to represent whole numbers.
@@ -30,508 +147,12431 @@ typedef struct vec2i {
 
 /*
     A simple vector for storing two dimensional data. 
-    Uses doubles to represent floating point numbers.
+    Uses the real type to represent floating point numbers.
 */
 typedef struct vec2 {
-    double  x;
-    double  y;
+    real    x;
+    real    y;
 } vec2;
 
 /*
-    A struct to store data for a single ball.
-    Contains fields for integer radius, a integer 2D vector for position, and
-    an integer 2D vector for the balls velocity (i.e. direction).
+    A Q16.16 fixed-point number: the upper 16 bits hold the whole part and
+    the lower 16 bits the fraction. The fixed engine only uses integer
+    arithmetic, so its results are bit-identical on every machine.
+*/
+typedef Sint32 fixed;
+
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define int_to_fixed(a) ((fixed) (a) * FIXED_ONE)
+
+/*
+    A simple vector for storing two dimensional data.
+    Uses fixed-point numbers, for the fixed engine.
+*/
+typedef struct vec2fx {
+    fixed   x;
+    fixed   y;
+} vec2fx;
+
+/*
+    Storage for every ball in the simulation, laid out as a structure of
+    arrays. Ball i is made up of the i-th entry of every array: its position
+    (pos_x, pos_y), its velocity, i.e. direction (dir_x, dir_y), its
+    integer radius and its mass. Each array is contiguous and SIMD aligned,
+    so the kernels can stream over just the fields they need.
+
+    inv_mass holds 1 / mass of every ball, worked out once by setBallMass,
+    so resolving a contact between balls of different masses only ever
+    multiplies by it.
 
-    The ball struct also contains the information about the subspaces where
-    the ball is located in. This is used for collision optimization.
-    The subspaces field is an int array of size 4.
+    The fix_ arrays hold the positions and velocities of the fixed engine.
+    When it runs they are the authoritative state, and pos_x and pos_y are
+    only copies kept for the broad phase and for drawing.
+
+    All of the arrays are carved out of the single block of the arena.
+
+    Splitting the fields this way is what keeps the hot loops small: a
+    step streams pos_x, pos_y, dir_x and dir_y through integration, and
+    the narrow phase reads only the positions and the radius of each
+    candidate, so a cache line holds that field of 8 balls, or of 16 with
+    -DBALLS_SINGLE_PRECISION. The cold arrays, the masses, the subspace
+    corners that only binning writes and the grid build reads, and the
+    fixed-point state, never share a line with them, and a pass that does
+    not need them never loads them. Every array starts on a line of its
+    own, ARENA_ALIGNMENT apart.
+
+    The store also contains the information about the subspaces where each
+    ball is located in. This is used for collision optimization.
+    Every ball has an int array of size 4 in subspaces.
     The order of the corners is: top-left, top-right, bottom-left, bottom-right.
 */
-typedef struct Ball {
-    int     radius;
-    vec2    pos;
-    vec2    dir;
-    int     subspaces[BALL_CORNER_COUNT];
-} Ball;
+typedef struct BallStore {
+    int     count;
+    int     capacity;
+    real*   pos_x;
+    real*   pos_y;
+    real*   dir_x;
+    real*   dir_y;
+    int*    radius;
+    real*   mass;
+    real*   inv_mass;
+    int     (*subspaces)[BALL_CORNER_COUNT];
+    fixed*  fix_pos_x;
+    fixed*  fix_pos_y;
+    fixed*  fix_dir_x;
+    fixed*  fix_dir_y;
+    Arena   arena;
+} BallStore;
 
 /*
-    Simple Linked List like struct for storing references to balls
-    within each subspace. Used for collision optimization.
+    A flat uniform grid used for collision optimization, stored in compressed
+    sparse row form. The balls of subspace s are the indices
+    cellBalls[cellStart[s]] up to (but not including) cellBalls[cellCursor[s]],
+    so every subspace is one contiguous slice of a single array.
+
+    The grid is rebuilt every frame with a counting sort: one pass counts the
+    balls of each subspace, a prefix sum turns the counts into offsets, and a
+    second pass scatters the ball indices into place using cellCursor. Every
+    pass only visits the subspaces in occupiedSubspaces, and an empty
+    subspace has both ends at 0.
+    With more than one thread every pass runs on all of them: the counts and
+    cursors are bumped atomically, and the prefix sum works on blocks of
+    GRID_BLOCK_WORDS occupancy words at a time, whose totals are kept in
+    blockOffsets.
 */
-typedef struct LinkedContainer LinkedContainer;
-struct LinkedContainer {
-    int                 subspace;
-    Ball*               ball;
-    LinkedContainer*    next;
-};
+typedef struct SubspaceGrid {
+    int*    cellStart;
+    int*    cellCursor;
+    int*    cellBalls;
+    int     capacity;
+    int*    blockOffsets;
+    int     blocks;
+} SubspaceGrid;
+
+/*
+    The subspace grid kept up to date incrementally instead of being rebuilt
+    every frame. Every subspace owns a growable bucket of ball indices, and
+    for every corner of every ball, slots records where in that corner's
+    bucket the ball sits (or -1 for a corner repeating an earlier one).
+    Only balls that crossed into other subspaces are moved between buckets.
+*/
+typedef struct SubspaceBuckets {
+    int**   cellBalls;
+    int*    cellCount;
+    int*    cellCapacity;
+    int     (*slots)[BALL_CORNER_COUNT];
+    bool    populated;
+} SubspaceBuckets;
 
 SDL_Window *win;
 SDL_Renderer *ren;
 
-LinkedContainer *(*subspaceTracker);
-
-bool pause = false;
+SubspaceGrid subspaceTracker;
+SubspaceBuckets subspaceBuckets;
 
+// Set while the grid lists the balls by their current indices, which stops
+// being true when the grid is reallocated or the balls are reordered.
+bool gridCurrent = false;
 
 /*
-    Sets up the SDL window and renderer.
+    One bit per subspace, set while the subspace holds any balls, so the
+    collision pass can go straight from one occupied subspace to the next
+    instead of looking at every subspace of the world. Whichever grid is in
+    use keeps it up to date.
 */
-int setup() {
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
-        return 1;
-    }
+Uint32 *occupiedSubspaces;
 
-    win = SDL_CreateWindow(
-        "Bouncy Balls",
-        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        SCREEN_WIDTH, SCREEN_HEIGHT,
-        SDL_WINDOW_SHOWN);
+#define OCCUPIED_WORDS(count) (((count) + 31) / 32)
 
-    if (win == NULL) {
-        printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
-        SDL_Quit();
-        return 1;
-    }
+// Occupancy words per block of the parallel prefix sum, and blocks per task
+// of the parallel grid build.
+#define GRID_BLOCK_WORDS 32
+#define GRID_TASK_BLOCKS 16
 
-    ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED);
-    if (ren == NULL) {
-        printf("Renderer could not be created! SDL_Error: %s\n", SDL_GetError());
-        SDL_DestroyWindow(win);
-        SDL_Quit();
-        return 1;
-    }
+void markOccupied(int subspace) {
+    occupiedSubspaces[subspace >> 5] |= (Uint32) 1 << (subspace & 31);
+}
 
-    return 0;
+void markEmpty(int subspace) {
+    occupiedSubspaces[subspace >> 5] &= ~((Uint32) 1 << (subspace & 31));
+}
+
+/*
+    Marks the subspace as occupied while other threads may be marking
+    subspaces that share its word.
+*/
+void markOccupiedAtomic(int subspace) {
+    // SDL_atomic_t is nothing but an int, so the words can be used as one
+    SDL_atomic_t *word = (SDL_atomic_t*) &occupiedSubspaces[subspace >> 5];
+    int bit = (int) ((Uint32) 1 << (subspace & 31));
+    int old;
+    do {
+        old = SDL_AtomicGet(word);
+    } while (!SDL_AtomicCAS(word, old, old | bit));
 }
 
-void calculateSubspaces(Ball* ball) {
-    #define SW SCREEN_WIDTH
-    #define SH SCREEN_HEIGHT
+bool isOccupied(int subspace) {
+    return (occupiedSubspaces[subspace >> 5] >> (subspace & 31)) & 1;
+}
 
-    // printf("Calculating subspaces for ball %p\n", ball);
+// When set, the grid is maintained incrementally by subspaceBuckets instead
+// of being rebuilt into subspaceTracker every frame.
+bool incrementalGrid = false;
 
-    double left = ball->pos.x - ball->radius;
-    double right = ball->pos.x + ball->radius;
-    double up = ball->pos.y - ball->radius;
-    double down = ball->pos.y + ball->radius;
+// When set, the grid lists every ball once, in the subspace of its center,
+// and tests every subspace against half of its neighbours, instead of
+// listing the ball in every subspace its corners reach.
+bool centerBinning = false;
 
-    // Subspaces per row.
-    int spr = SW / subspace_size_x;
+// When set, the subspace size is re-tuned from occupancy statistics
+// every tick_rate frames, once a second.
+bool adaptiveGrid = false;
+int adaptive_frames = 0;
 
-    // Subspaces per column.
-    int spc = SH / subspace_size_y;
+// When set, the ball stores ask the OS for huge pages.
+bool hugePages = false;
 
-    #define SSX subspace_size_x
-    #define SSY subspace_size_y
+// When set, the threads are pinned to CPUs by the layout of the machine,
+// and every thread is the first to touch its share of the balls.
+bool affinity = false;
 
-    #define int_divide(n1, n2) ((int) (n1 / n2))
+/*
+    How the mass of a placed ball follows from its size: every ball weighs
+    the same, or as much as its area, in units of the area of a ball of
+    radius 1 (default equal).
+*/
+typedef enum MassModel {
+    MASS_EQUAL,
+    MASS_AREA
+} MassModel;
 
-    ball->subspaces[0] = int_divide(left, SSX) + int_divide(up, SSY) * spr;
-    ball->subspaces[1] = int_divide(right, SSX) + int_divide(up, SSY) * spr;
-    ball->subspaces[2] = int_divide(left, SSX) + int_divide(down, SSY) * spr;
-    ball->subspaces[3] = int_divide(right, SSX) + int_divide(down, SSY) * spr;
+MassModel massModel = MASS_EQUAL;
+const char *mass_names[] = { "equal", "area" };
 
-    #undef SW
-    #undef SH
-    #undef SSX
-    #undef SSY
-}
+// Set while the balls do not all weigh the same, which only then makes
+// bounce weigh every contact by the masses.
+bool unequalMasses = false;
 
 /*
-    Creates a ball of specified radius, located at specified x and y coordinates.
-    Returns the pointer to the created ball.
+    Physics runs in fixed steps decoupled from rendering. Velocities are in
+    pixels per frame at tick_rate, every frame of simulated time is split into
+    substeps steps, and step_dt is the length of one step in frames.
+    Uncapped, the physics steps as often as it can between frames instead.
 */
-Ball* makeBall(int x, int y, int r) {
-    Ball* ball = (Ball*) malloc(sizeof(Ball));
+#define MAX_STEPS_PER_FRAME 64
 
-    ball->radius = r;
-    
-    ball->pos.x = x;
-    ball->pos.y = y;
+int substeps = 1;
+bool uncapped = false;
+real step_dt = 1;
+fixed fixed_step_dt = FIXED_ONE;
 
-    ball->dir.x = 0.0;
-    ball->dir.y = 0.0;
+/*
+    How frames are paced, independently of the simulation rate. Vsync lets
+    the renderer wait for the display, precise sleeps until close to the
+    next frame and spins for the rest, and uncapped draws frames back to
+    back. The target rate of precise pacing can be changed while running,
+    between PACING_MIN_FPS and PACING_MAX_FPS.
+*/
+typedef enum PacingMode {
+    PACING_VSYNC,
+    PACING_PRECISE,
+    PACING_UNCAPPED
+} PacingMode;
 
-    calculateSubspaces(ball);
+#define PACING_MIN_FPS 5
+#define PACING_MAX_FPS 1000
+#define PACING_FPS_STEP 5
 
-    return ball;
-}
+// Time left before a frame that is spun through rather than slept, as the
+// OS can oversleep SDL_Delay by about a millisecond.
+#define PACING_SPIN_MS 2
+
+typedef struct FramePacer {
+    PacingMode  mode;
+    int         target_fps;
+    Uint64      frequency;
+    Uint64      next_frame;
+} FramePacer;
+
+FramePacer pacer = { .mode = PACING_PRECISE, .target_fps = FPS };
 
 /*
-    Draws a single ball using the midpoint algorithm.
+    Per-phase timing, built in with -DBALLS_PROFILE (make PROFILE=1) and
+    compiled out otherwise, where the phases only mark their spans in the
+    trace of --trace. The time spent in a phase is summed
+    over a frame between PROFILE_BEGIN and PROFILE_END, and at the end of
+    the frame folded into a rolling average. Every phase is only ever timed by
+    one thread, which also keeps its average, and the averages are
+    published in nanoseconds through atomics so the render thread can show
+    them. H shows the averages in the window title.
 */
-void drawBall(Ball* ball) {
-    int x = ball->radius-1;
-    int y = 0;
-    int dx = 1;
-    int dy = 1;
-    int err = dx - (ball->radius << 1);
+typedef enum ProfilePhase {
+    PHASE_ASSIGN,
+    PHASE_COLLIDE,
+    PHASE_INTEGRATE,
+    PHASE_DRAW,
+    PHASE_PRESENT,
+    PHASE_COUNT
+} ProfilePhase;
 
-    int x0 = ball->pos.x;
-    int y0 = ball->pos.y;
+const char *phase_names[PHASE_COUNT] = { "assign", "collide", "integrate", "draw", "present" };
 
-    while (x >= y)
-    {
-        SDL_RenderDrawPoint(ren, x0 + x, y0 + y);
-        SDL_RenderDrawPoint(ren, x0 + y, y0 + x);
-        SDL_RenderDrawPoint(ren, x0 - y, y0 + x);
-        SDL_RenderDrawPoint(ren, x0 - x, y0 + y);
-        SDL_RenderDrawPoint(ren, x0 - x, y0 - y);
-        SDL_RenderDrawPoint(ren, x0 - y, y0 - x);
-        SDL_RenderDrawPoint(ren, x0 + y, y0 - x);
-        SDL_RenderDrawPoint(ren, x0 + x, y0 - y);
+#ifdef BALLS_PROFILE
 
-        if (err <= 0)
-        {
-            y++;
-            err += dy;
-            dy += 2;
-        }
-        
-        if (err > 0)
-        {
-            x--;
-            dx += 2;
-            err += dx - (ball->radius << 1);
-        }
+// Frames the rolling average mostly spans.
+#define PROFILE_SMOOTHING 16
+
+typedef struct PhaseTimer {
+    Uint64          ticks;
+    double          average;
+    SDL_atomic_t    average_ns;
+} PhaseTimer;
+
+PhaseTimer phaseTimers[PHASE_COUNT];
+bool showProfile = false;
+
+#define PROFILE_BEGIN(phase) traceBegin(phase_names[phase]); Uint64 profile_start_##phase = SDL_GetPerformanceCounter()
+#define PROFILE_END(phase) phaseTimers[phase].ticks += SDL_GetPerformanceCounter() - profile_start_##phase; traceEnd(phase_names[phase])
+
+/*
+    Folds the time summed this frame by the phases from first up to (but not
+    including) last into their rolling averages.
+*/
+void profileFrame(ProfilePhase first, ProfilePhase last) {
+    double frequency = SDL_GetPerformanceFrequency();
+
+    for (int phase = first; phase < last; phase++) {
+        PhaseTimer *timer = &phaseTimers[phase];
+        double ns = timer->ticks * 1e9 / frequency;
+        timer->average += (ns - timer->average) / PROFILE_SMOOTHING;
+        timer->ticks = 0;
+        SDL_AtomicSet(&timer->average_ns, (int) timer->average);
     }
 }
 
 /*
-    Makes the ball change position according to its direction and position.
+    Writes the average of every phase, in milliseconds, to the buffer.
 */
-void moveBall(Ball *ball) {
-    ball->pos.x += ball->dir.x;
-    ball->pos.y += ball->dir.y;
+void formatProfile(char *buffer, size_t size) {
+    int used = 0;
+    for (int phase = 0; phase < PHASE_COUNT && used < (int) size; phase++) {
+        used += snprintf(buffer + used, size - used, " %s %.2f", phase_names[phase],
+            SDL_AtomicGet(&phaseTimers[phase].average_ns) / 1e6);
+    }
 }
 
+#else
+
+#define PROFILE_BEGIN(phase) traceBegin(phase_names[phase])
+#define PROFILE_END(phase) traceEnd(phase_names[phase])
+#define profileFrame(first, last)
+
+#endif
+
 /*
-    Checks if two balls are overlapping with each other.
+    With continuous collisions on, the narrow phase finds the time of impact
+    of every pair within the step instead of only testing where the balls
+    are, so fast balls cannot tunnel through each other. The broad phase
+    then sees every ball grown by ccd_margin, the farthest any ball travels
+    in one step, so that it still pairs up balls that are about to meet.
 */
-bool overlaps(Ball *a, Ball *b) {
-    double c = pyth(a->pos.x - b->pos.x, a->pos.y - b->pos.y);
+bool continuousCollisions = false;
+real ccd_margin = 0;
 
-    return c < a->radius + b->radius;
-}
+// When set, the balls are simulated by the event-driven engine.
+bool eventDriven = false;
 
 /*
-    Normalizes the supplied vec2.
+    The position corrections of the continuous bounces, gathered during the
+    collision pass and applied when the balls move, so that the positions
+    the broad phase sorted the balls by stay put until then. They are back
+    to zero between steps.
 */
-void norm(vec2* v){
-    double magnitute = sqrt(pow(v->x, 2) + pow(v->y, 2));
-    v->x /= magnitute;
-    v->y /= magnitute;
-}
+real *ccd_shift_x;
+real *ccd_shift_y;
 
 /*
-    Calculates the dot product of the supplied vec2.
+    Occupancy statistics of the subspace grid: the mean number of balls in
+    the subspaces that hold any, the fullest subspace, and how many
+    subspaces hold any balls at all.
 */
-double dot(vec2* v1, vec2* v2){
-    return v1->x * v2->x + v1->y * v2->y;
-}
+typedef struct OccupancyStats {
+    double  mean;
+    int     max;
+    int     occupied;
+} OccupancyStats;
+
+bool pause = false;
+bool showGrid = true;
 
 /*
-    Calculate the final velocities after collision for both balls.
-    Assuming both balls are the same mass (which they should be).
+    The broad phase algorithms that can be picked from the command line.
+    The grid is the subspace based stepBallsImproved path, sweep and prune
+    keeps the balls sorted along the x axis instead, the quadtree adapts
+    its cells to where the balls actually are, and the spatial hash lists
+    the balls by subspace like the grid but only keeps the subspaces that
+    hold any. The hierarchical grid stacks grids of growing cells, for
+    balls of very different sizes.
 */
-void bounce(Ball *a, Ball *b) {
-    // A vector that records the distance between the centers of the ball
-    // along both axes.
-    vec2 n = {
-        .x = b->pos.x - a->pos.x,
-        .y = b->pos.y - a->pos.y
-    };
+typedef enum BroadPhase {
+    BROADPHASE_GRID,
+    BROADPHASE_SWEEP,
+    BROADPHASE_QUADTREE,
+    BROADPHASE_HASH,
+    BROADPHASE_HGRID
+} BroadPhase;
 
-    // Normalized.
-    norm(&n);
+BroadPhase broadphase = BROADPHASE_GRID;
 
-    // Projection of the balls' velocities onto the vector n.
-    double scalar_product = dot(&(a->dir), &n) - dot(&(b->dir), &n);
+const char *broadphase_names[] = { "grid", "sweep", "quadtree", "hash", "hgrid" };
 
-    // Update velocities.
-    a->dir.x = a->dir.x - scalar_product * n.x;
-    a->dir.y = a->dir.y - scalar_product * n.y;
+/*
+    The ways the balls can be drawn. Points sends the outline of every ball
+    as a batch of points, sprites rasterizes each radius once into a
+    texture and draws every ball as a textured quad, software rasterizes
+    every ball on the worker threads into a streaming texture, and gl draws
+    every ball with one instanced OpenGL draw call.
+*/
+typedef enum RenderMode {
+    RENDER_POINTS,
+    RENDER_SPRITES,
+    RENDER_SOFTWARE,
+    RENDER_GL
+} RenderMode;
 
-    b->dir.x = b->dir.x + scalar_product * n.x;
-    b->dir.y = b->dir.y + scalar_product * n.y;
-}
+RenderMode renderMode = RENDER_POINTS;
 
 /*
-    Check if the ball is bouncing off the wall. Reverse its corresponding
-    velocity component if it is.
+    The arithmetic the physics runs in. The real engine uses the real type,
+    while the fixed engine uses Q16.16 fixed-point numbers so that runs can
+    be reproduced bit for bit across machines and thread counts. The gpu
+    engine keeps the balls on the GPU in floats and steps them there with
+    compute shaders, leaving the store as it was until it is read back.
 */
-void bounceWall(Ball *a) {
-    double left  = a->pos.x - a->radius;
-    double right = a->pos.x + a->radius;
+typedef enum EngineMode {
+    ENGINE_REAL,
+    ENGINE_FIXED,
+    ENGINE_GPU
+} EngineMode;
 
-    double up   = a->pos.y - a->radius;
-    double down = a->pos.y + a->radius;
-
-    // Horizontal bounce
-    if (left < 0 || right > SCREEN_WIDTH) { 
-        a->dir.x *= -1; 
-        if (a->dir.x > 0) {
-            a->pos.x = a->radius + 1;
-        }
-        else {
-            a->pos.x = SCREEN_WIDTH - a->radius - 1;
-        }
-    }
-    // Vertical bounce
-    if (up < 0 || down > SCREEN_HEIGHT) { 
-        a->dir.y *= -1;
-        if (a->dir.y > 0) {
-            a->pos.y = a->radius + 1;
-        }
-        else {
-            a->pos.y = SCREEN_HEIGHT - a->radius - 1;
-        }
-    }
-}
+EngineMode engine = ENGINE_REAL;
+const char *engine_names[] = { "real", "fixed", "gpu" };
 
 /*
-    Renders all the balls at once, while also checking for
-    collision between balls and the walls.
+    Ball indices sorted by the left edge of each ball, kept from one frame
+    to the next for the sweep and prune broad phase. sweep_sorted is false
+    until the first sort, which has no earlier order to start from.
 */
-void renderBalls(int amnt, Ball* balls[]) {
-    /*
-        TODO: Optimize collision.
-    */
-    for (int i = 0; i < amnt; i++) {
-        for (int j = 0; j < amnt; j++) {
-            if (i == j) continue;
-            else {
-                if (overlaps(balls[i], balls[j])) {
-                    SDL_SetRenderDrawColor(ren, 255, 0, 0, 255);
-                    bounce(balls[i], balls[j]);
-                    break;
-                }
-                else {
-                    SDL_SetRenderDrawColor(ren, 0, 0, 255, 255);
-                }
-            }
-        }
-
-        drawBall(balls[i]);
-        printf("\n");
-        printf("There are %d subspaces!\n", subspace_count);
-        moveBall(balls[i]);
-        bounceWall(balls[i]);
-    }
-}
+int *sweepOrder;
+bool sweep_sorted;
 
-void freeContainer(LinkedContainer *container) {    
-    if (container->next != NULL) {
-        freeContainer(container->next);
-    }
+#define QUADTREE_LEAF_SIZE 8
+#define QUADTREE_MAX_DEPTH 16
 
-    container->ball = NULL;
-    free(container);
-}
+/*
+    A node of the quadtree broad phase. The balls of a node are the indices
+    quadOrder[first] up to quadOrder[first + count - 1], and the bounds
+    enclose every one of those balls, so any ball whose bounding box misses
+    them cannot collide with anything inside the node.
+    Inner nodes have four consecutive children starting at child, while
+    leaves have a child of -1.
+*/
+typedef struct QuadNode {
+    real    left;
+    real    up;
+    real    right;
+    real    down;
+    int     first;
+    int     count;
+    int     child;
+} QuadNode;
 
-void assignSubspaces(int amnt, Ball* balls[]) {
-    // This clears the subspaceTracker, since it must start anew every frame
-    for (int i = 0; i < subspace_count; i++) {
-        LinkedContainer *container = subspaceTracker[i];
-        if (container != NULL) {
-            freeContainer(container);
-        }
-        subspaceTracker[i] = NULL;
-    }
+/*
+    The nodes of the quadtree, rebuilt every frame into storage that is kept
+    between frames, along with the ball indices ordered by node.
+*/
+typedef struct Quadtree {
+    QuadNode*   nodes;
+    int         nodeCount;
+    int         nodeCapacity;
+    int*        quadOrder;
+} Quadtree;
 
-    // printf("Assigning subspaces...\n");
-    for (int i = 0; i < amnt; i++) {
-        Ball *ball = balls[i];
-        calculateSubspaces(balls[i]);
-        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
-            int subspace = ball->subspaces[j];
+Quadtree quadtree;
 
-            // if the ball is on the edge, it can be in an out of bounds subspace
-            if (subspace >= subspace_count || subspace < 0) {
-                continue;
-            }
-            // printf("Subspace: %d\n", subspace);
-            LinkedContainer *container = malloc(sizeof(LinkedContainer));
+/*
+    Scratch space for sorting the balls into Morton order: the sort keys,
+    the permutation from new to old index and its inverse, a spare store the
+    ball arrays are gathered into, and spare bucket slot records.
+*/
+typedef struct MortonKey {
+    Uint32  code;
+    int     index;
+} MortonKey;
 
-            container->subspace = subspace;
-            container->ball = ball;
-            container->next = NULL;
+typedef struct BallReorder {
+    MortonKey*  keys;
+    int*        newIndex;
+    BallStore   spare;
+    int         (*spareSlots)[BALL_CORNER_COUNT];
+} BallReorder;
 
-            if (subspaceTracker[subspace] == NULL) {
-                subspaceTracker[subspace] = container;   
-            }
-            else {
-                LinkedContainer *tempContainer = subspaceTracker[subspace];
-                LinkedContainer *prevContainer = NULL;
+BallReorder ballReorder;
 
-                // this is checking whether the ball is already in the subspace or not
-                bool already_added = false;
+// When positive, the balls are sorted into Morton order every
+// reorder_interval frames.
+int reorder_interval = 0;
+int reorder_frames = 0;
 
-                while (tempContainer != NULL) {
-                    if (tempContainer->ball == ball) {
-                        already_added = true;
-                        break;
-                    }
-                    else {
-                        prevContainer = tempContainer;
-                        tempContainer = tempContainer->next;
-                    }
-                }
 
-                if (!already_added) {
-                    prevContainer->next = container;
-                }
-                else {
-                    free(container);
-                }
-            }
-        }
-    }
+/*
+    Works out the subspace count and the binning constants from the world
+    and subspace sizes.
+*/
+void countSubspaces() {
+    subspace_columns = world_width / subspace_size_x;
+    subspace_rows = world_height / subspace_size_y;
+    subspace_count = subspace_columns * subspace_rows;
+    subspace_scale_x = (real) 1 / subspace_size_x;
+    subspace_scale_y = (real) 1 / subspace_size_y;
 }
 
-int calculateDepth(LinkedContainer *container) {
-    if (container == NULL) {
-        return 0;
+/*
+    Sets the subspace size to the smallest size of at least the requested
+    one that evenly divides the world, and updates the subspace count.
+*/
+void configureSubspaces(int size) {
+    subspace_size_x = size < world_width ? size : world_width;
+    subspace_size_y = size < world_height ? size : world_height;
+    while (world_width % subspace_size_x) {
+        subspace_size_x++;
     }
-    else {
-        return 1 + calculateDepth(container->next);
+    while (world_height % subspace_size_y) {
+        subspace_size_y++;
     }
-}
 
-struct CollisionTracker {
-        Ball* ball1;
-        Ball* ball2;
-    };
+    countSubspaces();
+}
 
-bool checkCollisionsRecorded(struct CollisionTracker recordedList[], int recordedCount, Ball* b1, Ball* b2) {
-    for (int i = 0; i < recordedCount; i++) {
-        struct CollisionTracker ct= recordedList[i];
-        if ((ct.ball1 == b1 && ct.ball2 == b2) || (ct.ball1 == b2 && ct.ball2 == b1)) return true;
+/*
+    Sets up the SDL window and renderer.
+*/
+int setup() {
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+        return 1;
     }
-    return false;
-}
 
-void collideBalls(int amnt, Ball* balls[]) {
-    // keeps track of what collisions happened on this frame.
-    // this is needed to avoid collisions that cancel each other out
-    struct CollisionTracker collisionsRecorded[amnt * 2];
-    int currentCollision = 0;
+    win = SDL_CreateWindow(
+        "Bouncy Balls",
+        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        screen_width, screen_height,
+        SDL_WINDOW_SHOWN);
 
-    for (int subspace = 0; subspace < subspace_count; subspace++) {
-        LinkedContainer *container1 = subspaceTracker[subspace];
+    if (win == NULL) {
+        printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
 
-        // printf("Subspace: %d ", subspace);
-        
-        // if the subspace is empty, move on to the next one
-        if (container1 == NULL) {
-            // printf("empty");
-        }
-        else {
-            while (container1 != NULL) {
-                // fetch the reference to the ball from the first container
-                Ball *ball1 = container1->ball;
-                // printf("(%f %f) ", ball1->pos.x, ball1->pos.y);
-                LinkedContainer *container2 = subspaceTracker[subspace];
-
-                // check the containers in the same subspace to see if any balls collide
-                while (container2 != NULL) {
-                    Ball *ball2 = container2->ball;
-
-                    if (ball1 != ball2 && !checkCollisionsRecorded(collisionsRecorded, currentCollision, ball1, ball2)) {
-                        if (overlaps(ball1, ball2)) {
-                            // printf("Boop! Ball at %f %f collided with ball at %f %f\n", ball1->pos.x, ball1->pos.y, ball2->pos.x, ball2->pos.y);
-                            bounce(ball1, ball2);
-                            collisionsRecorded[currentCollision].ball1 = ball1;
-                            collisionsRecorded[currentCollision].ball2 = ball2;
-                            currentCollision++;
-                            // printf("X ");
-                        }
-                    }
-                    container2 = container2->next;
-                }
-                container1 = container1->next;
-            }
-        }
-        // printf("\n");
+    Uint32 flags = SDL_RENDERER_ACCELERATED;
+    if (pacer.mode == PACING_VSYNC) {
+        flags |= SDL_RENDERER_PRESENTVSYNC;
+    }
+
+    ren = SDL_CreateRenderer(win, -1, flags);
+    if (ren == NULL) {
+        printf("Renderer could not be created! SDL_Error: %s\n", SDL_GetError());
+        SDL_DestroyWindow(win);
+        SDL_Quit();
+        return 1;
     }
+
+    return 0;
 }
 
 /*
-    Improved version of rendering and collision algorithm, using subspaces to only check
-    balls that can collide realistically within the frame.
+    Returns the length of a frame at the target rate, in performance
+    counter ticks.
 */
-void renderBallsImproved(int amnt, Ball* balls[]) {
-    
-    // assigns the balls to subspaces and generates the linked containers for each subspace
-    assignSubspaces(amnt, balls);
-    // performs the calculation of determining whether the ball has collided or not
-    collideBalls(amnt, balls);
-    
-    for (int i = 0; i < amnt; i++) {
-        Ball *ball = balls[i];
-        SDL_SetRenderDrawColor(ren, 255, 255, 255, 255);
-        drawBall(ball);
-        if (!pause) {
-            moveBall(ball);
-            bounceWall(ball);
-        }
-        
-    }
+Uint64 framePeriod() {
+    return pacer.frequency / pacer.target_fps;
+}
 
-    // TODO: Finish this lmao.
-    // You gotta loop through the subspaces in the tracker and then check all the balls colliding there.
+void startPacing() {
+    pacer.frequency = SDL_GetPerformanceFrequency();
+    pacer.next_frame = SDL_GetPerformanceCounter() + framePeriod();
 }
 
 /*
-    Main function.
-    The intented usage is to provide two numerical arguments:
-    - Argument 1 is the number of balls to render on the screen.
-    - Argument 2 is the size of every ball (as a radius).
+    Switches to the given pacing mode, turning vsync on the renderer on or
+    off to match.
 */
-int main(int argc, char* argv[]) {
-    bool running;
+void setPacingMode(PacingMode mode) {
+    pacer.mode = mode;
+    SDL_RenderSetVSync(ren, mode == PACING_VSYNC);
+    pacer.next_frame = SDL_GetPerformanceCounter() + framePeriod();
+}
 
-    // Amount of balls to give in the simulation
-    int ball_amnt;
-    int radius;
+/*
+    Moves the target rate of precise pacing by the given number of frames
+    per second.
+*/
+void changeTargetRate(int delta) {
+    int fps = pacer.target_fps + delta;
+    pacer.target_fps = fps < PACING_MIN_FPS ? PACING_MIN_FPS :
+                       fps > PACING_MAX_FPS ? PACING_MAX_FPS : fps;
+}
+
+/*
+    Waits until the next frame is due. Precise pacing sleeps away all but
+    the last PACING_SPIN_MS milliseconds and spins through those, so frames
+    land on time even though SDL_Delay only has millisecond precision.
+    A frame that is already late does not make the next ones rush.
+*/
+void waitForNextFrame() {
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (pacer.mode != PACING_PRECISE) {
+        pacer.next_frame = now;
+        return;
+    }
+
+    if (now >= pacer.next_frame) {
+        pacer.next_frame = now + framePeriod();
+        return;
+    }
+
+    Uint64 spin = pacer.frequency * PACING_SPIN_MS / 1000;
+    Uint64 left = pacer.next_frame - now;
+    if (left > spin) {
+        SDL_Delay((Uint32) ((left - spin) * 1000 / pacer.frequency));
+    }
+
+    while (SDL_GetPerformanceCounter() < pacer.next_frame) {
+        SDL_CPUPauseInstruction();
+    }
+    pacer.next_frame += framePeriod();
+}
+
+// Balls poking out of the screen are kept in the outermost subspaces,
+// otherwise a right edge past the screen would wrap into the next row.
+#define clamp_cell(n, max) ((n) < 0 ? 0 : ((n) >= (max) ? (max) - 1 : (n)))
+
+/*
+    Returns the cell of the given size that the coordinate falls into, out
+    of cells in a line. The coordinate is multiplied by the reciprocal of
+    the size, which can land just on the wrong side of a cell boundary, so
+    the cell is then nudged to where the exact division would put it.
+*/
+static inline int binCoordinate(real v, real scale, int size, int cells) {
+    real q = v * scale;
+    q = q < -1 ? -1 : (q > cells ? cells : q);
+
+    int cell = (int) q;
+    if ((real) (cell + 1) * size <= v) {
+        cell++;
+    }
+    else if ((real) cell * size > v) {
+        cell--;
+    }
+    return clamp_cell(cell, cells);
+}
+
+/*
+    Returns the column of the subspace containing the x coordinate.
+*/
+int subspaceColumn(real x) {
+    return binCoordinate(x, subspace_scale_x, subspace_size_x, subspace_columns);
+}
+
+/*
+    Returns the row of the subspace containing the y coordinate.
+*/
+int subspaceRow(real y) {
+    return binCoordinate(y, subspace_scale_y, subspace_size_y, subspace_rows);
+}
+
+#undef clamp_cell
+
+/*
+    Returns how far ball i reaches from its center as far as the broad
+    phase is concerned: its radius, plus the continuous collision margin.
+*/
+real ballExtent(BallStore *balls, int i) {
+    return balls->radius[i] + ccd_margin;
+}
+
+/*
+    Recalculates the subspaces the corners of ball i are in.
+    Returns true if any of them differs from the subspaces cached before.
+*/
+bool calculateSubspaces(BallStore *balls, int i) {
+    real left = balls->pos_x[i] - ballExtent(balls, i);
+    real right = balls->pos_x[i] + ballExtent(balls, i);
+    real up = balls->pos_y[i] - ballExtent(balls, i);
+    real down = balls->pos_y[i] + ballExtent(balls, i);
+
+    int spr = subspace_columns;
+
+    int col_left = subspaceColumn(left);
+    int col_right = subspaceColumn(right);
+    int row_up = subspaceRow(up);
+    int row_down = subspaceRow(down);
+
+    int subspaces[BALL_CORNER_COUNT] = {
+        col_left + row_up * spr,
+        col_right + row_up * spr,
+        col_left + row_down * spr,
+        col_right + row_down * spr
+    };
+
+    bool changed = false;
+    for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+        if (balls->subspaces[i][j] != subspaces[j]) {
+            balls->subspaces[i][j] = subspaces[j];
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/*
+    Returns the size of the block holding the arrays of a ball store with
+    room for the given number of balls.
+*/
+size_t ballStoreSize(int capacity) {
+    // keep the arrays non-empty so a store without balls is still valid
+    size_t n = capacity > 0 ? capacity : 1;
+
+    return 4 * arenaSize(sizeof(real) * n)
+         + arenaSize(sizeof(int) * n)
+         + 2 * arenaSize(sizeof(real) * n)
+         + arenaSize(sizeof(int[BALL_CORNER_COUNT]) * n)
+         + 4 * arenaSize(sizeof(fixed) * n);
+}
+
+/*
+    Carves the arrays of a ball store out of its arena, which must hold
+    ballStoreSize(capacity) bytes. The arrays always come in this order,
+    which is also the layout of the ball arrays of a scene file, so any
+    change to it needs a new SCENE_VERSION.
+*/
+void carveBallStore(BallStore *balls, int capacity) {
+    size_t n = capacity > 0 ? capacity : 1;
+
+    balls->pos_x = arenaAlloc(&balls->arena, sizeof(real) * n);
+    balls->pos_y = arenaAlloc(&balls->arena, sizeof(real) * n);
+    balls->dir_x = arenaAlloc(&balls->arena, sizeof(real) * n);
+    balls->dir_y = arenaAlloc(&balls->arena, sizeof(real) * n);
+    balls->radius = arenaAlloc(&balls->arena, sizeof(int) * n);
+    balls->mass = arenaAlloc(&balls->arena, sizeof(real) * n);
+    balls->inv_mass = arenaAlloc(&balls->arena, sizeof(real) * n);
+    balls->subspaces = arenaAlloc(&balls->arena, sizeof(*balls->subspaces) * n);
+    balls->fix_pos_x = arenaAlloc(&balls->arena, sizeof(fixed) * n);
+    balls->fix_pos_y = arenaAlloc(&balls->arena, sizeof(fixed) * n);
+    balls->fix_dir_x = arenaAlloc(&balls->arena, sizeof(fixed) * n);
+    balls->fix_dir_y = arenaAlloc(&balls->arena, sizeof(fixed) * n);
+}
+
+/*
+    Allocates the arrays of a ball store with room for the given number of
+    balls, all in one block. Every array is aligned for the widest SIMD
+    instructions the CPU has.
+    Returns 0 on success and 1 if the allocation failed.
+*/
+int initBallStore(BallStore *balls, int capacity) {
+    balls->count = 0;
+    balls->capacity = capacity;
+    if (initArena(&balls->arena, ballStoreSize(capacity), hugePages) != 0) {
+        return 1;
+    }
+
+    carveBallStore(balls, capacity);
+    return 0;
+}
+
+/*
+    Frees every array of a ball store at once.
+*/
+void freeBallStore(BallStore *balls) {
+    freeArena(&balls->arena);
+    balls->count = 0;
+    balls->capacity = 0;
+}
+
+/*
+    Worker task zeroing every array of a range of balls.
+*/
+void touchBallsTask(int begin, int end, void *data) {
+    BallStore *balls = data;
+    size_t n = end - begin;
+
+    memset(balls->pos_x + begin, 0, sizeof(real) * n);
+    memset(balls->pos_y + begin, 0, sizeof(real) * n);
+    memset(balls->dir_x + begin, 0, sizeof(real) * n);
+    memset(balls->dir_y + begin, 0, sizeof(real) * n);
+    memset(balls->radius + begin, 0, sizeof(int) * n);
+    memset(balls->mass + begin, 0, sizeof(real) * n);
+    memset(balls->inv_mass + begin, 0, sizeof(real) * n);
+    memset(balls->subspaces + begin, 0, sizeof(*balls->subspaces) * n);
+    memset(balls->fix_pos_x + begin, 0, sizeof(fixed) * n);
+    memset(balls->fix_pos_y + begin, 0, sizeof(fixed) * n);
+    memset(balls->fix_dir_x + begin, 0, sizeof(fixed) * n);
+    memset(balls->fix_dir_y + begin, 0, sizeof(fixed) * n);
+}
+
+/*
+    Touches the arrays of a fresh ball store on every thread, with the
+    same split of the balls between the threads as the per-ball passes of
+    a step. The OS places a page on the NUMA node of the thread that first
+    touches it, so every thread then works on balls in memory of its own
+    node.
+*/
+void touchBallStore(BallStore *balls) {
+    parallelFor(balls->capacity, BALL_TASK_GRAIN, touchBallsTask, balls);
+}
+
+/*
+    Sets the mass of ball i along with its inverse, which must be positive.
+*/
+void setBallMass(BallStore *balls, int i, real mass) {
+    balls->mass[i] = mass;
+    balls->inv_mass[i] = 1 / mass;
+}
+
+/*
+    Returns whether any two balls of the store differ in mass.
+*/
+bool hasUnequalMasses(BallStore *balls) {
+    for (int i = 1; i < balls->count; i++) {
+        if (balls->mass[i] != balls->mass[0]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Creates a ball of specified radius, located at specified x and y coordinates.
+    The ball has a mass of 1 until setBallMass says otherwise.
+    Returns the index of the created ball.
+*/
+int makeBall(BallStore *balls, int x, int y, int r) {
+    int i = balls->count++;
+
+    balls->radius[i] = r;
+    setBallMass(balls, i, 1);
+
+    balls->pos_x[i] = x;
+    balls->pos_y[i] = y;
+
+    balls->dir_x[i] = 0.0;
+    balls->dir_y[i] = 0.0;
+
+    calculateSubspaces(balls, i);
+
+    return i;
+}
+
+/*
+    Points waiting to be drawn in one color. The points of every ball of a
+    frame are gathered here and sent to the renderer in a single call,
+    instead of one renderer call per point.
+*/
+typedef struct PointBatch {
+    SDL_Point*  points;
+    int         count;
+    int         capacity;
+} PointBatch;
+
+PointBatch ballPoints;
+PointBatch hitPoints;
+
+/*
+    Appends a point to the batch, growing it if it is full.
+*/
+void addPoint(PointBatch *batch, int x, int y) {
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity == 0 ? 4096 : batch->capacity * 2;
+        SDL_Point *grown = realloc(batch->points, sizeof(SDL_Point) * capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Could not grow the point batch!\n");
+            exit(1);
+        }
+        batch->points = grown;
+        batch->capacity = capacity;
+    }
+
+    batch->points[batch->count].x = x;
+    batch->points[batch->count].y = y;
+    batch->count++;
+}
+
+/*
+    Draws every point of the batch in the given color with one renderer
+    call.
+*/
+void renderPoints(PointBatch *batch, Uint8 r, Uint8 g, Uint8 b) {
+    if (batch->count > 0) {
+        SDL_SetRenderDrawColor(ren, r, g, b, 255);
+        SDL_RenderDrawPoints(ren, batch->points, batch->count);
+    }
+}
+
+/*
+    Draws the batch like renderPoints, and empties it for the next frame.
+*/
+void flushPoints(PointBatch *batch, Uint8 r, Uint8 g, Uint8 b) {
+    renderPoints(batch, r, g, b);
+    batch->count = 0;
+}
+
+/*
+    Frees the storage of a point batch.
+*/
+void freePoints(PointBatch *batch) {
+    free(batch->points);
+    batch->points = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+}
+
+/*
+    Adds the outline of a circle to the batch using the midpoint algorithm.
+*/
+void drawCircle(int x0, int y0, int radius, PointBatch *batch) {
+    int x = radius-1;
+    int y = 0;
+    int dx = 1;
+    int dy = 1;
+    int err = dx - (radius << 1);
+
+    while (x >= y)
+    {
+        addPoint(batch, x0 + x, y0 + y);
+        addPoint(batch, x0 + y, y0 + x);
+        addPoint(batch, x0 - y, y0 + x);
+        addPoint(batch, x0 - x, y0 + y);
+        addPoint(batch, x0 - x, y0 - y);
+        addPoint(batch, x0 - y, y0 - x);
+        addPoint(batch, x0 + y, y0 - x);
+        addPoint(batch, x0 + x, y0 - y);
+
+        if (err <= 0)
+        {
+            y++;
+            err += dy;
+            dy += 2;
+        }
+        
+        if (err > 0)
+        {
+            x--;
+            dx += 2;
+            err += dx - (radius << 1);
+        }
+    }
+}
+
+/*
+    The levels of detail a ball outline can be drawn at, from the cheapest.
+    Balls of at most LOD_POINT_RADIUS pixels are a single point, balls of at
+    most LOD_STAMP_RADIUS pixels are a fixed stamp of eight points on their
+    outline, and larger balls get the full midpoint circle.
+    When drawing the points takes longer than LOD_BUDGET milliseconds of the
+    frame, lod_bias drops every ball that many tiers, and it climbs back
+    once drawing has fit comfortably for LOD_CLIMB_FRAMES frames.
+*/
+typedef enum LodTier {
+    LOD_POINT,
+    LOD_STAMP,
+    LOD_CIRCLE
+} LodTier;
+
+#define LOD_POINT_RADIUS 1
+#define LOD_STAMP_RADIUS 3
+#define LOD_BUDGET (1000.0 / pacer.target_fps / 4)
+#define LOD_CLIMB_FRAMES 30
+
+int lod_bias = 0;
+// frames in a row that fit in half the budget since lod_bias last moved
+int lod_fast_frames = 0;
+
+LodTier lodTier(int radius) {
+    int tier = radius <= LOD_POINT_RADIUS ? LOD_POINT :
+               radius <= LOD_STAMP_RADIUS ? LOD_STAMP : LOD_CIRCLE;
+    tier -= lod_bias;
+    return tier < LOD_POINT ? LOD_POINT : tier;
+}
+
+/*
+    Adds the stamp of a ball: the four points of its outline on the axes and
+    the four on the diagonals, on the same outline drawCircle draws, a pixel
+    inside the radius.
+*/
+void drawStamp(int x0, int y0, int radius, PointBatch *batch) {
+    int reach = radius - 1;
+    // 181 / 256 is 1 / sqrt(2)
+    int d = (reach * 181) >> 8;
+
+    addPoint(batch, x0 + reach, y0);
+    addPoint(batch, x0 - reach, y0);
+    addPoint(batch, x0, y0 + reach);
+    addPoint(batch, x0, y0 - reach);
+    addPoint(batch, x0 + d, y0 + d);
+    addPoint(batch, x0 - d, y0 + d);
+    addPoint(batch, x0 + d, y0 - d);
+    addPoint(batch, x0 - d, y0 - d);
+}
+
+/*
+    Draws a single ball, adding its outline to the batch at its level of
+    detail.
+*/
+void drawBall(BallStore *balls, int i, PointBatch *batch) {
+    int x = balls->pos_x[i];
+    int y = balls->pos_y[i];
+    int radius = balls->radius[i];
+
+    switch (lodTier(radius)) {
+        case LOD_POINT :
+            addPoint(batch, x, y);
+            break;
+        case LOD_STAMP :
+            drawStamp(x, y, radius, batch);
+            break;
+        case LOD_CIRCLE :
+            drawCircle(x, y, radius, batch);
+            break;
+    }
+}
+
+/*
+    Moves lod_bias given how long the points of the last frame took to draw,
+    in milliseconds. Dropping only needs one slow frame, while climbing back
+    needs LOD_CLIMB_FRAMES frames in a row that fit in half the budget, so
+    the tiers do not flicker when a frame of the cheaper tier happens to be
+    fast.
+*/
+void updateLevelOfDetail(double elapsed) {
+    if (elapsed > LOD_BUDGET) {
+        lod_fast_frames = 0;
+        if (lod_bias < LOD_CIRCLE) {
+            lod_bias++;
+        }
+    }
+    else if (elapsed < LOD_BUDGET / 2 && lod_bias > 0) {
+        if (++lod_fast_frames >= LOD_CLIMB_FRAMES) {
+            lod_fast_frames = 0;
+            lod_bias--;
+        }
+    }
+    else {
+        lod_fast_frames = 0;
+    }
+}
+
+/*
+    Filled balls are drawn as one horizontal span per row, each a rectangle
+    one pixel tall, collected for every ball of the frame and drawn with a
+    single SDL_RenderFillRects call. The width of every row comes from the
+    same midpoint algorithm as the outlines, so a filled ball covers exactly
+    the inside of its outline. halfWidths is scratch space for the rows of
+    one ball, grown to the largest radius seen.
+*/
+typedef struct SpanBatch {
+    SDL_Rect*   spans;
+    int         count;
+    int         capacity;
+    int*        halfWidths;
+    int         halfCapacity;
+} SpanBatch;
+
+bool filledBalls = false;
+SpanBatch ballSpans;
+
+/*
+    Appends a span of width pixels starting at x on row y, growing the
+    batch if it is full.
+*/
+void addSpan(SpanBatch *batch, int x, int y, int width) {
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity == 0 ? 4096 : batch->capacity * 2;
+        SDL_Rect *grown = realloc(batch->spans, sizeof(SDL_Rect) * capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Could not grow the span batch!\n");
+            exit(1);
+        }
+        batch->spans = grown;
+        batch->capacity = capacity;
+    }
+
+    batch->spans[batch->count] = (SDL_Rect) { .x = x, .y = y, .w = width, .h = 1 };
+    batch->count++;
+}
+
+/*
+    Adds the spans of a filled circle to the batch. The midpoint algorithm
+    visits every row of the outline, possibly several times, and the widest
+    point it visits on a row is where the span of that row ends.
+*/
+void fillCircle(int x0, int y0, int radius, SpanBatch *batch) {
+    if (radius <= 0) {
+        return;
+    }
+
+    if (radius > batch->halfCapacity) {
+        int *grown = realloc(batch->halfWidths, sizeof(int) * radius);
+        if (grown == NULL) {
+            fprintf(stderr, "Could not grow the span batch!\n");
+            exit(1);
+        }
+        batch->halfWidths = grown;
+        batch->halfCapacity = radius;
+    }
+
+    int *half = batch->halfWidths;
+    for (int row = 0; row < radius; row++) {
+        half[row] = -1;
+    }
+
+    int x = radius-1;
+    int y = 0;
+    int dx = 1;
+    int dy = 1;
+    int err = dx - (radius << 1);
+
+    while (x >= y) {
+        half[y] = x > half[y] ? x : half[y];
+        half[x] = y > half[x] ? y : half[x];
+
+        if (err <= 0) {
+            y++;
+            err += dy;
+            dy += 2;
+        }
+
+        if (err > 0) {
+            x--;
+            dx += 2;
+            err += dx - (radius << 1);
+        }
+    }
+
+    for (int row = 0; row < radius; row++) {
+        if (half[row] < 0) {
+            continue;
+        }
+        addSpan(batch, x0 - half[row], y0 + row, 2 * half[row] + 1);
+        if (row > 0) {
+            addSpan(batch, x0 - half[row], y0 - row, 2 * half[row] + 1);
+        }
+    }
+}
+
+/*
+    Draws every span of the batch in the given color with one renderer
+    call, and empties the batch for the next frame.
+*/
+void flushSpans(SpanBatch *batch, Uint8 r, Uint8 g, Uint8 b) {
+    if (batch->count > 0) {
+        SDL_SetRenderDrawColor(ren, r, g, b, 255);
+        SDL_RenderFillRects(ren, batch->spans, batch->count);
+    }
+    batch->count = 0;
+}
+
+void freeSpans(SpanBatch *batch) {
+    free(batch->spans);
+    free(batch->halfWidths);
+    batch->spans = NULL;
+    batch->halfWidths = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+    batch->halfCapacity = 0;
+}
+
+/*
+    A ball outline rasterized once into a texture, along with the quads of
+    the balls of that radius waiting to be drawn this frame. The texture is
+    white, and every quad is tinted to its ball's color through its vertex
+    colors, so one sprite serves every color of a radius.
+*/
+typedef struct BallSprite {
+    int             radius;
+    SDL_Texture*    texture;
+    SDL_Vertex*     vertices;
+    int             quadCount;
+    int             quadCapacity;
+} BallSprite;
+
+/*
+    Every sprite made so far, one per distinct radius, and the index buffer
+    shared by all of them, which lists the two triangles of every quad.
+*/
+typedef struct SpriteCache {
+    BallSprite*     sprites;
+    int             count;
+    int             capacity;
+    int*            indices;
+    int             indexQuads;
+} SpriteCache;
+
+SpriteCache spriteCache;
+
+/*
+    Rasterizes the outline of a ball of the given radius into a texture,
+    using the same midpoint algorithm as drawBall. The center of the ball
+    is the pixel (radius, radius).
+    Returns NULL if the texture could not be created.
+*/
+SDL_Texture* rasterizeSprite(int radius) {
+    int size = 2 * radius + 1;
+    Uint32 *pixels = calloc((size_t) size * size, sizeof(Uint32));
+    if (pixels == NULL) {
+        return NULL;
+    }
+
+    PointBatch outline = { 0 };
+    drawCircle(radius, radius, radius, &outline);
+
+    for (int k = 0; k < outline.count; k++) {
+        SDL_Point point = outline.points[k];
+        if (point.x >= 0 && point.y >= 0 && point.x < size && point.y < size) {
+            pixels[point.y * size + point.x] = 0xffffffff;
+        }
+    }
+    freePoints(&outline);
+
+    SDL_Texture *texture = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, size, size);
+    if (texture != NULL) {
+        SDL_UpdateTexture(texture, NULL, pixels, size * sizeof(Uint32));
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    }
+    free(pixels);
+    return texture;
+}
+
+/*
+    Returns the sprite of the given radius, rasterizing it the first time
+    the radius comes up.
+*/
+BallSprite* findSprite(int radius) {
+    for (int k = 0; k < spriteCache.count; k++) {
+        if (spriteCache.sprites[k].radius == radius) {
+            return &spriteCache.sprites[k];
+        }
+    }
+
+    if (spriteCache.count == spriteCache.capacity) {
+        int capacity = spriteCache.capacity == 0 ? 4 : spriteCache.capacity * 2;
+        BallSprite *grown = realloc(spriteCache.sprites, sizeof(BallSprite) * capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Could not grow the sprite cache!\n");
+            exit(1);
+        }
+        spriteCache.sprites = grown;
+        spriteCache.capacity = capacity;
+    }
+
+    BallSprite *sprite = &spriteCache.sprites[spriteCache.count++];
+    sprite->radius = radius;
+    sprite->texture = rasterizeSprite(radius);
+    sprite->vertices = NULL;
+    sprite->quadCount = 0;
+    sprite->quadCapacity = 0;
+    if (sprite->texture == NULL) {
+        fprintf(stderr, "Could not create the sprite of radius %d! SDL_Error: %s\n", radius, SDL_GetError());
+        exit(1);
+    }
+    return sprite;
+}
+
+/*
+    Makes sure the shared index buffer covers the given number of quads.
+*/
+void reserveSpriteIndices(int quads) {
+    if (quads <= spriteCache.indexQuads) {
+        return;
+    }
+
+    int *grown = realloc(spriteCache.indices, sizeof(int) * 6 * quads);
+    if (grown == NULL) {
+        fprintf(stderr, "Could not grow the sprite indices!\n");
+        exit(1);
+    }
+
+    for (int q = spriteCache.indexQuads; q < quads; q++) {
+        int *index = grown + 6 * q;
+        index[0] = 4 * q;
+        index[1] = 4 * q + 1;
+        index[2] = 4 * q + 2;
+        index[3] = 4 * q + 2;
+        index[4] = 4 * q + 3;
+        index[5] = 4 * q;
+    }
+    spriteCache.indices = grown;
+    spriteCache.indexQuads = quads;
+}
+
+/*
+    Adds the quad of ball i to the batch of its sprite.
+*/
+void addSpriteQuad(BallStore *balls, int i, SDL_Color color) {
+    BallSprite *sprite = findSprite(balls->radius[i]);
+
+    if (sprite->quadCount == sprite->quadCapacity) {
+        int capacity = sprite->quadCapacity == 0 ? 1024 : sprite->quadCapacity * 2;
+        SDL_Vertex *grown = realloc(sprite->vertices, sizeof(SDL_Vertex) * 4 * capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Could not grow the sprite batch!\n");
+            exit(1);
+        }
+        sprite->vertices = grown;
+        sprite->quadCapacity = capacity;
+    }
+
+    // the same whole pixel position drawBall puts the center at
+    float left = (int) balls->pos_x[i] - sprite->radius;
+    float up = (int) balls->pos_y[i] - sprite->radius;
+    float size = 2 * sprite->radius + 1;
+
+    SDL_Vertex *quad = sprite->vertices + 4 * sprite->quadCount++;
+    quad[0] = (SDL_Vertex) { { left, up }, color, { 0, 0 } };
+    quad[1] = (SDL_Vertex) { { left + size, up }, color, { 1, 0 } };
+    quad[2] = (SDL_Vertex) { { left + size, up + size }, color, { 1, 1 } };
+    quad[3] = (SDL_Vertex) { { left, up + size }, color, { 0, 1 } };
+}
+
+/*
+    Draws the quads of every sprite with one SDL_RenderGeometry call per
+    radius, and empties the batches for the next frame.
+*/
+void flushSprites() {
+    for (int k = 0; k < spriteCache.count; k++) {
+        BallSprite *sprite = &spriteCache.sprites[k];
+        if (sprite->quadCount == 0) {
+            continue;
+        }
+
+        reserveSpriteIndices(sprite->quadCount);
+        SDL_RenderGeometry(ren, sprite->texture, sprite->vertices, 4 * sprite->quadCount,
+                           spriteCache.indices, 6 * sprite->quadCount);
+        sprite->quadCount = 0;
+    }
+}
+
+/*
+    Frees every sprite along with its texture.
+*/
+void freeSprites() {
+    for (int k = 0; k < spriteCache.count; k++) {
+        SDL_DestroyTexture(spriteCache.sprites[k].texture);
+        free(spriteCache.sprites[k].vertices);
+    }
+    free(spriteCache.sprites);
+    free(spriteCache.indices);
+}
+
+#define RASTER_BANDS_PER_WORKER 4
+
+/*
+    The software rasterizer. Every frame the balls are drawn straight into
+    the pixels of a streaming texture that covers the screen. The screen is
+    split into horizontal bands that are rasterized in parallel, each only by
+    one thread, so no two threads ever write the same pixel. The balls are
+    sorted into the bands they touch with the same counting sort as the
+    subspace grid, which keeps the grid's compressed layout: the balls of
+    band b are bands.cellBalls[bands.cellStart[b]] up to
+    bands.cellBalls[bands.cellStart[b + 1]].
+*/
+typedef struct SoftwareRaster {
+    SDL_Texture*    texture;
+    Uint32*         pixels;
+    int             pitch;
+    SubspaceGrid    bands;
+    int             bandCount;
+    int             bandHeight;
+} SoftwareRaster;
+
+SoftwareRaster raster;
+
+// Instances of the OpenGL backend being written this frame.
+float *balls_instances;
+
+/*
+    Creates the streaming texture and the band grid of the software
+    rasterizer. Returns 0 on success and 1 if anything could not be created.
+*/
+int initSoftwareRaster() {
+    raster.texture = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                       screen_width, screen_height);
+    if (raster.texture == NULL) {
+        return 1;
+    }
+    // cleared pixels are transparent, so whatever was drawn below shows through
+    SDL_SetTextureBlendMode(raster.texture, SDL_BLENDMODE_BLEND);
+
+    raster.bandCount = workerCount() * RASTER_BANDS_PER_WORKER;
+    if (raster.bandCount > screen_height) {
+        raster.bandCount = screen_height;
+    }
+    raster.bandHeight = (screen_height + raster.bandCount - 1) / raster.bandCount;
+
+    raster.bands.capacity = 0;
+    raster.bands.cellBalls = NULL;
+    raster.bands.cellStart = calloc(raster.bandCount + 1, sizeof(int));
+    raster.bands.cellCursor = calloc(raster.bandCount, sizeof(int));
+
+    return raster.bands.cellStart == NULL || raster.bands.cellCursor == NULL;
+}
+
+/*
+    Frees the texture and the band grid of the software rasterizer.
+*/
+void freeSoftwareRaster() {
+    if (raster.texture != NULL) {
+        SDL_DestroyTexture(raster.texture);
+    }
+    free(raster.bands.cellStart);
+    free(raster.bands.cellCursor);
+    free(raster.bands.cellBalls);
+}
+
+/*
+    Returns the band holding the given row of pixels, clamped to the screen.
+*/
+int bandOf(int y) {
+    int band = y / raster.bandHeight;
+    if (band < 0) {
+        return 0;
+    }
+    return band < raster.bandCount ? band : raster.bandCount - 1;
+}
+
+/*
+    Sorts the balls into the bands their outlines touch.
+*/
+void binBallsIntoBands(BallStore *balls) {
+    int *start = raster.bands.cellStart;
+    int *cursor = raster.bands.cellCursor;
+
+    for (int b = 0; b <= raster.bandCount; b++) {
+        start[b] = 0;
+    }
+
+    for (int i = 0; i < balls->count; i++) {
+        int y = balls->pos_y[i];
+        int last = bandOf(y + balls->radius[i]);
+        for (int b = bandOf(y - balls->radius[i]); b <= last; b++) {
+            start[b + 1]++;
+        }
+    }
+
+    for (int b = 0; b < raster.bandCount; b++) {
+        start[b + 1] += start[b];
+        cursor[b] = start[b];
+    }
+
+    // balls spanning several bands are listed once in each
+    if (start[raster.bandCount] > raster.bands.capacity) {
+        int capacity = start[raster.bandCount] * 2;
+        int *grown = realloc(raster.bands.cellBalls, sizeof(int) * capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Could not grow the raster bands!\n");
+            exit(1);
+        }
+        raster.bands.cellBalls = grown;
+        raster.bands.capacity = capacity;
+    }
+
+    for (int i = 0; i < balls->count; i++) {
+        int y = balls->pos_y[i];
+        int last = bandOf(y + balls->radius[i]);
+        for (int b = bandOf(y - balls->radius[i]); b <= last; b++) {
+            raster.bands.cellBalls[cursor[b]++] = i;
+        }
+    }
+}
+
+/*
+    Writes one pixel of a ball outline if it lies within the rows from top
+    up to (but not including) bottom, and within the screen.
+*/
+static inline void plotPixel(int x, int y, int top, int bottom, Uint32 color) {
+    if (y >= top && y < bottom && x >= 0 && x < screen_width) {
+        raster.pixels[y * (raster.pitch / sizeof(Uint32)) + x] = color;
+    }
+}
+
+/*
+    Rasterizes the outline of a circle with the midpoint algorithm of
+    drawCircle, clipped to the rows from top up to bottom.
+*/
+void rasterCircle(int x0, int y0, int radius, int top, int bottom, Uint32 color) {
+    int x = radius - 1;
+    int y = 0;
+    int dx = 1;
+    int dy = 1;
+    int err = dx - (radius << 1);
+
+    while (x >= y) {
+        plotPixel(x0 + x, y0 + y, top, bottom, color);
+        plotPixel(x0 + y, y0 + x, top, bottom, color);
+        plotPixel(x0 - y, y0 + x, top, bottom, color);
+        plotPixel(x0 - x, y0 + y, top, bottom, color);
+        plotPixel(x0 - x, y0 - y, top, bottom, color);
+        plotPixel(x0 - y, y0 - x, top, bottom, color);
+        plotPixel(x0 + y, y0 - x, top, bottom, color);
+        plotPixel(x0 + x, y0 - y, top, bottom, color);
+
+        if (err <= 0) {
+            y++;
+            err += dy;
+            dy += 2;
+        }
+
+        if (err > 0) {
+            x--;
+            dx += 2;
+            err += dx - (radius << 1);
+        }
+    }
+}
+
+/*
+    Worker task clearing a range of bands and rasterizing their balls.
+*/
+void rasterBandsTask(int begin, int end, void *data) {
+    BallStore *balls = data;
+
+    for (int b = begin; b < end; b++) {
+        int top = b * raster.bandHeight;
+        int bottom = top + raster.bandHeight < screen_height ? top + raster.bandHeight : screen_height;
+
+        for (int y = top; y < bottom; y++) {
+            memset((char*) raster.pixels + (size_t) y * raster.pitch, 0, screen_width * sizeof(Uint32));
+        }
+
+        for (int k = raster.bands.cellStart[b]; k < raster.bands.cellStart[b + 1]; k++) {
+            int i = raster.bands.cellBalls[k];
+            rasterCircle(balls->pos_x[i], balls->pos_y[i], balls->radius[i], top, bottom, 0xffffffff);
+        }
+    }
+}
+
+/*
+    Draws every ball with the software rasterizer and copies the result to
+    the screen.
+*/
+void drawBallsSoftware(BallStore *balls) {
+    void *pixels;
+    if (SDL_LockTexture(raster.texture, NULL, &pixels, &raster.pitch) != 0) {
+        return;
+    }
+    raster.pixels = pixels;
+
+    binBallsIntoBands(balls);
+    parallelFor(raster.bandCount, 1, rasterBandsTask, balls);
+
+    SDL_UnlockTexture(raster.texture);
+    SDL_RenderCopy(ren, raster.texture, NULL, NULL);
+}
+
+/*
+    Worker task writing the OpenGL instances of a range of balls.
+*/
+void writeInstancesTask(int begin, int end, void *data) {
+    BallStore *balls = data;
+    float *instances = balls_instances;
+
+    for (int i = begin; i < end; i++) {
+        instances[i * GL_INSTANCE_FLOATS] = balls->pos_x[i];
+        instances[i * GL_INSTANCE_FLOATS + 1] = balls->pos_y[i];
+        instances[i * GL_INSTANCE_FLOATS + 2] = balls->radius[i];
+    }
+}
+
+/*
+    Draws every ball with one instanced OpenGL draw call.
+*/
+void drawBallsGL(BallStore *balls) {
+    balls_instances = beginGLInstances();
+    parallelFor(balls->count, 4096, writeInstancesTask, balls);
+    drawGLInstances(balls->count);
+}
+
+/*
+    Hands the balls of the store to the gpu engine.
+    Returns 0 on success and 1 if the staging copy could not be allocated.
+*/
+int uploadBallsGPU(BallStore *balls) {
+    size_t n = balls->count > 0 ? balls->count : 1;
+    float *state = malloc(sizeof(float) * GL_COMPUTE_STATE_FLOATS * n);
+    float *radii = malloc(sizeof(float) * n);
+    if (state == NULL || radii == NULL) {
+        free(state);
+        free(radii);
+        return 1;
+    }
+
+    for (int i = 0; i < balls->count; i++) {
+        float *ball = state + (size_t) i * GL_COMPUTE_STATE_FLOATS;
+        ball[0] = balls->pos_x[i];
+        ball[1] = balls->pos_y[i];
+        ball[2] = balls->dir_x[i];
+        ball[3] = balls->dir_y[i];
+        radii[i] = balls->radius[i];
+    }
+    uploadGLCompute(state, radii, balls->count);
+
+    free(state);
+    free(radii);
+    return 0;
+}
+
+/*
+    Brings the store up to date with the balls of the gpu engine, for what
+    reads them on the CPU such as saving the scene.
+    Returns 0 on success and 1 if the staging copy could not be allocated.
+*/
+int downloadBallsGPU(BallStore *balls) {
+    size_t n = balls->count > 0 ? balls->count : 1;
+    float *state = malloc(sizeof(float) * GL_COMPUTE_STATE_FLOATS * n);
+    if (state == NULL) {
+        return 1;
+    }
+
+    downloadGLCompute(state);
+    for (int i = 0; i < balls->count; i++) {
+        float *ball = state + (size_t) i * GL_COMPUTE_STATE_FLOATS;
+        balls->pos_x[i] = ball[0];
+        balls->pos_y[i] = ball[1];
+        balls->dir_x[i] = ball[2];
+        balls->dir_y[i] = ball[3];
+    }
+
+    free(state);
+    return 0;
+}
+
+/*
+    Multiplies two fixed-point numbers.
+*/
+fixed fixedMul(fixed a, fixed b) {
+    return (fixed) (((Sint64) a * b) >> FIXED_SHIFT);
+}
+
+/*
+    Divides two fixed-point numbers.
+*/
+fixed fixedDiv(fixed a, fixed b) {
+    return (fixed) (((Sint64) a * FIXED_ONE) / b);
+}
+
+/*
+    Integer square root, rounded down, using the digit by digit method.
+*/
+Uint64 isqrt(Uint64 n) {
+    Uint64 root = 0;
+    Uint64 bit = (Uint64) 1 << 62;
+
+    while (bit > n) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+/*
+    Copies the fixed-point position of a ball into pos_x and pos_y, where
+    the broad phase and the drawing code read it from.
+*/
+void syncFixedPosition(BallStore *balls, int i) {
+    balls->pos_x[i] = (real) balls->fix_pos_x[i] / FIXED_ONE;
+    balls->pos_y[i] = (real) balls->fix_pos_y[i] / FIXED_ONE;
+}
+
+/*
+    Converts the state of every ball to fixed-point, so the fixed engine
+    can take over from the balls as they were created.
+*/
+void loadFixedState(BallStore *balls) {
+    for (int i = 0; i < balls->count; i++) {
+        balls->fix_pos_x[i] = (fixed) lround(balls->pos_x[i] * FIXED_ONE);
+        balls->fix_pos_y[i] = (fixed) lround(balls->pos_y[i] * FIXED_ONE);
+        balls->fix_dir_x[i] = (fixed) lround(balls->dir_x[i] * FIXED_ONE);
+        balls->fix_dir_y[i] = (fixed) lround(balls->dir_y[i] * FIXED_ONE);
+        syncFixedPosition(balls, i);
+    }
+}
+
+/*
+    Fixed-point version of moveBall.
+*/
+void moveBallFixed(BallStore *balls, int i) {
+    balls->fix_pos_x[i] += fixedMul(balls->fix_dir_x[i], fixed_step_dt);
+    balls->fix_pos_y[i] += fixedMul(balls->fix_dir_y[i], fixed_step_dt);
+    syncFixedPosition(balls, i);
+}
+
+/*
+    Fixed-point version of overlaps. Compares the squared distance in
+    64 bits, so it needs no square root at all.
+*/
+bool overlapsFixed(BallStore *balls, int a, int b) {
+    Sint64 dx = balls->fix_pos_x[a] - balls->fix_pos_x[b];
+    Sint64 dy = balls->fix_pos_y[a] - balls->fix_pos_y[b];
+    Sint64 reach = (Sint64) int_to_fixed(balls->radius[a] + balls->radius[b]);
+
+    return dx * dx + dy * dy < reach * reach;
+}
+
+/*
+    Fixed-point version of the overlap kernel.
+*/
+Uint32 overlapMaskFixed(BallStore *balls, int ball, const int *candidates, int count) {
+    Uint32 mask = 0;
+    for (int k = 0; k < count; k++) {
+        if (overlapsFixed(balls, ball, candidates[k])) {
+            mask |= 1u << k;
+        }
+    }
+    return mask;
+}
+
+/*
+    Fixed-point version of bounce. Fixed-point rounding is not symmetric,
+    so the pair is always resolved from the ball with the lower index, which
+    keeps the result independent of the order a broad phase finds it in.
+*/
+void bounceFixed(BallStore *balls, int a, int b) {
+    if (a > b) {
+        int swap = a;
+        a = b;
+        b = swap;
+    }
+
+    vec2fx n = {
+        .x = balls->fix_pos_x[b] - balls->fix_pos_x[a],
+        .y = balls->fix_pos_y[b] - balls->fix_pos_y[a]
+    };
+
+    // The squared length is in Q32.32, so its square root is back in Q16.16.
+    fixed magnitude = (fixed) isqrt((Uint64) ((Sint64) n.x * n.x + (Sint64) n.y * n.y));
+    if (magnitude == 0) {
+        return;
+    }
+
+    n.x = fixedDiv(n.x, magnitude);
+    n.y = fixedDiv(n.y, magnitude);
+
+    vec2fx dir_a = { .x = balls->fix_dir_x[a], .y = balls->fix_dir_y[a] };
+    vec2fx dir_b = { .x = balls->fix_dir_x[b], .y = balls->fix_dir_y[b] };
+
+    fixed scalar_product = fixedMul(dir_a.x, n.x) + fixedMul(dir_a.y, n.y)
+                         - fixedMul(dir_b.x, n.x) - fixedMul(dir_b.y, n.y);
+
+    balls->fix_dir_x[a] = dir_a.x - fixedMul(scalar_product, n.x);
+    balls->fix_dir_y[a] = dir_a.y - fixedMul(scalar_product, n.y);
+
+    balls->fix_dir_x[b] = dir_b.x + fixedMul(scalar_product, n.x);
+    balls->fix_dir_y[b] = dir_b.y + fixedMul(scalar_product, n.y);
+}
+
+/*
+    Fixed-point version of bounceWall.
+*/
+void bounceWallFixed(BallStore *balls, int a) {
+    fixed radius = int_to_fixed(balls->radius[a]);
+
+    fixed left  = balls->fix_pos_x[a] - radius;
+    fixed right = balls->fix_pos_x[a] + radius;
+
+    fixed up   = balls->fix_pos_y[a] - radius;
+    fixed down = balls->fix_pos_y[a] + radius;
+
+    if (left < 0 || right > int_to_fixed(world_width)) {
+        balls->fix_dir_x[a] = -balls->fix_dir_x[a];
+        if (balls->fix_dir_x[a] > 0) {
+            balls->fix_pos_x[a] = radius + FIXED_ONE;
+        }
+        else {
+            balls->fix_pos_x[a] = int_to_fixed(world_width) - radius - FIXED_ONE;
+        }
+    }
+    if (up < 0 || down > int_to_fixed(world_height)) {
+        balls->fix_dir_y[a] = -balls->fix_dir_y[a];
+        if (balls->fix_dir_y[a] > 0) {
+            balls->fix_pos_y[a] = radius + FIXED_ONE;
+        }
+        else {
+            balls->fix_pos_y[a] = int_to_fixed(world_height) - radius - FIXED_ONE;
+        }
+    }
+    syncFixedPosition(balls, a);
+}
+
+/*
+    Finds the time at which balls a and b first touch, moving in straight
+    lines. Solves |d + w t| = ra + rb, where d is the offset between the
+    centers and w the relative velocity.
+    Returns true and stores the time in t if they ever touch, with t = 0
+    when they already overlap and are still closing in. Overlapping balls
+    that are already moving apart are left to separate.
+*/
+bool impactTime(BallStore *balls, int a, int b, real *t) {
+    real dx = balls->pos_x[b] - balls->pos_x[a];
+    real dy = balls->pos_y[b] - balls->pos_y[a];
+    real wx = balls->dir_x[b] - balls->dir_x[a];
+    real wy = balls->dir_y[b] - balls->dir_y[a];
+    real reach = balls->radius[a] + balls->radius[b];
+
+    // not closing in
+    real b_half = dx * wx + dy * wy;
+    if (b_half >= 0) {
+        return false;
+    }
+
+    real c = dx * dx + dy * dy - reach * reach;
+    if (c < 0) {
+        *t = 0;
+        return true;
+    }
+
+    real a_coef = wx * wx + wy * wy;
+    real discriminant = b_half * b_half - a_coef * c;
+    if (discriminant < 0) {
+        return false;
+    }
+
+    *t = (-b_half - real_sqrt(discriminant)) / a_coef;
+    return true;
+}
+
+/*
+    Like impactTime, but only for impacts within the current step.
+*/
+bool sweptImpactTime(BallStore *balls, int a, int b, real *t) {
+    return impactTime(balls, a, b, t) && *t <= step_dt;
+}
+
+/*
+    Continuous version of overlaps: whether the balls touch within the step.
+*/
+bool overlapsSwept(BallStore *balls, int a, int b) {
+    real t;
+    return sweptImpactTime(balls, a, b, &t);
+}
+
+/*
+    Continuous version of the overlap kernel.
+*/
+Uint32 overlapMaskSwept(BallStore *balls, int ball, const int *candidates, int count) {
+    Uint32 mask = 0;
+    for (int k = 0; k < count; k++) {
+        if (overlapsSwept(balls, ball, candidates[k])) {
+            mask |= 1u << k;
+        }
+    }
+    return mask;
+}
+
+/*
+    Continuous version of bounce. The velocities are reflected about the
+    normal at the time of impact, and the positions are shifted so that
+    moving by the new velocities for the whole step puts the balls where
+    they would be had they travelled with the old velocities up to the
+    impact and with the new ones after it.
+*/
+void bounceSwept(BallStore *balls, int a, int b) {
+    real t;
+    if (!sweptImpactTime(balls, a, b, &t)) {
+        return;
+    }
+
+    real nx = (balls->pos_x[b] + balls->dir_x[b] * t) - (balls->pos_x[a] + balls->dir_x[a] * t);
+    real ny = (balls->pos_y[b] + balls->dir_y[b] * t) - (balls->pos_y[a] + balls->dir_y[a] * t);
+    if (nx == 0 && ny == 0) {
+        return;
+    }
+
+#ifdef BALLS_FAST_RSQRT
+    real inverse = real_rsqrt(nx * nx + ny * ny);
+    nx *= inverse;
+    ny *= inverse;
+#else
+    real magnitude = real_sqrt(nx * nx + ny * ny);
+    nx /= magnitude;
+    ny /= magnitude;
+#endif
+
+    real scalar_product = (balls->dir_x[a] - balls->dir_x[b]) * nx
+                        + (balls->dir_y[a] - balls->dir_y[b]) * ny;
+
+    // the change of velocity, which is the same and opposite for both balls
+    // of the same mass, and split by the inverse masses otherwise
+    real change_x = scalar_product * nx;
+    real change_y = scalar_product * ny;
+    real weight_a = 1;
+    real weight_b = 1;
+    if (unequalMasses) {
+        real share = 2 / (balls->inv_mass[a] + balls->inv_mass[b]);
+        weight_a = share * balls->inv_mass[a];
+        weight_b = share * balls->inv_mass[b];
+    }
+
+    balls->dir_x[a] -= change_x * weight_a;
+    balls->dir_y[a] -= change_y * weight_a;
+    balls->dir_x[b] += change_x * weight_b;
+    balls->dir_y[b] += change_y * weight_b;
+
+    ccd_shift_x[a] += change_x * weight_a * t;
+    ccd_shift_y[a] += change_y * weight_a * t;
+    ccd_shift_x[b] -= change_x * weight_b * t;
+    ccd_shift_y[b] -= change_y * weight_b * t;
+}
+
+/*
+    Reflects one coordinate of a ball that has moved past a wall, placing it
+    where it would be had it bounced off the wall at the moment of contact.
+    Returns true if it had to.
+*/
+bool reflectOffWall(real *pos, real *dir, int radius, int size) {
+    if (*pos - radius < 0) {
+        *pos = 2 * radius - *pos;
+    }
+    else if (*pos + radius > size) {
+        *pos = 2 * (size - radius) - *pos;
+    }
+    else {
+        return false;
+    }
+
+    *dir = -*dir;
+    // a ball faster than the box is wide could land past the far wall
+    *pos = real_fmin(real_fmax(*pos, radius), size - radius);
+    return true;
+}
+
+/*
+    Continuous version of bounceWall, which bounces the ball at the exact
+    moment it reached the wall within the step.
+*/
+void bounceWallSwept(BallStore *balls, int a) {
+    int radius = balls->radius[a];
+
+    reflectOffWall(&balls->pos_x[a], &balls->dir_x[a], radius, world_width);
+    reflectOffWall(&balls->pos_y[a], &balls->dir_y[a], radius, world_height);
+}
+
+/*
+    Makes the ball change position according to its direction and position.
+*/
+void moveBall(BallStore *balls, int i) {
+    if (engine == ENGINE_FIXED) {
+        moveBallFixed(balls, i);
+        return;
+    }
+    balls->pos_x[i] += balls->dir_x[i] * step_dt;
+    balls->pos_y[i] += balls->dir_y[i] * step_dt;
+}
+
+/*
+    Checks if two balls are overlapping with each other.
+*/
+bool overlaps(BallStore *balls, int a, int b) {
+    if (engine == ENGINE_FIXED) {
+        return overlapsFixed(balls, a, b);
+    }
+    if (continuousCollisions) {
+        return overlapsSwept(balls, a, b);
+    }
+
+    // squared, like the overlap kernels, so no square root is needed
+    real dx = balls->pos_x[a] - balls->pos_x[b];
+    real dy = balls->pos_y[a] - balls->pos_y[b];
+    real reach = balls->radius[a] + balls->radius[b];
+
+    return dx * dx + dy * dy < reach * reach;
+}
+
+/*
+    Narrow phase kernel testing one ball against a batch of candidates.
+    Bit k of the returned mask is set when the ball overlaps the ball with
+    index candidates[k]. At most OVERLAP_BATCH candidates fit in one call.
+    The kernels compare squared distances, so they need no square roots.
+*/
+typedef Uint32 (*OverlapKernel)(BallStore *balls, int ball, const int *candidates, int count);
+
+/*
+    Portable version of the overlap kernel.
+*/
+Uint32 overlapMaskScalar(BallStore *balls, int ball, const int *candidates, int count) {
+    real x = balls->pos_x[ball];
+    real y = balls->pos_y[ball];
+    int radius = balls->radius[ball];
+
+    Uint32 mask = 0;
+    for (int k = 0; k < count; k++) {
+        int other = candidates[k];
+        real dx = balls->pos_x[other] - x;
+        real dy = balls->pos_y[other] - y;
+        real reach = radius + balls->radius[other];
+
+        if (dx * dx + dy * dy < reach * reach) {
+            mask |= 1u << k;
+        }
+    }
+    return mask;
+}
+
+#ifdef BALLS_X86
+
+#ifdef BALLS_SINGLE_PRECISION
+
+/*
+    SSE2 version of the overlap kernel, testing four candidates at a time.
+*/
+__attribute__((target("sse2")))
+Uint32 overlapMaskSSE2(BallStore *balls, int ball, const int *candidates, int count) {
+    __m128 x = _mm_set1_ps(balls->pos_x[ball]);
+    __m128 y = _mm_set1_ps(balls->pos_y[ball]);
+    __m128 radius = _mm_set1_ps(balls->radius[ball]);
+
+    Uint32 mask = 0;
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        const int *c = candidates + k;
+
+        __m128 dx = _mm_sub_ps(_mm_set_ps(balls->pos_x[c[3]], balls->pos_x[c[2]],
+                                          balls->pos_x[c[1]], balls->pos_x[c[0]]), x);
+        __m128 dy = _mm_sub_ps(_mm_set_ps(balls->pos_y[c[3]], balls->pos_y[c[2]],
+                                          balls->pos_y[c[1]], balls->pos_y[c[0]]), y);
+        __m128i radii = _mm_set_epi32(balls->radius[c[3]], balls->radius[c[2]],
+                                      balls->radius[c[1]], balls->radius[c[0]]);
+        __m128 reach = _mm_add_ps(_mm_cvtepi32_ps(radii), radius);
+
+        __m128 distance = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        __m128 hit = _mm_cmplt_ps(distance, _mm_mul_ps(reach, reach));
+
+        mask |= (Uint32) _mm_movemask_ps(hit) << k;
+    }
+
+    if (k < count) {
+        mask |= overlapMaskScalar(balls, ball, candidates + k, count - k) << k;
+    }
+    return mask;
+}
+
+/*
+    AVX2 version of the overlap kernel, gathering eight candidates at a time.
+*/
+__attribute__((target("avx2")))
+Uint32 overlapMaskAVX2(BallStore *balls, int ball, const int *candidates, int count) {
+    __m256 x = _mm256_set1_ps(balls->pos_x[ball]);
+    __m256 y = _mm256_set1_ps(balls->pos_y[ball]);
+    __m256 radius = _mm256_set1_ps(balls->radius[ball]);
+
+    Uint32 mask = 0;
+    int k = 0;
+    for (; k + 8 <= count; k += 8) {
+        __m256i index = _mm256_loadu_si256((const __m256i*) (candidates + k));
+
+        __m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(balls->pos_x, index, 4), x);
+        __m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(balls->pos_y, index, 4), y);
+        __m256 reach = _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_i32gather_epi32(balls->radius, index, 4)), radius);
+
+        __m256 distance = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 hit = _mm256_cmp_ps(distance, _mm256_mul_ps(reach, reach), _CMP_LT_OQ);
+
+        mask |= (Uint32) _mm256_movemask_ps(hit) << k;
+    }
+
+    if (k < count) {
+        mask |= overlapMaskScalar(balls, ball, candidates + k, count - k) << k;
+    }
+    return mask;
+}
+
+#else
+
+/*
+    SSE2 version of the overlap kernel, testing two candidates at a time.
+*/
+__attribute__((target("sse2")))
+Uint32 overlapMaskSSE2(BallStore *balls, int ball, const int *candidates, int count) {
+    __m128d x = _mm_set1_pd(balls->pos_x[ball]);
+    __m128d y = _mm_set1_pd(balls->pos_y[ball]);
+    __m128d radius = _mm_set1_pd(balls->radius[ball]);
+
+    Uint32 mask = 0;
+    int k = 0;
+    for (; k + 2 <= count; k += 2) {
+        int c0 = candidates[k];
+        int c1 = candidates[k + 1];
+
+        __m128d dx = _mm_sub_pd(_mm_set_pd(balls->pos_x[c1], balls->pos_x[c0]), x);
+        __m128d dy = _mm_sub_pd(_mm_set_pd(balls->pos_y[c1], balls->pos_y[c0]), y);
+        __m128d reach = _mm_add_pd(_mm_set_pd(balls->radius[c1], balls->radius[c0]), radius);
+
+        __m128d distance = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+        __m128d hit = _mm_cmplt_pd(distance, _mm_mul_pd(reach, reach));
+
+        mask |= (Uint32) _mm_movemask_pd(hit) << k;
+    }
+
+    if (k < count) {
+        mask |= overlapMaskScalar(balls, ball, candidates + k, count - k) << k;
+    }
+    return mask;
+}
+
+/*
+    AVX2 version of the overlap kernel, gathering four candidates at a time.
+*/
+__attribute__((target("avx2")))
+Uint32 overlapMaskAVX2(BallStore *balls, int ball, const int *candidates, int count) {
+    __m256d x = _mm256_set1_pd(balls->pos_x[ball]);
+    __m256d y = _mm256_set1_pd(balls->pos_y[ball]);
+    __m256d radius = _mm256_set1_pd(balls->radius[ball]);
+
+    Uint32 mask = 0;
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        __m128i index = _mm_loadu_si128((const __m128i*) (candidates + k));
+
+        __m256d dx = _mm256_sub_pd(_mm256_i32gather_pd(balls->pos_x, index, 8), x);
+        __m256d dy = _mm256_sub_pd(_mm256_i32gather_pd(balls->pos_y, index, 8), y);
+        __m256d reach = _mm256_add_pd(_mm256_cvtepi32_pd(_mm_i32gather_epi32(balls->radius, index, 4)), radius);
+
+        __m256d distance = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+        __m256d hit = _mm256_cmp_pd(distance, _mm256_mul_pd(reach, reach), _CMP_LT_OQ);
+
+        mask |= (Uint32) _mm256_movemask_pd(hit) << k;
+    }
+
+    if (k < count) {
+        mask |= overlapMaskScalar(balls, ball, candidates + k, count - k) << k;
+    }
+    return mask;
+}
+
+#endif
+
+#endif
+
+OverlapKernel overlapMask = overlapMaskScalar;
+
+/*
+    Picks the widest overlap kernel the CPU supports.
+    Returns the name of the chosen kernel.
+*/
+const char* selectOverlapKernel() {
+#ifdef BALLS_X86
+    if (SDL_HasAVX2()) {
+        overlapMask = overlapMaskAVX2;
+        return "AVX2";
+    }
+    if (SDL_HasSSE2()) {
+        overlapMask = overlapMaskSSE2;
+        return "SSE2";
+    }
+#endif
+    overlapMask = overlapMaskScalar;
+    return "scalar";
+}
+
+/*
+    Normalizes the supplied vec2.
+*/
+void norm(vec2* v){
+#ifdef BALLS_FAST_RSQRT
+    real inverse = real_rsqrt(v->x * v->x + v->y * v->y);
+    v->x *= inverse;
+    v->y *= inverse;
+#else
+    real magnitute = real_sqrt(v->x * v->x + v->y * v->y);
+    v->x /= magnitute;
+    v->y /= magnitute;
+#endif
+}
+
+/*
+    Calculates the dot product of the supplied vec2.
+*/
+real dot(vec2* v1, vec2* v2){
+    return v1->x * v2->x + v1->y * v2->y;
+}
+
+/*
+    Called with every pair of balls bounce resolves, when set, so a check can
+    see which pairs a backend found. The parallel collision passes call it
+    from several threads at once.
+*/
+void (*bounceObserver)(int a, int b) = NULL;
+
+/*
+    Collision events, for the logic outside the physics that has to know
+    what hit what, such as scoring, sounds or statistics. While anyone
+    subscribes, every bounce that passes momentum between two balls writes
+    an event straight into one array as it happens, and once the step is
+    done every subscriber gets the whole array as a single batch, instead
+    of a call per collision. Balls are named by their index in the store,
+    which stays the same until --reorder or --sleep renumbers them.
+    The resolving threads claim their slots atomically, so they can all
+    write at once, though the events of a batch are then in no fixed
+    order. Every step starts with room for COLLISION_EVENTS_PER_BALL events
+    per ball, as many as balls packed edge to edge can have, and a step
+    with more events than that delivers the rest as lost, and the array
+    grows for the next one. The gpu engine bounces the balls on the GPU
+    and has no events.
+*/
+typedef struct CollisionEvent {
+    int     a;
+    int     b;
+    // where the balls touch, on the surface of a towards b
+    real    x;
+    real    y;
+    // unit normal pointing from a to b
+    real    nx;
+    real    ny;
+    // momentum passed from a to b along the normal
+    real    impulse;
+} CollisionEvent;
+
+typedef struct CollisionBatch {
+    const CollisionEvent*   events;
+    int                     count;
+    int                     lost;
+    Uint64                  step;
+} CollisionBatch;
+
+typedef void (*CollisionHandler)(const CollisionBatch *batch, void *data);
+
+#define COLLISION_MAX_SUBSCRIBERS 4
+#define COLLISION_MIN_CAPACITY 1024
+#define COLLISION_EVENTS_PER_BALL 3
+
+typedef struct CollisionFeed {
+    CollisionEvent*     events;
+    int                 capacity;
+    SDL_atomic_t        count;
+    Uint64              step;
+    CollisionHandler    handlers[COLLISION_MAX_SUBSCRIBERS];
+    void*               data[COLLISION_MAX_SUBSCRIBERS];
+    int                 subscribers;
+} CollisionFeed;
+
+CollisionFeed collisionFeed;
+
+/*
+    Has the handler called with the collisions of every step from now on,
+    along with the given data.
+    Returns 0 on success and 1 if there are COLLISION_MAX_SUBSCRIBERS
+    subscribers already or the events could not be allocated.
+*/
+int subscribeCollisions(CollisionHandler handler, void *data) {
+    if (collisionFeed.subscribers == COLLISION_MAX_SUBSCRIBERS) {
+        return 1;
+    }
+    if (collisionFeed.events == NULL) {
+        collisionFeed.events = malloc(sizeof(CollisionEvent) * COLLISION_MIN_CAPACITY);
+        if (collisionFeed.events == NULL) {
+            return 1;
+        }
+        collisionFeed.capacity = COLLISION_MIN_CAPACITY;
+        SDL_AtomicSet(&collisionFeed.count, 0);
+    }
+
+    collisionFeed.handlers[collisionFeed.subscribers] = handler;
+    collisionFeed.data[collisionFeed.subscribers] = data;
+    collisionFeed.subscribers++;
+    return 0;
+}
+
+/*
+    Stops calling the handler subscribed with the given data. The events
+    are released along with the last subscriber.
+*/
+void unsubscribeCollisions(CollisionHandler handler, void *data) {
+    for (int k = 0; k < collisionFeed.subscribers; k++) {
+        if (collisionFeed.handlers[k] == handler && collisionFeed.data[k] == data) {
+            collisionFeed.subscribers--;
+            collisionFeed.handlers[k] = collisionFeed.handlers[collisionFeed.subscribers];
+            collisionFeed.data[k] = collisionFeed.data[collisionFeed.subscribers];
+            break;
+        }
+    }
+
+    if (collisionFeed.subscribers == 0) {
+        free(collisionFeed.events);
+        collisionFeed.events = NULL;
+        collisionFeed.capacity = 0;
+    }
+}
+
+/*
+    Stores the position and velocity of ball i in whichever state the
+    engine keeps.
+*/
+void collisionState(BallStore *balls, int i, real *x, real *y, real *dx, real *dy) {
+    if (engine == ENGINE_FIXED) {
+        *x = (real) balls->fix_pos_x[i] / FIXED_ONE;
+        *y = (real) balls->fix_pos_y[i] / FIXED_ONE;
+        *dx = (real) balls->fix_dir_x[i] / FIXED_ONE;
+        *dy = (real) balls->fix_dir_y[i] / FIXED_ONE;
+        return;
+    }
+    *x = balls->pos_x[i];
+    *y = balls->pos_y[i];
+    *dx = balls->dir_x[i];
+    *dy = balls->dir_y[i];
+}
+
+/*
+    Adds the bounce of balls a and b to the events of the step, given the
+    velocity ball a had before it. A bounce that changed nothing, as for a
+    contact already separating, is no event.
+*/
+void recordCollision(BallStore *balls, int a, int b, real before_x, real before_y) {
+    real ax, ay, adx, ady, bx, by, bdx, bdy;
+    collisionState(balls, a, &ax, &ay, &adx, &ady);
+    collisionState(balls, b, &bx, &by, &bdx, &bdy);
+
+    real distance = real_sqrt((bx - ax) * (bx - ax) + (by - ay) * (by - ay));
+    if (distance == 0) {
+        return;
+    }
+    real nx = (bx - ax) / distance;
+    real ny = (by - ay) / distance;
+
+    real impulse = balls->mass[a] * ((before_x - adx) * nx + (before_y - ady) * ny);
+    if (impulse == 0) {
+        return;
+    }
+
+    int slot = SDL_AtomicAdd(&collisionFeed.count, 1);
+    if (slot >= collisionFeed.capacity) {
+        return;
+    }
+    collisionFeed.events[slot] = (CollisionEvent) {
+        .a = a,
+        .b = b,
+        .x = ax + nx * balls->radius[a],
+        .y = ay + ny * balls->radius[a],
+        .nx = nx,
+        .ny = ny,
+        .impulse = impulse
+    };
+}
+
+/*
+    Grows the events to hold at least count of them, before a step starts
+    writing into them. Exits if they cannot grow.
+*/
+void reserveCollisions(int count) {
+    if (count <= collisionFeed.capacity) {
+        return;
+    }
+    int capacity = collisionFeed.capacity;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    CollisionEvent *grown = realloc(collisionFeed.events, sizeof(CollisionEvent) * capacity);
+    if (grown == NULL) {
+        fprintf(stderr, "Could not grow the collision events!\n");
+        exit(1);
+    }
+    collisionFeed.events = grown;
+    collisionFeed.capacity = capacity;
+}
+
+/*
+    Hands the events of the step to every subscriber and starts the events
+    of the next one, with room for all of this step's if they did not fit.
+*/
+void deliverCollisions() {
+    int count = SDL_AtomicSet(&collisionFeed.count, 0);
+    CollisionBatch batch = {
+        .events = collisionFeed.events,
+        .count = count < collisionFeed.capacity ? count : collisionFeed.capacity,
+        .lost = count > collisionFeed.capacity ? count - collisionFeed.capacity : 0,
+        .step = collisionFeed.step++
+    };
+    for (int k = 0; k < collisionFeed.subscribers; k++) {
+        collisionFeed.handlers[k](&batch, collisionFeed.data[k]);
+    }
+
+    reserveCollisions(count);
+}
+
+/*
+    With --collisions <file> the feed has a subscriber of its own, which
+    sums the events of every step into one CSV row: how many there were,
+    how many were lost, and the total and the largest impulse passed.
+*/
+FILE *collisionFile = NULL;
+
+void writeCollisionRow(const CollisionBatch *batch, void *data) {
+    FILE *file = data;
+    double total = 0;
+    double largest = 0;
+    for (int k = 0; k < batch->count; k++) {
+        double impulse = fabs(batch->events[k].impulse);
+        total += impulse;
+        largest = fmax(largest, impulse);
+    }
+    fprintf(file, "%llu,%d,%d,%.6g,%.6g\n", (unsigned long long) batch->step, batch->count, batch->lost,
+            total, largest);
+}
+
+/*
+    Opens the collisions file, writes its header and subscribes the writer.
+    Returns 0 on success and 1 if the file could not be opened or the
+    feed did not take the subscriber.
+*/
+int openCollisions(const char *path) {
+    collisionFile = fopen(path, "w");
+    if (collisionFile == NULL) {
+        return 1;
+    }
+    fprintf(collisionFile, "step,events,lost,impulse,max_impulse\n");
+    if (subscribeCollisions(writeCollisionRow, collisionFile) != 0) {
+        fclose(collisionFile);
+        collisionFile = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Unsubscribes the writer and closes the collisions file, if open.
+*/
+void closeCollisions() {
+    if (collisionFile == NULL) {
+        return;
+    }
+    unsubscribeCollisions(writeCollisionRow, collisionFile);
+    fclose(collisionFile);
+    collisionFile = NULL;
+}
+
+/*
+    Version of bounce for balls of different masses. The elastic impulse
+    along the offset d between the centers changes the velocities by
+        k * d / m_a  and  -k * d / m_b,  k = 2 (v_b - v_a) . d / (|d|^2 (1/m_a + 1/m_b))
+    so with the inverse masses at hand the only division is the one that
+    normalizing d costs the equal-mass bounce too. With equal masses it
+    comes out exactly as that bounce.
+*/
+void bounceWeighted(BallStore *balls, int a, int b) {
+    real dx = balls->pos_x[b] - balls->pos_x[a];
+    real dy = balls->pos_y[b] - balls->pos_y[a];
+    real distance_squared = dx * dx + dy * dy;
+    if (distance_squared == 0) {
+        return;
+    }
+
+    real inv_a = balls->inv_mass[a];
+    real inv_b = balls->inv_mass[b];
+    real closing = (balls->dir_x[a] - balls->dir_x[b]) * dx + (balls->dir_y[a] - balls->dir_y[b]) * dy;
+    real k = 2 * closing / (distance_squared * (inv_a + inv_b));
+
+    balls->dir_x[a] -= k * inv_a * dx;
+    balls->dir_y[a] -= k * inv_a * dy;
+    balls->dir_x[b] += k * inv_b * dx;
+    balls->dir_y[b] += k * inv_b * dy;
+}
+
+/*
+    With --separate a contact also pushes its balls apart, instead of only
+    exchanging their velocities, and only bounces balls that are closing
+    in. Without it, balls still overlapping after their bounce are found
+    again the next step and bounced back together, over and over; this way
+    a pair is bounced once per contact and is out of touch within a few
+    steps. The balls are pushed SEPARATION_PERCENT of the way out of each
+    other, less SEPARATION_SLOP pixels of overlap that are left alone so
+    resting balls do not shake, the lighter ball the farther.
+*/
+#define SEPARATION_SLOP 0.5
+#define SEPARATION_PERCENT 0.8
+
+bool separateContacts = false;
+
+/*
+    Version of bounce with positional correction and the check that the
+    balls are closing in. The velocities change like in bounceWeighted.
+*/
+void bounceSeparating(BallStore *balls, int a, int b) {
+    real dx = balls->pos_x[b] - balls->pos_x[a];
+    real dy = balls->pos_y[b] - balls->pos_y[a];
+    real distance_squared = dx * dx + dy * dy;
+    if (distance_squared == 0) {
+        return;
+    }
+
+    // an earlier contact of the step may have pushed them apart already
+    real reach = balls->radius[a] + balls->radius[b];
+    if (distance_squared >= reach * reach) {
+        return;
+    }
+
+#ifdef BALLS_FAST_RSQRT
+    real inverse = real_rsqrt(distance_squared);
+    real distance = distance_squared * inverse;
+    real nx = dx * inverse;
+    real ny = dy * inverse;
+#else
+    real distance = real_sqrt(distance_squared);
+    real nx = dx / distance;
+    real ny = dy / distance;
+#endif
+
+    // the share of the correction and of the impulse each ball takes
+    real share_a = 0.5;
+    real share_b = 0.5;
+    if (unequalMasses) {
+        real total = 1 / (balls->inv_mass[a] + balls->inv_mass[b]);
+        share_a = balls->inv_mass[a] * total;
+        share_b = balls->inv_mass[b] * total;
+    }
+
+    real depth = reach - distance - SEPARATION_SLOP;
+    if (depth > 0) {
+        real push = depth * SEPARATION_PERCENT;
+        balls->pos_x[a] -= push * share_a * nx;
+        balls->pos_y[a] -= push * share_a * ny;
+        balls->pos_x[b] += push * share_b * nx;
+        balls->pos_y[b] += push * share_b * ny;
+    }
+
+    real closing = (balls->dir_x[a] - balls->dir_x[b]) * nx + (balls->dir_y[a] - balls->dir_y[b]) * ny;
+    if (closing <= 0) {
+        return;
+    }
+
+    balls->dir_x[a] -= 2 * share_a * closing * nx;
+    balls->dir_y[a] -= 2 * share_a * closing * ny;
+    balls->dir_x[b] += 2 * share_b * closing * nx;
+    balls->dir_y[b] += 2 * share_b * closing * ny;
+}
+
+/*
+    With --contacts the pairs that touch are remembered from one step to
+    the next. bounce reflects the velocities of a pair whether or not its
+    balls are still closing in, so two balls that overlap for a few steps
+    used to be bounced back together again every step, and dense piles
+    jittered in place. A pair that touched in the previous step and whose
+    balls are moving apart already is left to separate now, with none of
+    the work of bouncing it.
+    The pairs are kept with the ball of the lower index, in CONTACT_SLOTS
+    slots each, stamped with the step they last touched in. Only the
+    thread resolving a ball ever touches its slots, so every parallel pass
+    can use the cache as it is.
+*/
+#define CONTACT_SLOTS 4
+
+typedef struct ContactCache {
+    int     (*partner)[CONTACT_SLOTS];
+    Uint32  (*step)[CONTACT_SLOTS];
+    Uint32  current;
+} ContactCache;
+
+ContactCache contactCache;
+bool persistentContacts = false;
+
+/*
+    Allocates the cache for up to amnt balls, with no pairs in it.
+    Returns 0 on success and 1 if the allocation failed.
+*/
+int initContactCache(int amnt) {
+    size_t n = amnt > 0 ? amnt : 1;
+    contactCache.partner = calloc(n, sizeof(*contactCache.partner));
+    contactCache.step = calloc(n, sizeof(*contactCache.step));
+    contactCache.current = 1;
+    return contactCache.partner == NULL || contactCache.step == NULL;
+}
+
+void freeContactCache() {
+    free(contactCache.partner);
+    free(contactCache.step);
+}
+
+/*
+    Forgets every pair, for when the balls are renumbered. Stamps two steps
+    behind are as good as empty.
+*/
+void resetContactCache() {
+    contactCache.current += 2;
+}
+
+/*
+    Remembers that balls a and b, a being the lower index, touch in the
+    current step.
+    Returns whether they touched in the previous step too.
+*/
+bool persistContact(int a, int b) {
+    int *partner = contactCache.partner[a];
+    Uint32 *step = contactCache.step[a];
+    Uint32 current = contactCache.current;
+
+    // the slot of the pair, or else the one that touched the longest ago
+    int slot = 0;
+    for (int k = 0; k < CONTACT_SLOTS; k++) {
+        if (partner[k] == b && step[k] + 1 >= current) {
+            bool persisted = step[k] + 1 == current;
+            step[k] = current;
+            return persisted;
+        }
+        if (step[k] < step[slot]) {
+            slot = k;
+        }
+    }
+
+    partner[slot] = b;
+    step[slot] = current;
+    return false;
+}
+
+/*
+    Returns whether the pair of balls a and b was already bounced in the
+    previous step and is now moving apart.
+*/
+bool contactSeparating(BallStore *balls, int a, int b) {
+    if (!persistContact(a < b ? a : b, a < b ? b : a)) {
+        return false;
+    }
+
+    real closing = (balls->dir_x[a] - balls->dir_x[b]) * (balls->pos_x[b] - balls->pos_x[a])
+                 + (balls->dir_y[a] - balls->dir_y[b]) * (balls->pos_y[b] - balls->pos_y[a]);
+    return closing <= 0;
+}
+
+/*
+    Version of bounce for balls of the same mass, exchanging the components
+    of their velocities along the line between their centers.
+*/
+void bounceEqual(BallStore *balls, int a, int b) {
+    // A vector that records the distance between the centers of the ball
+    // along both axes.
+    vec2 n = {
+        .x = balls->pos_x[b] - balls->pos_x[a],
+        .y = balls->pos_y[b] - balls->pos_y[a]
+    };
+
+    // Balls sitting exactly on top of each other have no collision normal,
+    // and normalizing would turn both of them into NaN.
+    if (n.x == 0 && n.y == 0) {
+        return;
+    }
+
+    // Normalized.
+    norm(&n);
+
+    vec2 dir_a = { .x = balls->dir_x[a], .y = balls->dir_y[a] };
+    vec2 dir_b = { .x = balls->dir_x[b], .y = balls->dir_y[b] };
+
+    // Projection of the balls' velocities onto the vector n.
+    real scalar_product = dot(&dir_a, &n) - dot(&dir_b, &n);
+
+    // Update velocities.
+    balls->dir_x[a] = dir_a.x - scalar_product * n.x;
+    balls->dir_y[a] = dir_a.y - scalar_product * n.y;
+
+    balls->dir_x[b] = dir_b.x + scalar_product * n.x;
+    balls->dir_y[b] = dir_b.y + scalar_product * n.y;
+}
+
+/*
+    Calculate the final velocities after collision for both balls.
+    Assuming both balls are the same mass, unless unequalMasses says
+    otherwise, in which case bounceWeighted takes over.
+*/
+void resolveBounce(BallStore *balls, int a, int b) {
+    if (bounceObserver != NULL) {
+        bounceObserver(a, b);
+    }
+    if (engine == ENGINE_FIXED) {
+        bounceFixed(balls, a, b);
+        return;
+    }
+    if (continuousCollisions) {
+        bounceSwept(balls, a, b);
+        return;
+    }
+    if (persistentContacts && contactSeparating(balls, a, b)) {
+        return;
+    }
+    if (separateContacts) {
+        bounceSeparating(balls, a, b);
+        return;
+    }
+    if (unequalMasses) {
+        bounceWeighted(balls, a, b);
+        return;
+    }
+    bounceEqual(balls, a, b);
+}
+
+/*
+    With --deterministic the broad phase only finds the contacts of a step,
+    and bounce files every pair it is given under a canonical key instead
+    of resolving it: the lower ball index times the ball count plus the
+    higher one. The keys are sorted once the broad phase is done, so the
+    pairs are resolved in the same order however the broad phase and the
+    threads came across them, and a run ends up bitwise the same on any
+    number of threads. The threads claim their slots atomically; a step
+    that finds more pairs than there is room for finds them again with
+    more room, which is safe since finding them changes nothing.
+*/
+typedef struct DeferredContacts {
+    Uint64*         keys;
+    Uint64*         scratch;
+    int             capacity;
+    SDL_atomic_t    count;
+    bool            deferring;
+} DeferredContacts;
+
+DeferredContacts deferredContacts;
+bool deterministic = false;
+
+/*
+    Files the pair of balls a and b under its key, to be resolved once all
+    the pairs of the step are known.
+*/
+void deferContact(BallStore *balls, int a, int b) {
+    Uint64 low = a < b ? a : b;
+    Uint64 high = a < b ? b : a;
+    int slot = SDL_AtomicAdd(&deferredContacts.count, 1);
+    if (slot < deferredContacts.capacity) {
+        deferredContacts.keys[slot] = low * balls->count + high;
+    }
+}
+
+/*
+    Bounces balls a and b off each other, and adds the collision to the
+    events of the step while anyone subscribes to them.
+*/
+void bounce(BallStore *balls, int a, int b) {
+    if (deferredContacts.deferring) {
+        deferContact(balls, a, b);
+        return;
+    }
+    if (collisionFeed.subscribers == 0) {
+        resolveBounce(balls, a, b);
+        return;
+    }
+
+    real x, y, dx, dy;
+    collisionState(balls, a, &x, &y, &dx, &dy);
+    resolveBounce(balls, a, b);
+    recordCollision(balls, a, b, dx, dy);
+}
+
+/*
+    Check if the ball is bouncing off the wall. Reverse its corresponding
+    velocity component if it is.
+*/
+void bounceWall(BallStore *balls, int a) {
+    if (engine == ENGINE_FIXED) {
+        bounceWallFixed(balls, a);
+        return;
+    }
+    if (continuousCollisions) {
+        bounceWallSwept(balls, a);
+        return;
+    }
+
+    int radius = balls->radius[a];
+
+    real left  = balls->pos_x[a] - radius;
+    real right = balls->pos_x[a] + radius;
+
+    real up   = balls->pos_y[a] - radius;
+    real down = balls->pos_y[a] + radius;
+
+    // Horizontal bounce
+    if (left < 0 || right > world_width) { 
+        balls->dir_x[a] *= -1; 
+        if (balls->dir_x[a] > 0) {
+            balls->pos_x[a] = radius + 1;
+        }
+        else {
+            balls->pos_x[a] = world_width - radius - 1;
+        }
+    }
+    // Vertical bounce
+    if (up < 0 || down > world_height) { 
+        balls->dir_y[a] *= -1;
+        if (balls->dir_y[a] > 0) {
+            balls->pos_y[a] = radius + 1;
+        }
+        else {
+            balls->pos_y[a] = world_height - radius - 1;
+        }
+    }
+}
+
+/*
+    Integration kernel moving the balls begin up to (but not including) end
+    by their velocity and reflecting them off the walls, with the same
+    result as calling moveBall and then bounceWall on each of them.
+*/
+typedef void (*IntegrateKernel)(BallStore *balls, int begin, int end);
+
+/*
+    Portable version of the integration kernel, written with selects
+    instead of branches so the compiler is free to vectorize it.
+*/
+void integrateBallsScalar(BallStore *balls, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        real radius = balls->radius[i];
+        real x = balls->pos_x[i] + balls->dir_x[i] * step_dt;
+        real y = balls->pos_y[i] + balls->dir_y[i] * step_dt;
+
+        bool hit_x = x - radius < 0 || x + radius > world_width;
+        real dir_x = hit_x ? -balls->dir_x[i] : balls->dir_x[i];
+        real wall_x = dir_x > 0 ? radius + 1 : world_width - radius - 1;
+
+        bool hit_y = y - radius < 0 || y + radius > world_height;
+        real dir_y = hit_y ? -balls->dir_y[i] : balls->dir_y[i];
+        real wall_y = dir_y > 0 ? radius + 1 : world_height - radius - 1;
+
+        balls->pos_x[i] = hit_x ? wall_x : x;
+        balls->pos_y[i] = hit_y ? wall_y : y;
+        balls->dir_x[i] = dir_x;
+        balls->dir_y[i] = dir_y;
+    }
+}
+
+/*
+    Fixed-point version of the integration kernel.
+*/
+void integrateBallsFixed(BallStore *balls, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        moveBallFixed(balls, i);
+        bounceWallFixed(balls, i);
+    }
+}
+
+/*
+    Continuous version of the integration kernel.
+*/
+void integrateBallsSwept(BallStore *balls, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        balls->pos_x[i] += ccd_shift_x[i];
+        balls->pos_y[i] += ccd_shift_y[i];
+        ccd_shift_x[i] = 0;
+        ccd_shift_y[i] = 0;
+
+        moveBall(balls, i);
+        bounceWallSwept(balls, i);
+    }
+}
+
+#ifdef BALLS_X86
+
+#ifdef BALLS_SINGLE_PRECISION
+
+/*
+    Integrates one axis of four balls. A ball past either wall gets its
+    velocity negated by flipping the sign bit and is put back just inside
+    the wall it is now moving away from.
+*/
+__attribute__((target("sse2")))
+static inline void integrateAxisSSE2(real *pos, real *dir, __m128 radius, __m128 size, __m128 dt) {
+    __m128 one = _mm_set1_ps(1);
+    __m128 sign = _mm_set1_ps(-0.0f);
+
+    __m128 d = _mm_loadu_ps(dir);
+    __m128 p = _mm_add_ps(_mm_loadu_ps(pos), _mm_mul_ps(d, dt));
+
+    __m128 hit = _mm_or_ps(_mm_cmplt_ps(_mm_sub_ps(p, radius), _mm_setzero_ps()),
+                           _mm_cmpgt_ps(_mm_add_ps(p, radius), size));
+    d = _mm_xor_ps(d, _mm_and_ps(hit, sign));
+
+    __m128 away = _mm_cmpgt_ps(d, _mm_setzero_ps());
+    __m128 wall = _mm_or_ps(_mm_and_ps(away, _mm_add_ps(radius, one)),
+                            _mm_andnot_ps(away, _mm_sub_ps(_mm_sub_ps(size, radius), one)));
+    p = _mm_or_ps(_mm_and_ps(hit, wall), _mm_andnot_ps(hit, p));
+
+    _mm_storeu_ps(pos, p);
+    _mm_storeu_ps(dir, d);
+}
+
+/*
+    SSE2 version of the integration kernel, moving four balls at a time.
+*/
+__attribute__((target("sse2")))
+void integrateBallsSSE2(BallStore *balls, int begin, int end) {
+    __m128 width = _mm_set1_ps(world_width);
+    __m128 height = _mm_set1_ps(world_height);
+    __m128 dt = _mm_set1_ps(step_dt);
+
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 radius = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (balls->radius + i)));
+        integrateAxisSSE2(balls->pos_x + i, balls->dir_x + i, radius, width, dt);
+        integrateAxisSSE2(balls->pos_y + i, balls->dir_y + i, radius, height, dt);
+    }
+    integrateBallsScalar(balls, i, end);
+}
+
+/*
+    Integrates one axis of eight balls, like integrateAxisSSE2.
+*/
+__attribute__((target("avx2")))
+static inline void integrateAxisAVX2(real *pos, real *dir, __m256 radius, __m256 size, __m256 dt) {
+    __m256 one = _mm256_set1_ps(1);
+    __m256 sign = _mm256_set1_ps(-0.0f);
+
+    __m256 d = _mm256_loadu_ps(dir);
+    __m256 p = _mm256_add_ps(_mm256_loadu_ps(pos), _mm256_mul_ps(d, dt));
+
+    __m256 hit = _mm256_or_ps(_mm256_cmp_ps(_mm256_sub_ps(p, radius), _mm256_setzero_ps(), _CMP_LT_OQ),
+                              _mm256_cmp_ps(_mm256_add_ps(p, radius), size, _CMP_GT_OQ));
+    d = _mm256_xor_ps(d, _mm256_and_ps(hit, sign));
+
+    __m256 away = _mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_GT_OQ);
+    __m256 wall = _mm256_blendv_ps(_mm256_sub_ps(_mm256_sub_ps(size, radius), one),
+                                   _mm256_add_ps(radius, one), away);
+    p = _mm256_blendv_ps(p, wall, hit);
+
+    _mm256_storeu_ps(pos, p);
+    _mm256_storeu_ps(dir, d);
+}
+
+/*
+    AVX2 version of the integration kernel, moving eight balls at a time.
+*/
+__attribute__((target("avx2")))
+void integrateBallsAVX2(BallStore *balls, int begin, int end) {
+    __m256 width = _mm256_set1_ps(world_width);
+    __m256 height = _mm256_set1_ps(world_height);
+    __m256 dt = _mm256_set1_ps(step_dt);
+
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 radius = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) (balls->radius + i)));
+        integrateAxisAVX2(balls->pos_x + i, balls->dir_x + i, radius, width, dt);
+        integrateAxisAVX2(balls->pos_y + i, balls->dir_y + i, radius, height, dt);
+    }
+    integrateBallsScalar(balls, i, end);
+}
+
+#else
+
+/*
+    Integrates one axis of two balls. A ball past either wall gets its
+    velocity negated by flipping the sign bit and is put back just inside
+    the wall it is now moving away from.
+*/
+__attribute__((target("sse2")))
+static inline void integrateAxisSSE2(real *pos, real *dir, __m128d radius, __m128d size, __m128d dt) {
+    __m128d one = _mm_set1_pd(1);
+    __m128d sign = _mm_set1_pd(-0.0);
+
+    __m128d d = _mm_loadu_pd(dir);
+    __m128d p = _mm_add_pd(_mm_loadu_pd(pos), _mm_mul_pd(d, dt));
+
+    __m128d hit = _mm_or_pd(_mm_cmplt_pd(_mm_sub_pd(p, radius), _mm_setzero_pd()),
+                            _mm_cmpgt_pd(_mm_add_pd(p, radius), size));
+    d = _mm_xor_pd(d, _mm_and_pd(hit, sign));
+
+    __m128d away = _mm_cmpgt_pd(d, _mm_setzero_pd());
+    __m128d wall = _mm_or_pd(_mm_and_pd(away, _mm_add_pd(radius, one)),
+                             _mm_andnot_pd(away, _mm_sub_pd(_mm_sub_pd(size, radius), one)));
+    p = _mm_or_pd(_mm_and_pd(hit, wall), _mm_andnot_pd(hit, p));
+
+    _mm_storeu_pd(pos, p);
+    _mm_storeu_pd(dir, d);
+}
+
+/*
+    SSE2 version of the integration kernel, moving two balls at a time.
+*/
+__attribute__((target("sse2")))
+void integrateBallsSSE2(BallStore *balls, int begin, int end) {
+    __m128d width = _mm_set1_pd(world_width);
+    __m128d height = _mm_set1_pd(world_height);
+    __m128d dt = _mm_set1_pd(step_dt);
+
+    int i = begin;
+    for (; i + 2 <= end; i += 2) {
+        __m128d radius = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*) (balls->radius + i)));
+        integrateAxisSSE2(balls->pos_x + i, balls->dir_x + i, radius, width, dt);
+        integrateAxisSSE2(balls->pos_y + i, balls->dir_y + i, radius, height, dt);
+    }
+    integrateBallsScalar(balls, i, end);
+}
+
+/*
+    Integrates one axis of four balls, like integrateAxisSSE2.
+*/
+__attribute__((target("avx2")))
+static inline void integrateAxisAVX2(real *pos, real *dir, __m256d radius, __m256d size, __m256d dt) {
+    __m256d one = _mm256_set1_pd(1);
+    __m256d sign = _mm256_set1_pd(-0.0);
+
+    __m256d d = _mm256_loadu_pd(dir);
+    __m256d p = _mm256_add_pd(_mm256_loadu_pd(pos), _mm256_mul_pd(d, dt));
+
+    __m256d hit = _mm256_or_pd(_mm256_cmp_pd(_mm256_sub_pd(p, radius), _mm256_setzero_pd(), _CMP_LT_OQ),
+                               _mm256_cmp_pd(_mm256_add_pd(p, radius), size, _CMP_GT_OQ));
+    d = _mm256_xor_pd(d, _mm256_and_pd(hit, sign));
+
+    __m256d away = _mm256_cmp_pd(d, _mm256_setzero_pd(), _CMP_GT_OQ);
+    __m256d wall = _mm256_blendv_pd(_mm256_sub_pd(_mm256_sub_pd(size, radius), one),
+                                    _mm256_add_pd(radius, one), away);
+    p = _mm256_blendv_pd(p, wall, hit);
+
+    _mm256_storeu_pd(pos, p);
+    _mm256_storeu_pd(dir, d);
+}
+
+/*
+    AVX2 version of the integration kernel, moving four balls at a time.
+*/
+__attribute__((target("avx2")))
+void integrateBallsAVX2(BallStore *balls, int begin, int end) {
+    __m256d width = _mm256_set1_pd(world_width);
+    __m256d height = _mm256_set1_pd(world_height);
+    __m256d dt = _mm256_set1_pd(step_dt);
+
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m256d radius = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*) (balls->radius + i)));
+        integrateAxisAVX2(balls->pos_x + i, balls->dir_x + i, radius, width, dt);
+        integrateAxisAVX2(balls->pos_y + i, balls->dir_y + i, radius, height, dt);
+    }
+    integrateBallsScalar(balls, i, end);
+}
+
+#endif
+
+#endif
+
+IntegrateKernel integrateBalls = integrateBallsScalar;
+
+/*
+    Picks the widest integration kernel the CPU supports.
+    Returns the name of the chosen kernel.
+*/
+const char* selectIntegrateKernel() {
+#ifdef BALLS_X86
+    if (SDL_HasAVX2()) {
+        integrateBalls = integrateBallsAVX2;
+        return "AVX2";
+    }
+    if (SDL_HasSSE2()) {
+        integrateBalls = integrateBallsSSE2;
+        return "SSE2";
+    }
+#endif
+    integrateBalls = integrateBallsScalar;
+    return "scalar";
+}
+
+/*
+    Renders all the balls at once, while also checking for
+    collision between balls and the walls.
+*/
+void renderBalls(BallStore *balls) {
+    /*
+        TODO: Optimize collision.
+    */
+    for (int i = 0; i < balls->count; i++) {
+        // colliding balls are drawn red, and the rest blue
+        PointBatch *batch = &ballPoints;
+        for (int j = 0; j < balls->count; j++) {
+            if (i == j) continue;
+            else {
+                if (overlaps(balls, i, j)) {
+                    batch = &hitPoints;
+                    bounce(balls, i, j);
+                    break;
+                }
+            }
+        }
+
+        drawBall(balls, i, batch);
+        moveBall(balls, i);
+        bounceWall(balls, i);
+    }
+
+    flushPoints(&hitPoints, 255, 0, 0);
+    flushPoints(&ballPoints, 0, 0, 255);
+}
+
+/*
+    Allocates the subspace grid. The ball index array has room for every
+    corner of every ball, which is the most entries a single frame can need.
+*/
+int initSubspaceGrid(int amnt) {
+    subspaceTracker.capacity = amnt * BALL_CORNER_COUNT;
+    subspaceTracker.cellStart = calloc(subspace_count, sizeof(int));
+    subspaceTracker.cellCursor = calloc(subspace_count, sizeof(int));
+    subspaceTracker.cellBalls = malloc(sizeof(int) * (subspaceTracker.capacity + 1));
+    subspaceTracker.blocks = (OCCUPIED_WORDS(subspace_count) + GRID_BLOCK_WORDS - 1) / GRID_BLOCK_WORDS;
+    subspaceTracker.blockOffsets = malloc(sizeof(int) * subspaceTracker.blocks);
+    occupiedSubspaces = calloc(OCCUPIED_WORDS(subspace_count), sizeof(Uint32));
+
+    if (subspaceTracker.cellStart == NULL || subspaceTracker.cellCursor == NULL || subspaceTracker.cellBalls == NULL ||
+        subspaceTracker.blockOffsets == NULL || occupiedSubspaces == NULL) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+    Checks whether the corner at the given index falls into a subspace that
+    an earlier corner of the same ball already covers. Small balls often
+    have several corners in the same subspace, and each ball must only be
+    listed once per subspace.
+*/
+bool isRepeatedCorner(BallStore *balls, int i, int corner) {
+    for (int k = 0; k < corner; k++) {
+        if (balls->subspaces[i][k] == balls->subspaces[i][corner]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Binning kernel working out the corner subspaces of the balls begin up
+    to (but not including) end, with the same result as calling
+    calculateSubspaces on each of them. The subspaces go straight into the
+    per-ball corner array the counting and scatter passes of the grid
+    build read.
+*/
+typedef void (*BinKernel)(BallStore *balls, int begin, int end);
+
+/*
+    Portable version of the binning kernel.
+*/
+void binBallsScalar(BallStore *balls, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        calculateSubspaces(balls, i);
+    }
+}
+
+/*
+    Binning for --binning center: every corner of a ball is set to the
+    subspace of its center, so the grid builds list it exactly once, as
+    the later corners are all repeats of the first.
+*/
+void binBallsCenter(BallStore *balls, int begin, int end) {
+    int spr = subspace_columns;
+    for (int i = begin; i < end; i++) {
+        int subspace = subspaceColumn(balls->pos_x[i]) + subspaceRow(balls->pos_y[i]) * spr;
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            balls->subspaces[i][j] = subspace;
+        }
+    }
+}
+
+#ifdef BALLS_X86
+
+#ifdef BALLS_SINGLE_PRECISION
+
+/*
+    Bins one coordinate of four balls like binCoordinate, truncating and
+    nudging the scaled coordinate onto the exact cell before clamping it.
+*/
+__attribute__((target("sse2")))
+static inline __m128i binAxisSSE2(__m128 v, __m128 scale, __m128 size, __m128 cells) {
+    __m128 one = _mm_set1_ps(1);
+
+    __m128 q = _mm_min_ps(_mm_max_ps(_mm_mul_ps(v, scale), _mm_set1_ps(-1)), cells);
+    __m128 cell = _mm_cvtepi32_ps(_mm_cvttps_epi32(q));
+
+    __m128 up = _mm_cmple_ps(_mm_mul_ps(_mm_add_ps(cell, one), size), v);
+    __m128 down = _mm_andnot_ps(up, _mm_cmpgt_ps(_mm_mul_ps(cell, size), v));
+    cell = _mm_sub_ps(_mm_add_ps(cell, _mm_and_ps(up, one)), _mm_and_ps(down, one));
+
+    cell = _mm_min_ps(_mm_max_ps(cell, _mm_setzero_ps()), _mm_sub_ps(cells, one));
+    return _mm_cvttps_epi32(cell);
+}
+
+/*
+    SSE2 version of the binning kernel, binning four balls at a time.
+*/
+__attribute__((target("sse2")))
+void binBallsSSE2(BallStore *balls, int begin, int end) {
+    __m128 scale_x = _mm_set1_ps(subspace_scale_x);
+    __m128 scale_y = _mm_set1_ps(subspace_scale_y);
+    __m128 size_x = _mm_set1_ps(subspace_size_x);
+    __m128 size_y = _mm_set1_ps(subspace_size_y);
+    __m128 columns = _mm_set1_ps(subspace_columns);
+    __m128 rows = _mm_set1_ps(subspace_rows);
+    __m128 margin = _mm_set1_ps(ccd_margin);
+    // rows and columns both stay below 2^15, so the row offsets can be
+    // multiplied out 16 bits at a time, which is all SSE2 has
+    __m128i spr = _mm_set1_epi32(subspace_columns);
+
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 extent = _mm_add_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (balls->radius + i))), margin);
+        __m128 x = _mm_loadu_ps(balls->pos_x + i);
+        __m128 y = _mm_loadu_ps(balls->pos_y + i);
+
+        __m128i left = binAxisSSE2(_mm_sub_ps(x, extent), scale_x, size_x, columns);
+        __m128i right = binAxisSSE2(_mm_add_ps(x, extent), scale_x, size_x, columns);
+        __m128i up = _mm_madd_epi16(binAxisSSE2(_mm_sub_ps(y, extent), scale_y, size_y, rows), spr);
+        __m128i down = _mm_madd_epi16(binAxisSSE2(_mm_add_ps(y, extent), scale_y, size_y, rows), spr);
+
+        // one vector per corner, one ball per lane, turned into four
+        // balls of four corners each
+        __m128 c0 = _mm_castsi128_ps(_mm_add_epi32(left, up));
+        __m128 c1 = _mm_castsi128_ps(_mm_add_epi32(right, up));
+        __m128 c2 = _mm_castsi128_ps(_mm_add_epi32(left, down));
+        __m128 c3 = _mm_castsi128_ps(_mm_add_epi32(right, down));
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+        _mm_storeu_ps((float*) balls->subspaces[i], c0);
+        _mm_storeu_ps((float*) balls->subspaces[i + 1], c1);
+        _mm_storeu_ps((float*) balls->subspaces[i + 2], c2);
+        _mm_storeu_ps((float*) balls->subspaces[i + 3], c3);
+    }
+    binBallsScalar(balls, i, end);
+}
+
+/*
+    Bins one coordinate of eight balls, like binAxisSSE2.
+*/
+__attribute__((target("avx2")))
+static inline __m256i binAxisAVX2(__m256 v, __m256 scale, __m256 size, __m256 cells) {
+    __m256 one = _mm256_set1_ps(1);
+
+    __m256 q = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(v, scale), _mm256_set1_ps(-1)), cells);
+    __m256 cell = _mm256_round_ps(q, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+
+    __m256 up = _mm256_cmp_ps(_mm256_mul_ps(_mm256_add_ps(cell, one), size), v, _CMP_LE_OQ);
+    __m256 down = _mm256_andnot_ps(up, _mm256_cmp_ps(_mm256_mul_ps(cell, size), v, _CMP_GT_OQ));
+    cell = _mm256_sub_ps(_mm256_add_ps(cell, _mm256_and_ps(up, one)), _mm256_and_ps(down, one));
+
+    cell = _mm256_min_ps(_mm256_max_ps(cell, _mm256_setzero_ps()), _mm256_sub_ps(cells, one));
+    return _mm256_cvttps_epi32(cell);
+}
+
+/*
+    AVX2 version of the binning kernel, binning eight balls at a time.
+*/
+__attribute__((target("avx2")))
+void binBallsAVX2(BallStore *balls, int begin, int end) {
+    __m256 scale_x = _mm256_set1_ps(subspace_scale_x);
+    __m256 scale_y = _mm256_set1_ps(subspace_scale_y);
+    __m256 size_x = _mm256_set1_ps(subspace_size_x);
+    __m256 size_y = _mm256_set1_ps(subspace_size_y);
+    __m256 columns = _mm256_set1_ps(subspace_columns);
+    __m256 rows = _mm256_set1_ps(subspace_rows);
+    __m256 margin = _mm256_set1_ps(ccd_margin);
+    __m256i spr = _mm256_set1_epi32(subspace_columns);
+
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 extent = _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) (balls->radius + i))),
+                                      margin);
+        __m256 x = _mm256_loadu_ps(balls->pos_x + i);
+        __m256 y = _mm256_loadu_ps(balls->pos_y + i);
+
+        __m256i left = binAxisAVX2(_mm256_sub_ps(x, extent), scale_x, size_x, columns);
+        __m256i right = binAxisAVX2(_mm256_add_ps(x, extent), scale_x, size_x, columns);
+        __m256i up = _mm256_mullo_epi32(binAxisAVX2(_mm256_sub_ps(y, extent), scale_y, size_y, rows), spr);
+        __m256i down = _mm256_mullo_epi32(binAxisAVX2(_mm256_add_ps(y, extent), scale_y, size_y, rows), spr);
+
+        __m256 c0 = _mm256_castsi256_ps(_mm256_add_epi32(left, up));
+        __m256 c1 = _mm256_castsi256_ps(_mm256_add_epi32(right, up));
+        __m256 c2 = _mm256_castsi256_ps(_mm256_add_epi32(left, down));
+        __m256 c3 = _mm256_castsi256_ps(_mm256_add_epi32(right, down));
+
+        // the transpose works within each 128 bit half, leaving the
+        // corners of balls 0 to 3 in the low halves and 4 to 7 in the high
+        __m256 t0 = _mm256_unpacklo_ps(c0, c1);
+        __m256 t1 = _mm256_unpackhi_ps(c0, c1);
+        __m256 t2 = _mm256_unpacklo_ps(c2, c3);
+        __m256 t3 = _mm256_unpackhi_ps(c2, c3);
+        __m256 b0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 b1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 b2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 b3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+
+        _mm256_storeu_ps((float*) balls->subspaces[i], _mm256_permute2f128_ps(b0, b1, 0x20));
+        _mm256_storeu_ps((float*) balls->subspaces[i + 2], _mm256_permute2f128_ps(b2, b3, 0x20));
+        _mm256_storeu_ps((float*) balls->subspaces[i + 4], _mm256_permute2f128_ps(b0, b1, 0x31));
+        _mm256_storeu_ps((float*) balls->subspaces[i + 6], _mm256_permute2f128_ps(b2, b3, 0x31));
+    }
+    binBallsScalar(balls, i, end);
+}
+
+#else
+
+/*
+    Bins one coordinate of two balls like binCoordinate, truncating and
+    nudging the scaled coordinate onto the exact cell before clamping it.
+    The cells come back as doubles, which hold every subspace index
+    exactly.
+*/
+__attribute__((target("sse2")))
+static inline __m128d binAxisSSE2(__m128d v, __m128d scale, __m128d size, __m128d cells) {
+    __m128d one = _mm_set1_pd(1);
+
+    __m128d q = _mm_min_pd(_mm_max_pd(_mm_mul_pd(v, scale), _mm_set1_pd(-1)), cells);
+    __m128d cell = _mm_cvtepi32_pd(_mm_cvttpd_epi32(q));
+
+    __m128d up = _mm_cmple_pd(_mm_mul_pd(_mm_add_pd(cell, one), size), v);
+    __m128d down = _mm_andnot_pd(up, _mm_cmpgt_pd(_mm_mul_pd(cell, size), v));
+    cell = _mm_sub_pd(_mm_add_pd(cell, _mm_and_pd(up, one)), _mm_and_pd(down, one));
+
+    return _mm_min_pd(_mm_max_pd(cell, _mm_setzero_pd()), _mm_sub_pd(cells, one));
+}
+
+/*
+    SSE2 version of the binning kernel, binning two balls at a time.
+*/
+__attribute__((target("sse2")))
+void binBallsSSE2(BallStore *balls, int begin, int end) {
+    __m128d scale_x = _mm_set1_pd(subspace_scale_x);
+    __m128d scale_y = _mm_set1_pd(subspace_scale_y);
+    __m128d size_x = _mm_set1_pd(subspace_size_x);
+    __m128d size_y = _mm_set1_pd(subspace_size_y);
+    __m128d columns = _mm_set1_pd(subspace_columns);
+    __m128d rows = _mm_set1_pd(subspace_rows);
+    __m128d margin = _mm_set1_pd(ccd_margin);
+
+    int i = begin;
+    for (; i + 2 <= end; i += 2) {
+        __m128d extent = _mm_add_pd(_mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*) (balls->radius + i))), margin);
+        __m128d x = _mm_loadu_pd(balls->pos_x + i);
+        __m128d y = _mm_loadu_pd(balls->pos_y + i);
+
+        __m128d left = binAxisSSE2(_mm_sub_pd(x, extent), scale_x, size_x, columns);
+        __m128d right = binAxisSSE2(_mm_add_pd(x, extent), scale_x, size_x, columns);
+        __m128d up = _mm_mul_pd(binAxisSSE2(_mm_sub_pd(y, extent), scale_y, size_y, rows), columns);
+        __m128d down = _mm_mul_pd(binAxisSSE2(_mm_add_pd(y, extent), scale_y, size_y, rows), columns);
+
+        // one vector per corner, one ball per lane, turned into two balls
+        // of four corners each
+        __m128i top = _mm_unpacklo_epi32(_mm_cvttpd_epi32(_mm_add_pd(left, up)),
+                                         _mm_cvttpd_epi32(_mm_add_pd(right, up)));
+        __m128i bottom = _mm_unpacklo_epi32(_mm_cvttpd_epi32(_mm_add_pd(left, down)),
+                                            _mm_cvttpd_epi32(_mm_add_pd(right, down)));
+
+        _mm_storeu_si128((__m128i*) balls->subspaces[i], _mm_unpacklo_epi64(top, bottom));
+        _mm_storeu_si128((__m128i*) balls->subspaces[i + 1], _mm_unpackhi_epi64(top, bottom));
+    }
+    binBallsScalar(balls, i, end);
+}
+
+/*
+    Bins one coordinate of four balls, like binAxisSSE2.
+*/
+__attribute__((target("avx2")))
+static inline __m256d binAxisAVX2(__m256d v, __m256d scale, __m256d size, __m256d cells) {
+    __m256d one = _mm256_set1_pd(1);
+
+    __m256d q = _mm256_min_pd(_mm256_max_pd(_mm256_mul_pd(v, scale), _mm256_set1_pd(-1)), cells);
+    __m256d cell = _mm256_round_pd(q, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+
+    __m256d up = _mm256_cmp_pd(_mm256_mul_pd(_mm256_add_pd(cell, one), size), v, _CMP_LE_OQ);
+    __m256d down = _mm256_andnot_pd(up, _mm256_cmp_pd(_mm256_mul_pd(cell, size), v, _CMP_GT_OQ));
+    cell = _mm256_sub_pd(_mm256_add_pd(cell, _mm256_and_pd(up, one)), _mm256_and_pd(down, one));
+
+    return _mm256_min_pd(_mm256_max_pd(cell, _mm256_setzero_pd()), _mm256_sub_pd(cells, one));
+}
+
+/*
+    AVX2 version of the binning kernel, binning four balls at a time.
+*/
+__attribute__((target("avx2")))
+void binBallsAVX2(BallStore *balls, int begin, int end) {
+    __m256d scale_x = _mm256_set1_pd(subspace_scale_x);
+    __m256d scale_y = _mm256_set1_pd(subspace_scale_y);
+    __m256d size_x = _mm256_set1_pd(subspace_size_x);
+    __m256d size_y = _mm256_set1_pd(subspace_size_y);
+    __m256d columns = _mm256_set1_pd(subspace_columns);
+    __m256d rows = _mm256_set1_pd(subspace_rows);
+    __m256d margin = _mm256_set1_pd(ccd_margin);
+
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m256d extent = _mm256_add_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*) (balls->radius + i))),
+                                       margin);
+        __m256d x = _mm256_loadu_pd(balls->pos_x + i);
+        __m256d y = _mm256_loadu_pd(balls->pos_y + i);
+
+        __m256d left = binAxisAVX2(_mm256_sub_pd(x, extent), scale_x, size_x, columns);
+        __m256d right = binAxisAVX2(_mm256_add_pd(x, extent), scale_x, size_x, columns);
+        __m256d up = _mm256_mul_pd(binAxisAVX2(_mm256_sub_pd(y, extent), scale_y, size_y, rows), columns);
+        __m256d down = _mm256_mul_pd(binAxisAVX2(_mm256_add_pd(y, extent), scale_y, size_y, rows), columns);
+
+        // one vector per corner, one ball per lane, turned into four balls
+        // of four corners each
+        __m128 c0 = _mm_castsi128_ps(_mm256_cvttpd_epi32(_mm256_add_pd(left, up)));
+        __m128 c1 = _mm_castsi128_ps(_mm256_cvttpd_epi32(_mm256_add_pd(right, up)));
+        __m128 c2 = _mm_castsi128_ps(_mm256_cvttpd_epi32(_mm256_add_pd(left, down)));
+        __m128 c3 = _mm_castsi128_ps(_mm256_cvttpd_epi32(_mm256_add_pd(right, down)));
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+        _mm_storeu_ps((float*) balls->subspaces[i], c0);
+        _mm_storeu_ps((float*) balls->subspaces[i + 1], c1);
+        _mm_storeu_ps((float*) balls->subspaces[i + 2], c2);
+        _mm_storeu_ps((float*) balls->subspaces[i + 3], c3);
+    }
+    binBallsScalar(balls, i, end);
+}
+
+#endif
+
+#endif
+
+BinKernel binBalls = binBallsScalar;
+
+/*
+    Picks the widest binning kernel the CPU supports.
+    Returns the name of the chosen kernel.
+*/
+const char* selectBinKernel() {
+#ifdef BALLS_X86
+    if (SDL_HasAVX2()) {
+        binBalls = binBallsAVX2;
+        return "AVX2";
+    }
+    if (SDL_HasSSE2()) {
+        binBalls = binBallsSSE2;
+        return "SSE2";
+    }
+#endif
+    binBalls = binBallsScalar;
+    return "scalar";
+}
+
+/*
+    Worker task recalculating the subspaces of a range of balls.
+*/
+void calculateSubspacesTask(int begin, int end, void *data) {
+    if (centerBinning) {
+        binBallsCenter(data, begin, end);
+    }
+    else {
+        binBalls(data, begin, end);
+    }
+}
+
+/*
+    Returns the cursor of the subspace as an atomic counter for the
+    parallel grid build. SDL_atomic_t is nothing but an int.
+*/
+SDL_atomic_t* gridCounter(int subspace) {
+    return (SDL_atomic_t*) &subspaceTracker.cellCursor[subspace];
+}
+
+/*
+    Worker task emptying the occupied subspaces of a range of prefix sum
+    blocks, and their occupancy words.
+*/
+void clearGridTask(int begin, int end, void *data) {
+    (void) data;
+    int words = OCCUPIED_WORDS(subspace_count);
+    for (int word = begin * GRID_BLOCK_WORDS; word < end * GRID_BLOCK_WORDS && word < words; word++) {
+        Uint32 bits = occupiedSubspaces[word];
+        while (bits != 0) {
+            int subspace = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+            bits &= bits - 1;
+            subspaceTracker.cellStart[subspace] = 0;
+            subspaceTracker.cellCursor[subspace] = 0;
+        }
+        occupiedSubspaces[word] = 0;
+    }
+}
+
+/*
+    Worker task counting the balls of a range into their subspaces. The
+    ball that brings a subspace its first entry marks it occupied.
+*/
+void countCornersTask(int begin, int end, void *data) {
+    BallStore *balls = data;
+    for (int i = begin; i < end; i++) {
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            if (!isRepeatedCorner(balls, i, j) && SDL_AtomicAdd(gridCounter(balls->subspaces[i][j]), 1) == 0) {
+                markOccupiedAtomic(balls->subspaces[i][j]);
+            }
+        }
+    }
+}
+
+/*
+    Worker task adding up the counts of the occupied subspaces of a range
+    of prefix sum blocks, block by block.
+*/
+void sumBlocksTask(int begin, int end, void *data) {
+    (void) data;
+    int words = OCCUPIED_WORDS(subspace_count);
+    for (int block = begin; block < end; block++) {
+        int total = 0;
+        for (int word = block * GRID_BLOCK_WORDS; word < (block + 1) * GRID_BLOCK_WORDS && word < words; word++) {
+            Uint32 bits = occupiedSubspaces[word];
+            while (bits != 0) {
+                total += subspaceTracker.cellCursor[word * 32 + SDL_MostSignificantBitIndex32(bits & -bits)];
+                bits &= bits - 1;
+            }
+        }
+        subspaceTracker.blockOffsets[block] = total;
+    }
+}
+
+/*
+    Worker task turning the counts of the occupied subspaces of a range of
+    prefix sum blocks into offsets, starting from the offset of each block.
+*/
+void placeBlocksTask(int begin, int end, void *data) {
+    (void) data;
+    int *start = subspaceTracker.cellStart;
+    int *cursor = subspaceTracker.cellCursor;
+    int words = OCCUPIED_WORDS(subspace_count);
+    for (int block = begin; block < end; block++) {
+        int offset = subspaceTracker.blockOffsets[block];
+        for (int word = block * GRID_BLOCK_WORDS; word < (block + 1) * GRID_BLOCK_WORDS && word < words; word++) {
+            Uint32 bits = occupiedSubspaces[word];
+            while (bits != 0) {
+                int subspace = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+                bits &= bits - 1;
+                start[subspace] = offset;
+                offset += cursor[subspace];
+                cursor[subspace] = start[subspace];
+            }
+        }
+    }
+}
+
+/*
+    Worker task dropping the balls of a range into the slices of their
+    subspaces, each claiming its entry with an atomic bump of the cursor.
+*/
+void scatterCornersTask(int begin, int end, void *data) {
+    BallStore *balls = data;
+    for (int i = begin; i < end; i++) {
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            if (!isRepeatedCorner(balls, i, j)) {
+                subspaceTracker.cellBalls[SDL_AtomicAdd(gridCounter(balls->subspaces[i][j]), 1)] = i;
+            }
+        }
+    }
+}
+
+/*
+    Worker task sorting the slices of the occupied subspaces of a range of
+    prefix sum blocks. The threads of the scatter pass leave every slice in
+    whatever order they got to it, and sorted it is back in the order the
+    serial build gives, so the collisions come out the same on any number
+    of threads.
+*/
+void sortSlicesTask(int begin, int end, void *data) {
+    (void) data;
+    int words = OCCUPIED_WORDS(subspace_count);
+    for (int word = begin * GRID_BLOCK_WORDS; word < end * GRID_BLOCK_WORDS && word < words; word++) {
+        Uint32 bits = occupiedSubspaces[word];
+        while (bits != 0) {
+            int subspace = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+            bits &= bits - 1;
+
+            // slices are a handful of balls long
+            int *slice = &subspaceTracker.cellBalls[subspaceTracker.cellStart[subspace]];
+            int depth = subspaceTracker.cellCursor[subspace] - subspaceTracker.cellStart[subspace];
+            for (int k = 1; k < depth; k++) {
+                int ball = slice[k];
+                int m = k;
+                for (; m > 0 && slice[m - 1] > ball; m--) {
+                    slice[m] = slice[m - 1];
+                }
+                slice[m] = ball;
+            }
+        }
+    }
+}
+
+/*
+    Builds the grid from the subspaces of the balls on every thread, with
+    the same result as the serial passes of assignSubspaces. Nothing is
+    locked or allocated: threads only ever meet on atomic counters.
+*/
+void buildGridParallel(BallStore *balls) {
+    parallelFor(balls->count, BALL_TASK_GRAIN, countCornersTask, balls);
+
+    parallelFor(subspaceTracker.blocks, GRID_TASK_BLOCKS, sumBlocksTask, NULL);
+    int offset = 0;
+    for (int block = 0; block < subspaceTracker.blocks; block++) {
+        int total = subspaceTracker.blockOffsets[block];
+        subspaceTracker.blockOffsets[block] = offset;
+        offset += total;
+    }
+    parallelFor(subspaceTracker.blocks, GRID_TASK_BLOCKS, placeBlocksTask, NULL);
+
+    parallelFor(balls->count, BALL_TASK_GRAIN, scatterCornersTask, balls);
+    parallelFor(subspaceTracker.blocks, GRID_TASK_BLOCKS, sortSlicesTask, NULL);
+}
+
+void assignSubspaces(BallStore *balls) {
+    int *start = subspaceTracker.cellStart;
+    int *cursor = subspaceTracker.cellCursor;
+    bool parallel = workerCount() > 1;
+
+    // This clears the subspaceTracker, since it must start anew every frame.
+    // Only the subspaces occupied last frame have anything to clear.
+    if (parallel) {
+        parallelFor(subspaceTracker.blocks, GRID_TASK_BLOCKS, clearGridTask, NULL);
+    }
+    else {
+        clearGridTask(0, subspaceTracker.blocks, NULL);
+    }
+
+    // Every ball's subspaces only depend on the ball itself, so they can be
+    // worked out on all threads before the grid is filled in.
+    parallelFor(balls->count, BALL_TASK_GRAIN, calculateSubspacesTask, balls);
+
+    if (parallel) {
+        buildGridParallel(balls);
+        return;
+    }
+
+    // Counting pass: how many balls land in every subspace.
+    for (int i = 0; i < balls->count; i++) {
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            if (!isRepeatedCorner(balls, i, j)) {
+                cursor[balls->subspaces[i][j]]++;
+                markOccupied(balls->subspaces[i][j]);
+            }
+        }
+    }
+
+    // Prefix sum over the occupied subspaces: turn the counts into offsets
+    // into cellBalls.
+    int offset = 0;
+    for (int word = 0; word < OCCUPIED_WORDS(subspace_count); word++) {
+        Uint32 bits = occupiedSubspaces[word];
+        while (bits != 0) {
+            int subspace = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+            bits &= bits - 1;
+            start[subspace] = offset;
+            offset += cursor[subspace];
+            cursor[subspace] = start[subspace];
+        }
+    }
+
+    // Scatter pass: drop every ball index into its subspace's slice, which
+    // leaves the cursor of every subspace at the end of its slice.
+    for (int i = 0; i < balls->count; i++) {
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            if (!isRepeatedCorner(balls, i, j)) {
+                subspaceTracker.cellBalls[cursor[balls->subspaces[i][j]]++] = i;
+            }
+        }
+    }
+}
+
+/*
+    Allocates an empty bucket per subspace, plus the per-ball slot records.
+    The buckets themselves only get memory once a ball lands in them.
+*/
+int initSubspaceBuckets(int amnt) {
+    subspaceBuckets.cellBalls = calloc(subspace_count, sizeof(int*));
+    subspaceBuckets.cellCount = calloc(subspace_count, sizeof(int));
+    subspaceBuckets.cellCapacity = calloc(subspace_count, sizeof(int));
+    subspaceBuckets.slots = malloc(sizeof(*subspaceBuckets.slots) * (amnt + 1));
+    subspaceBuckets.populated = false;
+
+    if (subspaceBuckets.cellBalls == NULL || subspaceBuckets.cellCount == NULL ||
+        subspaceBuckets.cellCapacity == NULL || subspaceBuckets.slots == NULL) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+    Appends the ball to the bucket of the subspace and returns its slot.
+*/
+int insertIntoSubspace(int subspace, int ball) {
+    int count = subspaceBuckets.cellCount[subspace];
+
+    if (count == subspaceBuckets.cellCapacity[subspace]) {
+        int capacity = count == 0 ? subspace_balls * 2 : count * 2;
+        int *grown = realloc(subspaceBuckets.cellBalls[subspace], sizeof(int) * capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Could not grow the bucket of subspace %d!\n", subspace);
+            exit(1);
+        }
+        subspaceBuckets.cellBalls[subspace] = grown;
+        subspaceBuckets.cellCapacity[subspace] = capacity;
+    }
+
+    subspaceBuckets.cellBalls[subspace][count] = ball;
+    subspaceBuckets.cellCount[subspace] = count + 1;
+    if (count == 0) {
+        markOccupied(subspace);
+    }
+    return count;
+}
+
+/*
+    Removes the entry at the given slot from the bucket of the subspace by
+    moving the last entry into its place, and fixes up the slot record of
+    the ball that moved.
+*/
+void removeFromSubspace(BallStore *balls, int subspace, int slot) {
+    int last = --subspaceBuckets.cellCount[subspace];
+    if (last == 0) {
+        markEmpty(subspace);
+    }
+    if (slot == last) {
+        return;
+    }
+
+    int moved = subspaceBuckets.cellBalls[subspace][last];
+    subspaceBuckets.cellBalls[subspace][slot] = moved;
+
+    // the moved ball is listed under the first of its corners in this subspace
+    for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+        if (balls->subspaces[moved][j] == subspace) {
+            subspaceBuckets.slots[moved][j] = slot;
+            break;
+        }
+    }
+}
+
+/*
+    Adds every distinct corner subspace of the ball to the buckets.
+*/
+void insertBall(BallStore *balls, int index) {
+    for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+        if (isRepeatedCorner(balls, index, j)) {
+            subspaceBuckets.slots[index][j] = -1;
+        }
+        else {
+            subspaceBuckets.slots[index][j] = insertIntoSubspace(balls->subspaces[index][j], index);
+        }
+    }
+}
+
+/*
+    Incremental version of assignSubspaces. Balls that stayed in the same
+    subspaces keep their bucket entries, and only the balls that crossed a
+    subspace boundary are removed from their old buckets and inserted into
+    the new ones. The first call fills the buckets from scratch.
+*/
+void assignSubspacesIncremental(BallStore *balls) {
+    if (!subspaceBuckets.populated) {
+        for (int i = 0; i < balls->count; i++) {
+            calculateSubspaces(balls, i);
+            insertBall(balls, i);
+        }
+        subspaceBuckets.populated = true;
+        return;
+    }
+
+    for (int i = 0; i < balls->count; i++) {
+        int *subspaces = balls->subspaces[i];
+        int old_subspaces[BALL_CORNER_COUNT];
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            old_subspaces[j] = subspaces[j];
+        }
+
+        if (!calculateSubspaces(balls, i)) {
+            continue;
+        }
+
+        // the moved-entry fix ups look at the cached corners of each ball,
+        // so this ball's old corners have to be in place while it is removed
+        int new_subspaces[BALL_CORNER_COUNT];
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            new_subspaces[j] = subspaces[j];
+            subspaces[j] = old_subspaces[j];
+        }
+
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            int slot = subspaceBuckets.slots[i][j];
+            if (slot >= 0) {
+                removeFromSubspace(balls, old_subspaces[j], slot);
+            }
+        }
+
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            subspaces[j] = new_subspaces[j];
+        }
+        insertBall(balls, i);
+    }
+}
+
+/*
+    Returns the balls listed in the given subspace as one contiguous slice,
+    from whichever grid is in use, and stores how many there are in depth.
+*/
+int* subspaceBalls(int subspace, int *depth) {
+    if (incrementalGrid) {
+        *depth = subspaceBuckets.cellCount[subspace];
+        return subspaceBuckets.cellBalls[subspace];
+    }
+
+    *depth = subspaceTracker.cellCursor[subspace] - subspaceTracker.cellStart[subspace];
+    return &subspaceTracker.cellBalls[subspaceTracker.cellStart[subspace]];
+}
+
+/*
+    Returns how many balls are currently listed in the given subspace.
+*/
+int calculateDepth(int subspace) {
+    int depth;
+    subspaceBalls(subspace, &depth);
+    return depth;
+}
+
+/*
+    Releases every per-subspace array of both grids, leaving them empty so
+    they can be released again.
+*/
+void freeSubspaceGrid() {
+    gridCurrent = false;
+    for (int i = 0; subspaceBuckets.cellBalls != NULL && i < subspace_count; i++) {
+        free(subspaceBuckets.cellBalls[i]);
+    }
+    free(subspaceBuckets.cellBalls);
+    free(subspaceBuckets.cellCount);
+    free(subspaceBuckets.cellCapacity);
+    free(subspaceBuckets.slots);
+
+    free(subspaceTracker.cellStart);
+    free(subspaceTracker.cellCursor);
+    free(subspaceTracker.cellBalls);
+    free(subspaceTracker.blockOffsets);
+    free(occupiedSubspaces);
+    subspaceBuckets = (SubspaceBuckets) { 0 };
+    subspaceTracker = (SubspaceGrid) { 0 };
+    occupiedSubspaces = NULL;
+}
+
+/*
+    Computes the occupancy statistics of the grid as it is right now.
+*/
+OccupancyStats measureOccupancy() {
+    OccupancyStats stats = { .mean = 0.0, .max = 0, .occupied = 0 };
+    long total = 0;
+
+    for (int subspace = 0; subspace < subspace_count; subspace++) {
+        int depth = calculateDepth(subspace);
+        if (depth > 0) {
+            stats.occupied++;
+            total += depth;
+            if (depth > stats.max) {
+                stats.max = depth;
+            }
+        }
+    }
+
+    if (stats.occupied > 0) {
+        stats.mean = (double) total / stats.occupied;
+    }
+    return stats;
+}
+
+/*
+    A ball spanning several subspaces is listed in each of them, so the same
+    pair of balls can be found in up to four subspaces. To resolve every pair
+    only once, a pair belongs to a single subspace: the one containing the
+    top-left corner of the overlap of the two balls' bounding boxes.
+    Both balls always cover that subspace, and no other subspace claims the
+    pair, so subspaces can be processed independently of each other.
+*/
+int pairOwner(BallStore *balls, int a, int b) {
+    real left = real_fmax(balls->pos_x[a] - ballExtent(balls, a), balls->pos_x[b] - ballExtent(balls, b));
+    real up = real_fmax(balls->pos_y[a] - ballExtent(balls, a), balls->pos_y[b] - ballExtent(balls, b));
+
+    int spr = world_width / subspace_size_x;
+    return subspaceColumn(left) + subspaceRow(up) * spr;
+}
+
+/*
+    Counters of the grid narrow phase over one step: the candidate pairs
+    tested, the ones that really overlap, the bounces, and the overlaps
+    skipped because another subspace owns the pair. Every collision pass
+    counts into its own CollisionCounts and adds them to stepCounts once,
+    under statsLock, at the end.
+*/
+typedef struct CollisionCounts {
+    Sint64  tested;
+    Sint64  overlaps;
+    Sint64  bounces;
+    Sint64  duplicates;
+} CollisionCounts;
+
+/*
+    With --stats every grid step writes one row of counters to statsFile,
+    as CSV, or as JSON when the file name ends in .json. The occupancy
+    histogram counts the subspaces holding 0, 1, 2, up to 4, up to 8 and so
+    on balls, up to OCCUPANCY_BINS bins.
+*/
+#define OCCUPANCY_BINS 8
+
+FILE *statsFile = NULL;
+bool statsJson = false;
+long stats_step = 0;
+CollisionCounts stepCounts;
+SDL_SpinLock statsLock;
+
+void addCollisionCounts(CollisionCounts *counts) {
+    if (statsFile == NULL) {
+        return;
+    }
+    SDL_AtomicLock(&statsLock);
+    stepCounts.tested += counts->tested;
+    stepCounts.overlaps += counts->overlaps;
+    stepCounts.bounces += counts->bounces;
+    stepCounts.duplicates += counts->duplicates;
+    SDL_AtomicUnlock(&statsLock);
+}
+
+/*
+    Opens the stats file and writes its header.
+    Returns 0 on success and 1 if the file could not be opened.
+*/
+int openStats(const char *path) {
+    statsFile = fopen(path, "w");
+    if (statsFile == NULL) {
+        return 1;
+    }
+
+    size_t length = strlen(path);
+    statsJson = length >= 5 && strcmp(path + length - 5, ".json") == 0;
+
+    if (statsJson) {
+        fprintf(statsFile, "[\n");
+    }
+    else {
+        fprintf(statsFile, "step,balls,subspaces,tested,overlaps,bounces,duplicates,occupied,mean,max");
+        for (int bin = 0; bin < OCCUPANCY_BINS; bin++) {
+            fprintf(statsFile, ",bin%d", bin);
+        }
+        fprintf(statsFile, "\n");
+    }
+    return 0;
+}
+
+void closeStats() {
+    if (statsFile == NULL) {
+        return;
+    }
+    if (statsJson) {
+        fprintf(statsFile, "\n]\n");
+    }
+    fclose(statsFile);
+    statsFile = NULL;
+}
+
+/*
+    Returns the occupancy histogram bin of a subspace holding depth balls:
+    0, 1, 2, then one bin per power of two, with the last bin open ended.
+*/
+int occupancyBin(int depth) {
+    int bin = 0;
+    while (depth > (1 << bin) / 2 && bin < OCCUPANCY_BINS - 1) {
+        bin++;
+    }
+    return bin;
+}
+
+/*
+    Writes the counters of the step that just ran, with the occupancy of the
+    grid it ran on, and resets them for the next step.
+*/
+void writeStats(BallStore *balls) {
+    OccupancyStats occupancy = measureOccupancy();
+
+    int histogram[OCCUPANCY_BINS] = { 0 };
+    for (int subspace = 0; subspace < subspace_count; subspace++) {
+        histogram[occupancyBin(calculateDepth(subspace))]++;
+    }
+
+    CollisionCounts *c = &stepCounts;
+    if (statsJson) {
+        fprintf(statsFile, "%s  {\"step\": %ld, \"balls\": %d, \"subspaces\": %d, "
+            "\"tested\": %lld, \"overlaps\": %lld, \"bounces\": %lld, \"duplicates\": %lld, "
+            "\"occupied\": %d, \"mean\": %.3f, \"max\": %d, \"histogram\": [",
+            stats_step > 0 ? ",\n" : "", stats_step, balls->count, subspace_count,
+            (long long) c->tested, (long long) c->overlaps, (long long) c->bounces, (long long) c->duplicates,
+            occupancy.occupied, occupancy.mean, occupancy.max);
+        for (int bin = 0; bin < OCCUPANCY_BINS; bin++) {
+            fprintf(statsFile, bin > 0 ? ", %d" : "%d", histogram[bin]);
+        }
+        fprintf(statsFile, "]}");
+    }
+    else {
+        fprintf(statsFile, "%ld,%d,%d,%lld,%lld,%lld,%lld,%d,%.3f,%d", stats_step, balls->count, subspace_count,
+            (long long) c->tested, (long long) c->overlaps, (long long) c->bounces, (long long) c->duplicates,
+            occupancy.occupied, occupancy.mean, occupancy.max);
+        for (int bin = 0; bin < OCCUPANCY_BINS; bin++) {
+            fprintf(statsFile, ",%d", histogram[bin]);
+        }
+        fprintf(statsFile, "\n");
+    }
+
+    stepCounts = (CollisionCounts) { 0 };
+    stats_step++;
+}
+
+/*
+    A growable list of contacts, as pairs of ball indices one after the
+    other: contact k is between balls pairs[2 * k] and pairs[2 * k + 1].
+*/
+typedef struct ContactList {
+    int     *pairs;
+    int     count;
+    int     capacity;
+} ContactList;
+
+/*
+    Appends the contact between balls a and b to the list. Exits if the
+    list cannot grow.
+*/
+void addContact(ContactList *list, int a, int b) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity > 0 ? list->capacity * 2 : 256;
+        int *grown = realloc(list->pairs, sizeof(int) * 2 * capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Could not grow a contact list!\n");
+            exit(1);
+        }
+        list->pairs = grown;
+        list->capacity = capacity;
+    }
+
+    list->pairs[2 * list->count] = a;
+    list->pairs[2 * list->count + 1] = b;
+    list->count++;
+}
+
+/*
+    The grid narrow phase comes in versions specialized at compile time for
+    the common shapes of a scene, all generated from collideCellShaped.
+    With every ball of the same radius the reach of a pair is a constant,
+    so no radius is loaded. With subspaces a power of two pixels across
+    the owner of a pair is found by multiplying with exact reciprocals
+    instead of dividing. They find exactly the pairs the general version
+    finds, and selectCellKernel picks the one for the scene and the grid
+    at hand.
+*/
+#define CELL_UNIFORM_RADIUS 1
+#define CELL_POW2_SUBSPACES 2
+
+typedef void (*CellKernel)(int subspace, const int *cell, int depth, BallStore *balls, CollisionCounts *counts, ContactList *contacts);
+
+/*
+    What the specialized versions take as given, set by selectCellKernel:
+    the radius of every ball, 0 if they differ, and the shape of the grid.
+*/
+typedef struct CellShape {
+    int     radius;
+    real    reach_squared;
+    real    inv_size_x;
+    real    inv_size_y;
+    int     spr;
+    int     spc;
+} CellShape;
+
+CellShape cellShape;
+
+/*
+    Overlap kernel for balls of the radius of cellShape.
+*/
+static inline Uint32 overlapMaskUniform(BallStore *balls, int ball, const int *candidates, int count) {
+    real x = balls->pos_x[ball];
+    real y = balls->pos_y[ball];
+
+    Uint32 mask = 0;
+    for (int k = 0; k < count; k++) {
+        real dx = balls->pos_x[candidates[k]] - x;
+        real dy = balls->pos_y[candidates[k]] - y;
+        mask |= (Uint32) (dx * dx + dy * dy < cellShape.reach_squared) << k;
+    }
+    return mask;
+}
+
+/*
+    Version of pairOwner for the shape the variant was made for.
+*/
+static inline __attribute__((always_inline)) int pairOwnerShaped(BallStore *balls, int a, int b, int variant) {
+    if (!(variant & CELL_POW2_SUBSPACES)) {
+        return pairOwner(balls, a, b);
+    }
+
+    real left, up;
+    if (variant & CELL_UNIFORM_RADIUS) {
+        left = real_fmax(balls->pos_x[a], balls->pos_x[b]) - cellShape.radius;
+        up = real_fmax(balls->pos_y[a], balls->pos_y[b]) - cellShape.radius;
+    }
+    else {
+        left = real_fmax(balls->pos_x[a] - balls->radius[a], balls->pos_x[b] - balls->radius[b]);
+        up = real_fmax(balls->pos_y[a] - balls->radius[a], balls->pos_y[b] - balls->radius[b]);
+    }
+
+    int col = (int) (left * cellShape.inv_size_x);
+    int row = (int) (up * cellShape.inv_size_y);
+    col = col < 0 ? 0 : (col >= cellShape.spr ? cellShape.spr - 1 : col);
+    row = row < 0 ? 0 : (row >= cellShape.spc ? cellShape.spc - 1 : row);
+    return col + row * cellShape.spr;
+}
+
+/*
+    Resolves the collisions among the given balls of one subspace, which
+    every broad phase built on subspaces lists as one contiguous slice.
+    Given a contact list, the pairs owned by the subspace are appended to
+    it instead of being bounced.
+*/
+static inline __attribute__((always_inline)) void collideCellShaped(int subspace, const int *cell, int depth, BallStore *balls,
+                                                                   CollisionCounts *counts, ContactList *contacts, int variant) {
+    counts->tested += (Sint64) depth * (depth - 1) / 2;
+
+    for (int m = 0; m < depth; m++) {
+        int ball1 = cell[m];
+
+        // check the other balls in the same subspace to see if any collide,
+        // every unordered pair only needs to be looked at once.
+        // Bouncing only changes directions, so a batch's mask stays valid
+        // while its hits are resolved; with --separate it moves balls too,
+        // and bounceSeparating checks the overlap again.
+        for (int first = m + 1; first < depth; first += OVERLAP_BATCH) {
+            int count = depth - first < OVERLAP_BATCH ? depth - first : OVERLAP_BATCH;
+            Uint32 hits = variant & CELL_UNIFORM_RADIUS ? overlapMaskUniform(balls, ball1, &cell[first], count)
+                                                        : overlapMask(balls, ball1, &cell[first], count);
+
+            while (hits != 0) {
+                int k = first + SDL_MostSignificantBitIndex32(hits & -hits);
+                hits &= hits - 1;
+
+                // pairs owned by another subspace are resolved over there
+                int ball2 = cell[k];
+                counts->overlaps++;
+                if (pairOwnerShaped(balls, ball1, ball2, variant) != subspace) {
+                    counts->duplicates++;
+                }
+                else if (contacts != NULL) {
+                    addContact(contacts, ball1, ball2);
+                }
+                else {
+                    bounce(balls, ball1, ball2);
+                    counts->bounces++;
+                }
+            }
+        }
+    }
+}
+
+#define DEFINE_CELL_KERNEL(name, variant) \
+    void name(int subspace, const int *cell, int depth, BallStore *balls, CollisionCounts *counts, ContactList *contacts) { \
+        collideCellShaped(subspace, cell, depth, balls, counts, contacts, variant); \
+    }
+
+DEFINE_CELL_KERNEL(collideCellGeneral, 0)
+DEFINE_CELL_KERNEL(collideCellUniform, CELL_UNIFORM_RADIUS)
+DEFINE_CELL_KERNEL(collideCellPow2, CELL_POW2_SUBSPACES)
+DEFINE_CELL_KERNEL(collideCellUniformPow2, CELL_UNIFORM_RADIUS | CELL_POW2_SUBSPACES)
+
+#undef DEFINE_CELL_KERNEL
+
+CellKernel collideCell = collideCellGeneral;
+
+/*
+    Returns the radius every ball of the store has, or 0 if they differ.
+*/
+int uniformRadius(BallStore *balls) {
+    for (int i = 1; i < balls->count; i++) {
+        if (balls->radius[i] != balls->radius[0]) {
+            return 0;
+        }
+    }
+    return balls->count > 0 ? balls->radius[0] : 0;
+}
+
+/*
+    Picks the version of the grid narrow phase for balls that all have the
+    given radius, 0 if they differ, on the current grid. It has to run
+    again whenever the grid changes. Only the plain narrow phase of the
+    real engine is specialized, the fixed and continuous ones test more
+    than the radii.
+    Returns the name of the chosen version.
+*/
+const char* selectCellKernel(int radius) {
+    bool plain = engine == ENGINE_REAL && !continuousCollisions;
+    bool uniform = plain && radius > 0;
+    bool pow2 = plain && SDL_HasExactlyOneBitSet32(subspace_size_x) && SDL_HasExactlyOneBitSet32(subspace_size_y);
+
+    cellShape = (CellShape) {
+        .radius = radius,
+        .reach_squared = (real) (2 * radius) * (2 * radius),
+        .inv_size_x = (real) 1 / subspace_size_x,
+        .inv_size_y = (real) 1 / subspace_size_y,
+        .spr = world_width / subspace_size_x,
+        .spc = world_height / subspace_size_y
+    };
+
+    if (uniform && pow2) {
+        collideCell = collideCellUniformPow2;
+        return "uniform radius, power of two";
+    }
+    if (uniform) {
+        collideCell = collideCellUniform;
+        return "uniform radius";
+    }
+    if (pow2) {
+        collideCell = collideCellPow2;
+        return "power of two";
+    }
+    collideCell = collideCellGeneral;
+    return "general";
+}
+
+/*
+    Re-tunes the subspace size when the occupancy statistics show the
+    subspaces have become too full or too empty. Occupancy grows with the
+    area of a subspace, so the side is scaled by the square root of how far
+    the occupancy is from its target. The grids are then reallocated and
+    get rebuilt from scratch on the next frame.
+*/
+void adaptSubspaces(BallStore *balls) {
+    if (++adaptive_frames < tick_rate) {
+        return;
+    }
+    adaptive_frames = 0;
+
+    OccupancyStats stats = measureOccupancy();
+    if (stats.occupied == 0) {
+        return;
+    }
+
+    double scale;
+    if (stats.mean > ADAPTIVE_MAX_MEAN || stats.max > ADAPTIVE_MAX_PEAK) {
+        scale = fmin(sqrt(ADAPTIVE_TARGET_MEAN / stats.mean), sqrt((double) ADAPTIVE_MAX_PEAK / stats.max));
+    }
+    else if (stats.mean < ADAPTIVE_MIN_MEAN) {
+        scale = sqrt(ADAPTIVE_TARGET_MEAN / stats.mean);
+    }
+    else {
+        return;
+    }
+
+    int old_size = subspace_size_x;
+    int size = (int) (old_size * scale);
+    if (size < min_subspace_size) {
+        size = min_subspace_size;
+    }
+
+    // configureSubspaces only ever rounds up, so a shrink that rounds back
+    // up to the current size would be a no-op
+    int snapped = size;
+    while (world_width % snapped || world_height % snapped) {
+        snapped++;
+    }
+    if (snapped == old_size || (scale < 1.0 && snapped > old_size) || snapped > world_width) {
+        return;
+    }
+
+    freeSubspaceGrid();
+    configureSubspaces(size);
+    selectCellKernel(cellShape.radius);
+
+    if (initSubspaceGrid(balls->count) != 0 || initSubspaceBuckets(balls->count) != 0) {
+        fprintf(stderr, "Could not reallocate the subspace grid!\n");
+        exit(1);
+    }
+
+    logInfo("Re-gridded to %d x %d pixel subspaces (mean %.1f, max %d balls)\n",
+        subspace_size_x, subspace_size_y, stats.mean, stats.max);
+}
+
+/*
+    The neighbours every subspace is tested against with --binning center,
+    as column and row offsets: the one to the right and the three below.
+    The other four test the subspace in turn, so every pair of neighbours
+    is tested once.
+*/
+#define CENTER_STENCIL 4
+// The most balls a subspace and its stencil are gathered into at once.
+#define CENTER_GATHER_MAX 256
+
+const int center_stencil[CENTER_STENCIL][2] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+
+/*
+    Resolves the collisions between the balls of a subspace and those of one
+    neighbour too crowded to gather with the rest of the stencil.
+*/
+static void collideCenterNeighbour(const int *cell, int depth, const int *other, int other_depth,
+                                   BallStore *balls, CollisionCounts *counts, bool uniform) {
+    counts->tested += (Sint64) depth * other_depth;
+    for (int m = 0; m < depth; m++) {
+        for (int first = 0; first < other_depth; first += OVERLAP_BATCH) {
+            int count = other_depth - first < OVERLAP_BATCH ? other_depth - first : OVERLAP_BATCH;
+            Uint32 hits = uniform ? overlapMaskUniform(balls, cell[m], &other[first], count)
+                                  : overlapMask(balls, cell[m], &other[first], count);
+            while (hits != 0) {
+                int k = first + SDL_MostSignificantBitIndex32(hits & -hits);
+                hits &= hits - 1;
+                bounce(balls, cell[m], other[k]);
+                counts->overlaps++;
+                counts->bounces++;
+            }
+        }
+    }
+}
+
+/*
+    Resolves the collisions of the balls the grid lists in a subspace by
+    their centers, among themselves and with the balls of the half stencil
+    around it. A ball is never wider than a subspace, so the balls it can
+    touch are centered in the same or a neighbouring subspace, and every
+    pair is found exactly once, with no owner to work out.
+*/
+void collideCenterCell(int subspace, BallStore *balls, CollisionCounts *counts) {
+    int depth;
+    int *cell = subspaceBalls(subspace, &depth);
+    int col = subspace % subspace_columns;
+    int row = subspace / subspace_columns;
+
+    // with one radius for every ball the candidates are tested like the
+    // uniform grid kernels test them, gathers cost more than they save on
+    // the few balls of a neighbourhood
+    bool uniform = engine == ENGINE_REAL && cellShape.radius > 0;
+
+    // the subspace and its stencil are gathered into one list, so the
+    // candidates of a ball are simply every ball listed after it
+    int gathered[CENTER_GATHER_MAX];
+    int *list = depth <= CENTER_GATHER_MAX ? gathered : cell;
+    if (list == gathered) {
+        memcpy(gathered, cell, depth * sizeof(int));
+    }
+    int total = depth;
+    for (int s = 0; s < CENTER_STENCIL; s++) {
+        int other_col = col + center_stencil[s][0];
+        int other_row = row + center_stencil[s][1];
+        if (other_col < 0 || other_col >= subspace_columns || other_row >= subspace_rows) {
+            continue;
+        }
+        int other_subspace = other_col + other_row * subspace_columns;
+        if (!isOccupied(other_subspace)) {
+            continue;
+        }
+
+        int other_depth;
+        int *other = subspaceBalls(other_subspace, &other_depth);
+        if (list != gathered || total + other_depth > CENTER_GATHER_MAX) {
+            collideCenterNeighbour(cell, depth, other, other_depth, balls, counts, uniform);
+            continue;
+        }
+        memcpy(&gathered[total], other, other_depth * sizeof(int));
+        total += other_depth;
+    }
+
+    counts->tested += (Sint64) depth * (depth - 1) / 2 + (Sint64) depth * (total - depth);
+    for (int m = 0; m < depth; m++) {
+        for (int first = m + 1; first < total; first += OVERLAP_BATCH) {
+            int count = total - first < OVERLAP_BATCH ? total - first : OVERLAP_BATCH;
+            Uint32 hits = uniform ? overlapMaskUniform(balls, list[m], &list[first], count)
+                                  : overlapMask(balls, list[m], &list[first], count);
+            while (hits != 0) {
+                int k = first + SDL_MostSignificantBitIndex32(hits & -hits);
+                hits &= hits - 1;
+                bounce(balls, list[m], list[k]);
+                counts->overlaps++;
+                counts->bounces++;
+            }
+        }
+    }
+}
+
+/*
+    Resolves every collision owned by the given subspace, adding what it did
+    to the counts.
+*/
+void collideSubspace(int subspace, BallStore *balls, CollisionCounts *counts) {
+    if (centerBinning) {
+        collideCenterCell(subspace, balls, counts);
+        return;
+    }
+
+    // the balls of this subspace are one contiguous slice of the grid
+    int depth;
+    int *cell = subspaceBalls(subspace, &depth);
+    collideCell(subspace, cell, depth, balls, counts, NULL);
+}
+
+/*
+    With --cell-block the subspaces are visited in square blocks of that
+    many subspaces a side instead of row by row, so the balls a subspace
+    shares with the ones below it are still in the cache when those come
+    up, instead of a whole row of the grid later. 0 keeps the plain row
+    order. A block row is at most CELL_BLOCK_MAX subspaces, one run of bits
+    read from the occupancy bitmap.
+*/
+#define CELL_BLOCK_MAX 32
+
+int cell_block = 0;
+
+/*
+    Returns the occupancy bits of count subspaces from first on, at most
+    CELL_BLOCK_MAX of them, which may straddle two words of the bitmap.
+*/
+static inline Uint32 occupiedRun(int first, int count) {
+    int word = first >> 5;
+    int shift = first & 31;
+    Uint64 bits = occupiedSubspaces[word] >> shift;
+    if (shift + count > 32) {
+        bits |= (Uint64) occupiedSubspaces[word + 1] << (32 - shift);
+    }
+    return (Uint32) bits & (Uint32) (((Uint64) 1 << count) - 1);
+}
+
+/*
+    Resolves the collisions of every occupied subspace block by block, and
+    in every block row by row.
+*/
+void collideBallsBlocked(BallStore *balls) {
+    CollisionCounts counts = { 0 };
+    for (int block_row = 0; block_row < subspace_rows; block_row += cell_block) {
+        int last_row = SDL_min(block_row + cell_block, subspace_rows);
+        for (int block_col = 0; block_col < subspace_columns; block_col += cell_block) {
+            int width = SDL_min(cell_block, subspace_columns - block_col);
+            for (int row = block_row; row < last_row; row++) {
+                int first = row * subspace_columns + block_col;
+                Uint32 bits = occupiedRun(first, width);
+                while (bits != 0) {
+                    int subspace = first + SDL_MostSignificantBitIndex32(bits & -bits);
+                    bits &= bits - 1;
+                    collideSubspace(subspace, balls, &counts);
+                }
+            }
+        }
+    }
+    addCollisionCounts(&counts);
+}
+
+/*
+    Resolves the collisions of every occupied subspace, in index order,
+    taking them one set bit of the occupancy bitmap at a time, or block by
+    block with --cell-block.
+*/
+void collideBalls(BallStore *balls) {
+    if (cell_block > 0) {
+        collideBallsBlocked(balls);
+        return;
+    }
+
+    CollisionCounts counts = { 0 };
+    for (int word = 0; word < OCCUPIED_WORDS(subspace_count); word++) {
+        Uint32 bits = occupiedSubspaces[word];
+        while (bits != 0) {
+            int subspace = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+            bits &= bits - 1;
+            collideSubspace(subspace, balls, &counts);
+        }
+    }
+    addCollisionCounts(&counts);
+}
+
+/*
+    The subspaces are grouped into square tiles of TILE_SUBSPACES subspaces
+    a side, and the tiles are colored like a 2 x 2 checkerboard.
+    Tiles of the same color are always at least one subspace apart, and a
+    subspace is at least one ball across, so no ball can be listed in two
+    tiles of the same color. Each color can therefore be processed in
+    parallel, with no locks around bounce.
+*/
+typedef struct TileColor {
+    BallStore*  balls;
+    int         color_x;
+    int         color_y;
+    int         tiles_x;
+} TileColor;
+
+/*
+    Worker task resolving the collisions in a range of tiles of a color.
+*/
+void collideTiles(int begin, int end, void *data) {
+    TileColor *color = data;
+    int spr = world_width / subspace_size_x;
+    int spc = world_height / subspace_size_y;
+
+    // number of tiles of this color in a row of tiles
+    int per_row = (color->tiles_x - color->color_x + 1) / 2;
+    CollisionCounts counts = { 0 };
+
+    for (int index = begin; index < end; index++) {
+        int tile_x = color->color_x + 2 * (index % per_row);
+        int tile_y = color->color_y + 2 * (index / per_row);
+
+        for (int row = tile_y * TILE_SUBSPACES; row < (tile_y + 1) * TILE_SUBSPACES && row < spc; row++) {
+            for (int col = tile_x * TILE_SUBSPACES; col < (tile_x + 1) * TILE_SUBSPACES && col < spr; col++) {
+                if (isOccupied(col + row * spr)) {
+                    collideSubspace(col + row * spr, color->balls, &counts);
+                }
+            }
+        }
+    }
+
+    addCollisionCounts(&counts);
+}
+
+/*
+    Parallel version of collideBalls, running the four tile colors one
+    after the other and the tiles within each color on the worker pool.
+*/
+void collideBallsParallel(BallStore *balls) {
+    // a ball wider than a subspace could reach into two tiles of one color
+    if (subspace_size_x < min_subspace_size || subspace_size_y < min_subspace_size) {
+        collideBalls(balls);
+        return;
+    }
+
+    int spr = world_width / subspace_size_x;
+    int spc = world_height / subspace_size_y;
+    int tiles_x = (spr + TILE_SUBSPACES - 1) / TILE_SUBSPACES;
+    int tiles_y = (spc + TILE_SUBSPACES - 1) / TILE_SUBSPACES;
+
+    for (int color_y = 0; color_y < 2; color_y++) {
+        for (int color_x = 0; color_x < 2; color_x++) {
+            TileColor color = {
+                .balls = balls,
+                .color_x = color_x,
+                .color_y = color_y,
+                .tiles_x = tiles_x
+            };
+
+            int per_row = (tiles_x - color_x + 1) / 2;
+            int per_column = (tiles_y - color_y + 1) / 2;
+            // tile costs vary a lot with clustering, so every tile is its
+            // own task and idle threads steal the expensive ones
+            parallelFor(per_row * per_column, 1, collideTiles, &color);
+        }
+    }
+}
+
+/*
+    Contacts of one color share no balls, so the contact graph can bounce
+    several of them at once in the lanes of a vector with the same
+    arithmetic as bounceEqual, in the same order, which keeps a colored
+    run bitwise the same whichever kernel resolves it. A kernel bounces
+    the balls of pairs[2 * contacts[k]] and pairs[2 * contacts[k] + 1] for
+    the count contacts given. It only stands in for bounceEqual, so
+    resolveContacts only takes it when nothing else decides how a pair
+    bounces.
+*/
+typedef void (*ResponseKernel)(BallStore *balls, const int *pairs, const int *contacts, int count);
+
+/*
+    Portable version of the response kernel.
+*/
+void respondContactsScalar(BallStore *balls, const int *pairs, const int *contacts, int count) {
+    for (int k = 0; k < count; k++) {
+        bounceEqual(balls, pairs[2 * contacts[k]], pairs[2 * contacts[k] + 1]);
+    }
+}
+
+/*
+    Returns whether every pair bounces like bounceEqual, with no one to tell.
+*/
+bool plainResponse() {
+    return engine == ENGINE_REAL && !continuousCollisions && !persistentContacts && !separateContacts &&
+           !unequalMasses && bounceObserver == NULL && collisionFeed.subscribers == 0;
+}
+
+#ifdef BALLS_X86
+
+#ifdef BALLS_SINGLE_PRECISION
+
+#ifdef BALLS_FAST_RSQRT
+
+/*
+    Refined reciprocal square roots of four and of eight floats, bitwise
+    the same as real_rsqrt of every lane.
+*/
+__attribute__((target("sse2")))
+static inline __m128 rsqrtSSE2(__m128 x) {
+    __m128 estimate = _mm_rsqrt_ps(x);
+    __m128 error = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), x), estimate), estimate);
+    return _mm_mul_ps(estimate, _mm_sub_ps(_mm_set1_ps(1.5f), error));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 rsqrtAVX2(__m256 x) {
+    __m256 estimate = _mm256_rsqrt_ps(x);
+    __m256 error = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), x), estimate), estimate);
+    return _mm256_mul_ps(estimate, _mm256_sub_ps(_mm256_set1_ps(1.5f), error));
+}
+
+#endif
+
+/*
+    SSE2 version of the response kernel, bouncing four contacts at a time.
+*/
+__attribute__((target("sse2")))
+void respondContactsSSE2(BallStore *balls, const int *pairs, const int *contacts, int count) {
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        int a[4], b[4];
+        for (int lane = 0; lane < 4; lane++) {
+            a[lane] = pairs[2 * contacts[k + lane]];
+            b[lane] = pairs[2 * contacts[k + lane] + 1];
+        }
+
+        __m128 nx = _mm_sub_ps(_mm_set_ps(balls->pos_x[b[3]], balls->pos_x[b[2]], balls->pos_x[b[1]], balls->pos_x[b[0]]),
+                               _mm_set_ps(balls->pos_x[a[3]], balls->pos_x[a[2]], balls->pos_x[a[1]], balls->pos_x[a[0]]));
+        __m128 ny = _mm_sub_ps(_mm_set_ps(balls->pos_y[b[3]], balls->pos_y[b[2]], balls->pos_y[b[1]], balls->pos_y[b[0]]),
+                               _mm_set_ps(balls->pos_y[a[3]], balls->pos_y[a[2]], balls->pos_y[a[1]], balls->pos_y[a[0]]));
+        __m128 ax = _mm_set_ps(balls->dir_x[a[3]], balls->dir_x[a[2]], balls->dir_x[a[1]], balls->dir_x[a[0]]);
+        __m128 ay = _mm_set_ps(balls->dir_y[a[3]], balls->dir_y[a[2]], balls->dir_y[a[1]], balls->dir_y[a[0]]);
+        __m128 bx = _mm_set_ps(balls->dir_x[b[3]], balls->dir_x[b[2]], balls->dir_x[b[1]], balls->dir_x[b[0]]);
+        __m128 by = _mm_set_ps(balls->dir_y[b[3]], balls->dir_y[b[2]], balls->dir_y[b[1]], balls->dir_y[b[0]]);
+
+        // balls on top of each other keep their velocities
+        __m128 none = _mm_and_ps(_mm_cmpeq_ps(nx, _mm_setzero_ps()), _mm_cmpeq_ps(ny, _mm_setzero_ps()));
+
+        __m128 squared = _mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny));
+#ifdef BALLS_FAST_RSQRT
+        __m128 inverse = rsqrtSSE2(squared);
+        nx = _mm_mul_ps(nx, inverse);
+        ny = _mm_mul_ps(ny, inverse);
+#else
+        __m128 magnitude = _mm_sqrt_ps(squared);
+        nx = _mm_div_ps(nx, magnitude);
+        ny = _mm_div_ps(ny, magnitude);
+#endif
+        __m128 product = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(ax, nx), _mm_mul_ps(ay, ny)),
+                                    _mm_add_ps(_mm_mul_ps(bx, nx), _mm_mul_ps(by, ny)));
+        __m128 px = _mm_andnot_ps(none, _mm_mul_ps(product, nx));
+        __m128 py = _mm_andnot_ps(none, _mm_mul_ps(product, ny));
+
+        float out_ax[4], out_ay[4], out_bx[4], out_by[4];
+        _mm_storeu_ps(out_ax, _mm_sub_ps(ax, px));
+        _mm_storeu_ps(out_ay, _mm_sub_ps(ay, py));
+        _mm_storeu_ps(out_bx, _mm_add_ps(bx, px));
+        _mm_storeu_ps(out_by, _mm_add_ps(by, py));
+        for (int lane = 0; lane < 4; lane++) {
+            balls->dir_x[a[lane]] = out_ax[lane];
+            balls->dir_y[a[lane]] = out_ay[lane];
+            balls->dir_x[b[lane]] = out_bx[lane];
+            balls->dir_y[b[lane]] = out_by[lane];
+        }
+    }
+    respondContactsScalar(balls, pairs, contacts + k, count - k);
+}
+
+/*
+    AVX2 version of the response kernel, bouncing eight contacts at a time.
+*/
+__attribute__((target("avx2")))
+void respondContactsAVX2(BallStore *balls, const int *pairs, const int *contacts, int count) {
+    int k = 0;
+    for (; k + 8 <= count; k += 8) {
+        int a[8], b[8];
+        for (int lane = 0; lane < 8; lane++) {
+            a[lane] = pairs[2 * contacts[k + lane]];
+            b[lane] = pairs[2 * contacts[k + lane] + 1];
+        }
+
+        float in[6][8];
+        for (int lane = 0; lane < 8; lane++) {
+            in[0][lane] = balls->pos_x[b[lane]] - balls->pos_x[a[lane]];
+            in[1][lane] = balls->pos_y[b[lane]] - balls->pos_y[a[lane]];
+            in[2][lane] = balls->dir_x[a[lane]];
+            in[3][lane] = balls->dir_y[a[lane]];
+            in[4][lane] = balls->dir_x[b[lane]];
+            in[5][lane] = balls->dir_y[b[lane]];
+        }
+        __m256 nx = _mm256_loadu_ps(in[0]);
+        __m256 ny = _mm256_loadu_ps(in[1]);
+        __m256 ax = _mm256_loadu_ps(in[2]);
+        __m256 ay = _mm256_loadu_ps(in[3]);
+        __m256 bx = _mm256_loadu_ps(in[4]);
+        __m256 by = _mm256_loadu_ps(in[5]);
+
+        // balls on top of each other keep their velocities
+        __m256 none = _mm256_and_ps(_mm256_cmp_ps(nx, _mm256_setzero_ps(), _CMP_EQ_OQ),
+                                    _mm256_cmp_ps(ny, _mm256_setzero_ps(), _CMP_EQ_OQ));
+
+        __m256 squared = _mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny));
+#ifdef BALLS_FAST_RSQRT
+        __m256 inverse = rsqrtAVX2(squared);
+        nx = _mm256_mul_ps(nx, inverse);
+        ny = _mm256_mul_ps(ny, inverse);
+#else
+        __m256 magnitude = _mm256_sqrt_ps(squared);
+        nx = _mm256_div_ps(nx, magnitude);
+        ny = _mm256_div_ps(ny, magnitude);
+#endif
+        __m256 product = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(ax, nx), _mm256_mul_ps(ay, ny)),
+                                       _mm256_add_ps(_mm256_mul_ps(bx, nx), _mm256_mul_ps(by, ny)));
+        __m256 px = _mm256_andnot_ps(none, _mm256_mul_ps(product, nx));
+        __m256 py = _mm256_andnot_ps(none, _mm256_mul_ps(product, ny));
+
+        _mm256_storeu_ps(in[2], _mm256_sub_ps(ax, px));
+        _mm256_storeu_ps(in[3], _mm256_sub_ps(ay, py));
+        _mm256_storeu_ps(in[4], _mm256_add_ps(bx, px));
+        _mm256_storeu_ps(in[5], _mm256_add_ps(by, py));
+        for (int lane = 0; lane < 8; lane++) {
+            balls->dir_x[a[lane]] = in[2][lane];
+            balls->dir_y[a[lane]] = in[3][lane];
+            balls->dir_x[b[lane]] = in[4][lane];
+            balls->dir_y[b[lane]] = in[5][lane];
+        }
+    }
+    respondContactsScalar(balls, pairs, contacts + k, count - k);
+}
+
+#else
+
+#ifdef BALLS_FAST_RSQRT
+
+/*
+    Refined reciprocal square roots of two and of four doubles, from the
+    float estimates, bitwise the same as real_rsqrt of every lane.
+*/
+__attribute__((target("sse2")))
+static inline __m128d rsqrtSSE2(__m128d x) {
+    __m128d estimate = _mm_cvtps_pd(_mm_rsqrt_ps(_mm_cvtpd_ps(x)));
+    for (int step = 0; step < 2; step++) {
+        __m128d error = _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(_mm_set1_pd(0.5), x), estimate), estimate);
+        estimate = _mm_mul_pd(estimate, _mm_sub_pd(_mm_set1_pd(1.5), error));
+    }
+    return estimate;
+}
+
+__attribute__((target("avx2")))
+static inline __m256d rsqrtAVX2(__m256d x) {
+    __m256d estimate = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(x)));
+    for (int step = 0; step < 2; step++) {
+        __m256d error = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(0.5), x), estimate), estimate);
+        estimate = _mm256_mul_pd(estimate, _mm256_sub_pd(_mm256_set1_pd(1.5), error));
+    }
+    return estimate;
+}
+
+#endif
+
+/*
+    SSE2 version of the response kernel, bouncing two contacts at a time.
+*/
+__attribute__((target("sse2")))
+void respondContactsSSE2(BallStore *balls, const int *pairs, const int *contacts, int count) {
+    int k = 0;
+    for (; k + 2 <= count; k += 2) {
+        int a0 = pairs[2 * contacts[k]];
+        int b0 = pairs[2 * contacts[k] + 1];
+        int a1 = pairs[2 * contacts[k + 1]];
+        int b1 = pairs[2 * contacts[k + 1] + 1];
+
+        __m128d nx = _mm_sub_pd(_mm_set_pd(balls->pos_x[b1], balls->pos_x[b0]),
+                                _mm_set_pd(balls->pos_x[a1], balls->pos_x[a0]));
+        __m128d ny = _mm_sub_pd(_mm_set_pd(balls->pos_y[b1], balls->pos_y[b0]),
+                                _mm_set_pd(balls->pos_y[a1], balls->pos_y[a0]));
+        __m128d ax = _mm_set_pd(balls->dir_x[a1], balls->dir_x[a0]);
+        __m128d ay = _mm_set_pd(balls->dir_y[a1], balls->dir_y[a0]);
+        __m128d bx = _mm_set_pd(balls->dir_x[b1], balls->dir_x[b0]);
+        __m128d by = _mm_set_pd(balls->dir_y[b1], balls->dir_y[b0]);
+
+        // balls on top of each other keep their velocities
+        __m128d none = _mm_and_pd(_mm_cmpeq_pd(nx, _mm_setzero_pd()), _mm_cmpeq_pd(ny, _mm_setzero_pd()));
+
+        __m128d squared = _mm_add_pd(_mm_mul_pd(nx, nx), _mm_mul_pd(ny, ny));
+#ifdef BALLS_FAST_RSQRT
+        __m128d inverse = rsqrtSSE2(squared);
+        nx = _mm_mul_pd(nx, inverse);
+        ny = _mm_mul_pd(ny, inverse);
+#else
+        __m128d magnitude = _mm_sqrt_pd(squared);
+        nx = _mm_div_pd(nx, magnitude);
+        ny = _mm_div_pd(ny, magnitude);
+#endif
+        __m128d product = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(ax, nx), _mm_mul_pd(ay, ny)),
+                                     _mm_add_pd(_mm_mul_pd(bx, nx), _mm_mul_pd(by, ny)));
+        __m128d px = _mm_andnot_pd(none, _mm_mul_pd(product, nx));
+        __m128d py = _mm_andnot_pd(none, _mm_mul_pd(product, ny));
+
+        __m128d out_ax = _mm_sub_pd(ax, px);
+        __m128d out_ay = _mm_sub_pd(ay, py);
+        __m128d out_bx = _mm_add_pd(bx, px);
+        __m128d out_by = _mm_add_pd(by, py);
+        _mm_storel_pd(&balls->dir_x[a0], out_ax);
+        _mm_storeh_pd(&balls->dir_x[a1], out_ax);
+        _mm_storel_pd(&balls->dir_y[a0], out_ay);
+        _mm_storeh_pd(&balls->dir_y[a1], out_ay);
+        _mm_storel_pd(&balls->dir_x[b0], out_bx);
+        _mm_storeh_pd(&balls->dir_x[b1], out_bx);
+        _mm_storel_pd(&balls->dir_y[b0], out_by);
+        _mm_storeh_pd(&balls->dir_y[b1], out_by);
+    }
+    respondContactsScalar(balls, pairs, contacts + k, count - k);
+}
+
+/*
+    AVX2 version of the response kernel, bouncing four contacts at a time.
+*/
+__attribute__((target("avx2")))
+void respondContactsAVX2(BallStore *balls, const int *pairs, const int *contacts, int count) {
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        int a[4], b[4];
+        for (int lane = 0; lane < 4; lane++) {
+            a[lane] = pairs[2 * contacts[k + lane]];
+            b[lane] = pairs[2 * contacts[k + lane] + 1];
+        }
+
+        __m256d nx = _mm256_sub_pd(_mm256_set_pd(balls->pos_x[b[3]], balls->pos_x[b[2]], balls->pos_x[b[1]], balls->pos_x[b[0]]),
+                                   _mm256_set_pd(balls->pos_x[a[3]], balls->pos_x[a[2]], balls->pos_x[a[1]], balls->pos_x[a[0]]));
+        __m256d ny = _mm256_sub_pd(_mm256_set_pd(balls->pos_y[b[3]], balls->pos_y[b[2]], balls->pos_y[b[1]], balls->pos_y[b[0]]),
+                                   _mm256_set_pd(balls->pos_y[a[3]], balls->pos_y[a[2]], balls->pos_y[a[1]], balls->pos_y[a[0]]));
+        __m256d ax = _mm256_set_pd(balls->dir_x[a[3]], balls->dir_x[a[2]], balls->dir_x[a[1]], balls->dir_x[a[0]]);
+        __m256d ay = _mm256_set_pd(balls->dir_y[a[3]], balls->dir_y[a[2]], balls->dir_y[a[1]], balls->dir_y[a[0]]);
+        __m256d bx = _mm256_set_pd(balls->dir_x[b[3]], balls->dir_x[b[2]], balls->dir_x[b[1]], balls->dir_x[b[0]]);
+        __m256d by = _mm256_set_pd(balls->dir_y[b[3]], balls->dir_y[b[2]], balls->dir_y[b[1]], balls->dir_y[b[0]]);
+
+        // balls on top of each other keep their velocities
+        __m256d none = _mm256_and_pd(_mm256_cmp_pd(nx, _mm256_setzero_pd(), _CMP_EQ_OQ),
+                                     _mm256_cmp_pd(ny, _mm256_setzero_pd(), _CMP_EQ_OQ));
+
+        __m256d squared = _mm256_add_pd(_mm256_mul_pd(nx, nx), _mm256_mul_pd(ny, ny));
+#ifdef BALLS_FAST_RSQRT
+        __m256d inverse = rsqrtAVX2(squared);
+        nx = _mm256_mul_pd(nx, inverse);
+        ny = _mm256_mul_pd(ny, inverse);
+#else
+        __m256d magnitude = _mm256_sqrt_pd(squared);
+        nx = _mm256_div_pd(nx, magnitude);
+        ny = _mm256_div_pd(ny, magnitude);
+#endif
+        __m256d product = _mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(ax, nx), _mm256_mul_pd(ay, ny)),
+                                        _mm256_add_pd(_mm256_mul_pd(bx, nx), _mm256_mul_pd(by, ny)));
+        __m256d px = _mm256_andnot_pd(none, _mm256_mul_pd(product, nx));
+        __m256d py = _mm256_andnot_pd(none, _mm256_mul_pd(product, ny));
+
+        double out_ax[4], out_ay[4], out_bx[4], out_by[4];
+        _mm256_storeu_pd(out_ax, _mm256_sub_pd(ax, px));
+        _mm256_storeu_pd(out_ay, _mm256_sub_pd(ay, py));
+        _mm256_storeu_pd(out_bx, _mm256_add_pd(bx, px));
+        _mm256_storeu_pd(out_by, _mm256_add_pd(by, py));
+        for (int lane = 0; lane < 4; lane++) {
+            balls->dir_x[a[lane]] = out_ax[lane];
+            balls->dir_y[a[lane]] = out_ay[lane];
+            balls->dir_x[b[lane]] = out_bx[lane];
+            balls->dir_y[b[lane]] = out_by[lane];
+        }
+    }
+    respondContactsScalar(balls, pairs, contacts + k, count - k);
+}
+
+#endif
+
+#endif
+
+ResponseKernel respondContacts = respondContactsScalar;
+
+/*
+    Picks the widest response kernel the CPU supports.
+    Returns the name of the chosen kernel.
+*/
+const char* selectResponseKernel() {
+#ifdef BALLS_X86
+    if (SDL_HasAVX2()) {
+        respondContacts = respondContactsAVX2;
+        return "AVX2";
+    }
+    if (SDL_HasSSE2()) {
+        respondContacts = respondContactsSSE2;
+        return "SSE2";
+    }
+#endif
+    respondContacts = respondContactsScalar;
+    return "scalar";
+}
+
+/*
+    With --colored the grid finds the contacts of a step first and resolves
+    them after, instead of bouncing every pair the moment it is found.
+    Detection only reads the positions, so every occupied subspace can be
+    tested in parallel: the subspaces are cut into chunks of CONTACT_GRAIN,
+    every chunk lists its contacts on its own, and the chunks are joined in
+    order. The contacts are then colored greedily, each taking the lowest
+    color neither of its balls has yet, so no two contacts of a color share
+    a ball and a color can be resolved in parallel with no locks at all.
+    The contacts and their colors only depend on the grid, so the result
+    is the same on any number of threads.
+    Each ball keeps the colors it has taken as the bits of a Uint64; a
+    contact whose balls have taken CONTACT_COLORS - 1 colors between them
+    goes to the last color, which is resolved on one thread in order.
+*/
+#define CONTACT_GRAIN 16
+#define CONTACT_COLORS 64
+#define CONTACT_RESOLVE_GRAIN 512
+
+typedef struct ContactGraph {
+    int         *occupied;
+    int         occupiedCapacity;
+    ContactList *chunks;
+    int         chunkCapacity;
+    ContactList joined;
+    int         *sorted;
+    int         sortedCapacity;
+    Uint8       *colors;
+    Uint64      *taken;
+    int         colorStart[CONTACT_COLORS + 1];
+} ContactGraph;
+
+ContactGraph contactGraph;
+bool coloredContacts = false;
+
+/*
+    Allocates the colors taken by up to amnt balls, all of them free.
+    Returns 0 on success and 1 if the allocation failed.
+*/
+int initContactGraph(int amnt) {
+    contactGraph.taken = calloc(amnt > 0 ? amnt : 1, sizeof(Uint64));
+    return contactGraph.taken == NULL;
+}
+
+void freeContactGraph() {
+    for (int c = 0; c < contactGraph.chunkCapacity; c++) {
+        free(contactGraph.chunks[c].pairs);
+    }
+    free(contactGraph.chunks);
+    free(contactGraph.occupied);
+    free(contactGraph.joined.pairs);
+    free(contactGraph.sorted);
+    free(contactGraph.colors);
+    free(contactGraph.taken);
+}
+
+/*
+    Grows an int array to hold at least count entries. Exits if it cannot.
+*/
+void reserveInts(int **array, int *capacity, int count) {
+    if (count <= *capacity) {
+        return;
+    }
+    int *grown = realloc(*array, sizeof(int) * count);
+    if (grown == NULL) {
+        fprintf(stderr, "Could not grow the contact graph!\n");
+        exit(1);
+    }
+    *array = grown;
+    *capacity = count;
+}
+
+typedef struct ContactTask {
+    BallStore   *balls;
+    int         color;
+} ContactTask;
+
+/*
+    Worker task listing the contacts of a range of occupied subspaces into
+    the chunk of the range.
+*/
+void detectContacts(int begin, int end, void *data) {
+    ContactTask *task = data;
+    ContactList *chunk = &contactGraph.chunks[begin / CONTACT_GRAIN];
+    CollisionCounts counts = { 0 };
+
+    for (int k = begin; k < end; k++) {
+        int subspace = contactGraph.occupied[k];
+        int depth;
+        int *cell = subspaceBalls(subspace, &depth);
+        collideCell(subspace, cell, depth, task->balls, &counts, chunk);
+    }
+    addCollisionCounts(&counts);
+}
+
+/*
+    Worker task bouncing a range of the contacts of one color. Only the
+    last color can share balls between its contacts, so every other one
+    goes through the response kernel when it can.
+*/
+void resolveContacts(int begin, int end, void *data) {
+    ContactTask *task = data;
+    const int *pairs = contactGraph.joined.pairs;
+    const int *sorted = contactGraph.sorted + contactGraph.colorStart[task->color];
+
+    if (task->color != CONTACT_COLORS - 1 && plainResponse()) {
+        respondContacts(task->balls, pairs, sorted + begin, end - begin);
+        return;
+    }
+    for (int k = begin; k < end; k++) {
+        int contact = sorted[k];
+        bounce(task->balls, pairs[2 * contact], pairs[2 * contact + 1]);
+    }
+}
+
+/*
+    Returns the index of the lowest set bit, of bits that are not all 0.
+*/
+int lowestBit64(Uint64 bits) {
+    Uint32 low = (Uint32) bits;
+    if (low != 0) {
+        return SDL_MostSignificantBitIndex32(low & -low);
+    }
+    Uint32 high = (Uint32) (bits >> 32);
+    return 32 + SDL_MostSignificantBitIndex32(high & -high);
+}
+
+/*
+    Gives every joined contact the lowest color free on both of its balls,
+    then sorts the contacts by color, keeping their order within a color.
+*/
+void colorContacts() {
+    ContactGraph *graph = &contactGraph;
+    int count = graph->joined.count;
+    const int *pairs = graph->joined.pairs;
+
+    Uint8 *colors = realloc(graph->colors, count > 0 ? count : 1);
+    if (colors == NULL) {
+        fprintf(stderr, "Could not grow the contact graph!\n");
+        exit(1);
+    }
+    graph->colors = colors;
+
+    int sizes[CONTACT_COLORS] = { 0 };
+    for (int k = 0; k < count; k++) {
+        int a = pairs[2 * k];
+        int b = pairs[2 * k + 1];
+        Uint64 free_colors = ~(graph->taken[a] | graph->taken[b]);
+
+        // the last color is the serial one, never taken by a ball
+        int color = CONTACT_COLORS - 1;
+        free_colors &= ~((Uint64) 1 << (CONTACT_COLORS - 1));
+        if (free_colors != 0) {
+            color = lowestBit64(free_colors);
+            graph->taken[a] |= (Uint64) 1 << color;
+            graph->taken[b] |= (Uint64) 1 << color;
+        }
+        colors[k] = color;
+        sizes[color]++;
+    }
+
+    graph->colorStart[0] = 0;
+    for (int c = 0; c < CONTACT_COLORS; c++) {
+        graph->colorStart[c + 1] = graph->colorStart[c] + sizes[c];
+    }
+
+    reserveInts(&graph->sorted, &graph->sortedCapacity, count);
+    int cursor[CONTACT_COLORS];
+    memcpy(cursor, graph->colorStart, sizeof(cursor));
+    for (int k = 0; k < count; k++) {
+        graph->sorted[cursor[colors[k]]++] = k;
+
+        // every ball of a contact has its colors cleared for the next step
+        graph->taken[pairs[2 * k]] = 0;
+        graph->taken[pairs[2 * k + 1]] = 0;
+    }
+}
+
+/*
+    Colors the joined contacts and resolves them color by color, every
+    color but the last on the worker pool.
+*/
+void resolveJoinedContacts(BallStore *balls) {
+    ContactGraph *graph = &contactGraph;
+    colorContacts();
+
+    ContactTask task = { .balls = balls };
+    for (int color = 0; color < CONTACT_COLORS; color++) {
+        int size = graph->colorStart[color + 1] - graph->colorStart[color];
+        if (size == 0) {
+            continue;
+        }
+
+        task.color = color;
+        if (color == CONTACT_COLORS - 1) {
+            resolveContacts(0, size, &task);
+        }
+        else {
+            parallelFor(size, CONTACT_RESOLVE_GRAIN, resolveContacts, &task);
+        }
+    }
+}
+
+/*
+    Version of collideBalls that finds every contact of the step first and
+    then resolves them color by color, both on the worker pool.
+*/
+void collideBallsColored(BallStore *balls) {
+    ContactGraph *graph = &contactGraph;
+
+    // the occupied subspaces, in index order
+    int occupied = 0;
+    reserveInts(&graph->occupied, &graph->occupiedCapacity, subspace_count);
+    for (int word = 0; word < OCCUPIED_WORDS(subspace_count); word++) {
+        Uint32 bits = occupiedSubspaces[word];
+        while (bits != 0) {
+            graph->occupied[occupied++] = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+            bits &= bits - 1;
+        }
+    }
+
+    int chunks = (occupied + CONTACT_GRAIN - 1) / CONTACT_GRAIN;
+    if (chunks > graph->chunkCapacity) {
+        ContactList *grown = realloc(graph->chunks, sizeof(ContactList) * chunks);
+        if (grown == NULL) {
+            fprintf(stderr, "Could not grow the contact graph!\n");
+            exit(1);
+        }
+        memset(grown + graph->chunkCapacity, 0, sizeof(ContactList) * (chunks - graph->chunkCapacity));
+        graph->chunks = grown;
+        graph->chunkCapacity = chunks;
+    }
+    for (int c = 0; c < chunks; c++) {
+        graph->chunks[c].count = 0;
+    }
+
+    ContactTask task = { .balls = balls };
+    parallelFor(occupied, CONTACT_GRAIN, detectContacts, &task);
+
+    // the chunks joined in order, whichever thread listed them
+    graph->joined.count = 0;
+    for (int c = 0; c < chunks; c++) {
+        ContactList *chunk = &graph->chunks[c];
+        for (int k = 0; k < chunk->count; k++) {
+            addContact(&graph->joined, chunk->pairs[2 * k], chunk->pairs[2 * k + 1]);
+        }
+    }
+    resolveJoinedContacts(balls);
+
+    CollisionCounts counts = { .bounces = graph->joined.count };
+    addCollisionCounts(&counts);
+}
+
+/*
+    Allocates the keys of the deferred contacts, with room for the contacts
+    of amnt balls packed edge to edge to begin with, and the colors of the
+    contact graph they are resolved through.
+    Returns 0 on success and 1 if the allocation failed.
+*/
+int initDeferredContacts(int amnt) {
+    deferredContacts.capacity = (amnt > 0 ? amnt : 1) * COLLISION_EVENTS_PER_BALL;
+    deferredContacts.keys = malloc(sizeof(Uint64) * deferredContacts.capacity);
+    deferredContacts.scratch = malloc(sizeof(Uint64) * deferredContacts.capacity);
+    if (deferredContacts.keys == NULL || deferredContacts.scratch == NULL) {
+        return 1;
+    }
+    return initContactGraph(amnt);
+}
+
+void freeDeferredContacts() {
+    free(deferredContacts.keys);
+    free(deferredContacts.scratch);
+    freeContactGraph();
+}
+
+/*
+    Sorts the keys of the deferred contacts, all below 2^bits, with a radix
+    sort of a byte per pass.
+*/
+void sortDeferredContacts(int count, int bits) {
+    Uint64 *keys = deferredContacts.keys;
+    Uint64 *scratch = deferredContacts.scratch;
+
+    for (int shift = 0; shift < bits; shift += 8) {
+        int offsets[257] = { 0 };
+        for (int k = 0; k < count; k++) {
+            offsets[((keys[k] >> shift) & 255) + 1]++;
+        }
+        for (int digit = 0; digit < 256; digit++) {
+            offsets[digit + 1] += offsets[digit];
+        }
+        for (int k = 0; k < count; k++) {
+            scratch[offsets[(keys[k] >> shift) & 255]++] = keys[k];
+        }
+
+        Uint64 *swap = keys;
+        keys = scratch;
+        scratch = swap;
+    }
+
+    // the passes leave the keys in whichever array they wrote last
+    deferredContacts.keys = keys;
+    deferredContacts.scratch = scratch;
+}
+
+/*
+    Runs the broad phase with every pair it bounces deferred, then
+    resolves the pairs in the order of their keys, colored so that every
+    color can be resolved on all threads at once. A pair a broad phase
+    found twice is only resolved once.
+    Exits if the keys cannot grow.
+*/
+void collideDeterministic(BallStore *balls, void (*collide)(BallStore *balls)) {
+    int count;
+    while (true) {
+        SDL_AtomicSet(&deferredContacts.count, 0);
+        deferredContacts.deferring = true;
+        collide(balls);
+        deferredContacts.deferring = false;
+
+        count = SDL_AtomicGet(&deferredContacts.count);
+        if (count <= deferredContacts.capacity) {
+            break;
+        }
+
+        Uint64 *keys = realloc(deferredContacts.keys, sizeof(Uint64) * count);
+        Uint64 *scratch = keys != NULL ? realloc(deferredContacts.scratch, sizeof(Uint64) * count) : NULL;
+        if (scratch == NULL) {
+            fprintf(stderr, "Could not grow the deferred contacts!\n");
+            exit(1);
+        }
+        deferredContacts.keys = keys;
+        deferredContacts.scratch = scratch;
+        deferredContacts.capacity = count;
+    }
+
+    // the keys are below count^2
+    int bits = 2 * (SDL_MostSignificantBitIndex32(balls->count > 1 ? balls->count - 1 : 1) + 1);
+    sortDeferredContacts(count, bits);
+
+    ContactList *joined = &contactGraph.joined;
+    joined->count = 0;
+    for (int k = 0; k < count; k++) {
+        Uint64 key = deferredContacts.keys[k];
+        if (k == 0 || key != deferredContacts.keys[k - 1]) {
+            addContact(joined, (int) (key / balls->count), (int) (key % balls->count));
+        }
+    }
+    resolveJoinedContacts(balls);
+}
+
+/*
+    Runs the broad phase and resolves its contacts, in the order of their
+    keys with --deterministic and as they are found otherwise.
+*/
+void collideWith(BallStore *balls, void (*collide)(BallStore *balls)) {
+    if (deterministic) {
+        collideDeterministic(balls, collide);
+    }
+    else {
+        collide(balls);
+    }
+}
+
+/*
+    External force fields, which change the velocities of the balls every
+    step before they move. Gravity and drag act on every ball alike, so
+    they are one pass over the velocity arrays, folded into the same task
+    that moves the balls so the arrays are only streamed through once.
+    An attractor only pulls the balls within its radius, towards its
+    center (or pushes them away with a negative strength), weaker the
+    farther out they are. On the grid it visits just the subspaces it
+    covers; a ball is listed in up to four subspaces, so it is only pulled
+    from the one of its top-left corner.
+    Gravity and the strength of attractors are in pixels per frame per
+    frame, and drag is the fraction of velocity lost per frame.
+*/
+#define FIELD_MAX_ATTRACTORS 8
+
+typedef struct Attractor {
+    real    x;
+    real    y;
+    real    strength;
+    real    radius;
+} Attractor;
+
+typedef struct ForceFields {
+    real        gravity;
+    real        drag;
+    Attractor   attractors[FIELD_MAX_ATTRACTORS];
+    int         attractorCount;
+} ForceFields;
+
+ForceFields forceFields;
+
+/*
+    Returns whether gravity or drag is on.
+*/
+bool uniformFields() {
+    return forceFields.gravity != 0 || forceFields.drag != 0;
+}
+
+/*
+    Applies gravity and drag to a range of balls over one step.
+*/
+void applyUniformFields(BallStore *balls, int begin, int end) {
+    real pull = forceFields.gravity * step_dt;
+    real damping = real_fmax(1 - forceFields.drag * step_dt, 0);
+    real *dir_x = balls->dir_x;
+    real *dir_y = balls->dir_y;
+
+    for (int i = begin; i < end; i++) {
+        dir_x[i] *= damping;
+        dir_y[i] = dir_y[i] * damping + pull;
+    }
+}
+
+/*
+    Pulls ball i towards the center of the attractor over one step, if it
+    is within reach.
+*/
+void attractBall(BallStore *balls, int i, const Attractor *field) {
+    real dx = field->x - balls->pos_x[i];
+    real dy = field->y - balls->pos_y[i];
+    real distance_squared = dx * dx + dy * dy;
+    if (distance_squared >= field->radius * field->radius) {
+        return;
+    }
+
+    // the pull fades out linearly towards the edge of the field, and the
+    // direction is left alone within a pixel of the center
+    real distance = real_sqrt(distance_squared);
+    real pull = field->strength * (1 - distance / field->radius) * step_dt / real_fmax(distance, 1);
+    balls->dir_x[i] += pull * dx;
+    balls->dir_y[i] += pull * dy;
+}
+
+/*
+    Applies one attractor to every ball it reaches, going through the
+    subspaces it covers when the grid lists the balls where they are.
+*/
+void applyAttractor(BallStore *balls, const Attractor *field) {
+    if (broadphase != BROADPHASE_GRID || eventDriven || !gridCurrent) {
+        for (int i = 0; i < balls->count; i++) {
+            attractBall(balls, i, field);
+        }
+        return;
+    }
+
+    // a ball whose center is in reach may have its top-left corner a
+    // radius farther out
+    real reach = field->radius + min_subspace_size / 2 + ccd_margin;
+    int spr = world_width / subspace_size_x;
+    int col_first = subspaceColumn(field->x - reach);
+    int col_last = subspaceColumn(field->x + reach);
+    int row_first = subspaceRow(field->y - reach);
+    int row_last = subspaceRow(field->y + reach);
+
+    for (int row = row_first; row <= row_last; row++) {
+        for (int col = col_first; col <= col_last; col++) {
+            int subspace = col + row * spr;
+            if (!isOccupied(subspace)) {
+                continue;
+            }
+
+            int depth;
+            int *cell = subspaceBalls(subspace, &depth);
+            for (int k = 0; k < depth; k++) {
+                if (balls->subspaces[cell[k]][0] == subspace) {
+                    attractBall(balls, cell[k], field);
+                }
+            }
+        }
+    }
+}
+
+/*
+    Worker task moving a range of balls and bouncing them off the walls.
+*/
+void moveBallsTask(int begin, int end, void *data) {
+    if (uniformFields()) {
+        applyUniformFields(data, begin, end);
+    }
+    integrateBalls(data, begin, end);
+}
+
+/*
+    The part of the world on the screen. The top-left corner of the screen
+    shows the world point x, y, and a pixel of the world is zoom pixels of
+    the screen wide. While the camera is at the origin at zoom 1 and the
+    world fits on the screen, as by default, the balls are drawn straight
+    from their store. Otherwise the camera lists the balls it sees into a
+    store of its own, in screen coordinates, which the renderers draw like
+    any other.
+*/
+typedef struct Camera {
+    double  x;
+    double  y;
+    double  zoom;
+} Camera;
+
+#define CAMERA_MIN_ZOOM 0.05
+#define CAMERA_MAX_ZOOM 16.0
+#define CAMERA_ZOOM_STEP 1.25
+// Screen pixels an arrow key pans by.
+#define CAMERA_PAN 64
+// How far a ball may have moved since the grid was built, in world pixels.
+#define CAMERA_MARGIN 16
+
+Camera camera = { .x = 0, .y = 0, .zoom = 1 };
+
+/*
+    The balls the camera saw in the current frame. Seen holds the frame in
+    which every ball was last listed, so a ball found in several subspaces
+    is listed once.
+*/
+typedef struct CameraView {
+    BallStore   balls;
+    Uint32      *seen;
+    Uint32      frame;
+} CameraView;
+
+CameraView cameraView;
+
+/*
+    Returns whether the given camera shows the world as it is.
+*/
+bool viewIsIdentity(const Camera *cam) {
+    return cam->x == 0 && cam->y == 0 && cam->zoom == 1 &&
+        world_width <= screen_width && world_height <= screen_height;
+}
+
+/*
+    Returns whether the camera of the window shows the world as it is.
+*/
+bool cameraIsIdentity() {
+    return viewIsIdentity(&camera);
+}
+
+/*
+    Keeps the center of the screen within the world.
+*/
+void clampCamera() {
+    double half_x = screen_width / camera.zoom / 2;
+    double half_y = screen_height / camera.zoom / 2;
+    camera.x = fmin(fmax(camera.x, -half_x), world_width - half_x);
+    camera.y = fmin(fmax(camera.y, -half_y), world_height - half_y);
+}
+
+/*
+    Puts the camera back at zoom 1 over the center of the world, which for
+    a world the size of the screen is the origin.
+*/
+void resetCamera() {
+    camera.zoom = 1;
+    camera.x = (world_width - screen_width) / 2.0;
+    camera.y = (world_height - screen_height) / 2.0;
+}
+
+/*
+    Moves the camera by the given number of screen pixels.
+*/
+void panCamera(double dx, double dy) {
+    camera.x += dx / camera.zoom;
+    camera.y += dy / camera.zoom;
+    clampCamera();
+}
+
+/*
+    Zooms by the given factor, keeping the world point under the screen
+    point x, y where it is.
+*/
+void zoomCamera(double factor, int x, int y) {
+    double world_x = camera.x + x / camera.zoom;
+    double world_y = camera.y + y / camera.zoom;
+    camera.zoom = fmin(fmax(camera.zoom * factor, CAMERA_MIN_ZOOM), CAMERA_MAX_ZOOM);
+    camera.x = world_x - x / camera.zoom;
+    camera.y = world_y - y / camera.zoom;
+    clampCamera();
+}
+
+/*
+    Allocates the store of the camera for the given number of balls, with
+    room for the positions and radii only.
+    Returns 0 on success and 1 if an allocation failed.
+*/
+int initCameraView(int amnt) {
+    size_t n = amnt > 0 ? amnt : 1;
+    size_t size = 2 * arenaSize(sizeof(real) * n) + arenaSize(sizeof(int) * n);
+
+    BallStore *view = &cameraView.balls;
+    memset(view, 0, sizeof(*view));
+    if (initArena(&view->arena, size, false) != 0) {
+        return 1;
+    }
+    view->capacity = amnt;
+    view->pos_x = arenaAlloc(&view->arena, sizeof(real) * n);
+    view->pos_y = arenaAlloc(&view->arena, sizeof(real) * n);
+    view->radius = arenaAlloc(&view->arena, sizeof(int) * n);
+
+    cameraView.seen = calloc(n, sizeof(Uint32));
+    cameraView.frame = 0;
+    return cameraView.seen == NULL ? 1 : 0;
+}
+
+void freeCameraView() {
+    freeBallStore(&cameraView.balls);
+    free(cameraView.seen);
+}
+
+/*
+    Lists ball i in the store of the camera, in the screen coordinates of
+    the given camera, if any of it is on the screen.
+*/
+static inline void viewBall(BallStore *balls, int i, const Camera *cam, double right, double down) {
+    real radius = balls->radius[i];
+    real x = balls->pos_x[i];
+    real y = balls->pos_y[i];
+    if (x + radius < cam->x || x - radius > right || y + radius < cam->y || y - radius > down) {
+        return;
+    }
+
+    BallStore *view = &cameraView.balls;
+    int k = view->count++;
+    view->pos_x[k] = (x - cam->x) * cam->zoom;
+    view->pos_y[k] = (y - cam->y) * cam->zoom;
+
+    // zoomed out, a ball still covers at least a pixel
+    int scaled = (int) (radius * cam->zoom + 0.5);
+    view->radius[k] = scaled > 1 ? scaled : 1;
+}
+
+/*
+    Returns the balls to draw this frame: the balls themselves when the
+    given camera shows the world as it is, and otherwise the balls on the
+    screen as it sees them. With use_grid only the subspaces under the
+    screen are walked, so the cost follows what is visible instead of the
+    number of balls. Without it every ball is looked at, as on the draw
+    thread, whose snapshot has no grid.
+*/
+BallStore* viewBalls(const Camera *cam, BallStore *balls, bool use_grid) {
+    if (viewIsIdentity(cam)) {
+        return balls;
+    }
+
+    cameraView.balls.count = 0;
+    if (++cameraView.frame == 0) {
+        memset(cameraView.seen, 0, sizeof(Uint32) * balls->count);
+        cameraView.frame = 1;
+    }
+
+    double right = cam->x + screen_width / cam->zoom;
+    double down = cam->y + screen_height / cam->zoom;
+
+    if (!use_grid) {
+        for (int i = 0; i < balls->count; i++) {
+            viewBall(balls, i, cam, right, down);
+        }
+        return &cameraView.balls;
+    }
+
+    int spr = world_width / subspace_size_x;
+    int col_first = subspaceColumn(cam->x - CAMERA_MARGIN);
+    int col_last = subspaceColumn(right + CAMERA_MARGIN);
+    int row_first = subspaceRow(cam->y - CAMERA_MARGIN);
+    int row_last = subspaceRow(down + CAMERA_MARGIN);
+
+    for (int row = row_first; row <= row_last; row++) {
+        for (int col = col_first; col <= col_last; col++) {
+            int depth;
+            int *cell = subspaceBalls(col + row * spr, &depth);
+            for (int k = 0; k < depth; k++) {
+                int i = cell[k];
+                if (cameraView.seen[i] != cameraView.frame) {
+                    cameraView.seen[i] = cameraView.frame;
+                    viewBall(balls, i, cam, right, down);
+                }
+            }
+        }
+    }
+    return &cameraView.balls;
+}
+
+/*
+    Returns the balls to draw this frame as the camera of the window sees
+    them, like viewBalls.
+*/
+BallStore* cameraBalls(BallStore *balls, bool use_grid) {
+    return viewBalls(&camera, balls, use_grid);
+}
+
+/*
+    Outlines the edges of the world, for when the camera shows where they are.
+*/
+void drawWorldBounds() {
+    SDL_Rect bounds = {
+        .x = (int) (-camera.x * camera.zoom),
+        .y = (int) (-camera.y * camera.zoom),
+        .w = (int) (world_width * camera.zoom),
+        .h = (int) (world_height * camera.zoom)
+    };
+    SDL_SetRenderDrawColor(ren, 128, 128, 128, 255);
+    SDL_RenderDrawRect(ren, &bounds);
+}
+
+/*
+    The debug overlay of the subspace grid, drawn once into a target texture
+    and copied to the screen every frame. It remembers the subspace size it
+    was drawn for, and is redrawn when the grid changes or the renderer
+    loses its targets.
+*/
+typedef struct GridOverlay {
+    SDL_Texture*    texture;
+    int             size_x;
+    int             size_y;
+    bool            stale;
+} GridOverlay;
+
+GridOverlay gridOverlay;
+
+/*
+    Draws the lines between the subspaces on the screen with the current
+    draw color, as the camera sees them.
+*/
+void drawGridLines(int size_x, int size_y) {
+    double right = fmin(camera.x + screen_width / camera.zoom, world_width);
+    double down = fmin(camera.y + screen_height / camera.zoom, world_height);
+    int top = (int) (-camera.y * camera.zoom);
+    int bottom = (int) ((world_height - camera.y) * camera.zoom);
+    int left = (int) (-camera.x * camera.zoom);
+    int end = (int) ((world_width - camera.x) * camera.zoom);
+
+    int first_y = camera.y > 0 ? (int) (camera.y / size_y) * size_y : 0;
+    for (int y = first_y; y < down; y+=size_y) {
+        int screen_y = (int) ((y - camera.y) * camera.zoom);
+        SDL_RenderDrawLine(ren, left, screen_y, end, screen_y);
+    }
+    int first_x = camera.x > 0 ? (int) (camera.x / size_x) * size_x : 0;
+    for (int x = first_x; x < right; x+=size_x) {
+        int screen_x = (int) ((x - camera.x) * camera.zoom);
+        SDL_RenderDrawLine(ren, screen_x, top, screen_x, bottom);
+    }
+}
+
+/*
+    Redraws the grid overlay texture, creating it the first time.
+    Returns 0 on success and 1 if the renderer has no target textures.
+*/
+int buildGridOverlay(int size_x, int size_y) {
+    if (gridOverlay.texture == NULL) {
+        gridOverlay.texture = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+                                                screen_width, screen_height);
+        if (gridOverlay.texture == NULL) {
+            return 1;
+        }
+        SDL_SetTextureBlendMode(gridOverlay.texture, SDL_BLENDMODE_BLEND);
+    }
+
+    if (SDL_SetRenderTarget(ren, gridOverlay.texture) != 0) {
+        return 1;
+    }
+    SDL_SetRenderDrawColor(ren, 0, 0, 0, 0);
+    SDL_RenderClear(ren);
+    SDL_SetRenderDrawColor(ren, 255, 255, 255, 255);
+    drawGridLines(size_x, size_y);
+    SDL_SetRenderTarget(ren, NULL);
+
+    gridOverlay.size_x = size_x;
+    gridOverlay.size_y = size_y;
+    gridOverlay.stale = false;
+    return 0;
+}
+
+/*
+    Draws the grid of subspaces of the given size with one copy of the
+    overlay texture, falling back to drawing the lines when the renderer
+    has no target textures.
+*/
+void drawGridOverlay(int size_x, int size_y) {
+    // the texture only holds the grid the way it is seen by default
+    if (!cameraIsIdentity()) {
+        SDL_SetRenderDrawColor(ren, 255, 255, 255, 255);
+        drawGridLines(size_x, size_y);
+        return;
+    }
+
+    if (gridOverlay.stale || gridOverlay.texture == NULL ||
+        gridOverlay.size_x != size_x || gridOverlay.size_y != size_y) {
+        if (buildGridOverlay(size_x, size_y) != 0) {
+            SDL_SetRenderDrawColor(ren, 255, 255, 255, 255);
+            drawGridLines(size_x, size_y);
+            return;
+        }
+    }
+
+    SDL_RenderCopy(ren, gridOverlay.texture, NULL, NULL);
+}
+
+void freeGridOverlay() {
+    if (gridOverlay.texture != NULL) {
+        SDL_DestroyTexture(gridOverlay.texture);
+    }
+}
+
+/*
+    Draws every ball. Drawing has to stay on the thread that owns the
+    renderer.
+*/
+void drawBalls(BallStore *balls) {
+    if (renderMode == RENDER_SOFTWARE) {
+        drawBallsSoftware(balls);
+        return;
+    }
+
+    if (renderMode == RENDER_GL) {
+        drawBallsGL(balls);
+        return;
+    }
+
+    if (renderMode == RENDER_SPRITES) {
+        SDL_Color white = { 255, 255, 255, 255 };
+        for (int i = 0; i < balls->count; i++) {
+            addSpriteQuad(balls, i, white);
+        }
+        flushSprites();
+        return;
+    }
+
+    if (filledBalls) {
+        for (int i = 0; i < balls->count; i++) {
+            fillCircle(balls->pos_x[i], balls->pos_y[i], balls->radius[i], &ballSpans);
+        }
+        flushSpans(&ballSpans, 255, 255, 255);
+        return;
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    for (int i = 0; i < balls->count; i++) {
+        drawBall(balls, i, &ballPoints);
+    }
+    flushPoints(&ballPoints, 255, 255, 255);
+
+    updateLevelOfDetail((double) (SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency());
+}
+
+/*
+    Moves every ball by one step and bounces them off the walls, spread
+    over the worker pool.
+*/
+void moveBalls(BallStore *balls) {
+    PROFILE_BEGIN(PHASE_INTEGRATE);
+    for (int f = 0; f < forceFields.attractorCount; f++) {
+        applyAttractor(balls, &forceFields.attractors[f]);
+    }
+    parallelFor(balls->count, BALL_TASK_GRAIN, moveBallsTask, balls);
+    PROFILE_END(PHASE_INTEGRATE);
+}
+
+/*
+    Resolves the collisions of the balls on the grid the way the options
+    ask for. The fixed engine always takes the tiled order, so any thread
+    count matches.
+*/
+void collideGrid(BallStore *balls) {
+    if (coloredContacts) {
+        collideBallsColored(balls);
+    }
+    else if (workerCount() > 1 || engine == ENGINE_FIXED) {
+        collideBallsParallel(balls);
+    }
+    else {
+        collideBalls(balls);
+    }
+}
+
+/*
+    Improved version of the collision algorithm, using subspaces to only check
+    balls that can collide realistically within the step.
+*/
+void stepBallsImproved(BallStore *balls) {
+    
+    // assigns the balls to subspaces and builds the grid slice of each subspace
+    PROFILE_BEGIN(PHASE_ASSIGN);
+    if (incrementalGrid) {
+        assignSubspacesIncremental(balls);
+    }
+    else {
+        assignSubspaces(balls);
+    }
+    gridCurrent = true;
+    PROFILE_END(PHASE_ASSIGN);
+
+    // performs the calculation of determining whether the ball has collided or not
+    PROFILE_BEGIN(PHASE_COLLIDE);
+    collideWith(balls, collideGrid);
+    PROFILE_END(PHASE_COLLIDE);
+
+    // measured before adapting, which may rebuild the grid
+    if (statsFile != NULL) {
+        writeStats(balls);
+    }
+
+    if (adaptiveGrid) {
+        adaptSubspaces(balls);
+    }
+
+    moveBalls(balls);
+}
+
+/*
+    With --verlet every ball keeps a list of the balls within the sum of
+    their radii plus a skin, and the lists are tested every step in place
+    of the grid. A pair that is not listed was more than the skin apart
+    when the lists were built, so it cannot touch before one of the two
+    has moved half the skin, and the lists are only rebuilt once some ball
+    has. Each pair is listed once, with the ball of the lower index.
+    The lists are built on a grid of their own, binned by the centers of
+    the balls, with cells the widest pair plus the skin across.
+*/
+real verlet_skin = 0;
+
+typedef struct VerletLists {
+    int*    start;
+    int*    neighbours;
+    int     neighbourCapacity;
+    real*   built_x;
+    real*   built_y;
+    int*    cellStart;
+    int*    cellBalls;
+    int*    ballCell;
+    int     cellCapacity;
+    int     capacity;
+    int     count;
+    bool    valid;
+    long    rebuilds;
+} VerletLists;
+
+VerletLists verletLists;
+
+/*
+    Allocates the neighbour lists for amnt balls.
+    Returns 0 on success and 1 if an allocation failed.
+*/
+int initVerletLists(int amnt) {
+    int capacity = amnt > 0 ? amnt : 1;
+    verletLists = (VerletLists) {
+        .start = malloc(sizeof(int) * (capacity + 1)),
+        .neighbours = malloc(sizeof(int) * capacity * BALLS_PER_SUBSPACE),
+        .neighbourCapacity = capacity * BALLS_PER_SUBSPACE,
+        .built_x = malloc(sizeof(real) * capacity),
+        .built_y = malloc(sizeof(real) * capacity),
+        .cellBalls = malloc(sizeof(int) * capacity),
+        .ballCell = malloc(sizeof(int) * capacity),
+        .capacity = capacity
+    };
+
+    if (verletLists.start == NULL || verletLists.neighbours == NULL || verletLists.built_x == NULL ||
+        verletLists.built_y == NULL || verletLists.cellBalls == NULL || verletLists.ballCell == NULL) {
+        return 1;
+    }
+    return 0;
+}
+
+void freeVerletLists() {
+    free(verletLists.start);
+    free(verletLists.neighbours);
+    free(verletLists.built_x);
+    free(verletLists.built_y);
+    free(verletLists.cellStart);
+    free(verletLists.cellBalls);
+    free(verletLists.ballCell);
+    verletLists = (VerletLists) { 0 };
+}
+
+/*
+    Reallocates one of the arrays of the neighbour lists to the given size,
+    exiting if it cannot.
+*/
+static void* growVerletArray(void *array, size_t size) {
+    void *grown = realloc(array, size);
+    if (grown == NULL) {
+        fprintf(stderr, "Could not grow the neighbour lists!\n");
+        exit(1);
+    }
+    return grown;
+}
+
+/*
+    Makes room in the lists for the balls added since they were allocated.
+*/
+static void growVerletBalls(int count) {
+    if (count <= verletLists.capacity) {
+        return;
+    }
+
+    int capacity = verletLists.capacity * 2 > count ? verletLists.capacity * 2 : count;
+    verletLists.start = growVerletArray(verletLists.start, sizeof(int) * (capacity + 1));
+    verletLists.built_x = growVerletArray(verletLists.built_x, sizeof(real) * capacity);
+    verletLists.built_y = growVerletArray(verletLists.built_y, sizeof(real) * capacity);
+    verletLists.cellBalls = growVerletArray(verletLists.cellBalls, sizeof(int) * capacity);
+    verletLists.ballCell = growVerletArray(verletLists.ballCell, sizeof(int) * capacity);
+    verletLists.capacity = capacity;
+}
+
+/*
+    Returns true when the lists no longer cover every pair that can touch:
+    they were never built, the balls were added to or renumbered, or a ball
+    moved more than half the skin since they were built.
+*/
+bool verletListsStale(BallStore *balls) {
+    if (!verletLists.valid || verletLists.count != balls->count) {
+        return true;
+    }
+
+    real limit = verlet_skin * verlet_skin / 4;
+    for (int i = 0; i < balls->count; i++) {
+        real dx = balls->pos_x[i] - verletLists.built_x[i];
+        real dy = balls->pos_y[i] - verletLists.built_y[i];
+        if (dx * dx + dy * dy > limit) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Rebuilds the neighbour lists from the current positions.
+*/
+void rebuildVerletLists(BallStore *balls) {
+    int n = balls->count;
+    growVerletBalls(n);
+
+    int largest = 1;
+    for (int i = 0; i < n; i++) {
+        if (balls->radius[i] > largest) {
+            largest = balls->radius[i];
+        }
+    }
+
+    // a listed pair is less than the widest pair plus the skin apart, so
+    // its centers are at most one cell apart
+    real cell = 2 * largest + verlet_skin;
+    int columns = (int) (world_width / cell) + 1;
+    int rows = (int) (world_height / cell) + 1;
+    int cells = columns * rows;
+    if (cells + 1 > verletLists.cellCapacity) {
+        verletLists.cellStart = growVerletArray(verletLists.cellStart, sizeof(int) * (cells + 1));
+        verletLists.cellCapacity = cells + 1;
+    }
+
+    // counting sort of the balls by the cell of their centers
+    int *cellStart = verletLists.cellStart;
+    memset(cellStart, 0, sizeof(int) * (cells + 1));
+    for (int i = 0; i < n; i++) {
+        int col = (int) (balls->pos_x[i] / cell);
+        int row = (int) (balls->pos_y[i] / cell);
+        col = col < 0 ? 0 : (col >= columns ? columns - 1 : col);
+        row = row < 0 ? 0 : (row >= rows ? rows - 1 : row);
+        verletLists.ballCell[i] = col + row * columns;
+        cellStart[verletLists.ballCell[i] + 1]++;
+    }
+    for (int c = 0; c < cells; c++) {
+        cellStart[c + 1] += cellStart[c];
+    }
+    for (int i = 0; i < n; i++) {
+        verletLists.cellBalls[cellStart[verletLists.ballCell[i]]++] = i;
+    }
+    // the scatter left every cell starting where the next one does
+    memmove(cellStart + 1, cellStart, sizeof(int) * cells);
+    cellStart[0] = 0;
+
+    int listed = 0;
+    for (int i = 0; i < n; i++) {
+        verletLists.start[i] = listed;
+        verletLists.built_x[i] = balls->pos_x[i];
+        verletLists.built_y[i] = balls->pos_y[i];
+
+        int col = verletLists.ballCell[i] % columns;
+        int row = verletLists.ballCell[i] / columns;
+        for (int other_row = row - 1; other_row <= row + 1; other_row++) {
+            for (int other_col = col - 1; other_col <= col + 1; other_col++) {
+                if (other_col < 0 || other_col >= columns || other_row < 0 || other_row >= rows) {
+                    continue;
+                }
+
+                int other_cell = other_col + other_row * columns;
+                for (int k = cellStart[other_cell]; k < cellStart[other_cell + 1]; k++) {
+                    int j = verletLists.cellBalls[k];
+                    if (j <= i) {
+                        continue;
+                    }
+
+                    real dx = balls->pos_x[j] - balls->pos_x[i];
+                    real dy = balls->pos_y[j] - balls->pos_y[i];
+                    real reach = balls->radius[i] + balls->radius[j] + verlet_skin;
+                    if (dx * dx + dy * dy < reach * reach) {
+                        if (listed == verletLists.neighbourCapacity) {
+                            verletLists.neighbourCapacity *= 2;
+                            verletLists.neighbours = growVerletArray(verletLists.neighbours,
+                                                                     sizeof(int) * verletLists.neighbourCapacity);
+                        }
+                        verletLists.neighbours[listed++] = j;
+                    }
+                }
+            }
+        }
+    }
+    verletLists.start[n] = listed;
+
+    verletLists.count = n;
+    verletLists.valid = true;
+    verletLists.rebuilds++;
+}
+
+/*
+    Resolves the collisions of every ball with the balls of its list.
+*/
+void collideVerletLists(BallStore *balls) {
+    bool uniform = engine == ENGINE_REAL && cellShape.radius > 0;
+
+    for (int i = 0; i < balls->count; i++) {
+        const int *list = &verletLists.neighbours[verletLists.start[i]];
+        int length = verletLists.start[i + 1] - verletLists.start[i];
+
+        for (int first = 0; first < length; first += OVERLAP_BATCH) {
+            int count = length - first < OVERLAP_BATCH ? length - first : OVERLAP_BATCH;
+            Uint32 hits = uniform ? overlapMaskUniform(balls, i, &list[first], count)
+                                  : overlapMask(balls, i, &list[first], count);
+            while (hits != 0) {
+                int k = first + SDL_MostSignificantBitIndex32(hits & -hits);
+                hits &= hits - 1;
+                bounce(balls, i, list[k]);
+            }
+        }
+    }
+}
+
+/*
+    One physics step on the neighbour lists, rebuilding them first when
+    they went stale.
+*/
+void stepBallsVerlet(BallStore *balls) {
+    PROFILE_BEGIN(PHASE_ASSIGN);
+    if (verletListsStale(balls)) {
+        rebuildVerletLists(balls);
+    }
+    PROFILE_END(PHASE_ASSIGN);
+
+    PROFILE_BEGIN(PHASE_COLLIDE);
+    collideVerletLists(balls);
+    PROFILE_END(PHASE_COLLIDE);
+
+    moveBalls(balls);
+}
+
+/*
+    With --sleep a ball that stays slower than the given speed, in pixels
+    per step, for SLEEP_FRAMES frames in a row falls asleep: it stops, and
+    is left out of the grid, the collision pass and the integration until
+    a fast ball touches it, so a scene that has mostly come to rest
+    costs about as much as the balls still moving. The awake balls are
+    kept at the front of the store, the sleepers behind them, and the step
+    runs on the front alone as if the store held no more balls.
+    Before each step every awake ball faster than the speed looks for the
+    sleepers it touches on a grid of the sleepers alone, binned by their
+    centers and only rebuilt once some ball fell asleep or woke. A woken
+    ball is knocked away in the step and wakes whatever it touches in
+    turn, so the wake spreads through a pile as far as the hit carries.
+    An awake ball slower than that leaves the sleepers asleep and treats
+    them as walls instead: after the step it is pushed back out of any it
+    moved into and bounced off them, so it comes to rest on a pile rather
+    than sinking into it. A ball wedged with no room between two sleepers
+    wakes them and settles among them.
+*/
+real sleep_speed = 0;
+
+#define SLEEP_FRAMES 30
+// How far apart two balls may be and still wake one another, in pixels.
+#define SLEEP_MARGIN 1
+
+typedef struct SleepState {
+    Uint16* still;
+    bool*   woken;
+    int*    waking;
+    int*    cellStart;
+    int*    cellBalls;
+    int     columns;
+    int     rows;
+    real    cell;
+    int     awake;
+    int     rested;
+    bool    valid;
+    long    slept;
+    long    woke;
+} SleepState;
+
+SleepState sleepState;
+
+/*
+    Allocates the sleep state for amnt balls, all of them awake.
+    Returns 0 on success and 1 if an allocation failed.
+*/
+int initSleepState(int amnt) {
+    int capacity = amnt > 0 ? amnt : 1;
+    sleepState = (SleepState) {
+        .still = calloc(capacity, sizeof(Uint16)),
+        .woken = calloc(capacity, sizeof(bool)),
+        .waking = malloc(sizeof(int) * capacity),
+        .cellBalls = malloc(sizeof(int) * capacity),
+        .awake = amnt
+    };
+
+    if (sleepState.still == NULL || sleepState.woken == NULL || sleepState.waking == NULL ||
+        sleepState.cellBalls == NULL) {
+        return 1;
+    }
+    return 0;
+}
+
+void freeSleepState() {
+    free(sleepState.still);
+    free(sleepState.woken);
+    free(sleepState.waking);
+    free(sleepState.cellStart);
+    free(sleepState.cellBalls);
+    sleepState = (SleepState) { 0 };
+}
+
+/*
+    Swaps two balls of the store, along with how long each has been slow.
+*/
+void swapBalls(BallStore *balls, int a, int b) {
+    if (a == b) {
+        return;
+    }
+
+#define SWAP_ENTRY(type, array) { type t = (array)[a]; (array)[a] = (array)[b]; (array)[b] = t; }
+    SWAP_ENTRY(real, balls->pos_x);
+    SWAP_ENTRY(real, balls->pos_y);
+    SWAP_ENTRY(real, balls->dir_x);
+    SWAP_ENTRY(real, balls->dir_y);
+    SWAP_ENTRY(int, balls->radius);
+    SWAP_ENTRY(real, balls->mass);
+    SWAP_ENTRY(real, balls->inv_mass);
+    SWAP_ENTRY(Uint16, sleepState.still);
+#undef SWAP_ENTRY
+
+    int subspaces[4];
+    memcpy(subspaces, balls->subspaces[a], sizeof(subspaces));
+    memcpy(balls->subspaces[a], balls->subspaces[b], sizeof(subspaces));
+    memcpy(balls->subspaces[b], subspaces, sizeof(subspaces));
+}
+
+/*
+    Returns the cell of the sleeper grid the given point is in.
+*/
+static inline int sleeperCell(real x, real y) {
+    int col = (int) (x / sleepState.cell);
+    int row = (int) (y / sleepState.cell);
+    col = col < 0 ? 0 : (col >= sleepState.columns ? sleepState.columns - 1 : col);
+    row = row < 0 ? 0 : (row >= sleepState.rows ? sleepState.rows - 1 : row);
+    return col + row * sleepState.columns;
+}
+
+/*
+    Rebuilds the grid of the sleepers from where they lie.
+*/
+void rebuildSleepers(BallStore *balls) {
+    int n = balls->count;
+    if (sleepState.cell == 0) {
+        int largest = 1;
+        for (int i = 0; i < n; i++) {
+            if (balls->radius[i] > largest) {
+                largest = balls->radius[i];
+            }
+        }
+
+        // a touching pair is less than a cell apart
+        sleepState.cell = 2 * largest + SLEEP_MARGIN;
+        sleepState.columns = (int) (world_width / sleepState.cell) + 1;
+        sleepState.rows = (int) (world_height / sleepState.cell) + 1;
+        int cells = sleepState.columns * sleepState.rows;
+        sleepState.cellStart = malloc(sizeof(int) * (cells + 1));
+        if (sleepState.cellStart == NULL) {
+            fprintf(stderr, "Could not allocate the grid of the sleeping balls!\n");
+            exit(1);
+        }
+    }
+
+    // counting sort of the sleepers by the cell of their centers
+    int cells = sleepState.columns * sleepState.rows;
+    int *cellStart = sleepState.cellStart;
+    memset(cellStart, 0, sizeof(int) * (cells + 1));
+    for (int i = sleepState.awake; i < n; i++) {
+        cellStart[sleeperCell(balls->pos_x[i], balls->pos_y[i]) + 1]++;
+    }
+    for (int c = 0; c < cells; c++) {
+        cellStart[c + 1] += cellStart[c];
+    }
+    for (int i = sleepState.awake; i < n; i++) {
+        sleepState.cellBalls[cellStart[sleeperCell(balls->pos_x[i], balls->pos_y[i])]++] = i;
+    }
+    // the scatter left every cell starting where the next one does
+    memmove(cellStart + 1, cellStart, sizeof(int) * cells);
+    cellStart[0] = 0;
+    sleepState.valid = true;
+}
+
+/*
+    Called for every sleeper j in the cells around ball i.
+*/
+typedef void (*SleeperVisitor)(BallStore *balls, int i, int j, void *data);
+
+/*
+    Calls visit for every sleeper other than ball i in the cells around
+    it, which holds every sleeper it can touch.
+*/
+void visitSleepers(BallStore *balls, int i, SleeperVisitor visit, void *data) {
+    int cell = sleeperCell(balls->pos_x[i], balls->pos_y[i]);
+    int col = cell % sleepState.columns;
+    int row = cell / sleepState.columns;
+    int *cellStart = sleepState.cellStart;
+
+    for (int other_row = row - 1; other_row <= row + 1; other_row++) {
+        for (int other_col = col - 1; other_col <= col + 1; other_col++) {
+            if (other_col < 0 || other_col >= sleepState.columns || other_row < 0 || other_row >= sleepState.rows) {
+                continue;
+            }
+
+            int other_cell = other_col + other_row * sleepState.columns;
+            for (int k = cellStart[other_cell]; k < cellStart[other_cell + 1]; k++) {
+                int j = sleepState.cellBalls[k];
+                if (j != i) {
+                    visit(balls, i, j, data);
+                }
+            }
+        }
+    }
+}
+
+/*
+    Marks sleeper j to be woken if ball i touches it, adding it to the
+    waking list, whose length data points to.
+*/
+void touchSleeper(BallStore *balls, int i, int j, void *data) {
+    int *waking = data;
+    if (sleepState.woken[j]) {
+        return;
+    }
+
+    real dx = balls->pos_x[j] - balls->pos_x[i];
+    real dy = balls->pos_y[j] - balls->pos_y[i];
+    real reach = balls->radius[i] + balls->radius[j] + SLEEP_MARGIN;
+    if (dx * dx + dy * dy < reach * reach) {
+        sleepState.woken[j] = true;
+        sleepState.waking[(*waking)++] = j;
+    }
+}
+
+/*
+    Has ball i rest on sleeper j as on a wall: pushes it out of the
+    sleeper, and reflects the part of its velocity that heads into it.
+*/
+void restOnSleeper(BallStore *balls, int i, int j, void *data) {
+    (void) data;
+    real dx = balls->pos_x[i] - balls->pos_x[j];
+    real dy = balls->pos_y[i] - balls->pos_y[j];
+    real distance_squared = dx * dx + dy * dy;
+    real reach = balls->radius[i] + balls->radius[j];
+    if (distance_squared >= reach * reach || distance_squared == 0) {
+        return;
+    }
+
+    real distance = real_sqrt(distance_squared);
+    real nx = dx / distance;
+    real ny = dy / distance;
+    balls->pos_x[i] = balls->pos_x[j] + nx * reach;
+    balls->pos_y[i] = balls->pos_y[j] + ny * reach;
+
+    real closing = balls->dir_x[i] * nx + balls->dir_y[i] * ny;
+    if (closing < 0) {
+        balls->dir_x[i] -= 2 * closing * nx;
+        balls->dir_y[i] -= 2 * closing * ny;
+    }
+    // a sleeper against the wall may push it into the wall
+    bounceWall(balls, i);
+}
+
+/*
+    Marks sleeper j to be woken if ball i is still deep inside it, as it is
+    when it was wedged between two sleepers and pushed out of one into the
+    other.
+*/
+void wedgedOnSleeper(BallStore *balls, int i, int j, void *data) {
+    int *waking = data;
+    if (sleepState.woken[j]) {
+        return;
+    }
+
+    real dx = balls->pos_x[j] - balls->pos_x[i];
+    real dy = balls->pos_y[j] - balls->pos_y[i];
+    real reach = balls->radius[i] + balls->radius[j] - SLEEP_MARGIN;
+    if (dx * dx + dy * dy < reach * reach) {
+        sleepState.woken[j] = true;
+        sleepState.waking[(*waking)++] = j;
+    }
+}
+
+/*
+    Orders ball indices from the lowest.
+*/
+int compareIndices(const void *a, const void *b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+/*
+    Wakes the given number of sleepers of the waking list, moving them to
+    the end of the awake balls.
+*/
+void wakeMarked(BallStore *balls, int waking) {
+    if (waking == 0) {
+        return;
+    }
+
+    // from the lowest index up, a woken ball only ever trades places with
+    // a sleeper that is not woken, or with itself
+    qsort(sleepState.waking, waking, sizeof(int), compareIndices);
+    for (int k = 0; k < waking; k++) {
+        int j = sleepState.waking[k];
+        sleepState.woken[j] = false;
+        sleepState.still[j] = 0;
+        swapBalls(balls, j, sleepState.awake++);
+    }
+    sleepState.woke += waking;
+    sleepState.valid = false;
+}
+
+/*
+    Wakes every sleeper touched by an awake ball that is not slow, moving
+    them to the end of the awake balls.
+*/
+void wakeSleepers(BallStore *balls) {
+    if (sleepState.awake == balls->count) {
+        return;
+    }
+    if (!sleepState.valid) {
+        rebuildSleepers(balls);
+    }
+
+    // a slow ball rests on the sleepers instead, once it has moved
+    real limit = sleep_speed * sleep_speed;
+    int waking = 0;
+    for (int i = 0; i < sleepState.awake; i++) {
+        if (balls->dir_x[i] * balls->dir_x[i] + balls->dir_y[i] * balls->dir_y[i] >= limit) {
+            visitSleepers(balls, i, touchSleeper, &waking);
+        }
+    }
+    wakeMarked(balls, waking);
+}
+
+/*
+    Keeps the slow awake balls out of the sleepers they have moved into, so
+    they neither pass through a sleeper nor sink into a pile. A ball with
+    no room between the sleepers wakes them instead.
+*/
+void restOnSleepers(BallStore *balls) {
+    sleepState.rested = sleepState.awake;
+    if (sleepState.awake == balls->count) {
+        return;
+    }
+    if (!sleepState.valid) {
+        rebuildSleepers(balls);
+    }
+
+    real limit = sleep_speed * sleep_speed;
+    int waking = 0;
+    for (int i = 0; i < sleepState.awake; i++) {
+        if (balls->dir_x[i] * balls->dir_x[i] + balls->dir_y[i] * balls->dir_y[i] < limit) {
+            visitSleepers(balls, i, restOnSleeper, NULL);
+            visitSleepers(balls, i, wedgedOnSleeper, &waking);
+        }
+    }
+    // a wedged ball is left to the sleepers it is wedged between to settle
+    sleepState.rested = sleepState.awake;
+    wakeMarked(balls, waking);
+}
+
+/*
+    The slow awake balls left inside a sleeper by more than SLEEP_MARGIN,
+    which restOnSleepers should never leave. Two sleepers overlap as far
+    as they did when they fell asleep, which is up to the collisions of
+    the awake balls.
+*/
+typedef struct SleeperOverlaps {
+    int     count;
+    real    deepest;
+} SleeperOverlaps;
+
+/*
+    Counts ball i into the overlaps if it is slow and deep inside sleeper j.
+*/
+void countSleeperOverlap(BallStore *balls, int i, int j, void *data) {
+    SleeperOverlaps *overlaps = data;
+    // a fast ball wakes the sleeper it moved into the next step
+    real limit = sleep_speed * sleep_speed;
+    if (balls->dir_x[i] * balls->dir_x[i] + balls->dir_y[i] * balls->dir_y[i] >= limit) {
+        return;
+    }
+
+    real dx = balls->pos_x[j] - balls->pos_x[i];
+    real dy = balls->pos_y[j] - balls->pos_y[i];
+    real depth = balls->radius[i] + balls->radius[j] - real_sqrt(dx * dx + dy * dy);
+    if (depth > SLEEP_MARGIN) {
+        overlaps->count++;
+        overlaps->deepest = depth > overlaps->deepest ? depth : overlaps->deepest;
+    }
+}
+
+/*
+    Counts the slow awake balls inside the sleepers, for the check at the
+    end of a headless run.
+*/
+SleeperOverlaps sleeperOverlaps(BallStore *balls) {
+    SleeperOverlaps overlaps = { 0 };
+    if (sleepState.awake == balls->count) {
+        return overlaps;
+    }
+    if (!sleepState.valid) {
+        rebuildSleepers(balls);
+    }
+
+    // the balls woken at the end of the last step have yet to settle
+    for (int i = 0; i < sleepState.rested; i++) {
+        visitSleepers(balls, i, countSleeperOverlap, &overlaps);
+    }
+    return overlaps;
+}
+
+/*
+    Counts another step for every awake ball that was slow for it, and
+    puts the balls that were slow for long enough to sleep behind the
+    awake ones.
+*/
+void settleBalls(BallStore *balls) {
+    Uint16 steps = SLEEP_FRAMES * substeps < UINT16_MAX ? SLEEP_FRAMES * substeps : UINT16_MAX;
+    real limit = sleep_speed * sleep_speed;
+
+    // from the back, so the ball swapped in has already been counted
+    for (int i = sleepState.awake - 1; i >= 0; i--) {
+        real speed = balls->dir_x[i] * balls->dir_x[i] + balls->dir_y[i] * balls->dir_y[i];
+        if (speed >= limit) {
+            sleepState.still[i] = 0;
+            continue;
+        }
+
+        if (++sleepState.still[i] < steps) {
+            continue;
+        }
+        balls->dir_x[i] = 0;
+        balls->dir_y[i] = 0;
+        swapBalls(balls, i, --sleepState.awake);
+        sleepState.slept++;
+        sleepState.valid = false;
+    }
+}
+
+/*
+    Steps the awake balls on the grid, after waking the sleepers the fast
+    ones touch, and keeps the slow ones resting on the sleepers.
+*/
+void stepBallsSleeping(BallStore *balls) {
+    if (sleepState.awake > balls->count) {
+        sleepState.awake = balls->count;
+    }
+
+    PROFILE_BEGIN(PHASE_ASSIGN);
+    wakeSleepers(balls);
+    PROFILE_END(PHASE_ASSIGN);
+
+    int count = balls->count;
+    balls->count = sleepState.awake;
+    stepBallsImproved(balls);
+    balls->count = count;
+    // the grid only lists the balls that are awake
+    gridCurrent = false;
+
+    // the balls that fell asleep count as obstacles right away
+    settleBalls(balls);
+    restOnSleepers(balls);
+}
+
+/*
+    Allocates the sweep order, starting out with the balls in index order.
+*/
+int initSweepOrder(int amnt) {
+    sweepOrder = malloc(sizeof(int) * (amnt + 1));
+    if (sweepOrder == NULL) {
+        return 1;
+    }
+
+    for (int i = 0; i < amnt; i++) {
+        sweepOrder[i] = i;
+    }
+    sweep_sorted = false;
+    return 0;
+}
+
+BallStore *sweep_store;
+
+/*
+    Orders two sweep entries by the left edge of their balls, for qsort.
+*/
+int compareSweepOrder(const void *a, const void *b) {
+    int ball_a = *(const int*) a;
+    int ball_b = *(const int*) b;
+    real left_a = sweep_store->pos_x[ball_a] - ballExtent(sweep_store, ball_a);
+    real left_b = sweep_store->pos_x[ball_b] - ballExtent(sweep_store, ball_b);
+    return (left_a > left_b) - (left_a < left_b);
+}
+
+/*
+    Restores the sort of sweepOrder by left edge. The first sort starts
+    from index order, which is no better than random, so it goes through
+    qsort. After that balls only move a little between frames, the order
+    from the previous frame is almost sorted already and an insertion sort
+    runs in close to linear time.
+*/
+void sortSweepOrder(BallStore *balls) {
+    if (!sweep_sorted) {
+        sweep_store = balls;
+        qsort(sweepOrder, balls->count, sizeof(int), compareSweepOrder);
+        sweep_sorted = true;
+        return;
+    }
+
+    for (int i = 1; i < balls->count; i++) {
+        int index = sweepOrder[i];
+        real left = balls->pos_x[index] - ballExtent(balls, index);
+
+        int j = i - 1;
+        while (j >= 0 && balls->pos_x[sweepOrder[j]] - ballExtent(balls, sweepOrder[j]) > left) {
+            sweepOrder[j + 1] = sweepOrder[j];
+            j--;
+        }
+        sweepOrder[j + 1] = index;
+    }
+}
+
+/*
+    Sweep and prune collision pass along the x axis.
+    With the balls sorted by their left edge, a ball can only collide with
+    the balls after it whose left edge starts before its own right edge.
+*/
+void sweepBalls(BallStore *balls) {
+    sortSweepOrder(balls);
+
+    for (int i = 0; i < balls->count; i++) {
+        int ball1 = sweepOrder[i];
+        real right = balls->pos_x[ball1] + ballExtent(balls, ball1);
+
+        for (int j = i + 1; j < balls->count; j++) {
+            int ball2 = sweepOrder[j];
+
+            // every ball from here on starts past this ball's right edge
+            if (balls->pos_x[ball2] - ballExtent(balls, ball2) > right) {
+                break;
+            }
+
+            if (overlaps(balls, ball1, ball2)) {
+                bounce(balls, ball1, ball2);
+            }
+        }
+    }
+}
+
+/*
+    One physics step using the sweep and prune broad phase.
+*/
+void stepBallsSweep(BallStore *balls) {
+    PROFILE_BEGIN(PHASE_COLLIDE);
+    collideWith(balls, sweepBalls);
+    PROFILE_END(PHASE_COLLIDE);
+
+    moveBalls(balls);
+}
+
+/*
+    Allocates the quadtree, starting out with room for a node per ball.
+    The node pool grows on demand and is kept between frames.
+*/
+int initQuadtree(int amnt) {
+    quadtree.nodeCapacity = amnt + 1;
+    quadtree.nodeCount = 0;
+    quadtree.nodes = malloc(sizeof(QuadNode) * quadtree.nodeCapacity);
+    quadtree.quadOrder = malloc(sizeof(int) * (amnt + 1));
+
+    for (int i = 0; i < amnt; i++) {
+        quadtree.quadOrder[i] = i;
+    }
+
+    return quadtree.nodes == NULL || quadtree.quadOrder == NULL;
+}
+
+/*
+    Frees the nodes and the ball order of the quadtree.
+*/
+void freeQuadtree() {
+    free(quadtree.nodes);
+    free(quadtree.quadOrder);
+}
+
+/*
+    Takes four consecutive nodes from the pool and returns the first one.
+*/
+int allocQuadNodes() {
+    if (quadtree.nodeCount + 4 > quadtree.nodeCapacity) {
+        quadtree.nodeCapacity *= 2;
+        quadtree.nodes = realloc(quadtree.nodes, sizeof(QuadNode) * quadtree.nodeCapacity);
+        if (quadtree.nodes == NULL) {
+            fprintf(stderr, "Could not grow the quadtree!\n");
+            exit(1);
+        }
+    }
+
+    int first = quadtree.nodeCount;
+    quadtree.nodeCount += 4;
+    return first;
+}
+
+/*
+    Moves the balls in order[0..count-1] whose center passes the test to the
+    front and returns how many there are.
+    When vertical is true the test is being above y = split, otherwise it
+    is being left of x = split.
+*/
+int partitionBalls(BallStore *balls, int *order, int count, bool vertical, real split) {
+    real *centers = vertical ? balls->pos_y : balls->pos_x;
+
+    int front = 0;
+    for (int i = 0; i < count; i++) {
+        real center = centers[order[i]];
+        if (center < split) {
+            int t = order[front];
+            order[front] = order[i];
+            order[i] = t;
+            front++;
+        }
+    }
+    return front;
+}
+
+/*
+    Fills in the node for the given slice of quadOrder, splitting the region
+    into four quadrants by ball center for as long as the node holds too
+    many balls. The node bounds are refit to the balls of the node.
+*/
+void buildQuadNode(int node, BallStore *balls, int first, int count,
+                   real x0, real y0, real x1, real y1, int depth) {
+    int *order = &quadtree.quadOrder[first];
+
+    real left = INFINITY, up = INFINITY, right = -INFINITY, down = -INFINITY;
+    for (int i = 0; i < count; i++) {
+        int ball = order[i];
+        left = real_fmin(left, balls->pos_x[ball] - ballExtent(balls, ball));
+        up = real_fmin(up, balls->pos_y[ball] - ballExtent(balls, ball));
+        right = real_fmax(right, balls->pos_x[ball] + ballExtent(balls, ball));
+        down = real_fmax(down, balls->pos_y[ball] + ballExtent(balls, ball));
+    }
+
+    quadtree.nodes[node] = (QuadNode) {
+        .left = left, .up = up, .right = right, .down = down,
+        .first = first, .count = count, .child = -1
+    };
+
+    if (count <= QUADTREE_LEAF_SIZE || depth >= QUADTREE_MAX_DEPTH) {
+        return;
+    }
+
+    real mx = (x0 + x1) / 2;
+    real my = (y0 + y1) / 2;
+
+    // split into the top and bottom halves, then each half into left and right
+    int top = partitionBalls(balls, order, count, true, my);
+    int top_left = partitionBalls(balls, order, top, false, mx);
+    int bottom_left = partitionBalls(balls, order + top, count - top, false, mx);
+
+    int child = allocQuadNodes();
+    quadtree.nodes[node].child = child;
+
+    buildQuadNode(child, balls, first, top_left, x0, y0, mx, my, depth + 1);
+    buildQuadNode(child + 1, balls, first + top_left, top - top_left, mx, y0, x1, my, depth + 1);
+    buildQuadNode(child + 2, balls, first + top, bottom_left, x0, my, mx, y1, depth + 1);
+    buildQuadNode(child + 3, balls, first + top + bottom_left, count - top - bottom_left, mx, my, x1, y1, depth + 1);
+}
+
+/*
+    Rebuilds the quadtree over the whole screen from the current positions.
+*/
+void buildQuadtree(BallStore *balls) {
+    quadtree.nodeCount = 1;
+    buildQuadNode(0, balls, 0, balls->count, 0, 0, world_width, world_height, 0);
+}
+
+/*
+    Quadtree collision pass. Every ball walks down the nodes its bounding box
+    touches and tests the balls in the leaves it reaches. Each pair is only
+    resolved by the ball with the lower index.
+*/
+void collideQuadtree(BallStore *balls) {
+    // every visited inner node pushes four children, and the walk goes
+    // depth first, so the stack never holds more than this
+    int stack[3 * QUADTREE_MAX_DEPTH + 4];
+
+    buildQuadtree(balls);
+
+    for (int i = 0; i < balls->count; i++) {
+        real left = balls->pos_x[i] - ballExtent(balls, i);
+        real up = balls->pos_y[i] - ballExtent(balls, i);
+        real right = balls->pos_x[i] + ballExtent(balls, i);
+        real down = balls->pos_y[i] + ballExtent(balls, i);
+
+        int top = 0;
+        stack[top++] = 0;
+
+        while (top > 0) {
+            QuadNode *node = &quadtree.nodes[stack[--top]];
+
+            if (node->count == 0 || node->left > right || node->right < left ||
+                node->up > down || node->down < up) {
+                continue;
+            }
+
+            if (node->child >= 0) {
+                for (int c = 0; c < 4; c++) {
+                    stack[top++] = node->child + c;
+                }
+                continue;
+            }
+
+            for (int k = 0; k < node->count; k++) {
+                int j = quadtree.quadOrder[node->first + k];
+                if (j > i && overlaps(balls, i, j)) {
+                    bounce(balls, i, j);
+                }
+            }
+        }
+    }
+}
+
+/*
+    One physics step using the quadtree broad phase.
+*/
+void stepBallsQuadtree(BallStore *balls) {
+    PROFILE_BEGIN(PHASE_COLLIDE);
+    collideWith(balls, collideQuadtree);
+    PROFILE_END(PHASE_COLLIDE);
+
+    moveBalls(balls);
+}
+
+/*
+    The spatial hash broad phase lists the balls by subspace like the grid,
+    but only keeps the subspaces that hold any balls: each step, they are
+    numbered in the order they are first met, and an open addressing table
+    maps a subspace index to its number. The slices, the counts and the
+    collision pass all run over the occupied subspaces only, so a large,
+    mostly empty world costs no more than a small, full one.
+    A slot of the table is in use only if it carries the current
+    generation, so clearing the table is a single increment of it.
+*/
+typedef struct HashSlot {
+    int     subspace;
+    int     cell;
+    Uint32  generation;
+} HashSlot;
+
+typedef struct SpatialHash {
+    HashSlot    *slots;
+    int         capacity;
+    Uint32      generation;
+    int         cellCount;
+    int         *cellSubspace;
+    int         *cellStart;
+    int         *cellCursor;
+    int         *cellBalls;
+    int         (*ballCells)[BALL_CORNER_COUNT];
+} SpatialHash;
+
+SpatialHash spatialHash;
+
+/*
+    Allocates the spatial hash. A ball covers at most BALL_CORNER_COUNT
+    subspaces, which bounds the occupied subspaces and the slice entries;
+    the table starts out at twice the ball count and doubles whenever it
+    gets half full, and is kept between steps.
+    Returns 0 on success and 1 if any allocation failed.
+*/
+int initSpatialHash(int amnt) {
+    int corners = amnt * BALL_CORNER_COUNT;
+    spatialHash.capacity = 16;
+    while (spatialHash.capacity < amnt * 2) {
+        spatialHash.capacity *= 2;
+    }
+    spatialHash.generation = 0;
+    spatialHash.cellCount = 0;
+
+    spatialHash.slots = calloc(spatialHash.capacity, sizeof(HashSlot));
+    spatialHash.cellSubspace = malloc(sizeof(int) * (corners + 1));
+    spatialHash.cellStart = malloc(sizeof(int) * (corners + 1));
+    spatialHash.cellCursor = malloc(sizeof(int) * (corners + 1));
+    spatialHash.cellBalls = malloc(sizeof(int) * (corners + 1));
+    spatialHash.ballCells = malloc(sizeof(*spatialHash.ballCells) * (amnt + 1));
+
+    return spatialHash.slots == NULL || spatialHash.cellSubspace == NULL || spatialHash.cellStart == NULL ||
+        spatialHash.cellCursor == NULL || spatialHash.cellBalls == NULL || spatialHash.ballCells == NULL;
+}
+
+/*
+    Frees every array of the spatial hash.
+*/
+void freeSpatialHash() {
+    free(spatialHash.slots);
+    free(spatialHash.cellSubspace);
+    free(spatialHash.cellStart);
+    free(spatialHash.cellCursor);
+    free(spatialHash.cellBalls);
+    free(spatialHash.ballCells);
+}
+
+/*
+    Returns the home slot of a subspace. Neighbouring subspaces have
+    neighbouring indices, which the multiplication spreads over the table.
+*/
+Uint32 hashSubspace(int subspace) {
+    Uint32 hash = (Uint32) subspace * 0x9E3779B1u;
+    return hash ^ (hash >> 15);
+}
+
+/*
+    Puts the subspace of the given cell into the first free slot, probing
+    linearly from its home slot.
+*/
+void insertHashSlot(int subspace, int cell) {
+    Uint32 mask = spatialHash.capacity - 1;
+    Uint32 slot = hashSubspace(subspace) & mask;
+    while (spatialHash.slots[slot].generation == spatialHash.generation) {
+        slot = (slot + 1) & mask;
+    }
+    spatialHash.slots[slot] = (HashSlot) { .subspace = subspace, .cell = cell, .generation = spatialHash.generation };
+}
+
+/*
+    Doubles the table and inserts the occupied subspaces again. The cells
+    keep their numbers, so nothing that refers to them changes.
+*/
+void growSpatialHash() {
+    free(spatialHash.slots);
+    spatialHash.capacity *= 2;
+    spatialHash.slots = calloc(spatialHash.capacity, sizeof(HashSlot));
+    if (spatialHash.slots == NULL) {
+        fprintf(stderr, "Could not grow the spatial hash!\n");
+        exit(1);
+    }
+
+    for (int cell = 0; cell < spatialHash.cellCount; cell++) {
+        insertHashSlot(spatialHash.cellSubspace[cell], cell);
+    }
+}
+
+/*
+    Returns the number of the cell of the given subspace, occupying a new
+    cell the first time the subspace is met in this step.
+*/
+int findHashCell(int subspace) {
+    Uint32 mask = spatialHash.capacity - 1;
+    Uint32 slot = hashSubspace(subspace) & mask;
+    while (spatialHash.slots[slot].generation == spatialHash.generation) {
+        if (spatialHash.slots[slot].subspace == subspace) {
+            return spatialHash.slots[slot].cell;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    int cell = spatialHash.cellCount++;
+    spatialHash.slots[slot] = (HashSlot) { .subspace = subspace, .cell = cell, .generation = spatialHash.generation };
+    spatialHash.cellSubspace[cell] = subspace;
+    spatialHash.cellStart[cell + 1] = 0;
+
+    if (spatialHash.cellCount * 2 > spatialHash.capacity) {
+        growSpatialHash();
+    }
+    return cell;
+}
+
+/*
+    Lists every ball in the cells of the subspaces it covers, the same
+    counting, prefix sum and scatter passes as assignSubspaces but over the
+    occupied cells only.
+*/
+void assignSpatialHash(BallStore *balls) {
+    // a new generation empties every slot; only once it wraps around do
+    // the slots need clearing for real
+    spatialHash.generation++;
+    if (spatialHash.generation == 0) {
+        memset(spatialHash.slots, 0, sizeof(HashSlot) * spatialHash.capacity);
+        spatialHash.generation = 1;
+    }
+    spatialHash.cellCount = 0;
+    spatialHash.cellStart[0] = 0;
+
+    parallelFor(balls->count, BALL_TASK_GRAIN, calculateSubspacesTask, balls);
+
+    int *start = spatialHash.cellStart;
+    int *cursor = spatialHash.cellCursor;
+
+    // Counting pass, which also numbers the cells. A repeated corner gets
+    // no cell, so every ball is listed once per subspace.
+    for (int i = 0; i < balls->count; i++) {
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            if (isRepeatedCorner(balls, i, j)) {
+                spatialHash.ballCells[i][j] = -1;
+                continue;
+            }
+
+            int cell = findHashCell(balls->subspaces[i][j]);
+            spatialHash.ballCells[i][j] = cell;
+            start[cell + 1]++;
+        }
+    }
+
+    for (int cell = 0; cell < spatialHash.cellCount; cell++) {
+        start[cell + 1] += start[cell];
+        cursor[cell] = start[cell];
+    }
+
+    for (int i = 0; i < balls->count; i++) {
+        for (int j = 0; j < BALL_CORNER_COUNT; j++) {
+            int cell = spatialHash.ballCells[i][j];
+            if (cell >= 0) {
+                spatialHash.cellBalls[cursor[cell]++] = i;
+            }
+        }
+    }
+}
+
+/*
+    Resolves the collisions in every occupied cell. The cells are numbered
+    in ball order, so the result is the same for any number of threads.
+*/
+void collideSpatialHash(BallStore *balls) {
+    CollisionCounts counts = { 0 };
+    for (int cell = 0; cell < spatialHash.cellCount; cell++) {
+        int first = spatialHash.cellStart[cell];
+        collideCell(spatialHash.cellSubspace[cell], &spatialHash.cellBalls[first],
+            spatialHash.cellStart[cell + 1] - first, balls, &counts, NULL);
+    }
+    addCollisionCounts(&counts);
+}
+
+/*
+    One physics step using the spatial hash broad phase.
+*/
+void stepBallsHash(BallStore *balls) {
+    PROFILE_BEGIN(PHASE_ASSIGN);
+    assignSpatialHash(balls);
+    PROFILE_END(PHASE_ASSIGN);
+
+    PROFILE_BEGIN(PHASE_COLLIDE);
+    collideWith(balls, collideSpatialHash);
+    PROFILE_END(PHASE_COLLIDE);
+
+    moveBalls(balls);
+}
+
+/*
+    The hierarchical grid broad phase is for balls of very different sizes.
+    It stacks one grid per power of two: the cells of level 0 are as wide
+    as the smallest ball across, and every level up has cells twice as
+    wide. A ball is listed once, by its center, in the lowest level whose
+    cells are at least as wide as it is across, so a small ball never sits
+    in a large cell and a large ball never spans dozens of small ones.
+    A ball is tested against the balls of its own level and of every level
+    above it, in the 3 x 3 cells or so its reach covers there; a pair of
+    balls is found from the smaller one only, or from the one listed first
+    of two on the same level, so every pair is tested once.
+    The cells of all levels are one CSR grid numbered level after level,
+    and like the subspace grid only the cells occupied last step are
+    cleared.
+*/
+#define HGRID_MAX_LEVELS 16
+
+typedef struct GridLevel {
+    int     cell_size;
+    int     columns;
+    int     rows;
+    int     first_cell;
+    int     ball_count;
+} GridLevel;
+
+typedef struct HierarchicalGrid {
+    GridLevel   levels[HGRID_MAX_LEVELS];
+    int         levelCount;
+    int         cellCount;
+    int         *cellStart;
+    int         *cellCursor;
+    int         *cellBalls;
+    int         *ballCell;
+    Uint32      *occupied;
+} HierarchicalGrid;
+
+HierarchicalGrid hierarchicalGrid;
+
+/*
+    Sets up the levels for the radii of the given balls and allocates the
+    grid for up to amnt of them.
+    Returns 0 on success and 1 if the radii need too many levels or an
+    allocation failed.
+*/
+int initHierarchicalGrid(BallStore *balls, int amnt) {
+    HierarchicalGrid *grid = &hierarchicalGrid;
+    int smallest = balls->count > 0 ? balls->radius[0] : 1;
+    int largest = smallest;
+    for (int i = 1; i < balls->count; i++) {
+        smallest = SDL_min(smallest, balls->radius[i]);
+        largest = SDL_max(largest, balls->radius[i]);
+    }
+
+    grid->levelCount = 0;
+    grid->cellCount = 0;
+    for (int size = SDL_max(smallest * 2, 1); ; size *= 2) {
+        if (grid->levelCount == HGRID_MAX_LEVELS) {
+            return 1;
+        }
+
+        GridLevel *level = &grid->levels[grid->levelCount++];
+        level->cell_size = size;
+        level->columns = (world_width + size - 1) / size;
+        level->rows = (world_height + size - 1) / size;
+        level->first_cell = grid->cellCount;
+        level->ball_count = 0;
+        grid->cellCount += level->columns * level->rows;
+
+        // the top level has a cell wide enough for the largest ball
+        if (size >= largest * 2) {
+            break;
+        }
+    }
+
+    size_t n = amnt > 0 ? amnt : 1;
+    grid->cellStart = calloc(grid->cellCount, sizeof(int));
+    grid->cellCursor = calloc(grid->cellCount, sizeof(int));
+    grid->cellBalls = malloc(sizeof(int) * n);
+    grid->ballCell = malloc(sizeof(int) * n);
+    grid->occupied = calloc(OCCUPIED_WORDS(grid->cellCount), sizeof(Uint32));
+    if (grid->cellStart == NULL || grid->cellCursor == NULL || grid->cellBalls == NULL ||
+        grid->ballCell == NULL || grid->occupied == NULL) {
+        return 1;
+    }
+
+    logInfo("The hierarchical grid has %d levels, with cells from %d to %d pixels wide\n",
+        grid->levelCount, grid->levels[0].cell_size, grid->levels[grid->levelCount - 1].cell_size);
+    return 0;
+}
+
+void freeHierarchicalGrid() {
+    free(hierarchicalGrid.cellStart);
+    free(hierarchicalGrid.cellCursor);
+    free(hierarchicalGrid.cellBalls);
+    free(hierarchicalGrid.ballCell);
+    free(hierarchicalGrid.occupied);
+}
+
+/*
+    Returns the lowest level whose cells are at least as wide as a ball of
+    the given radius is across.
+*/
+int gridLevel(int radius) {
+    int level = 0;
+    while (level < hierarchicalGrid.levelCount - 1 && hierarchicalGrid.levels[level].cell_size < radius * 2) {
+        level++;
+    }
+    return level;
+}
+
+/*
+    Returns the column or row of the cells of the given size holding the
+    coordinate, clamped to the count of them there are.
+*/
+int levelSlot(real coordinate, int cell_size, int count) {
+    int slot = (int) (coordinate / cell_size);
+    return slot < 0 ? 0 : (slot >= count ? count - 1 : slot);
+}
+
+/*
+    Returns the cell of the given level holding the point x, y.
+*/
+int levelCell(GridLevel *level, real x, real y) {
+    int column = levelSlot(x, level->cell_size, level->columns);
+    int row = levelSlot(y, level->cell_size, level->rows);
+    return level->first_cell + column + row * level->columns;
+}
+
+/*
+    Lists every ball in the cell of its center on its level, with the same
+    counting sort as assignSubspaces.
+*/
+void assignHierarchicalGrid(BallStore *balls) {
+    HierarchicalGrid *grid = &hierarchicalGrid;
+    int *start = grid->cellStart;
+    int *cursor = grid->cellCursor;
+
+    for (int word = 0; word < OCCUPIED_WORDS(grid->cellCount); word++) {
+        Uint32 bits = grid->occupied[word];
+        while (bits != 0) {
+            int cell = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+            bits &= bits - 1;
+            start[cell] = 0;
+            cursor[cell] = 0;
+        }
+        grid->occupied[word] = 0;
+    }
+    for (int l = 0; l < grid->levelCount; l++) {
+        grid->levels[l].ball_count = 0;
+    }
+
+    for (int i = 0; i < balls->count; i++) {
+        GridLevel *level = &grid->levels[gridLevel(balls->radius[i])];
+        int cell = levelCell(level, balls->pos_x[i], balls->pos_y[i]);
+        grid->ballCell[i] = cell;
+        level->ball_count++;
+        cursor[cell]++;
+        grid->occupied[cell / 32] |= 1u << (cell % 32);
+    }
+
+    int offset = 0;
+    for (int word = 0; word < OCCUPIED_WORDS(grid->cellCount); word++) {
+        Uint32 bits = grid->occupied[word];
+        while (bits != 0) {
+            int cell = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+            bits &= bits - 1;
+            start[cell] = offset;
+            offset += cursor[cell];
+            cursor[cell] = start[cell];
+        }
+    }
+
+    for (int i = 0; i < balls->count; i++) {
+        grid->cellBalls[cursor[grid->ballCell[i]]++] = i;
+    }
+}
+
+/*
+    Tests a ball against a batch of candidates and bounces it off every
+    one it overlaps.
+*/
+void collideCandidates(BallStore *balls, int ball, const int *candidates, int count, CollisionCounts *counts) {
+    counts->tested += count;
+    Uint32 hits = overlapMask(balls, ball, candidates, count);
+    while (hits != 0) {
+        int k = SDL_MostSignificantBitIndex32(hits & -hits);
+        hits &= hits - 1;
+        counts->overlaps++;
+        counts->bounces++;
+        bounce(balls, ball, candidates[k]);
+    }
+}
+
+/*
+    Collides every ball with the balls of its level listed after it and
+    with all the balls of the levels above. A ball of a level touches
+    another from at most the radius plus half a cell away, so the cells to
+    test are those that reach covers. The balls are taken in the order of
+    the grid, cell by cell, so neighbouring balls and cells are tested
+    while they are still in the cache, and the candidates of all levels
+    share one batch.
+*/
+void collideHierarchicalGrid(BallStore *balls) {
+    HierarchicalGrid *grid = &hierarchicalGrid;
+    CollisionCounts counts = { 0 };
+    int candidates[OVERLAP_BATCH];
+
+    for (int slot = 0; slot < balls->count; slot++) {
+        int i = grid->cellBalls[slot];
+        int own = gridLevel(balls->radius[i]);
+        real x = balls->pos_x[i];
+        real y = balls->pos_y[i];
+        int count = 0;
+
+        for (int l = own; l < grid->levelCount; l++) {
+            GridLevel *level = &grid->levels[l];
+            if (level->ball_count == 0) {
+                continue;
+            }
+
+            real reach = balls->radius[i] + level->cell_size / 2;
+            int column_first = levelSlot(x - reach, level->cell_size, level->columns);
+            int column_last = levelSlot(x + reach, level->cell_size, level->columns);
+            int row_first = levelSlot(y - reach, level->cell_size, level->rows);
+            int row_last = levelSlot(y + reach, level->cell_size, level->rows);
+
+            for (int row = row_first; row <= row_last; row++) {
+                for (int column = column_first; column <= column_last; column++) {
+                    int cell = level->first_cell + column + row * level->columns;
+                    int first = grid->cellStart[cell];
+                    if (l == own && first <= slot) {
+                        first = slot + 1;
+                    }
+
+                    for (int k = first; k < grid->cellCursor[cell]; k++) {
+                        candidates[count++] = grid->cellBalls[k];
+                        if (count == OVERLAP_BATCH) {
+                            collideCandidates(balls, i, candidates, count, &counts);
+                            count = 0;
+                        }
+                    }
+                }
+            }
+        }
+        if (count > 0) {
+            collideCandidates(balls, i, candidates, count, &counts);
+        }
+    }
+    addCollisionCounts(&counts);
+}
+
+void stepBallsHierarchical(BallStore *balls) {
+    PROFILE_BEGIN(PHASE_ASSIGN);
+    assignHierarchicalGrid(balls);
+    PROFILE_END(PHASE_ASSIGN);
+
+    PROFILE_BEGIN(PHASE_COLLIDE);
+    collideWith(balls, collideHierarchicalGrid);
+    PROFILE_END(PHASE_COLLIDE);
+
+    moveBalls(balls);
+}
+
+/*
+    The kinds of events of the event-driven engine: two balls colliding, a
+    ball reaching a vertical or a horizontal wall, and a ball's center
+    crossing into another subspace.
+*/
+typedef enum EventKind {
+    EVENT_BALL,
+    EVENT_WALL_X,
+    EVENT_WALL_Y,
+    EVENT_CELL
+} EventKind;
+
+/*
+    A predicted event. b is the other ball of a collision, or the subspace
+    entered by a crossing. The counts are the collision counts of the balls
+    when the event was predicted: once either ball has bounced since, the
+    prediction is stale and the event is skipped.
+*/
+typedef struct Event {
+    double      time;
+    EventKind   kind;
+    int         a;
+    int         b;
+    int         count_a;
+    int         count_b;
+} Event;
+
+/*
+    State of the event-driven engine. Instead of testing every pair on every
+    step, it keeps a binary min-heap of predicted events and jumps from one
+    event to the next, only updating the balls an event involves.
+    Every ball is only moved when it takes part in an event, so ballTime
+    holds the time its position is valid at. The balls are also kept in
+    linked lists by the subspace their center is in, so that predictions
+    only look at the balls of the neighboring subspaces.
+*/
+typedef struct EventEngine {
+    Event*      heap;
+    int         eventCount;
+    int         eventCapacity;
+    double      now;
+    double*     ballTime;
+    int*        collisions;
+    int*        cell;
+    int*        cellHead;
+    int*        next;
+    int*        prev;
+    int         columns;
+    int         rows;
+} EventEngine;
+
+EventEngine events;
+
+/*
+    Allocates the event-driven engine for the given number of balls.
+    Returns 0 on success and 1 if any allocation failed.
+*/
+int initEvents(int amnt) {
+    events.eventCapacity = amnt * 8 + 16;
+    events.eventCount = 0;
+    events.heap = malloc(sizeof(Event) * events.eventCapacity);
+    events.ballTime = malloc(sizeof(double) * (amnt + 1));
+    events.collisions = calloc(amnt + 1, sizeof(int));
+    events.cell = malloc(sizeof(int) * (amnt + 1));
+    events.cellHead = malloc(sizeof(int) * subspace_count);
+    events.next = malloc(sizeof(int) * (amnt + 1));
+    events.prev = malloc(sizeof(int) * (amnt + 1));
+
+    return events.heap == NULL || events.ballTime == NULL || events.collisions == NULL ||
+           events.cell == NULL || events.cellHead == NULL || events.next == NULL ||
+           events.prev == NULL;
+}
+
+/*
+    Frees the event-driven engine.
+*/
+void freeEvents() {
+    free(events.heap);
+    free(events.ballTime);
+    free(events.collisions);
+    free(events.cell);
+    free(events.cellHead);
+    free(events.next);
+    free(events.prev);
+}
+
+/*
+    Returns whether an event is still valid, i.e. none of its balls bounced
+    since it was predicted.
+*/
+bool eventValid(Event *event) {
+    return events.collisions[event->a] == event->count_a &&
+           (event->kind != EVENT_BALL || events.collisions[event->b] == event->count_b);
+}
+
+/*
+    Restores the heap order of the subtree rooted at i.
+*/
+void siftEventDown(int i) {
+    Event moving = events.heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= events.eventCount) {
+            break;
+        }
+        if (child + 1 < events.eventCount && events.heap[child + 1].time < events.heap[child].time) {
+            child++;
+        }
+        if (moving.time <= events.heap[child].time) {
+            break;
+        }
+        events.heap[i] = events.heap[child];
+        i = child;
+    }
+    events.heap[i] = moving;
+}
+
+/*
+    Drops every stale event from the heap and rebuilds it from the rest.
+*/
+void compactEvents() {
+    int kept = 0;
+    for (int i = 0; i < events.eventCount; i++) {
+        if (eventValid(&events.heap[i])) {
+            events.heap[kept++] = events.heap[i];
+        }
+    }
+    events.eventCount = kept;
+
+    for (int i = kept / 2 - 1; i >= 0; i--) {
+        siftEventDown(i);
+    }
+}
+
+/*
+    Adds an event to the heap. A full heap is first cleared of stale
+    events, and only grown if that does not free up at least half of it.
+*/
+void pushEvent(Event event) {
+    if (events.eventCount == events.eventCapacity) {
+        compactEvents();
+
+        if (events.eventCount * 2 > events.eventCapacity) {
+            int capacity = events.eventCapacity * 2;
+            Event *grown = realloc(events.heap, sizeof(Event) * capacity);
+            if (grown == NULL) {
+                fprintf(stderr, "Could not grow the event queue!\n");
+                exit(1);
+            }
+            events.heap = grown;
+            events.eventCapacity = capacity;
+        }
+    }
+
+    int i = events.eventCount++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (events.heap[parent].time <= event.time) {
+            break;
+        }
+        events.heap[i] = events.heap[parent];
+        i = parent;
+    }
+    events.heap[i] = event;
+}
+
+/*
+    Removes the earliest event from the heap and returns it.
+*/
+Event popEvent() {
+    Event first = events.heap[0];
+
+    events.heap[0] = events.heap[--events.eventCount];
+    if (events.eventCount > 0) {
+        siftEventDown(0);
+    }
+    return first;
+}
+
+/*
+    Moves ball i along its velocity up to the given time.
+*/
+void advanceBall(BallStore *balls, int i, double time) {
+    real elapsed = (real) (time - events.ballTime[i]);
+    balls->pos_x[i] += balls->dir_x[i] * elapsed;
+    balls->pos_y[i] += balls->dir_y[i] * elapsed;
+    events.ballTime[i] = time;
+}
+
+/*
+    Adds ball i to the list of the given subspace.
+*/
+void linkBall(int i, int cell) {
+    events.cell[i] = cell;
+    events.prev[i] = -1;
+    events.next[i] = events.cellHead[cell];
+    if (events.next[i] >= 0) {
+        events.prev[events.next[i]] = i;
+    }
+    events.cellHead[cell] = i;
+}
+
+/*
+    Removes ball i from the list of its subspace.
+*/
+void unlinkBall(int i) {
+    if (events.prev[i] >= 0) {
+        events.next[events.prev[i]] = events.next[i];
+    }
+    else {
+        events.cellHead[events.cell[i]] = events.next[i];
+    }
+    if (events.next[i] >= 0) {
+        events.prev[events.next[i]] = events.prev[i];
+    }
+}
+
+/*
+    Predicts when ball i reaches the wall it is heading to along one axis,
+    where pos and dir are that axis' position and velocity.
+    Returns a negative time if it is not moving along the axis.
+*/
+real wallTime(real pos, real dir, int radius, int size) {
+    if (dir > 0) {
+        return real_fmax((size - radius - pos) / dir, 0);
+    }
+    if (dir < 0) {
+        return real_fmax((radius - pos) / dir, 0);
+    }
+    return -1;
+}
+
+/*
+    Predicts when ball i leaves its subspace along one axis, given its cell
+    coordinate on that axis and the number of cells along it.
+    Returns a negative time if it never does, and sets step to the
+    direction it leaves in.
+*/
+real crossingTime(real pos, real dir, int coordinate, int size, int cells, int *step) {
+    if (dir > 0 && coordinate + 1 < cells) {
+        *step = 1;
+        return real_fmax(((coordinate + 1) * size - pos) / dir, 0);
+    }
+    if (dir < 0 && coordinate > 0) {
+        *step = -1;
+        return real_fmax((coordinate * size - pos) / dir, 0);
+    }
+    return -1;
+}
+
+/*
+    Predicts the next events of ball i at the current time and pushes them:
+    wall hits, the next subspace crossing, and collisions with the balls in
+    the neighboring subspaces. When the ball just crossed over from the
+    subspace skip, the balls around skip were already predicted against and
+    so are left out, as are the walls, which nothing changed about.
+*/
+void predictBall(BallStore *balls, int i, int skip) {
+    int count = events.collisions[i];
+    int column = events.cell[i] % events.columns;
+    int row = events.cell[i] / events.columns;
+
+    if (skip < 0) {
+        real tx = wallTime(balls->pos_x[i], balls->dir_x[i], balls->radius[i], world_width);
+        if (tx >= 0) {
+            pushEvent((Event) { events.now + tx, EVENT_WALL_X, i, -1, count, 0 });
+        }
+        real ty = wallTime(balls->pos_y[i], balls->dir_y[i], balls->radius[i], world_height);
+        if (ty >= 0) {
+            pushEvent((Event) { events.now + ty, EVENT_WALL_Y, i, -1, count, 0 });
+        }
+    }
+
+    int step_x = 0, step_y = 0;
+    real cx = crossingTime(balls->pos_x[i], balls->dir_x[i], column, subspace_size_x, events.columns, &step_x);
+    real cy = crossingTime(balls->pos_y[i], balls->dir_y[i], row, subspace_size_y, events.rows, &step_y);
+    if (cx >= 0 && (cy < 0 || cx <= cy)) {
+        pushEvent((Event) { events.now + cx, EVENT_CELL, i, events.cell[i] + step_x, count, 0 });
+    }
+    else if (cy >= 0) {
+        pushEvent((Event) { events.now + cy, EVENT_CELL, i, events.cell[i] + step_y * events.columns, count, 0 });
+    }
+
+    int skip_column = skip % events.columns;
+    int skip_row = skip / events.columns;
+
+    for (int y = row - 1; y <= row + 1; y++) {
+        for (int x = column - 1; x <= column + 1; x++) {
+            if (x < 0 || y < 0 || x >= events.columns || y >= events.rows) {
+                continue;
+            }
+            if (skip >= 0 && abs(x - skip_column) <= 1 && abs(y - skip_row) <= 1) {
+                continue;
+            }
+
+            for (int j = events.cellHead[y * events.columns + x]; j >= 0; j = events.next[j]) {
+                if (j == i) {
+                    continue;
+                }
+
+                advanceBall(balls, j, events.now);
+                real t;
+                if (impactTime(balls, i, j, &t)) {
+                    pushEvent((Event) { events.now + t, EVENT_BALL, i, j, count, events.collisions[j] });
+                }
+            }
+        }
+    }
+}
+
+/*
+    Clears every prediction and starts the event-driven engine over from
+    the balls as they are now, which is also needed after anything
+    renumbers the balls.
+*/
+void resetEvents(BallStore *balls) {
+    events.columns = world_width / subspace_size_x;
+    events.rows = world_height / subspace_size_y;
+    events.now = 0;
+    events.eventCount = 0;
+
+    for (int s = 0; s < subspace_count; s++) {
+        events.cellHead[s] = -1;
+    }
+    for (int i = 0; i < balls->count; i++) {
+        events.ballTime[i] = 0;
+        linkBall(i, subspaceRow(balls->pos_y[i]) * events.columns + subspaceColumn(balls->pos_x[i]));
+    }
+    for (int i = 0; i < balls->count; i++) {
+        predictBall(balls, i, -1);
+    }
+}
+
+/*
+    One physics step of the event-driven engine. Handles every event due
+    within the step in order, predicting new events for the balls each one
+    changes, and then brings every ball up to the end of the step so they
+    can be drawn.
+*/
+void stepBallsEvents(BallStore *balls) {
+    double end = events.now + step_dt;
+
+    while (events.eventCount > 0 && events.heap[0].time <= end) {
+        Event event = popEvent();
+        if (!eventValid(&event)) {
+            continue;
+        }
+
+        events.now = event.time;
+        advanceBall(balls, event.a, events.now);
+
+        switch (event.kind) {
+            case EVENT_BALL :
+                advanceBall(balls, event.b, events.now);
+                bounce(balls, event.a, event.b);
+                events.collisions[event.a]++;
+                events.collisions[event.b]++;
+                predictBall(balls, event.a, -1);
+                predictBall(balls, event.b, -1);
+                break;
+
+            case EVENT_WALL_X :
+                balls->dir_x[event.a] = -balls->dir_x[event.a];
+                events.collisions[event.a]++;
+                predictBall(balls, event.a, -1);
+                break;
+
+            case EVENT_WALL_Y :
+                balls->dir_y[event.a] = -balls->dir_y[event.a];
+                events.collisions[event.a]++;
+                predictBall(balls, event.a, -1);
+                break;
+
+            case EVENT_CELL : {
+                int from = events.cell[event.a];
+                unlinkBall(event.a);
+                linkBall(event.a, event.b);
+                predictBall(balls, event.a, from);
+                break;
+            }
+        }
+    }
+
+    events.now = end;
+    for (int i = 0; i < balls->count; i++) {
+        advanceBall(balls, i, end);
+    }
+}
+
+/*
+    Sets ccd_margin to the farthest any ball moves within one step. On the
+    grid and the spatial hash the margin is capped so a grown ball still
+    fits in one subspace, so balls faster than that can still tunnel there.
+*/
+void updateSweptMargin(BallStore *balls) {
+    real fastest = 0;
+    for (int i = 0; i < balls->count; i++) {
+        fastest = real_fmax(fastest, balls->dir_x[i] * balls->dir_x[i] + balls->dir_y[i] * balls->dir_y[i]);
+    }
+    ccd_margin = real_sqrt(fastest) * step_dt;
+
+    if (broadphase == BROADPHASE_GRID || broadphase == BROADPHASE_HASH) {
+        int size = subspace_size_x < subspace_size_y ? subspace_size_x : subspace_size_y;
+        real cap = (real) (size - min_subspace_size) / 2;
+        ccd_margin = real_fmin(ccd_margin, real_fmax(cap, 0));
+    }
+}
+
+/*
+    With --stream every step writes the positions and velocities of all
+    balls to a file or a named pipe, for analysis outside the program.
+    The stepping thread only fills one of STREAM_BUFFERS buffers, spread
+    over the workers, and a writer thread of its own writes the full ones
+    out; the stepping thread only ever waits if the writer falls a whole
+    buffer behind.
+    The stream is little endian:
+        "BBST" version flags ball_count world_width world_height
+        substeps                                         (Uint32 each)
+        radius (Uint16)                                  per ball
+        step ball_count (Uint32), then per frame
+        x[] y[] dir_x[] dir_y[] (float)                  per ball, or with
+        x[] y[] (Uint16) dir_x[] dir_y[] (Sint16)        STREAM_QUANTIZED
+    Quantized positions span the world in 65536 steps, and quantized
+    velocities are in 1/STREAM_VELOCITY_SCALE pixels per frame.
+*/
+#define STREAM_MAGIC 0x54534242
+#define STREAM_VERSION 1
+#define STREAM_QUANTIZED 1
+#define STREAM_BUFFERS 2
+#define STREAM_VELOCITY_SCALE 256
+#define STREAM_FRAME_HEADER 8
+
+typedef struct StreamBuffer {
+    Uint8   *data;
+    size_t  size;
+} StreamBuffer;
+
+/*
+    The buffers are handed back and forth in turn through two semaphores:
+    empty counts the buffers the stepping thread may fill, filled the ones
+    the writer may write. A buffer of size 0 tells the writer to stop.
+*/
+typedef struct Stream {
+    FILE            *file;
+    bool            quantized;
+    SDL_Thread      *thread;
+    StreamBuffer    buffers[STREAM_BUFFERS];
+    int             next;
+    SDL_sem         *empty;
+    SDL_sem         *filled;
+    SDL_atomic_t    failed;
+    Uint32          step;
+    Uint64          wait_ticks;
+} Stream;
+
+bool streaming = false;
+bool streamQuantized = false;
+Stream stream;
+
+size_t streamFrameSize(int count) {
+    size_t per_ball = stream.quantized ? 4 * sizeof(Uint16) : 4 * sizeof(float);
+    return STREAM_FRAME_HEADER + per_ball * count;
+}
+
+/*
+    Main loop of the writer thread, taking the buffers in the order they
+    were filled.
+*/
+int streamMain(void *data) {
+    (void) data;
+    traceThreadName("stream");
+
+    for (int index = 0; ; index = (index + 1) % STREAM_BUFFERS) {
+        SDL_SemWait(stream.filled);
+        StreamBuffer *buffer = &stream.buffers[index];
+        if (buffer->size == 0) {
+            break;
+        }
+
+        // after a failed write the frames are only thrown away
+        traceBegin("write stream");
+        if (!SDL_AtomicGet(&stream.failed) && fwrite(buffer->data, buffer->size, 1, stream.file) != 1) {
+            SDL_AtomicSet(&stream.failed, 1);
+        }
+        traceEnd("write stream");
+        SDL_SemPost(stream.empty);
+    }
+    return 0;
+}
+
+/*
+    Closes the file and frees what startStream set up so far, after it
+    failed part of the way.
+*/
+void abandonStream() {
+    fclose(stream.file);
+    for (int b = 0; b < STREAM_BUFFERS; b++) {
+        free(stream.buffers[b].data);
+        stream.buffers[b].data = NULL;
+    }
+    if (stream.empty != NULL) {
+        SDL_DestroySemaphore(stream.empty);
+        stream.empty = NULL;
+    }
+    if (stream.filled != NULL) {
+        SDL_DestroySemaphore(stream.filled);
+        stream.filled = NULL;
+    }
+}
+
+/*
+    Opens the stream, writes its header and the radii of the balls, and
+    starts the writer thread.
+    Returns 0 on success and 1 if anything could not be set up.
+*/
+int startStream(const char *path, BallStore *balls) {
+    stream.file = fopen(path, "wb");
+    if (stream.file == NULL) {
+        return 1;
+    }
+    stream.quantized = streamQuantized;
+
+    Uint32 header[7] = { STREAM_MAGIC, STREAM_VERSION, stream.quantized ? STREAM_QUANTIZED : 0,
+        balls->count, world_width, world_height, substeps };
+    for (int k = 0; k < 7; k++) {
+        header[k] = SDL_SwapLE32(header[k]);
+    }
+
+    Uint16 *radii = malloc(sizeof(Uint16) * (balls->count + 1));
+    if (radii == NULL) {
+        abandonStream();
+        return 1;
+    }
+    for (int i = 0; i < balls->count; i++) {
+        radii[i] = SDL_SwapLE16((Uint16) balls->radius[i]);
+    }
+
+    bool written = fwrite(header, sizeof(header), 1, stream.file) == 1 &&
+        fwrite(radii, sizeof(Uint16), balls->count, stream.file) == (size_t) balls->count;
+    free(radii);
+    if (!written) {
+        abandonStream();
+        return 1;
+    }
+
+    for (int b = 0; b < STREAM_BUFFERS; b++) {
+        stream.buffers[b].data = malloc(streamFrameSize(balls->count));
+        if (stream.buffers[b].data == NULL) {
+            abandonStream();
+            return 1;
+        }
+    }
+
+    stream.next = 0;
+    stream.step = 0;
+    stream.wait_ticks = 0;
+    SDL_AtomicSet(&stream.failed, 0);
+    stream.empty = SDL_CreateSemaphore(STREAM_BUFFERS);
+    stream.filled = SDL_CreateSemaphore(0);
+    if (stream.empty == NULL || stream.filled == NULL) {
+        abandonStream();
+        return 1;
+    }
+
+    stream.thread = SDL_CreateThread(streamMain, "stream", NULL);
+    if (stream.thread == NULL) {
+        abandonStream();
+        return 1;
+    }
+    streaming = true;
+    return 0;
+}
+
+/*
+    What a worker task fills in: the frame data, the balls it comes from,
+    and how the velocities and positions are scaled when quantized.
+*/
+typedef struct StreamFill {
+    BallStore   *balls;
+    Uint8       *data;
+    real        scale_x;
+    real        scale_y;
+} StreamFill;
+
+static inline float streamVelocity(real *dir, fixed *fix_dir, int i) {
+    // the fixed engine keeps the authoritative velocities
+    return engine == ENGINE_FIXED ? (float) fix_dir[i] / FIXED_ONE : (float) dir[i];
+}
+
+static inline Uint16 quantizePosition(real pos, real scale) {
+    real q = pos * scale + (real) 0.5;
+    return (Uint16) (q < 0 ? 0 : q > 65535 ? 65535 : q);
+}
+
+static inline Sint16 quantizeVelocity(float dir) {
+    float q = dir * STREAM_VELOCITY_SCALE;
+    return (Sint16) lroundf(q < -32768 ? -32768 : q > 32767 ? 32767 : q);
+}
+
+/*
+    Worker task filling the frame for a range of balls. Every array of the
+    frame is one block, so the ranges never share a byte.
+*/
+void fillStreamTask(int begin, int end, void *data) {
+    StreamFill *fill = data;
+    BallStore *balls = fill->balls;
+    int n = balls->count;
+
+    if (stream.quantized) {
+        Uint16 *x = (Uint16*) (fill->data + STREAM_FRAME_HEADER);
+        Uint16 *y = x + n;
+        Sint16 *dx = (Sint16*) (y + n);
+        Sint16 *dy = dx + n;
+        for (int i = begin; i < end; i++) {
+            x[i] = SDL_SwapLE16(quantizePosition(balls->pos_x[i], fill->scale_x));
+            y[i] = SDL_SwapLE16(quantizePosition(balls->pos_y[i], fill->scale_y));
+            dx[i] = (Sint16) SDL_SwapLE16((Uint16) quantizeVelocity(streamVelocity(balls->dir_x, balls->fix_dir_x, i)));
+            dy[i] = (Sint16) SDL_SwapLE16((Uint16) quantizeVelocity(streamVelocity(balls->dir_y, balls->fix_dir_y, i)));
+        }
+    }
+    else {
+        float *x = (float*) (fill->data + STREAM_FRAME_HEADER);
+        float *y = x + n;
+        float *dx = y + n;
+        float *dy = dx + n;
+        for (int i = begin; i < end; i++) {
+            x[i] = SDL_SwapFloatLE((float) balls->pos_x[i]);
+            y[i] = SDL_SwapFloatLE((float) balls->pos_y[i]);
+            dx[i] = SDL_SwapFloatLE(streamVelocity(balls->dir_x, balls->fix_dir_x, i));
+            dy[i] = SDL_SwapFloatLE(streamVelocity(balls->dir_y, balls->fix_dir_y, i));
+        }
+    }
+}
+
+/*
+    Hands the state after a step to the writer. Runs on the thread that
+    steps the simulation.
+*/
+void streamFrame(BallStore *balls) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    SDL_SemWait(stream.empty);
+    stream.wait_ticks += SDL_GetPerformanceCounter() - start;
+
+    StreamBuffer *buffer = &stream.buffers[stream.next];
+    Uint32 header[2] = { SDL_SwapLE32(stream.step), SDL_SwapLE32(balls->count) };
+    memcpy(buffer->data, header, sizeof(header));
+
+    StreamFill fill = {
+        .balls = balls,
+        .data = buffer->data,
+        .scale_x = (real) 65535 / world_width,
+        .scale_y = (real) 65535 / world_height
+    };
+    parallelFor(balls->count, BALL_TASK_GRAIN, fillStreamTask, &fill);
+    buffer->size = streamFrameSize(balls->count);
+
+    SDL_SemPost(stream.filled);
+    stream.next = (stream.next + 1) % STREAM_BUFFERS;
+    stream.step++;
+}
+
+/*
+    Lets the writer finish the frames still in the buffers, then closes
+    the stream and reports how long the simulation waited for it.
+*/
+void stopStream() {
+    if (!streaming) {
+        return;
+    }
+    streaming = false;
+
+    SDL_SemWait(stream.empty);
+    stream.buffers[stream.next].size = 0;
+    SDL_SemPost(stream.filled);
+    SDL_WaitThread(stream.thread, NULL);
+
+    if (fclose(stream.file) != 0 || SDL_AtomicGet(&stream.failed)) {
+        fprintf(stderr, "Could not write the whole stream, it is cut short!\n");
+    }
+    logInfo("Streamed %u frames, the simulation waited %.1f ms for the writer\n",
+        stream.step, stream.wait_ticks * 1000.0 / SDL_GetPerformanceFrequency());
+
+    for (int b = 0; b < STREAM_BUFFERS; b++) {
+        free(stream.buffers[b].data);
+    }
+    SDL_DestroySemaphore(stream.empty);
+    SDL_DestroySemaphore(stream.filled);
+}
+
+/*
+    With --capture every frame presented is recorded to a file, as
+    capture.h describes. On the opengl render driver the frames are read
+    back through the ring of pixel buffers of glrender.h, so the render
+    loop never waits for the GPU, and on any other driver they are read
+    back with SDL_RenderReadPixels, which does.
+*/
+bool capturing = false;
+bool captureAsync = false;
+const char *capture_path = NULL;
+
+/*
+    Returns 0 on success and 1 if the capture could not be started.
+*/
+int startFrameCapture(const char *path) {
+    int width;
+    int height;
+    if (SDL_GetRendererOutputSize(ren, &width, &height) != 0 || startCapture(path, width, height) != 0) {
+        stopCapture();
+        return 1;
+    }
+
+    capturing = true;
+    capture_path = path;
+    captureAsync = startGLReadback(ren, width, height) == 0;
+    logInfo("Capturing %dx%d frames to %s, read back %s\n", width, height, path,
+        captureAsync ? "through pixel buffers" : "synchronously without the opengl render driver");
+    if (strchr(path, '%') == NULL) {
+        logInfo("The capture is raw video, ffmpeg -f rawvideo -pixel_format rgb24 -video_size %dx%d -framerate %d -i %s\n",
+            width, height, pacer.target_fps, path);
+    }
+    return 0;
+}
+
+/*
+    Takes the oldest frame out of the readback ring and queues it, or
+    drops it if the queue is full and the encoder is not waited for.
+*/
+void queueGLFrame(bool wait) {
+    Uint8 *pixels = beginCaptureFrame(wait);
+    takeGLFrame(pixels);
+    if (pixels != NULL) {
+        endCaptureFrame();
+    }
+}
+
+/*
+    Captures the frame drawn so far, before it is presented.
+*/
+void captureFrame() {
+    if (captureAsync) {
+        if (pendingGLFrames() == GL_READBACK_FRAMES) {
+            queueGLFrame(false);
+        }
+        readGLFrame();
+        return;
+    }
+
+    Uint8 *pixels = beginCaptureFrame(false);
+    if (pixels == NULL) {
+        return;
+    }
+    int width;
+    int height;
+    SDL_GetRendererOutputSize(ren, &width, &height);
+    if (SDL_RenderReadPixels(ren, NULL, SDL_PIXELFORMAT_RGBA32, pixels, width * 4) != 0) {
+        memset(pixels, 0, (size_t) width * height * 4);
+    }
+    endCaptureFrame();
+}
+
+/*
+    Queues the frames still being read back, lets the encoder write them
+    all, and reports how far the encoder fell behind.
+*/
+void stopFrameCapture() {
+    if (!capturing) {
+        return;
+    }
+    capturing = false;
+
+    if (captureAsync) {
+        while (pendingGLFrames() > 0) {
+            queueGLFrame(true);
+        }
+        stopGLReadback();
+    }
+
+    if (stopCapture() != 0) {
+        fprintf(stderr, "Could not write the whole capture to %s!\n", capture_path);
+    }
+    CaptureStats stats;
+    captureStats(&stats);
+    logInfo("Captured %u frames, dropped %u with the queue full, which held up to %d of %d frames\n",
+        stats.frames, stats.dropped, stats.deepest, CAPTURE_QUEUE_FRAMES);
+}
+
+/*
+    With --share the state of the balls is published after every step to
+    a shared memory file other processes map to read it in place, laid out
+    and guarded by a seqlock as share.h describes. The arrays are those of
+    the ball store, in its scalar type, with the velocities of the fixed
+    engine converted from fixed point.
+*/
+#define SHARE_ARRAYS 6
+
+ShareRegion shareRegion;
+
+const char *share_names[SHARE_ARRAYS] = { "x", "y", "dx", "dy", "radius", "mass" };
+
+/*
+    Creates the shared memory file with room for capacity balls, and
+    publishes the balls as they are.
+    Returns 0 on success and 1 if the file could not be created.
+*/
+int startShare(const char *path, BallStore *balls, int capacity) {
+    ShareType real_type = sizeof(real) == sizeof(double) ? SHARE_FLOAT64 : SHARE_FLOAT32;
+    ShareType types[SHARE_ARRAYS] = { real_type, real_type, real_type, real_type, SHARE_INT32, real_type };
+    if (openShare(&shareRegion, path, share_names, types, SHARE_ARRAYS, capacity) != 0) {
+        return 1;
+    }
+
+    shareRegion.header->world_width = world_width;
+    shareRegion.header->world_height = world_height;
+    return 0;
+}
+
+/*
+    Copies the state of the balls into the shared memory file, between the
+    two halves of the seqlock.
+*/
+void publishShare(BallStore *balls) {
+    int n = balls->count;
+    real *dir_x = shareArray(&shareRegion, 2);
+    real *dir_y = shareArray(&shareRegion, 3);
+
+    beginShareWrite(&shareRegion);
+    memcpy(shareArray(&shareRegion, 0), balls->pos_x, sizeof(real) * n);
+    memcpy(shareArray(&shareRegion, 1), balls->pos_y, sizeof(real) * n);
+    if (engine == ENGINE_FIXED) {
+        for (int i = 0; i < n; i++) {
+            dir_x[i] = (real) balls->fix_dir_x[i] / FIXED_ONE;
+            dir_y[i] = (real) balls->fix_dir_y[i] / FIXED_ONE;
+        }
+    }
+    else {
+        memcpy(dir_x, balls->dir_x, sizeof(real) * n);
+        memcpy(dir_y, balls->dir_y, sizeof(real) * n);
+    }
+    memcpy(shareArray(&shareRegion, 4), balls->radius, sizeof(int) * n);
+    memcpy(shareArray(&shareRegion, 5), balls->mass, sizeof(real) * n);
+
+    for (int k = 0; k < SHARE_ARRAYS; k++) {
+        shareRegion.header->arrays[k].length = n;
+    }
+    shareRegion.header->step++;
+    endShareWrite(&shareRegion);
+}
+
+/*
+    With --publish <port> remote viewers, other copies of the program run
+    with --view <host>:<port>, can connect to the port at any time and are
+    sent the positions of the balls tick_rate times a second of wall clock,
+    however fast the simulation steps. Positions are quantized like those
+    of a quantized stream, to 65536 steps across the world.
+    A keyframe holds every ball, and goes out every publish_keyframes
+    frames, or out of turn to a viewer that just joined, fell behind, or
+    sees a different number of balls. Every other frame is a delta listing
+    only the balls whose quantized position changed since the frame before,
+    so resting balls cost nothing. A viewer still receiving an older frame
+    is skipped rather than waited for, and gets a keyframe once it caught
+    up, so a slow viewer never slows the run down.
+    Every message is prefixed with its size as a Uint64, like the messages
+    between slabs, and all fields are little endian:
+        kind (Uint8), step (Uint32), count (Uint32)      every frame, then
+        world width, world height (Uint32)               for VIEW_KEYFRAME,
+        x, y, radius (Uint16) per ball                   and for VIEW_DELTA
+        entries (Uint32)
+        index gap, dx, dy (varint) per changed ball
+    The index gap is the number of unchanged balls since the last changed
+    one, and dx and dy are the changes of the quantized position, zigzag
+    encoded so small changes either way take one byte.
+*/
+#define VIEW_KEYFRAME 1
+#define VIEW_DELTA 2
+#define VIEW_MAX_VIEWERS 4
+#define VIEW_PREFIX sizeof(Uint64)
+
+typedef struct Viewer {
+    int         peer;
+    NetBuffer   pending;
+    bool        synced;
+} Viewer;
+
+typedef struct Publisher {
+    int         listener;
+    Viewer      viewers[VIEW_MAX_VIEWERS];
+    int         viewer_count;
+    Uint16*     sent_x;
+    Uint16*     sent_y;
+    int         sent_count;
+    NetBuffer   key;
+    NetBuffer   delta;
+    Uint32      frame;
+    Uint32      step;
+    Uint64      next_frame;
+} Publisher;
+
+Publisher publisher = { .listener = -1 };
+// 0 until startup makes it 5 * tick_rate, unless --keyframes is given
+int publish_keyframes = 0;
+
+void appendU8(NetBuffer *buffer, Uint8 value) {
+    netAppend(buffer, &value, 1);
+}
+
+void appendU16(NetBuffer *buffer, Uint16 value) {
+    value = SDL_SwapLE16(value);
+    netAppend(buffer, &value, sizeof(value));
+}
+
+void appendU32(NetBuffer *buffer, Uint32 value) {
+    value = SDL_SwapLE32(value);
+    netAppend(buffer, &value, sizeof(value));
+}
+
+void appendVarint(NetBuffer *buffer, Uint32 value) {
+    while (value >= 0x80) {
+        appendU8(buffer, (Uint8) (value | 0x80));
+        value >>= 7;
+    }
+    appendU8(buffer, (Uint8) value);
+}
+
+Uint32 zigzag(int value) {
+    return ((Uint32) value << 1) ^ (Uint32) -(value < 0);
+}
+
+int unzigzag(Uint32 value) {
+    return (int) (value >> 1) ^ -(int) (value & 1);
+}
+
+/*
+    Starts a message of the given kind in the buffer, leaving room for the
+    size prefix, which finishMessage fills in.
+*/
+void beginMessage(NetBuffer *buffer, Uint8 kind, int count) {
+    buffer->size = 0;
+    netReserve(buffer, VIEW_PREFIX);
+    buffer->size = VIEW_PREFIX;
+    appendU8(buffer, kind);
+    appendU32(buffer, publisher.step);
+    appendU32(buffer, count);
+}
+
+void finishMessage(NetBuffer *buffer) {
+    Uint64 size = SDL_SwapLE64(buffer->size - VIEW_PREFIX);
+    memcpy(buffer->data, &size, VIEW_PREFIX);
+}
+
+/*
+    Starts listening for viewers on the port, with room for the positions
+    of capacity balls.
+    Returns 0 on success and 1 if the port could not be listened on.
+*/
+int startPublisher(int port, int capacity) {
+    publisher.listener = netListen(port);
+    publisher.sent_x = malloc(sizeof(Uint16) * (capacity + 1));
+    publisher.sent_y = malloc(sizeof(Uint16) * (capacity + 1));
+    publisher.sent_count = -1;
+    return publisher.listener < 0 || publisher.sent_x == NULL || publisher.sent_y == NULL;
+}
+
+void dropViewer(int v) {
+    netClose(publisher.viewers[v].peer);
+    netFree(&publisher.viewers[v].pending);
+    publisher.viewers[v] = publisher.viewers[--publisher.viewer_count];
+    logInfo("A viewer left, %d watching\n", publisher.viewer_count);
+}
+
+/*
+    Counts one step towards the step number of the next frame, and sends it
+    to the viewers once one is due.
+*/
+void publishFrame(BallStore *balls, int steps) {
+    publisher.step += steps;
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (now < publisher.next_frame) {
+        return;
+    }
+    publisher.next_frame = now + SDL_GetPerformanceFrequency() / tick_rate;
+
+    int peer;
+    while ((peer = netPoll(publisher.listener)) >= 0) {
+        if (publisher.viewer_count == VIEW_MAX_VIEWERS) {
+            netClose(peer);
+            continue;
+        }
+        publisher.viewers[publisher.viewer_count++] = (Viewer) { .peer = peer };
+        logInfo("A viewer joined, %d watching\n", publisher.viewer_count);
+    }
+    if (publisher.viewer_count == 0) {
+        return;
+    }
+
+    // the baseline of the deltas is only kept while someone is watching
+    int n = balls->count;
+    bool keyframe = publisher.frame % publish_keyframes == 0 || n != publisher.sent_count;
+    bool deltas = false;
+    bool keys = keyframe;
+    for (int v = 0; v < publisher.viewer_count; v++) {
+        if (publisher.viewers[v].pending.size == 0) {
+            deltas |= publisher.viewers[v].synced;
+            keys |= !publisher.viewers[v].synced;
+        }
+    }
+
+    real scale_x = (real) 65535 / world_width;
+    real scale_y = (real) 65535 / world_height;
+    NetBuffer *delta = &publisher.delta;
+    if (deltas && !keyframe) {
+        beginMessage(delta, VIEW_DELTA, n);
+        size_t entries_at = delta->size;
+        appendU32(delta, 0);
+
+        Uint32 entries = 0;
+        int last = -1;
+        for (int i = 0; i < n; i++) {
+            Uint16 x = quantizePosition(balls->pos_x[i], scale_x);
+            Uint16 y = quantizePosition(balls->pos_y[i], scale_y);
+            if (x == publisher.sent_x[i] && y == publisher.sent_y[i]) {
+                continue;
+            }
+
+            appendVarint(delta, i - last - 1);
+            appendVarint(delta, zigzag(x - publisher.sent_x[i]));
+            appendVarint(delta, zigzag(y - publisher.sent_y[i]));
+            publisher.sent_x[i] = x;
+            publisher.sent_y[i] = y;
+            last = i;
+            entries++;
+        }
+
+        entries = SDL_SwapLE32(entries);
+        memcpy(delta->data + entries_at, &entries, sizeof(entries));
+        finishMessage(delta);
+    }
+    else {
+        for (int i = 0; i < n; i++) {
+            publisher.sent_x[i] = quantizePosition(balls->pos_x[i], scale_x);
+            publisher.sent_y[i] = quantizePosition(balls->pos_y[i], scale_y);
+        }
+    }
+    publisher.sent_count = n;
+
+    NetBuffer *key = &publisher.key;
+    if (keys) {
+        beginMessage(key, VIEW_KEYFRAME, n);
+        appendU32(key, world_width);
+        appendU32(key, world_height);
+        netReserve(key, key->size + 3 * sizeof(Uint16) * n);
+        for (int i = 0; i < n; i++) {
+            appendU16(key, publisher.sent_x[i]);
+            appendU16(key, publisher.sent_y[i]);
+            appendU16(key, (Uint16) balls->radius[i]);
+        }
+        finishMessage(key);
+    }
+
+    for (int v = publisher.viewer_count - 1; v >= 0; v--) {
+        Viewer *viewer = &publisher.viewers[v];
+        if (viewer->pending.size > 0) {
+            viewer->synced = false;
+        }
+        else {
+            NetBuffer *message = keyframe || !viewer->synced ? key : delta;
+            netAppend(&viewer->pending, message->data, message->size);
+            viewer->synced = true;
+        }
+
+        if (netSend(viewer->peer, &viewer->pending) != 0) {
+            dropViewer(v);
+        }
+    }
+    publisher.frame++;
+}
+
+void stopPublisher() {
+    while (publisher.viewer_count > 0) {
+        dropViewer(publisher.viewer_count - 1);
+    }
+    netClose(publisher.listener);
+    publisher.listener = -1;
+    netFree(&publisher.key);
+    netFree(&publisher.delta);
+    free(publisher.sent_x);
+    free(publisher.sent_y);
+}
+
+/*
+    The viewer side of --view: the connection to the publisher, the bytes
+    received from it that do not make a whole message yet, and the
+    quantized positions of the last frame, which the deltas change.
+*/
+typedef struct View {
+    int         peer;
+    NetBuffer   received;
+    Uint16*     x;
+    Uint16*     y;
+    bool        keyed;
+} View;
+
+View view = { .peer = -1 };
+
+/*
+    A cursor reading the fields of one message, which stops at its end.
+*/
+typedef struct MessageReader {
+    const Uint8 *at;
+    const Uint8 *end;
+    bool        failed;
+} MessageReader;
+
+Uint32 readBytes(MessageReader *reader, int size) {
+    if (reader->end - reader->at < size) {
+        reader->failed = true;
+        return 0;
+    }
+
+    Uint32 value = 0;
+    for (int k = 0; k < size; k++) {
+        value |= (Uint32) reader->at[k] << (8 * k);
+    }
+    reader->at += size;
+    return value;
+}
+
+Uint32 readVarint(MessageReader *reader) {
+    Uint32 value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        Uint32 byte = readBytes(reader, 1);
+        value |= (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    reader->failed = true;
+    return 0;
+}
+
+/*
+    Returns the size of the first message in the received bytes, not
+    counting its prefix, or 0 if it has not arrived in full yet.
+*/
+size_t nextViewMessage() {
+    if (view.received.size < VIEW_PREFIX) {
+        return 0;
+    }
+
+    Uint64 size;
+    memcpy(&size, view.received.data, VIEW_PREFIX);
+    size = SDL_SwapLE64(size);
+    return view.received.size - VIEW_PREFIX >= size ? size : 0;
+}
+
+/*
+    Connects to a publisher and waits for its first keyframe, leaving it
+    with the received bytes for receiveView, and returns the world and the
+    number of balls it describes along with the radius of the largest.
+    Returns 0 on success and 1 if the publisher could not be reached.
+*/
+int startView(const char *host, int port, int *count, int *largest) {
+    view.peer = netConnect(host, port);
+    if (view.peer < 0) {
+        return 1;
+    }
+
+    for (;;) {
+        bool closed = netReceive(view.peer, &view.received) != 0;
+
+        size_t size;
+        while ((size = nextViewMessage()) > 0) {
+            MessageReader reader = { (Uint8*) view.received.data + VIEW_PREFIX, (Uint8*) view.received.data + VIEW_PREFIX + size };
+            Uint32 kind = readBytes(&reader, 1);
+            if (kind == VIEW_KEYFRAME) {
+                readBytes(&reader, 4);
+                int n = readBytes(&reader, 4);
+                world_width = readBytes(&reader, 4);
+                world_height = readBytes(&reader, 4);
+
+                *largest = 1;
+                for (int i = 0; i < n && !reader.failed; i++) {
+                    readBytes(&reader, 4);
+                    int r = readBytes(&reader, 2);
+                    *largest = SDL_max(*largest, r);
+                }
+                *count = n;
+
+                view.x = malloc(sizeof(Uint16) * (n + 1));
+                view.y = malloc(sizeof(Uint16) * (n + 1));
+                return reader.failed || world_width <= 0 || world_height <= 0 || view.x == NULL || view.y == NULL;
+            }
+
+            // the deltas before the first keyframe have nothing to change
+            view.received.size -= VIEW_PREFIX + size;
+            memmove(view.received.data, view.received.data + VIEW_PREFIX + size, view.received.size);
+        }
+        if (closed) {
+            return 1;
+        }
+        SDL_Delay(10);
+    }
+}
+
+/*
+    Applies one message from the publisher to the balls.
+    Returns 0 on success and 1 if the message is damaged or does not fit.
+*/
+int applyViewMessage(BallStore *balls, MessageReader *reader) {
+    Uint32 kind = readBytes(reader, 1);
+    readBytes(reader, 4);
+    int n = readBytes(reader, 4);
+    real scale_x = (real) world_width / 65535;
+    real scale_y = (real) world_height / 65535;
+
+    if (kind == VIEW_KEYFRAME) {
+        // a world of another size cannot be drawn in this window
+        if (n > balls->capacity || (int) readBytes(reader, 4) != world_width || (int) readBytes(reader, 4) != world_height) {
+            return 1;
+        }
+        balls->count = n;
+        for (int i = 0; i < n && !reader->failed; i++) {
+            view.x[i] = readBytes(reader, 2);
+            view.y[i] = readBytes(reader, 2);
+            balls->radius[i] = readBytes(reader, 2);
+        }
+        view.keyed = true;
+    }
+    else if (kind == VIEW_DELTA && view.keyed && n == balls->count) {
+        Uint32 entries = readBytes(reader, 4);
+        int i = -1;
+        for (Uint32 e = 0; e < entries && !reader->failed; e++) {
+            i += readVarint(reader) + 1;
+            int dx = unzigzag(readVarint(reader));
+            int dy = unzigzag(readVarint(reader));
+            if (i >= n) {
+                return 1;
+            }
+            view.x[i] += dx;
+            view.y[i] += dy;
+        }
+    }
+    else {
+        return 1;
+    }
+
+    for (int i = 0; i < balls->count; i++) {
+        balls->pos_x[i] = view.x[i] * scale_x;
+        balls->pos_y[i] = view.y[i] * scale_y;
+    }
+    return reader->failed;
+}
+
+/*
+    Applies every message that arrived from the publisher since the last
+    call.
+    Returns 0 on success and 1 if the publisher hung up or sent something
+    damaged.
+*/
+int receiveView(BallStore *balls) {
+    bool closed = netReceive(view.peer, &view.received) != 0;
+
+    size_t size;
+    size_t consumed = 0;
+    while (consumed + VIEW_PREFIX <= view.received.size) {
+        Uint64 prefix;
+        memcpy(&prefix, view.received.data + consumed, VIEW_PREFIX);
+        size = SDL_SwapLE64(prefix);
+        if (view.received.size - consumed - VIEW_PREFIX < size) {
+            break;
+        }
+
+        const Uint8 *message = (Uint8*) view.received.data + consumed + VIEW_PREFIX;
+        MessageReader reader = { message, message + size, false };
+        if (applyViewMessage(balls, &reader) != 0) {
+            return 1;
+        }
+        consumed += VIEW_PREFIX + size;
+    }
+
+    view.received.size -= consumed;
+    memmove(view.received.data, view.received.data + consumed, view.received.size);
+    return closed;
+}
+
+void stopView() {
+    netClose(view.peer);
+    netFree(&view.received);
+    free(view.x);
+    free(view.y);
+}
+
+/*
+    Every frame drawn and every step taken is timed into a histogram, and
+    the percentiles of both are printed on exit. With --latency <file> the
+    percentiles of the last LATENCY_SNAPSHOT_MS are written to latencyFile
+    as well, one CSV row per series, so stalls that are rare overall still
+    show in the interval they happened in.
+*/
+#define LATENCY_SNAPSHOT_MS 1000
+
+LatencyHistogram frameLatency;
+LatencyHistogram stepLatency;
+LatencyHistogram frameSnapshot;
+LatencyHistogram stepSnapshot;
+FILE *latencyFile = NULL;
+Uint64 latency_start = 0;
+Uint64 latency_snapshot = 0;
+
+/*
+    Returns the given number of performance counter ticks in nanoseconds.
+*/
+Uint64 latencyNanoseconds(Uint64 ticks) {
+    return (Uint64) ((double) ticks * 1e9 / SDL_GetPerformanceFrequency());
+}
+
+/*
+    Forgets the times so far, like those of the autotune steps.
+*/
+void resetLatencies() {
+    resetLatency(&frameLatency);
+    resetLatency(&stepLatency);
+    memset(&frameSnapshot, 0, sizeof(frameSnapshot));
+    memset(&stepSnapshot, 0, sizeof(stepSnapshot));
+    latency_start = SDL_GetPerformanceCounter();
+    latency_snapshot = latency_start;
+}
+
+/*
+    Opens the latency file and writes its header.
+    Returns 0 on success and 1 if the file could not be opened.
+*/
+int openLatency(const char *path) {
+    latencyFile = fopen(path, "w");
+    if (latencyFile == NULL) {
+        return 1;
+    }
+    fprintf(latencyFile, "seconds,series,count,p50_ms,p90_ms,p99_ms,p999_ms,max_ms\n");
+    latency_start = SDL_GetPerformanceCounter();
+    latency_snapshot = latency_start;
+    return 0;
+}
+
+/*
+    Writes the CSV row of one series for the times since the given snapshot,
+    unless there were none.
+*/
+void writeLatencyRow(double seconds, const char *series, LatencyHistogram *histogram, LatencyHistogram *since) {
+    LatencySummary summary;
+    summarizeLatency(histogram, since, &summary);
+    if (summary.count == 0) {
+        return;
+    }
+    fprintf(latencyFile, "%.3f,%s,%llu,%.3f,%.3f,%.3f,%.3f,%.3f\n", seconds, series,
+            (unsigned long long) summary.count, summary.p50 / 1e6, summary.p90 / 1e6,
+            summary.p99 / 1e6, summary.p999 / 1e6, summary.max / 1e6);
+}
+
+/*
+    Writes the rows of the interval since the last snapshot once it is
+    LATENCY_SNAPSHOT_MS long, or at once when forced.
+*/
+void snapshotLatency(bool force) {
+    if (latencyFile == NULL) {
+        return;
+    }
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint64 interval = SDL_GetPerformanceFrequency() * LATENCY_SNAPSHOT_MS / 1000;
+    if (!force && now - latency_snapshot < interval) {
+        return;
+    }
+    latency_snapshot = now;
+
+    double seconds = (double) (now - latency_start) / SDL_GetPerformanceFrequency();
+    writeLatencyRow(seconds, "frame", &frameLatency, &frameSnapshot);
+    writeLatencyRow(seconds, "step", &stepLatency, &stepSnapshot);
+    fflush(latencyFile);
+}
+
+/*
+    Writes the rows of the last interval and closes the latency file.
+*/
+void closeLatency() {
+    if (latencyFile == NULL) {
+        return;
+    }
+    snapshotLatency(true);
+    fclose(latencyFile);
+    latencyFile = NULL;
+}
+
+/*
+    Prints the percentiles of one series since the start, unless it has
+    no times.
+*/
+void printLatencyLine(const char *series, LatencyHistogram *histogram) {
+    LatencySummary summary;
+    summarizeLatency(histogram, NULL, &summary);
+    if (summary.count == 0) {
+        return;
+    }
+    printf("%s times of %llu: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n", series,
+           (unsigned long long) summary.count, summary.p50 / 1e6, summary.p90 / 1e6,
+           summary.p99 / 1e6, summary.p999 / 1e6, summary.max / 1e6);
+}
+
+/*
+    Prints the percentiles of the frame and step times since the start.
+*/
+void printLatencies() {
+    printLatencyLine("Frame", &frameLatency);
+    printLatencyLine("Step", &stepLatency);
+}
+
+/*
+    Advances the simulation by one step with the chosen broad phase, or on
+    the GPU with the gpu engine, and streams the result with --stream and
+    publishes it with --share.
+*/
+void stepBalls(BallStore *balls) {
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    if (collisionFeed.subscribers > 0) {
+        reserveCollisions(balls->count * COLLISION_EVENTS_PER_BALL);
+    }
+
+    if (engine == ENGINE_GPU) {
+        PROFILE_BEGIN(PHASE_COLLIDE);
+        stepGLCompute(step_dt);
+        PROFILE_END(PHASE_COLLIDE);
+    }
+    else if (eventDriven) {
+        PROFILE_BEGIN(PHASE_COLLIDE);
+        stepBallsEvents(balls);
+        PROFILE_END(PHASE_COLLIDE);
+    }
+    else {
+        if (continuousCollisions) {
+            updateSweptMargin(balls);
+        }
+        if (persistentContacts) {
+            contactCache.current++;
+        }
+
+        switch (broadphase) {
+            case BROADPHASE_GRID :
+                if (verlet_skin > 0) {
+                    stepBallsVerlet(balls);
+                }
+                else if (sleep_speed > 0) {
+                    stepBallsSleeping(balls);
+                }
+                else {
+                    stepBallsImproved(balls);
+                }
+                break;
+
+            case BROADPHASE_SWEEP :
+                stepBallsSweep(balls);
+                break;
+
+            case BROADPHASE_QUADTREE :
+                stepBallsQuadtree(balls);
+                break;
+
+            case BROADPHASE_HASH :
+                stepBallsHash(balls);
+                break;
+
+            case BROADPHASE_HGRID :
+                stepBallsHierarchical(balls);
+                break;
+        }
+    }
+
+    if (collisionFeed.subscribers > 0) {
+        deliverCollisions();
+    }
+    if (streaming) {
+        streamFrame(balls);
+    }
+    if (shareRegion.header != NULL) {
+        publishShare(balls);
+    }
+
+    recordLatency(&stepLatency, latencyNanoseconds(SDL_GetPerformanceCounter() - start));
+}
+
+/*
+    With --slab the world is split into vertical slabs, one per process,
+    each connected to the processes of the slabs to its left and right.
+    A process owns the balls whose centers lie in its slab, which are the
+    first slab.owned balls of its store. Every step it sends its neighbours
+    the balls within one subspace of the shared edge, and they append them
+    after their own as ghosts: two balls can only touch when they are
+    closer than a subspace, so every contact across an edge is seen by
+    both processes, each resolving it for its own ball. Then the step runs
+    as usual, the ghosts are dropped, and the balls that crossed an edge
+    migrate to the neighbour that owns them now.
+    Contacts across an edge use the state the ghost was sent with, so they
+    may differ slightly from those of a single process, as with the order
+    of contacts on several threads.
+*/
+#define SLAB_HEADROOM 2
+#define SLAB_MIN_CAPACITY 1024
+
+typedef struct SlabBall {
+    real    x;
+    real    y;
+    real    dir_x;
+    real    dir_y;
+    real    mass;
+    int     radius;
+} SlabBall;
+
+/*
+    The slab of this process. peers[0] and peers[1] are the connections to
+    the left and the right neighbour, or -1 at the walls of the world.
+*/
+typedef struct Slab {
+    int         index;
+    int         count;
+    int         left_x;
+    int         right_x;
+    int         peers[2];
+    int         owned;
+    NetBuffer   send[2];
+    NetBuffer   received[2];
+    Sint64      migrated;
+} Slab;
+
+bool distributed = false;
+Slab slab = { .peers = { -1, -1 } };
+
+/*
+    Sets the x range of the slab: the world split evenly, with the last
+    slab also owning the right wall itself.
+*/
+void configureSlab() {
+    slab.left_x = (int) ((Sint64) world_width * slab.index / slab.count);
+    slab.right_x = slab.index == slab.count - 1 ? world_width + 1 : (int) ((Sint64) world_width * (slab.index + 1) / slab.count);
+}
+
+/*
+    Checks whether a ball at this x belongs to this process.
+*/
+bool slabOwns(real x) {
+    if (!distributed) {
+        return true;
+    }
+    return (slab.index == 0 || x >= slab.left_x) && (slab.index == slab.count - 1 || x < slab.right_x);
+}
+
+/*
+    Connects to the neighbours. Every process first waits for its right
+    neighbour on the listening port and then connects to its left one, so
+    the connections are made from the rightmost slab to the leftmost.
+    Returns 0 on success and 1 if a connection could not be made.
+*/
+int connectSlab(int listen_port, const char *left_host, int left_port) {
+    if (slab.index < slab.count - 1) {
+        slab.peers[1] = netAccept(listen_port);
+        if (slab.peers[1] < 0) {
+            return 1;
+        }
+    }
+    if (slab.index > 0) {
+        slab.peers[0] = netConnect(left_host, left_port);
+        if (slab.peers[0] < 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void closeSlab() {
+    for (int k = 0; k < 2; k++) {
+        netClose(slab.peers[k]);
+        netFree(&slab.send[k]);
+        netFree(&slab.received[k]);
+    }
+}
+
+void copyBall(BallStore *balls, int from, int to) {
+    balls->pos_x[to] = balls->pos_x[from];
+    balls->pos_y[to] = balls->pos_y[from];
+    balls->dir_x[to] = balls->dir_x[from];
+    balls->dir_y[to] = balls->dir_y[from];
+    balls->radius[to] = balls->radius[from];
+    balls->mass[to] = balls->mass[from];
+    balls->inv_mass[to] = balls->inv_mass[from];
+    memcpy(balls->subspaces[to], balls->subspaces[from], sizeof(*balls->subspaces));
+}
+
+void sendBall(NetBuffer *buffer, BallStore *balls, int i) {
+    SlabBall ball = {
+        .x = balls->pos_x[i],
+        .y = balls->pos_y[i],
+        .dir_x = balls->dir_x[i],
+        .dir_y = balls->dir_y[i],
+        .mass = balls->mass[i],
+        .radius = balls->radius[i]
+    };
+    netAppend(buffer, &ball, sizeof(ball));
+}
+
+/*
+    Appends the balls received from both neighbours to the store.
+*/
+void appendReceivedBalls(BallStore *balls) {
+    for (int k = 0; k < 2; k++) {
+        int n = slab.received[k].size / sizeof(SlabBall);
+        if (balls->count + n > balls->capacity) {
+            fprintf(stderr, "Slab %d ran out of room for the balls of its neighbours!\n", slab.index);
+            exit(1);
+        }
+
+        SlabBall *received = (SlabBall*) slab.received[k].data;
+        for (int r = 0; r < n; r++) {
+            int i = makeBall(balls, 0, 0, received[r].radius);
+            balls->pos_x[i] = received[r].x;
+            balls->pos_y[i] = received[r].y;
+            balls->dir_x[i] = received[r].dir_x;
+            balls->dir_y[i] = received[r].dir_y;
+            setBallMass(balls, i, received[r].mass);
+        }
+    }
+}
+
+/*
+    Exchanges the messages built in slab.send with both neighbours.
+*/
+void exchangeSlab() {
+    if (netExchange(slab.peers, slab.send, slab.received, 2) != 0) {
+        fprintf(stderr, "Slab %d lost the connection to a neighbour!\n", slab.index);
+        exit(1);
+    }
+}
+
+/*
+    One physics step of the slab of this process.
+*/
+void stepSlab(BallStore *balls) {
+    // the ghosts: owned balls close enough to an edge to touch a ball
+    // on the other side of it
+    int halo = subspace_size_x;
+    slab.owned = balls->count;
+    slab.send[0].size = 0;
+    slab.send[1].size = 0;
+    for (int i = 0; i < slab.owned; i++) {
+        if (slab.peers[0] >= 0 && balls->pos_x[i] < slab.left_x + halo) {
+            sendBall(&slab.send[0], balls, i);
+        }
+        if (slab.peers[1] >= 0 && balls->pos_x[i] >= slab.right_x - halo) {
+            sendBall(&slab.send[1], balls, i);
+        }
+    }
+    exchangeSlab();
+    appendReceivedBalls(balls);
+
+    stepBalls(balls);
+    balls->count = slab.owned;
+
+    // the migrants: owned balls that moved past an edge, taken out by
+    // moving the last ball into their place
+    slab.send[0].size = 0;
+    slab.send[1].size = 0;
+    for (int i = balls->count - 1; i >= 0; i--) {
+        if (slabOwns(balls->pos_x[i])) {
+            continue;
+        }
+
+        sendBall(&slab.send[balls->pos_x[i] < slab.left_x ? 0 : 1], balls, i);
+        copyBall(balls, --balls->count, i);
+        slab.migrated++;
+    }
+    exchangeSlab();
+    appendReceivedBalls(balls);
+}
+
+/*
+    Allocates the scratch space of the Morton reorder for the given number
+    of balls. Returns 0 on success and 1 if any allocation failed.
+*/
+int initBallReorder(int amnt) {
+    ballReorder.keys = malloc(sizeof(MortonKey) * (amnt + 1));
+    ballReorder.newIndex = malloc(sizeof(int) * (amnt + 1));
+    ballReorder.spareSlots = malloc(sizeof(*ballReorder.spareSlots) * (amnt + 1));
+
+    if (ballReorder.keys == NULL || ballReorder.newIndex == NULL ||
+        ballReorder.spareSlots == NULL || initBallStore(&ballReorder.spare, amnt) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Frees the scratch space of the Morton reorder.
+*/
+void freeBallReorder() {
+    free(ballReorder.keys);
+    free(ballReorder.newIndex);
+    free(ballReorder.spareSlots);
+    freeBallStore(&ballReorder.spare);
+}
+
+/*
+    Spreads the lower 16 bits of v out to the even bits of the result.
+*/
+Uint32 spreadBits(Uint32 v) {
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+/*
+    Interleaves the bits of a subspace column and row into a Z-order code,
+    so subspaces that are close on screen get close codes.
+*/
+Uint32 mortonCode(int column, int row) {
+    return spreadBits(column) | (spreadBits(row) << 1);
+}
+
+/*
+    Orders Morton keys by code, and by the old index within a subspace so
+    that the sort is stable.
+*/
+int compareMortonKeys(const void *a, const void *b) {
+    const MortonKey *ka = a;
+    const MortonKey *kb = b;
+
+    if (ka->code != kb->code) {
+        return ka->code < kb->code ? -1 : 1;
+    }
+    return ka->index - kb->index;
+}
+
+/*
+    Sorts the ball arrays by the Morton code of the subspace each ball's
+    center is in, so that the balls of neighboring subspaces sit close
+    together in memory. Every ball index held outside the store, in the
+    sweep order and the incremental buckets, is renumbered to match.
+    The flat grid and the quadtree are rebuilt every frame, so they are
+    left alone, and the contact cache starts over.
+*/
+void reorderBalls(BallStore *balls) {
+    int n = balls->count;
+    gridCurrent = false;
+    verletLists.valid = false;
+    if (persistentContacts) {
+        resetContactCache();
+    }
+    MortonKey *keys = ballReorder.keys;
+    int *newIndex = ballReorder.newIndex;
+
+    for (int i = 0; i < n; i++) {
+        keys[i].code = mortonCode(subspaceColumn(balls->pos_x[i]), subspaceRow(balls->pos_y[i]));
+        keys[i].index = i;
+    }
+    qsort(keys, n, sizeof(MortonKey), compareMortonKeys);
+
+    BallStore *spare = &ballReorder.spare;
+    for (int i = 0; i < n; i++) {
+        int old = keys[i].index;
+        newIndex[old] = i;
+
+        spare->pos_x[i] = balls->pos_x[old];
+        spare->pos_y[i] = balls->pos_y[old];
+        spare->dir_x[i] = balls->dir_x[old];
+        spare->dir_y[i] = balls->dir_y[old];
+        spare->radius[i] = balls->radius[old];
+        spare->mass[i] = balls->mass[old];
+        spare->inv_mass[i] = balls->inv_mass[old];
+        memcpy(spare->subspaces[i], balls->subspaces[old], sizeof(*balls->subspaces));
+        spare->fix_pos_x[i] = balls->fix_pos_x[old];
+        spare->fix_pos_y[i] = balls->fix_pos_y[old];
+        spare->fix_dir_x[i] = balls->fix_dir_x[old];
+        spare->fix_dir_y[i] = balls->fix_dir_y[old];
+        if (subspaceBuckets.slots != NULL) {
+            memcpy(ballReorder.spareSlots[i], subspaceBuckets.slots[old], sizeof(*subspaceBuckets.slots));
+        }
+    }
+
+    // the gathered arrays become the live ones, and the old ones the spares
+    BallStore live = *balls;
+    spare->count = live.count;
+    spare->capacity = live.capacity;
+    *balls = *spare;
+    *spare = live;
+
+    if (subspaceBuckets.slots != NULL) {
+        int (*slots)[BALL_CORNER_COUNT] = subspaceBuckets.slots;
+        subspaceBuckets.slots = ballReorder.spareSlots;
+        ballReorder.spareSlots = slots;
+    }
+
+    // the balls keep their places, so the renumbered order stays sorted
+    for (int i = 0; i < n; i++) {
+        sweepOrder[i] = newIndex[sweepOrder[i]];
+    }
+
+    if (subspaceBuckets.populated) {
+        for (int s = 0; s < subspace_count; s++) {
+            int *cell = subspaceBuckets.cellBalls[s];
+            for (int k = 0; k < subspaceBuckets.cellCount[s]; k++) {
+                cell[k] = newIndex[cell[k]];
+            }
+        }
+    }
+
+    // renumbering would invalidate every predicted event, so start over
+    if (eventDriven) {
+        resetEvents(balls);
+    }
+}
+
+/*
+    Scene files hold the balls exactly as they sit in memory, so a scene of
+    millions of balls starts without making or placing a single one. The
+    file is one SCENE_HEADER_SIZE page of header, padded with zeros,
+    followed by the block of the ball store: loading maps that block
+    privately as the arena of the store and uses it in place, and falls
+    back to reading it where it cannot be mapped.
+    The layout is the native one of the machine that wrote the file, so a
+    file only loads on machines with the same byte order, real type and
+    arena alignment, which the header records. S saves the running scene,
+    and a headless run saves it once it is done.
+*/
+#define SCENE_MAGIC 0x43534242
+#define SCENE_VERSION 2
+#define SCENE_HEADER_SIZE 4096
+
+typedef struct SceneHeader {
+    Uint32  magic;
+    Uint32  version;
+    Uint32  real_size;
+    Uint32  alignment;
+    Uint32  count;
+    Uint32  capacity;
+    Uint32  radius;
+    Uint32  engine;
+    Uint32  world_width;
+    Uint32  world_height;
+    Uint32  subspace_size_x;
+    Uint32  subspace_size_y;
+    Uint64  store_size;
+} SceneHeader;
+
+const char *save_path = "balls.scene";
+bool saveRequested = false;
+
+/*
+    Writes the balls to save_path, through a temporary file that replaces
+    it at the end, so a scene mapped from the same path keeps its pages.
+    The radius the grid was set up for is half of min_subspace_size.
+    Returns 0 on success and 1 if the file could not be written.
+*/
+int saveScene(BallStore *balls) {
+    SceneHeader header = {
+        .magic = SCENE_MAGIC,
+        .version = SCENE_VERSION,
+        .real_size = sizeof(real),
+        .alignment = ARENA_ALIGNMENT,
+        .count = balls->count,
+        .capacity = balls->capacity,
+        .radius = min_subspace_size / 2,
+        .engine = engine,
+        .world_width = world_width,
+        .world_height = world_height,
+        .subspace_size_x = subspace_size_x,
+        .subspace_size_y = subspace_size_y,
+        .store_size = ballStoreSize(balls->capacity)
+    };
+
+    char temporary[1024];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", save_path);
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL) {
+        return 1;
+    }
+
+    char page[SCENE_HEADER_SIZE] = { 0 };
+    memcpy(page, &header, sizeof(header));
+    bool written = fwrite(page, sizeof(page), 1, file) == 1 &&
+        fwrite(balls->arena.base, header.store_size, 1, file) == 1;
+    if (fclose(file) != 0 || !written) {
+        remove(temporary);
+        return 1;
+    }
+
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows
+    remove(save_path);
+#endif
+    if (rename(temporary, save_path) != 0) {
+        remove(temporary);
+        return 1;
+    }
+
+    logInfo("Saved %d balls to %s\n", balls->count, save_path);
+    return 0;
+}
+
+/*
+    Reads the header of a scene file and makes sure this build can use the
+    balls that follow it.
+    Returns 0 on success and 1 if the file cannot be read or does not fit.
+*/
+int readSceneHeader(const char *path, SceneHeader *header) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 1;
+    }
+    bool read = fread(header, sizeof(*header), 1, file) == 1;
+    fclose(file);
+
+    if (!read || header->magic != SCENE_MAGIC || header->version != SCENE_VERSION) {
+        fprintf(stderr, "%s is not a scene file of this version or byte order!\n", path);
+        return 1;
+    }
+    if (header->real_size != sizeof(real) || header->alignment != ARENA_ALIGNMENT) {
+        fprintf(stderr, "%s was saved by a build with another real type or alignment!\n", path);
+        return 1;
+    }
+
+    if (header->count > header->capacity || header->capacity > SDL_MAX_SINT32 / BALL_CORNER_COUNT ||
+        header->store_size != ballStoreSize(header->capacity) || header->radius < 1 ||
+        header->world_width < 100 || header->world_height < 100 ||
+        header->world_width > WORLD_MAX_SIZE || header->world_height > WORLD_MAX_SIZE ||
+        header->subspace_size_x < 1 || header->subspace_size_y < 1 ||
+        header->world_width % header->subspace_size_x != 0 || header->world_height % header->subspace_size_y != 0) {
+        fprintf(stderr, "The header of %s is damaged!\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Takes the world and the grid of a scene whose header was read.
+*/
+void applySceneHeader(SceneHeader *header) {
+    world_width = header->world_width;
+    world_height = header->world_height;
+    subspace_size_x = header->subspace_size_x;
+    subspace_size_y = header->subspace_size_y;
+    countSubspaces();
+}
+
+/*
+    Makes the balls of a scene file the given store. The fixed-point state
+    is only kept if the scene was saved by the fixed engine, otherwise it
+    is left for loadFixedState to work out.
+    Returns 0 on success and 1 if the balls could not be loaded.
+*/
+int loadScene(BallStore *balls, const char *path, SceneHeader *header) {
+    balls->count = header->count;
+    balls->capacity = header->capacity;
+
+    if (mapArenaFile(&balls->arena, path, SCENE_HEADER_SIZE, header->store_size) == 0) {
+        carveBallStore(balls, balls->capacity);
+        return 0;
+    }
+
+    if (initBallStore(balls, header->capacity) != 0) {
+        return 1;
+    }
+    balls->count = header->count;
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        freeBallStore(balls);
+        return 1;
+    }
+    bool read = fseek(file, SCENE_HEADER_SIZE, SEEK_SET) == 0 &&
+        fread(balls->arena.base, header->store_size, 1, file) == 1;
+    fclose(file);
+
+    if (!read) {
+        freeBallStore(balls);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    With --interpolate the balls are drawn between their last two physics
+    steps, as far along as the clock is into the next step, so the display
+    can run at its own rate above that of the physics without the balls
+    jumping from step to step. Whoever steps the balls keeps where they
+    were before the last step in prev_x and prev_y, for the first
+    prev_count balls; balls past those, and all of them right after the
+    store was reordered, are drawn where they are. The blend is drawn from
+    blended, which holds only the positions and radii.
+*/
+typedef struct Interpolation {
+    real*       prev_x;
+    real*       prev_y;
+    int         prev_count;
+    Arena       arena;
+    BallStore   blended;
+} Interpolation;
+
+bool interpolate = false;
+Interpolation interpolation;
+
+/*
+    Allocates the previous positions and the blended store for the given
+    number of balls.
+    Returns 0 on success and 1 if the allocation failed.
+*/
+int initInterpolation(int amnt) {
+    size_t n = amnt > 0 ? amnt : 1;
+    size_t size = 4 * arenaSize(sizeof(real) * n) + arenaSize(sizeof(int) * n);
+    if (initArena(&interpolation.arena, size, false) != 0) {
+        return 1;
+    }
+
+    interpolation.prev_x = arenaAlloc(&interpolation.arena, sizeof(real) * n);
+    interpolation.prev_y = arenaAlloc(&interpolation.arena, sizeof(real) * n);
+    interpolation.prev_count = 0;
+
+    BallStore *blended = &interpolation.blended;
+    memset(blended, 0, sizeof(*blended));
+    blended->capacity = amnt;
+    blended->pos_x = arenaAlloc(&interpolation.arena, sizeof(real) * n);
+    blended->pos_y = arenaAlloc(&interpolation.arena, sizeof(real) * n);
+    blended->radius = arenaAlloc(&interpolation.arena, sizeof(int) * n);
+    return 0;
+}
+
+void freeInterpolation() {
+    freeArena(&interpolation.arena);
+}
+
+/*
+    Keeps where the balls are as their previous positions, right before
+    they step.
+*/
+void rememberPositions(BallStore *balls) {
+    memcpy(interpolation.prev_x, balls->pos_x, sizeof(real) * balls->count);
+    memcpy(interpolation.prev_y, balls->pos_y, sizeof(real) * balls->count);
+    interpolation.prev_count = balls->count;
+}
+
+/*
+    Returns the balls of the given current positions and radii, and of
+    the given previous positions for the first prev_count of them, drawn
+    the given fraction of the way from the previous positions to the
+    current ones.
+*/
+BallStore* blendBalls(const real *pos_x, const real *pos_y, const int *radius, int count,
+                      const real *prev_x, const real *prev_y, int prev_count, real alpha) {
+    BallStore *blended = &interpolation.blended;
+    int blend = prev_count < count ? prev_count : count;
+    for (int i = 0; i < blend; i++) {
+        blended->pos_x[i] = prev_x[i] + (pos_x[i] - prev_x[i]) * alpha;
+        blended->pos_y[i] = prev_y[i] + (pos_y[i] - prev_y[i]) * alpha;
+    }
+    memcpy(blended->pos_x + blend, pos_x + blend, sizeof(real) * (count - blend));
+    memcpy(blended->pos_y + blend, pos_y + blend, sizeof(real) * (count - blend));
+    memcpy(blended->radius, radius, sizeof(int) * count);
+    blended->count = count;
+    return blended;
+}
+
+/*
+    The published state of the simulation, as much of it as drawing needs:
+    a ball store holding only the positions and radii, and the subspace
+    size the grid overlay is drawn with. With --interpolate it also holds
+    the previous positions of the first prev_count balls, and the
+    performance counter at which the last step was due.
+*/
+typedef struct Snapshot {
+    BallStore   balls;
+    int         subspace_size_x;
+    int         subspace_size_y;
+    real*       prev_x;
+    real*       prev_y;
+    int         prev_count;
+    Uint64      due;
+} Snapshot;
+
+#define SNAPSHOT_SLOTS 3
+#define SNAPSHOT_FRESH 4
+
+// How long the paused simulation thread sleeps between checks, in milliseconds.
+#define SIMULATION_PAUSED_MS 25
+
+/*
+    With --simthread the simulation steps on its own thread and hands its
+    state to the render thread through a triple buffer of snapshots. The
+    simulation always owns the back slot and the renderer the front slot,
+    and the third is the latest one published, with SNAPSHOT_FRESH set in
+    latest until the renderer picks it up. Both sides only ever swap their
+    own slot with the latest through one atomic exchange, so neither ever
+    waits for the other.
+*/
+typedef struct Simulation {
+    SDL_Thread*     thread;
+    BallStore*      balls;
+    Snapshot        slots[SNAPSHOT_SLOTS];
+    SDL_atomic_t    latest;
+    int             back;
+    int             front;
+    SDL_atomic_t    quit;
+    SDL_atomic_t    paused;
+    SDL_atomic_t    steps;
+    SDL_atomic_t    save;
+} Simulation;
+
+bool simThread = false;
+Simulation simulation;
+
+/*
+    Allocates the snapshot slots for the given number of balls.
+    Returns 0 on success and 1 if a slot could not be allocated.
+*/
+int initSnapshots(int amnt) {
+    size_t n = amnt > 0 ? amnt : 1;
+    size_t size = (interpolate ? 4 : 2) * arenaSize(sizeof(real) * n) + arenaSize(sizeof(int) * n);
+
+    for (int s = 0; s < SNAPSHOT_SLOTS; s++) {
+        BallStore *slot = &simulation.slots[s].balls;
+        memset(slot, 0, sizeof(*slot));
+        if (initArena(&slot->arena, size, false) != 0) {
+            return 1;
+        }
+        slot->capacity = amnt;
+        slot->pos_x = arenaAlloc(&slot->arena, sizeof(real) * n);
+        slot->pos_y = arenaAlloc(&slot->arena, sizeof(real) * n);
+        slot->radius = arenaAlloc(&slot->arena, sizeof(int) * n);
+        if (interpolate) {
+            simulation.slots[s].prev_x = arenaAlloc(&slot->arena, sizeof(real) * n);
+            simulation.slots[s].prev_y = arenaAlloc(&slot->arena, sizeof(real) * n);
+        }
+        simulation.slots[s].prev_count = 0;
+    }
+
+    simulation.back = 0;
+    simulation.front = 1;
+    SDL_AtomicSet(&simulation.latest, 2);
+    return 0;
+}
+
+void freeSnapshots() {
+    for (int s = 0; s < SNAPSHOT_SLOTS; s++) {
+        freeBallStore(&simulation.slots[s].balls);
+    }
+}
+
+/*
+    Copies the state of the balls into the back slot and publishes it as
+    the latest snapshot, with the last step due at the given performance
+    counter. Runs on the simulation thread.
+*/
+void publishSnapshot(BallStore *balls, Uint64 due) {
+    Snapshot *snapshot = &simulation.slots[simulation.back];
+    int n = balls->count;
+
+    snapshot->balls.count = n;
+    memcpy(snapshot->balls.pos_x, balls->pos_x, sizeof(real) * n);
+    memcpy(snapshot->balls.pos_y, balls->pos_y, sizeof(real) * n);
+    memcpy(snapshot->balls.radius, balls->radius, sizeof(int) * n);
+    snapshot->subspace_size_x = subspace_size_x;
+    snapshot->subspace_size_y = subspace_size_y;
+    if (interpolate) {
+        snapshot->prev_count = interpolation.prev_count;
+        memcpy(snapshot->prev_x, interpolation.prev_x, sizeof(real) * interpolation.prev_count);
+        memcpy(snapshot->prev_y, interpolation.prev_y, sizeof(real) * interpolation.prev_count);
+        snapshot->due = due;
+    }
+
+    int previous = SDL_AtomicSet(&simulation.latest, simulation.back | SNAPSHOT_FRESH);
+    simulation.back = previous & ~SNAPSHOT_FRESH;
+}
+
+/*
+    Returns the newest snapshot, taking the latest one if the simulation
+    published since the last call. Runs on the render thread.
+*/
+Snapshot* acquireSnapshot() {
+    if (SDL_AtomicGet(&simulation.latest) & SNAPSHOT_FRESH) {
+        int previous = SDL_AtomicSet(&simulation.latest, simulation.front);
+        simulation.front = previous & ~SNAPSHOT_FRESH;
+    }
+    return &simulation.slots[simulation.front];
+}
+
+/*
+    With --pipeline the frames of --simthread pass through three stages,
+    each on a thread of its own: the simulation thread bins, collides and
+    moves the balls, a draw thread turns the newest snapshot into the
+    points of every ball as the camera sees them, and the main thread only
+    hands the finished points to the renderer and presents them. So while
+    the main thread draws one frame, the draw thread builds the points of
+    the next snapshot and the simulation steps towards the one after.
+    The stages are joined by bounded queues: the triple buffer of
+    snapshots, and DRAW_LIST_SLOTS draw lists handed along through two
+    semaphores like the buffers of --stream. The main thread always takes
+    the newest list and draws the one it holds again until there is a
+    newer one, and the draw thread waits only when every list is taken.
+    The simulation steps exactly as it does with --simthread alone.
+*/
+#define DRAW_LIST_SLOTS 3
+
+/*
+    The points of one frame, and the subspace size of the snapshot they
+    were built from for the grid overlay.
+*/
+typedef struct DrawList {
+    PointBatch  points;
+    int         subspace_size_x;
+    int         subspace_size_y;
+} DrawList;
+
+/*
+    The draw thread takes the lists in order from next and the main thread
+    hands them back in the same order, holding the one at shown. wake is
+    posted with every snapshot published and every frame, and the draw
+    thread builds a list whenever the snapshot or the camera it last built
+    from has changed, as the main thread last set it under lock.
+*/
+typedef struct Pipeline {
+    SDL_Thread      *thread;
+    DrawList        lists[DRAW_LIST_SLOTS];
+    int             next;
+    int             taken;
+    int             shown;
+    SDL_sem         *empty;
+    SDL_sem         *filled;
+    SDL_sem         *wake;
+    SDL_SpinLock    lock;
+    Camera          camera;
+    Uint32          camera_version;
+    SDL_atomic_t    quit;
+    Uint32          built;
+    Uint32          skipped;
+} Pipeline;
+
+bool pipelined = false;
+Pipeline pipeline;
+
+/*
+    Builds the draw list of the newest snapshot as the given camera sees
+    it. Runs on the draw thread, which owns the lod_bias and the store of
+    the camera while pipelined.
+*/
+void buildDrawList(DrawList *list, const Camera *cam) {
+    Snapshot *snapshot = acquireSnapshot();
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    BallStore *seen = viewBalls(cam, &snapshot->balls, false);
+    list->points.count = 0;
+    for (int i = 0; i < seen->count; i++) {
+        drawBall(seen, i, &list->points);
+    }
+    list->subspace_size_x = snapshot->subspace_size_x;
+    list->subspace_size_y = snapshot->subspace_size_y;
+
+    updateLevelOfDetail((double) (SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency());
+}
+
+/*
+    Main loop of the draw thread.
+*/
+int pipelineMain(void *data) {
+    (void) data;
+    traceThreadName("draw");
+
+    Uint32 built_version = 0;
+    bool built = false;
+    while (true) {
+        SDL_SemWait(pipeline.wake);
+        while (SDL_SemTryWait(pipeline.wake) == 0) {
+            // the wakes since the last one all ask for the same list
+        }
+        if (SDL_AtomicGet(&pipeline.quit)) {
+            break;
+        }
+
+        SDL_AtomicLock(&pipeline.lock);
+        Camera cam = pipeline.camera;
+        Uint32 version = pipeline.camera_version;
+        SDL_AtomicUnlock(&pipeline.lock);
+
+        bool fresh = SDL_AtomicGet(&simulation.latest) & SNAPSHOT_FRESH;
+        if (built && !fresh && version == built_version) {
+            continue;
+        }
+
+        SDL_SemWait(pipeline.empty);
+        if (SDL_AtomicGet(&pipeline.quit)) {
+            break;
+        }
+
+        traceBegin("build draw list");
+        buildDrawList(&pipeline.lists[pipeline.next], &cam);
+        traceEnd("build draw list");
+        pipeline.next = (pipeline.next + 1) % DRAW_LIST_SLOTS;
+        pipeline.built++;
+        built = true;
+        built_version = version;
+        SDL_SemPost(pipeline.filled);
+    }
+    return 0;
+}
+
+/*
+    Starts the draw thread, to be started before the simulation thread.
+    Returns 0 on success and 1 if the thread could not be created.
+*/
+int startPipeline() {
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.shown = -1;
+    pipeline.camera = camera;
+    pipeline.empty = SDL_CreateSemaphore(DRAW_LIST_SLOTS);
+    pipeline.filled = SDL_CreateSemaphore(0);
+    pipeline.wake = SDL_CreateSemaphore(0);
+    if (pipeline.empty == NULL || pipeline.filled == NULL || pipeline.wake == NULL) {
+        return 1;
+    }
+
+    pipeline.thread = SDL_CreateThread(pipelineMain, "draw", NULL);
+    if (pipeline.thread == NULL) {
+        return 1;
+    }
+    pipelined = true;
+    return 0;
+}
+
+/*
+    Wakes the draw thread. Runs on either of the other two.
+*/
+void wakePipeline() {
+    if (pipelined) {
+        SDL_SemPost(pipeline.wake);
+    }
+}
+
+/*
+    Hands the camera of the frame about to be drawn to the draw thread, and
+    returns the newest draw list built, or NULL before the first one. Runs
+    on the main thread.
+*/
+DrawList* takeDrawList() {
+    if (memcmp(&camera, &pipeline.camera, sizeof(camera)) != 0) {
+        SDL_AtomicLock(&pipeline.lock);
+        pipeline.camera = camera;
+        pipeline.camera_version++;
+        SDL_AtomicUnlock(&pipeline.lock);
+    }
+    wakePipeline();
+
+    // of several lists built since the last frame only the newest is drawn
+    int taken = 0;
+    while (SDL_SemTryWait(pipeline.filled) == 0) {
+        if (pipeline.shown >= 0) {
+            SDL_SemPost(pipeline.empty);
+        }
+        pipeline.shown = pipeline.taken;
+        pipeline.taken = (pipeline.taken + 1) % DRAW_LIST_SLOTS;
+        taken++;
+    }
+    if (taken > 1) {
+        pipeline.skipped += taken - 1;
+    }
+
+    return pipeline.shown >= 0 ? &pipeline.lists[pipeline.shown] : NULL;
+}
+
+/*
+    Stops the draw thread, after the simulation thread, which wakes it.
+*/
+void stopPipeline() {
+    if (!pipelined) {
+        return;
+    }
+    pipelined = false;
+
+    SDL_AtomicSet(&pipeline.quit, 1);
+    SDL_SemPost(pipeline.wake);
+    SDL_SemPost(pipeline.empty);
+    SDL_WaitThread(pipeline.thread, NULL);
+
+    logInfo("Built %u draw lists on the draw thread, %u of them replaced before they were drawn\n",
+        pipeline.built, pipeline.skipped);
+    for (int k = 0; k < DRAW_LIST_SLOTS; k++) {
+        freePoints(&pipeline.lists[k].points);
+    }
+    SDL_DestroySemaphore(pipeline.empty);
+    SDL_DestroySemaphore(pipeline.filled);
+    SDL_DestroySemaphore(pipeline.wake);
+}
+
+/*
+    Main loop of the simulation thread. It paces the steps exactly like the
+    main loop does without --simthread, and publishes a snapshot after
+    every batch of steps.
+*/
+int simulationMain(void *data) {
+    BallStore *balls = simulation.balls;
+    traceThreadName("simulation");
+    if (pinWorkerThread() != 0) {
+        fprintf(stderr, "Could not pin the simulation thread!\n");
+    }
+
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 step_ticks = frequency / ((Uint64) tick_rate * substeps);
+    Uint64 accumulator = 0;
+    Uint64 last_time = SDL_GetPerformanceCounter();
+
+    while (!SDL_AtomicGet(&simulation.quit)) {
+        // only this thread may read the balls while they step
+        if (SDL_AtomicSet(&simulation.save, 0) && saveScene(balls) != 0) {
+            fprintf(stderr, "Could not save the scene to %s!\n", save_path);
+        }
+
+        Uint64 now = SDL_GetPerformanceCounter();
+        accumulator += now - last_time;
+        last_time = now;
+
+        int steps = 0;
+        if (SDL_AtomicGet(&simulation.paused)) {
+            accumulator = 0;
+            SDL_Delay(SIMULATION_PAUSED_MS);
+            continue;
+        }
+        else if (uncapped) {
+            Uint64 frame_end = now + frequency / tick_rate;
+            do {
+                stepBalls(balls);
+                steps++;
+            } while (SDL_GetPerformanceCounter() < frame_end);
+            accumulator = 0;
+
+            // there is no step to be into when stepping flat out
+            interpolation.prev_count = 0;
+        }
+        else {
+            while (accumulator >= step_ticks && steps < MAX_STEPS_PER_FRAME) {
+                if (interpolate) {
+                    rememberPositions(balls);
+                }
+                stepBalls(balls);
+                accumulator -= step_ticks;
+                steps++;
+            }
+
+            if (steps == MAX_STEPS_PER_FRAME) {
+                accumulator = 0;
+            }
+        }
+
+        if (steps == 0) {
+            // nothing is due yet, so give the core back until the next step
+            SDL_Delay(1);
+            continue;
+        }
+
+        SDL_AtomicAdd(&simulation.steps, steps);
+        profileFrame(PHASE_ASSIGN, PHASE_DRAW);
+
+        if (reorder_interval > 0 && ++reorder_frames >= reorder_interval) {
+            reorderBalls(balls);
+            reorder_frames = 0;
+            interpolation.prev_count = 0;
+        }
+
+        publishSnapshot(balls, now - accumulator);
+        wakePipeline();
+    }
+
+    return 0;
+}
+
+/*
+    Publishes the starting state and starts the simulation thread.
+    Returns 0 on success and 1 if the thread could not be created.
+*/
+int startSimulation(BallStore *balls) {
+    simulation.balls = balls;
+    SDL_AtomicSet(&simulation.quit, 0);
+    SDL_AtomicSet(&simulation.paused, pause);
+    SDL_AtomicSet(&simulation.steps, 0);
+    SDL_AtomicSet(&simulation.save, 0);
+    publishSnapshot(balls, SDL_GetPerformanceCounter());
+    wakePipeline();
+
+    simulation.thread = SDL_CreateThread(simulationMain, "simulation", NULL);
+    return simulation.thread == NULL;
+}
+
+void stopSimulation() {
+    SDL_AtomicSet(&simulation.quit, 1);
+    SDL_WaitThread(simulation.thread, NULL);
+}
+
+/*
+    Recording and replay of a run, for comparing timings of the very same
+    workload. A recording holds the initial state of every ball followed by
+    one record per frame: the number of physics steps the frame ran and the
+    inputs that changed the workload during it. A replay runs exactly those
+    steps and applies those inputs frame by frame, whatever the clock says,
+    so the physics and the drawing are the same from one replay to the next.
+    The engine, the broad phase, the options that change how it resolves
+    the contacts as RECORD_ bits, the sizing of the subspaces and of the
+    cell blocks, the verlet skin and the force fields are kept as well, and
+    a replay has to be given the same ones, since any of them steps the
+    same balls differently.
+    The file is little endian:
+        "BBRC" version ball_count radius substeps
+        world_width world_height engine broadphase
+        options cell_balls cell_block                     (Uint32 each)
+        verlet_skin gravity drag (float)
+        attractor_count (Uint32)
+        x y strength radius (float)                       per attractor
+        x y (Sint16) radius (Uint16) dir_x dir_y (Sint8)
+        mass (float)                                      per ball
+        steps (Uint32) inputs (Uint8)                     per frame
+*/
+#define RECORDING_MAGIC 0x43524242
+#define RECORDING_VERSION 5
+#define RECORDING_HEADER 16
+
+// Options that change how the contacts are resolved, as bits of the header.
+#define RECORD_INCREMENTAL 1
+#define RECORD_ADAPTIVE 2
+#define RECORD_CENTER 4
+#define RECORD_CCD 8
+#define RECORD_EVENTS 16
+#define RECORD_CONTACTS 32
+#define RECORD_SEPARATE 64
+#define RECORD_DETERMINISTIC 128
+#define RECORD_COLORED 256
+
+// Inputs that change the workload, as bits of a frame record.
+#define INPUT_PAUSE 1
+#define INPUT_GRID 2
+
+typedef enum RecordingMode {
+    RECORDING_OFF,
+    RECORDING_WRITE,
+    RECORDING_READ
+} RecordingMode;
+
+typedef struct Recording {
+    RecordingMode   mode;
+    FILE            *file;
+    Uint8           inputs;
+    // what the recording being replayed was made with
+    Uint32          engine;
+    Uint32          broadphase;
+    Uint32          options;
+    Uint32          cell_balls;
+    Uint32          cell_block;
+    float           verlet_skin;
+    float           gravity;
+    float           drag;
+    Uint32          attractor_count;
+    float           attractors[FIELD_MAX_ATTRACTORS][4];
+} Recording;
+
+Recording recording = { .mode = RECORDING_OFF };
+
+void writeLittleEndian(FILE *file, Uint32 value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        fputc((value >> (8 * i)) & 0xff, file);
+    }
+}
+
+/*
+    Reads a value of the given number of bytes.
+    Returns 0 on success and 1 at the end of the file.
+*/
+int readLittleEndian(FILE *file, Uint32 *value, int bytes) {
+    *value = 0;
+    for (int i = 0; i < bytes; i++) {
+        int byte = fgetc(file);
+        if (byte == EOF) {
+            return 1;
+        }
+        *value |= (Uint32) byte << (8 * i);
+    }
+    return 0;
+}
+
+/*
+    Returns the RECORD_ bits of the options the run was given.
+*/
+Uint32 recordingOptions() {
+    return (incrementalGrid ? RECORD_INCREMENTAL : 0) | (adaptiveGrid ? RECORD_ADAPTIVE : 0) |
+           (centerBinning ? RECORD_CENTER : 0) | (continuousCollisions ? RECORD_CCD : 0) |
+           (eventDriven ? RECORD_EVENTS : 0) | (persistentContacts ? RECORD_CONTACTS : 0) |
+           (separateContacts ? RECORD_SEPARATE : 0) | (deterministic ? RECORD_DETERMINISTIC : 0) |
+           (coloredContacts ? RECORD_COLORED : 0);
+}
+
+Uint32 floatBits(float value) {
+    Uint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+float bitsFloat(Uint32 bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/*
+    Returns the x, y, strength and radius of an attractor, the way they are
+    kept in a recording.
+*/
+void attractorFloats(const Attractor *attractor, float floats[4]) {
+    floats[0] = (float) attractor->x;
+    floats[1] = (float) attractor->y;
+    floats[2] = (float) attractor->strength;
+    floats[3] = (float) attractor->radius;
+}
+
+/*
+    Creates a recording and writes its header.
+    Returns 0 on success and 1 if the file could not be created.
+*/
+int startRecording(const char *path, int ball_amnt, int radius) {
+    recording.file = fopen(path, "wb");
+    if (recording.file == NULL) {
+        return 1;
+    }
+
+    writeLittleEndian(recording.file, RECORDING_MAGIC, 4);
+    writeLittleEndian(recording.file, RECORDING_VERSION, 4);
+    writeLittleEndian(recording.file, ball_amnt, 4);
+    writeLittleEndian(recording.file, radius, 4);
+    writeLittleEndian(recording.file, substeps, 4);
+    writeLittleEndian(recording.file, world_width, 4);
+    writeLittleEndian(recording.file, world_height, 4);
+    writeLittleEndian(recording.file, engine, 4);
+    writeLittleEndian(recording.file, broadphase, 4);
+    writeLittleEndian(recording.file, recordingOptions(), 4);
+    writeLittleEndian(recording.file, subspace_balls, 4);
+    writeLittleEndian(recording.file, cell_block, 4);
+    writeLittleEndian(recording.file, floatBits(verlet_skin), 4);
+    writeLittleEndian(recording.file, floatBits(forceFields.gravity), 4);
+    writeLittleEndian(recording.file, floatBits(forceFields.drag), 4);
+    writeLittleEndian(recording.file, forceFields.attractorCount, 4);
+    for (int f = 0; f < forceFields.attractorCount; f++) {
+        float floats[4];
+        attractorFloats(&forceFields.attractors[f], floats);
+        for (int i = 0; i < 4; i++) {
+            writeLittleEndian(recording.file, floatBits(floats[i]), 4);
+        }
+    }
+    recording.mode = RECORDING_WRITE;
+    return 0;
+}
+
+/*
+    Opens a recording and reads its header, which takes the place of the
+    number of balls, their radius, the substeps and the size of the world
+    given on the command line.
+    Returns 0 on success and 1 if the file is not a recording.
+*/
+int startReplay(const char *path, int *ball_amnt, int *radius) {
+    recording.file = fopen(path, "rb");
+    if (recording.file == NULL) {
+        return 1;
+    }
+
+    Uint32 header[RECORDING_HEADER];
+    for (int i = 0; i < RECORDING_HEADER; i++) {
+        if (readLittleEndian(recording.file, &header[i], 4) != 0) {
+            fclose(recording.file);
+            return 1;
+        }
+    }
+    if (header[0] != RECORDING_MAGIC || header[1] != RECORDING_VERSION || header[4] < 1 ||
+        header[5] < 100 || header[5] > WORLD_MAX_SIZE || header[6] < 100 || header[6] > WORLD_MAX_SIZE ||
+        header[15] > FIELD_MAX_ATTRACTORS) {
+        fclose(recording.file);
+        return 1;
+    }
+    for (Uint32 f = 0; f < header[15]; f++) {
+        for (int i = 0; i < 4; i++) {
+            Uint32 bits;
+            if (readLittleEndian(recording.file, &bits, 4) != 0) {
+                fclose(recording.file);
+                return 1;
+            }
+            recording.attractors[f][i] = bitsFloat(bits);
+        }
+    }
+
+    *ball_amnt = header[2];
+    *radius = header[3];
+    substeps = header[4];
+    world_width = header[5];
+    world_height = header[6];
+    recording.engine = header[7];
+    recording.broadphase = header[8];
+    recording.options = header[9];
+    recording.cell_balls = header[10];
+    recording.cell_block = header[11];
+    recording.verlet_skin = bitsFloat(header[12]);
+    recording.gravity = bitsFloat(header[13]);
+    recording.drag = bitsFloat(header[14]);
+    recording.attractor_count = header[15];
+    recording.mode = RECORDING_READ;
+    return 0;
+}
+
+/*
+    Returns whether the run was given the engine, the broad phase, the
+    options, the sizing and the force fields the recording being replayed
+    was made with.
+*/
+bool replayMatches() {
+    if (recording.engine != (Uint32) engine || recording.broadphase != (Uint32) broadphase ||
+        recording.options != recordingOptions() || recording.cell_balls != (Uint32) subspace_balls ||
+        recording.cell_block != (Uint32) cell_block || recording.verlet_skin != (float) verlet_skin ||
+        recording.gravity != (float) forceFields.gravity || recording.drag != (float) forceFields.drag ||
+        recording.attractor_count != (Uint32) forceFields.attractorCount) {
+        return false;
+    }
+    for (int f = 0; f < forceFields.attractorCount; f++) {
+        float floats[4];
+        attractorFloats(&forceFields.attractors[f], floats);
+        for (int i = 0; i < 4; i++) {
+            if (floats[i] != recording.attractors[f][i]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+    Writes the initial state of the balls to the recording.
+*/
+void recordBalls(BallStore *balls) {
+    for (int ball = 0; ball < balls->count; ball++) {
+        writeLittleEndian(recording.file, (Sint16) balls->pos_x[ball], 2);
+        writeLittleEndian(recording.file, (Sint16) balls->pos_y[ball], 2);
+        writeLittleEndian(recording.file, balls->radius[ball], 2);
+        writeLittleEndian(recording.file, (Sint8) balls->dir_x[ball], 1);
+        writeLittleEndian(recording.file, (Sint8) balls->dir_y[ball], 1);
+
+        float mass = balls->mass[ball];
+        Uint32 bits;
+        memcpy(&bits, &mass, sizeof(bits));
+        writeLittleEndian(recording.file, bits, 4);
+    }
+}
+
+/*
+    Makes the given number of balls from the initial state in the recording.
+    Returns 0 on success and 1 if the recording ends early.
+*/
+int replayBalls(BallStore *balls, int ball_amnt) {
+    for (int i = 0; i < ball_amnt; i++) {
+        Uint32 x, y, r, dir_x, dir_y, bits;
+        if (readLittleEndian(recording.file, &x, 2) != 0 || readLittleEndian(recording.file, &y, 2) != 0 ||
+            readLittleEndian(recording.file, &r, 2) != 0 || readLittleEndian(recording.file, &dir_x, 1) != 0 ||
+            readLittleEndian(recording.file, &dir_y, 1) != 0 || readLittleEndian(recording.file, &bits, 4) != 0) {
+            return 1;
+        }
+
+        float mass;
+        memcpy(&mass, &bits, sizeof(mass));
+        if (!(mass > 0)) {
+            return 1;
+        }
+
+        int ball = makeBall(balls, (Sint16) x, (Sint16) y, r);
+        balls->dir_x[ball] = (Sint8) dir_x;
+        balls->dir_y[ball] = (Sint8) dir_y;
+        setBallMass(balls, ball, mass);
+    }
+    return 0;
+}
+
+/*
+    Writes the record of a frame that ran the given number of steps, with
+    the inputs noted since the last one.
+*/
+void recordFrame(int steps) {
+    writeLittleEndian(recording.file, steps, 4);
+    writeLittleEndian(recording.file, recording.inputs, 1);
+    recording.inputs = 0;
+}
+
+/*
+    Reads the record of the next frame, keeping its inputs for
+    replayInputs.
+    Returns 0 on success and 1 once the recording is over.
+*/
+int replayFrame(int *steps) {
+    Uint32 count, inputs;
+    if (readLittleEndian(recording.file, &count, 4) != 0 || readLittleEndian(recording.file, &inputs, 1) != 0) {
+        return 1;
+    }
+    *steps = count;
+    recording.inputs = inputs;
+    return 0;
+}
+
+/*
+    Applies the inputs of the frame being replayed, at the point of the
+    frame where they were handled when it was recorded.
+*/
+void replayInputs() {
+    if (recording.inputs & INPUT_PAUSE) {
+        pause = pause ? false : true;
+    }
+    if (recording.inputs & INPUT_GRID) {
+        showGrid = showGrid ? false : true;
+    }
+    recording.inputs = 0;
+}
+
+void stopRecording() {
+    if (recording.mode != RECORDING_OFF) {
+        fclose(recording.file);
+        recording.mode = RECORDING_OFF;
+    }
+}
+
+/*
+    What the window lets the loop skip. Minimized or hidden, nothing that is
+    drawn can be seen, and paused, nothing changes once the last frame
+    is on screen, so in all three cases the loop stops stepping and
+    presenting and waits for events instead. Redraw asks for one more frame
+    while paused, after the window was exposed or a setting changed.
+*/
+typedef struct WindowState {
+    bool    minimized;
+    bool    hidden;
+    bool    redraw;
+} WindowState;
+
+// Longest sleep of an idle loop, in milliseconds.
+#define IDLE_WAKE_MS 250
+
+WindowState windowState = { .redraw = true };
+
+bool isIdle() {
+    // a paused replay still has recorded frames to run
+    bool paused = pause && !windowState.redraw && recording.mode != RECORDING_READ;
+    return windowState.minimized || windowState.hidden || paused;
+}
+
+/*
+    Tells the simulation thread whether to stop stepping.
+*/
+void updateSimulationPause() {
+    SDL_AtomicSet(&simulation.paused, pause || windowState.minimized || windowState.hidden);
+}
+
+/*
+    Reacts to one event from the SDL queue. Clears running once the program
+    is asked to quit.
+*/
+void handleEvent(SDL_Event *e, bool *running) {
+    switch (e->type) {
+        // quitting the game
+        case SDL_QUIT :
+            *running = false;
+            break;
+
+        case SDL_WINDOWEVENT :
+            switch (e->window.event) {
+                case SDL_WINDOWEVENT_MINIMIZED :
+                    windowState.minimized = true;
+                    break;
+                case SDL_WINDOWEVENT_RESTORED :
+                case SDL_WINDOWEVENT_MAXIMIZED :
+                    windowState.minimized = false;
+                    break;
+                case SDL_WINDOWEVENT_HIDDEN :
+                    windowState.hidden = true;
+                    break;
+                case SDL_WINDOWEVENT_SHOWN :
+                    windowState.hidden = false;
+                    break;
+            }
+            updateSimulationPause();
+            windowState.redraw = true;
+            break;
+
+        // the contents of target textures are lost with the device
+        case SDL_RENDER_TARGETS_RESET :
+            gridOverlay.stale = true;
+            windowState.redraw = true;
+            break;
+        case SDL_RENDER_DEVICE_RESET :
+            freeGridOverlay();
+            gridOverlay.texture = NULL;
+            windowState.redraw = true;
+            break;
+
+        // the mouse wheel zooms around the pointer, and dragging pans
+        case SDL_MOUSEWHEEL :
+            if (e->wheel.y != 0) {
+                int x;
+                int y;
+                SDL_GetMouseState(&x, &y);
+                zoomCamera(e->wheel.y > 0 ? CAMERA_ZOOM_STEP : 1 / CAMERA_ZOOM_STEP, x, y);
+                windowState.redraw = true;
+            }
+            break;
+        case SDL_MOUSEMOTION :
+            if (e->motion.state & SDL_BUTTON_LMASK) {
+                panCamera(-e->motion.xrel, -e->motion.yrel);
+                windowState.redraw = true;
+            }
+            break;
+
+        // key pressed
+        case SDL_KEYDOWN :
+            windowState.redraw = true;
+            switch(e->key.keysym.sym) {
+                case SDLK_ESCAPE :
+                    SDL_Event quit_event;
+                    quit_event.type = SDL_QUIT;
+                    SDL_PushEvent(&quit_event);
+                    break;
+                // a replay takes these from the recording instead
+                case SDLK_p :
+                    if (recording.mode == RECORDING_READ) {
+                        break;
+                    }
+                    pause = pause ? false : true;
+                    recording.inputs |= INPUT_PAUSE;
+                    updateSimulationPause();
+                    break;
+                case SDLK_g :
+                    if (recording.mode == RECORDING_READ) {
+                        break;
+                    }
+                    showGrid = showGrid ? false : true;
+                    recording.inputs |= INPUT_GRID;
+                    break;
+#ifdef BALLS_PROFILE
+                case SDLK_h :
+                    showProfile = showProfile ? false : true;
+                    break;
+#endif
+                case SDLK_s :
+                    saveRequested = true;
+                    break;
+                case SDLK_t :
+                    if (tracing && writeTrace() != 0) {
+                        fprintf(stderr, "Could not write the trace!\n");
+                    }
+                    break;
+                case SDLK_LEFT :
+                    panCamera(-CAMERA_PAN, 0);
+                    break;
+                case SDLK_RIGHT :
+                    panCamera(CAMERA_PAN, 0);
+                    break;
+                case SDLK_UP :
+                    panCamera(0, -CAMERA_PAN);
+                    break;
+                case SDLK_DOWN :
+                    panCamera(0, CAMERA_PAN);
+                    break;
+                case SDLK_HOME :
+                    resetCamera();
+                    break;
+                case SDLK_v :
+                    setPacingMode((pacer.mode + 1) % (PACING_UNCAPPED + 1));
+                    break;
+                case SDLK_PLUS :
+                case SDLK_EQUALS :
+                case SDLK_KP_PLUS :
+                    changeTargetRate(PACING_FPS_STEP);
+                    break;
+                case SDLK_MINUS :
+                case SDLK_KP_MINUS :
+                    changeTargetRate(-PACING_FPS_STEP);
+                    break;
+            }
+    }
+}
+
+/*
+    How the balls are scattered at the start. Uniform spreads them evenly
+    over the screen; clustered piles them up around a few random centers,
+    which leaves most subspaces empty and a few of them crowded; poisson
+    spreads them evenly too, but with no two overlapping and none in a
+    wall, so the first steps have no pile-ups to resolve.
+    The rest are the stress patterns of load testing: lattice packs the
+    balls edge to edge in a hexagonal block at the center of the world,
+    gas sends them flying in every direction at one high speed, and fronts
+    splits them into two walls at either side that run into each other.
+    Every placement is drawn from the seed, and most take parameters after
+    a colon, which placement_params holds.
+*/
+typedef enum Placement {
+    PLACEMENT_UNIFORM,
+    PLACEMENT_CLUSTERED,
+    PLACEMENT_POISSON,
+    PLACEMENT_LATTICE,
+    PLACEMENT_GAS,
+    PLACEMENT_FRONTS
+} Placement;
+
+#define PLACEMENT_CLUSTERS 8
+#define PLACEMENT_MAX_CLUSTERS 256
+// Farthest a clustered ball starts from its center along either axis, in pixels.
+#define PLACEMENT_SPREAD 80
+// Pixels between the balls of the lattice, and the speed they jitter at.
+#define PLACEMENT_LATTICE_GAP 0
+#define PLACEMENT_LATTICE_SPEED 1
+#define PLACEMENT_GAS_SPEED 16
+#define PLACEMENT_FRONTS_SPEED 4
+
+// Candidates tried around a sample before it is given up on.
+#define POISSON_ATTEMPTS 30
+// Samples that fill an area, per square of the distance between them,
+// rounded down from the 0.69 or so of Bridson's method.
+#define POISSON_DENSITY 0.6
+
+Placement placement = PLACEMENT_UNIFORM;
+const char *placement_names[] = { "uniform", "clustered", "poisson", "lattice", "gas", "fronts" };
+
+/*
+    The parameters of the placement: clusters and spread for clustered,
+    gap and speed for lattice, speed for gas and fronts.
+*/
+typedef struct PlacementParams {
+    int     clusters;
+    int     spread;
+    int     gap;
+    int     speed;
+} PlacementParams;
+
+PlacementParams placement_params = {
+    .clusters = PLACEMENT_CLUSTERS,
+    .spread = PLACEMENT_SPREAD
+};
+
+/*
+    The radius of the largest ball with --max-radius, 0 when every ball is
+    as large as the radius given on the command line.
+*/
+int max_radius = 0;
+
+int clampInt(int value, int low, int high) {
+    return value < low ? low : value > high ? high : value;
+}
+
+/*
+    A xorshift generator, for placing balls on several threads at once,
+    as the worlds of an ensemble are, where the one sequence of rand
+    shared by the whole process would depend on which thread got there
+    first. Everything else places from rand and a NULL generator, so the
+    scenes of a seed stay what they always were.
+*/
+typedef struct Xorshift {
+    Uint64  state;
+} Xorshift;
+
+/*
+    Starts the generator from the given seed, mixed so that neighbouring
+    seeds start far apart and the state is never 0.
+*/
+void seedXorshift(Xorshift *random, unsigned int seed) {
+    Uint64 z = (Uint64) seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    random->state = z != 0 ? z : 1;
+}
+
+/*
+    A random number from 0 to RAND_MAX, like rand, from the generator, or
+    from rand itself without one.
+*/
+int randomInt(Xorshift *random) {
+    if (random == NULL) {
+        return rand();
+    }
+    Uint64 x = random->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    random->state = x;
+    return (int) (((x * 0x2545F4914F6CDD1DULL) >> 33) % ((Uint64) RAND_MAX + 1));
+}
+
+/*
+    A random number in [0, 1), from randomInt so the seed decides it.
+*/
+double randomUnit(Xorshift *random) {
+    return randomInt(random) / ((double) RAND_MAX + 1);
+}
+
+/*
+    Fills the world with points at least distance apart and at least
+    margin from every wall, with Bridson's Poisson-disk sampling: new
+    points are tried in a ring around a random active point, and a point
+    that finds no room after POISSON_ATTEMPTS tries stops being active.
+    A background grid with cells distance / sqrt(2) wide holds at most one
+    point per cell, so every candidate is checked against the points of
+    the 5 x 5 cells around it only and the whole run takes time linear in
+    the number of points.
+    The points are returned in xs and ys, which the caller frees, and the
+    random numbers come from randomInt.
+    Returns the number of points, or -1 if the memory ran out.
+*/
+int samplePoissonDisk(double distance, int margin, int **xs, int **ys, Xorshift *random) {
+    double left = margin;
+    double top = margin;
+    double width = world_width - 2 * margin > 0 ? world_width - 2 * margin : 0;
+    double height = world_height - 2 * margin > 0 ? world_height - 2 * margin : 0;
+
+    double cell = distance / sqrt(2);
+    int columns = (int) (width / cell) + 1;
+    int rows = (int) (height / cell) + 1;
+    size_t capacity = (size_t) columns * rows;
+
+    int *grid = malloc(sizeof(int) * capacity);
+    double *px = malloc(sizeof(double) * capacity);
+    double *py = malloc(sizeof(double) * capacity);
+    int *active = malloc(sizeof(int) * capacity);
+    *xs = malloc(sizeof(int) * capacity);
+    *ys = malloc(sizeof(int) * capacity);
+    if (grid == NULL || px == NULL || py == NULL || active == NULL || *xs == NULL || *ys == NULL) {
+        free(grid);
+        free(px);
+        free(py);
+        free(active);
+        free(*xs);
+        free(*ys);
+        return -1;
+    }
+    for (size_t c = 0; c < capacity; c++) {
+        grid[c] = -1;
+    }
+
+    int count = 0;
+    int active_count = 0;
+    px[0] = left + randomUnit(random) * width;
+    py[0] = top + randomUnit(random) * height;
+    grid[(int) ((px[0] - left) / cell) + (int) ((py[0] - top) / cell) * columns] = 0;
+    active[active_count++] = count++;
+
+    while (active_count > 0) {
+        int a = (int) (randomUnit(random) * active_count);
+        int from = active[a];
+        bool placed = false;
+
+        for (int attempt = 0; attempt < POISSON_ATTEMPTS && !placed; attempt++) {
+            double angle = randomUnit(random) * 2 * M_PI;
+            double reach = distance * (1 + randomUnit(random));
+            double x = px[from] + cos(angle) * reach;
+            double y = py[from] + sin(angle) * reach;
+            if (x < left || x > left + width || y < top || y > top + height) {
+                continue;
+            }
+
+            int column = (int) ((x - left) / cell);
+            int row = (int) ((y - top) / cell);
+            bool free_spot = true;
+            for (int r = SDL_max(row - 2, 0); r <= SDL_min(row + 2, rows - 1) && free_spot; r++) {
+                for (int c = SDL_max(column - 2, 0); c <= SDL_min(column + 2, columns - 1); c++) {
+                    int other = grid[c + r * columns];
+                    if (other >= 0 && (px[other] - x) * (px[other] - x) + (py[other] - y) * (py[other] - y) < distance * distance) {
+                        free_spot = false;
+                        break;
+                    }
+                }
+            }
+
+            if (free_spot) {
+                px[count] = x;
+                py[count] = y;
+                grid[column + row * columns] = count;
+                active[active_count++] = count++;
+                placed = true;
+            }
+        }
+
+        if (!placed) {
+            active[a] = active[--active_count];
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        (*xs)[i] = (int) lround(px[i]);
+        (*ys)[i] = (int) lround(py[i]);
+    }
+
+    free(grid);
+    free(px);
+    free(py);
+    free(active);
+    return count;
+}
+
+/*
+    Places up to ball_amnt balls with Poisson-disk sampling, in xs and ys.
+    The points are kept far enough apart that no two balls overlap once
+    rounded to whole pixels, and spread out further when the world has the
+    room, so a sparse scene covers the whole world instead of a patch of
+    it: the world is filled once, at the distance that makes a few more
+    points than balls, and ball_amnt of them are picked at random.
+    Returns the number of balls placed, which is less than ball_amnt when
+    the world cannot fit them all apart. Exits if the memory runs out.
+*/
+int placePoisson(int ball_amnt, int radius, int **xs, int **ys, Xorshift *random) {
+    double area = (double) world_width * world_height;
+    double spread = sqrt(POISSON_DENSITY * area / (ball_amnt > 0 ? ball_amnt : 1));
+    // rounding moves two points at most sqrt(2) closer together
+    double distance = fmax(2 * radius + sqrt(2), spread);
+
+    int count = samplePoissonDisk(distance, radius + 1, xs, ys, random);
+    if (count < 0) {
+        fprintf(stderr, "Could not allocate the Poisson-disk samples!\n");
+        exit(1);
+    }
+
+    // the first ball_amnt of a partial shuffle are a random pick
+    int placed = count < ball_amnt ? count : ball_amnt;
+    for (int i = 0; i < placed; i++) {
+        int k = i + (int) (randomUnit(random) * (count - i));
+        int x = (*xs)[i];
+        int y = (*ys)[i];
+        (*xs)[i] = (*xs)[k];
+        (*ys)[i] = (*ys)[k];
+        (*xs)[k] = x;
+        (*ys)[k] = y;
+    }
+    return placed;
+}
+
+/*
+    The hexagonal block of the lattice placement: rows of columns balls
+    pitch apart, row_height apart from one row to the next, every other
+    row shifted by half the pitch, with the first ball at left, top.
+*/
+typedef struct Lattice {
+    int     columns;
+    int     rows;
+    double  pitch;
+    double  row_height;
+    double  left;
+    double  top;
+} Lattice;
+
+/*
+    Lays out a lattice for ball_amnt balls of the given radius, gap pixels
+    apart, as close to square as the world allows and centered in it.
+    Returns the number of balls it holds, which is less than ball_amnt
+    when the world cannot fit them all.
+*/
+int planLattice(Lattice *lattice, int ball_amnt, int radius, int gap) {
+    double pitch = 2 * radius + gap;
+    double row_height = pitch * sqrt(3) / 2;
+
+    // the centers stay a radius and a pixel clear of the walls
+    double width = world_width - 2 * (radius + 1);
+    double height = world_height - 2 * (radius + 1);
+    int max_columns = SDL_max((int) ((width - pitch / 2) / pitch) + 1, 1);
+    int max_rows = SDL_max((int) (height / row_height) + 1, 1);
+
+    // as many rows as columns take up as much height as width
+    int columns = clampInt((int) ceil(sqrt(ball_amnt * sqrt(3) / 2)), 1, max_columns);
+    int rows = clampInt((ball_amnt + columns - 1) / columns, 1, max_rows);
+
+    *lattice = (Lattice) {
+        .columns = columns,
+        .rows = rows,
+        .pitch = pitch,
+        .row_height = row_height,
+        .left = (world_width - (columns - 1) * pitch - (rows > 1 ? pitch / 2 : 0)) / 2,
+        .top = (world_height - (rows - 1) * row_height) / 2
+    };
+    return SDL_min(ball_amnt, columns * rows);
+}
+
+/*
+    Makes the given number of balls with random positions and velocities,
+    scattered the way placement says. With --max-radius the radii are
+    spread from radius to max_radius, evenly on a log scale so there are as
+    many balls of every octave of sizes. The masses follow massModel. With
+    --slab only the balls of this process are made, from the very same
+    random numbers, so the slabs of all processes add up to the scene of a
+    single one. Without a store the balls are only counted. The random
+    numbers come from randomInt.
+    Returns the number of balls made.
+*/
+int scatterBalls(BallStore *balls, int ball_amnt, int radius, Xorshift *random) {
+    int made = 0;
+    int largest = max_radius > radius ? max_radius : radius;
+    int center_x[PLACEMENT_MAX_CLUSTERS];
+    int center_y[PLACEMENT_MAX_CLUSTERS];
+    if (placement == PLACEMENT_CLUSTERED) {
+        for (int c = 0; c < placement_params.clusters; c++) {
+            center_x[c] = randomInt(random) % (world_width + 1);
+            center_y[c] = randomInt(random) % (world_height + 1);
+        }
+    }
+
+    int *poisson_x = NULL;
+    int *poisson_y = NULL;
+    if (placement == PLACEMENT_POISSON) {
+        int placed = placePoisson(ball_amnt, largest, &poisson_x, &poisson_y, random);
+        if (placed < ball_amnt && balls != NULL) {
+            logInfo("Only %d of the balls fit apart from each other\n", placed);
+        }
+        ball_amnt = placed;
+    }
+
+    Lattice lattice;
+    if (placement == PLACEMENT_LATTICE) {
+        int placed = planLattice(&lattice, ball_amnt, largest, placement_params.gap);
+        if (placed < ball_amnt && balls != NULL) {
+            logInfo("Only %d of the balls fit on the lattice\n", placed);
+        }
+        ball_amnt = placed;
+    }
+
+    for (int i = 0; i < ball_amnt; i++) {
+        int x;
+        int y;
+        if (placement == PLACEMENT_POISSON) {
+            x = poisson_x[i];
+            y = poisson_y[i];
+        }
+        else if (placement == PLACEMENT_CLUSTERED) {
+            // the sum of two uniform offsets thins out away from the center
+            int c = i % placement_params.clusters;
+            int spread = placement_params.spread / 2;
+            x = center_x[c] + randomInt(random) % (spread * 2 + 1) + randomInt(random) % (spread * 2 + 1) - spread * 2;
+            y = center_y[c] + randomInt(random) % (spread * 2 + 1) + randomInt(random) % (spread * 2 + 1) - spread * 2;
+            x = clampInt(x, 0, world_width);
+            y = clampInt(y, 0, world_height);
+        }
+        else if (placement == PLACEMENT_LATTICE) {
+            int column = i % lattice.columns;
+            int row = i / lattice.columns;
+            x = (int) lround(lattice.left + column * lattice.pitch + (row % 2) * lattice.pitch / 2);
+            y = (int) lround(lattice.top + row * lattice.row_height);
+        }
+        else if (placement == PLACEMENT_FRONTS) {
+            // every other ball to the wall in the left or the right quarter
+            int depth = world_width / 4;
+            x = randomInt(random) % (depth + 1);
+            x = i % 2 == 0 ? x : world_width - x;
+            y = randomInt(random) % (world_height + 1);
+        }
+        else {
+            x = randomInt(random) % (world_width + 1);
+            y = randomInt(random) % (world_height + 1);
+        }
+
+        // whole pixels per step, as a recording holds them
+        int dir_x;
+        int dir_y;
+        if (placement == PLACEMENT_LATTICE) {
+            dir_x = randomInt(random) % (2 * placement_params.speed + 1) - placement_params.speed;
+            dir_y = randomInt(random) % (2 * placement_params.speed + 1) - placement_params.speed;
+        }
+        else if (placement == PLACEMENT_GAS) {
+            double angle = randomUnit(random) * 2 * M_PI;
+            dir_x = (int) lround(cos(angle) * placement_params.speed);
+            dir_y = (int) lround(sin(angle) * placement_params.speed);
+        }
+        else if (placement == PLACEMENT_FRONTS) {
+            dir_x = i % 2 == 0 ? placement_params.speed : -placement_params.speed;
+            dir_y = 0;
+        }
+        else {
+            dir_x = (randomInt(random) % 10) - 5;
+            dir_y = (randomInt(random) % 10) - 5;
+        }
+
+        // only drawn for mixed sizes, so a scene of one size stays the same
+        int size = radius;
+        if (largest > radius) {
+            size = (int) lround(radius * pow((double) largest / radius, randomUnit(random)));
+        }
+        if (!slabOwns(x)) {
+            continue;
+        }
+
+        if (balls != NULL) {
+            int ball = makeBall(balls, x, y, size);
+            balls->dir_x[ball] = dir_x;
+            balls->dir_y[ball] = dir_y;
+            if (massModel == MASS_AREA) {
+                setBallMass(balls, ball, (real) size * size);
+            }
+        }
+        made++;
+    }
+
+    free(poisson_x);
+    free(poisson_y);
+    return made;
+}
+
+/*
+    Number of steps of a headless run, 0 to open the window as usual.
+*/
+int headless_steps = 0;
+
+/*
+    Runs the given number of physics steps back to back, without drawing,
+    and prints how fast they went.
+*/
+void runHeadless(BallStore *balls, int steps) {
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    for (int step = 0; step < steps; step++) {
+        if (reorder_interval > 0 && ++reorder_frames >= reorder_interval) {
+            reorderBalls(balls);
+            reorder_frames = 0;
+        }
+        if (distributed) {
+            stepSlab(balls);
+        }
+        else {
+            stepBalls(balls);
+        }
+        if (publisher.listener >= 0) {
+            publishFrame(balls, 1);
+        }
+        snapshotLatency(false);
+    }
+
+    double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    printf("Ran %d steps in %.3f s, %.1f steps/s\n", steps, seconds, steps / seconds);
+    if (distributed) {
+        printf("Slab %d of %d owns %d balls, %lld migrated out\n", slab.index, slab.count, balls->count, (long long) slab.migrated);
+    }
+    if (verlet_skin > 0) {
+        printf("Rebuilt the neighbour lists %ld times\n", verletLists.rebuilds);
+    }
+    if (sleep_speed > 0) {
+        printf("%d of %d balls asleep, %ld fell asleep and %ld woke\n", balls->count - sleepState.awake, balls->count,
+               sleepState.slept, sleepState.woke);
+        SleeperOverlaps overlaps = sleeperOverlaps(balls);
+        if (overlaps.count > 0) {
+            printf("%d resting balls are inside a sleeping ball by more than %d pixel, the deepest by %.2f\n",
+                   overlaps.count, SLEEP_MARGIN, (double) overlaps.deepest);
+        }
+    }
+}
+
+/*
+    With --ensemble, the number of independent worlds stepped side by side
+    instead of the one scene, 0 for the one scene.
+    Every world is a world of libbouncy, built from <number> <radius> and
+    the placement options like the scene would be, from a seed of its own
+    and a Xorshift generator of its own, so the worlds are placed on all
+    threads at once.
+*/
+int ensemble_count = 0;
+
+// A batch of worlds is handed to a thread at once, as many of them as fit
+// about ENSEMBLE_BATCH_BYTES, at around ENSEMBLE_BYTES_PER_BALL each ball.
+#define ENSEMBLE_BATCH_BYTES (256 * 1024)
+#define ENSEMBLE_BYTES_PER_BALL 96
+
+/*
+    The summary of one world of an ensemble once its steps are done.
+*/
+typedef struct EnsembleSummary {
+    unsigned int    seed;
+    int             balls;
+    long            steps;
+    double          energy;
+    double          momentum_x;
+    double          momentum_y;
+    double          seconds;
+    bool            failed;
+} EnsembleSummary;
+
+typedef struct EnsembleJob {
+    EnsembleSummary*    summaries;
+    unsigned int        seed;
+    int                 balls;
+    int                 radius;
+    int                 steps;
+} EnsembleJob;
+
+/*
+    Places, steps and sums up one world of the ensemble, scattering its
+    balls into the given store first. A world is made by the thread that
+    steps it, so its memory is where that thread touches it first.
+*/
+void runEnsembleWorld(EnsembleJob *job, BallStore *store, int world) {
+    EnsembleSummary *summary = &job->summaries[world];
+    Uint64 start = SDL_GetPerformanceCounter();
+    summary->seed = job->seed + world;
+
+    // the same seed places the same balls, whichever thread gets the world
+    Xorshift random;
+    seedXorshift(&random, summary->seed);
+    store->count = 0;
+    scatterBalls(store, job->balls, job->radius, &random);
+
+    int largest = max_radius > job->radius ? max_radius : job->radius;
+    BouncyWorld *bouncy = bouncyCreateWorld(world_width, world_height, store->count, largest);
+    if (bouncy == NULL) {
+        summary->failed = true;
+        return;
+    }
+    for (int i = 0; i < store->count; i++) {
+        BouncyBall ball = {
+            .x = store->pos_x[i],
+            .y = store->pos_y[i],
+            .dx = store->dir_x[i],
+            .dy = store->dir_y[i],
+            .radius = store->radius[i],
+            .mass = store->mass[i]
+        };
+        bouncyAddBall(bouncy, &ball);
+    }
+
+    bouncyStep(bouncy, job->steps);
+
+    summary->balls = bouncyBallCount(bouncy);
+    summary->steps = bouncyStepCount(bouncy);
+    for (int i = 0; i < summary->balls; i++) {
+        BouncyBall ball;
+        bouncyGetBall(bouncy, i, &ball);
+        summary->energy += ball.mass * (ball.dx * ball.dx + ball.dy * ball.dy) / 2;
+        summary->momentum_x += ball.mass * ball.dx;
+        summary->momentum_y += ball.mass * ball.dy;
+    }
+    bouncyFreeWorld(bouncy);
+
+    summary->seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+/*
+    Runs a batch of worlds one after the other on the same thread. Each
+    world takes all of its steps before the next one starts, so it stays
+    in the caches of the thread throughout, and the next world reuses the
+    memory the last one freed, still warm.
+*/
+void runEnsembleTask(int begin, int end, void *data) {
+    EnsembleJob *job = data;
+    BallStore store;
+    if (initBallStore(&store, job->balls) != 0) {
+        for (int world = begin; world < end; world++) {
+            job->summaries[world].failed = true;
+        }
+        return;
+    }
+
+    for (int world = begin; world < end; world++) {
+        runEnsembleWorld(job, &store, world);
+    }
+    freeBallStore(&store);
+}
+
+/*
+    Runs count worlds of the given number of balls for the given number of
+    steps each, on every thread of the pool, with the seeds from seed up.
+    Writes a CSV row summing up every world to the file at the given path,
+    or to stdout without one, in the order of the worlds, and prints how
+    fast they went all together.
+    Returns 0 on success and 1 if the file could not be written or a world
+    could not be allocated.
+*/
+int runEnsemble(int count, int steps, int ball_amnt, int radius, unsigned int seed, const char *path) {
+    EnsembleJob job = {
+        .summaries = calloc(count, sizeof(EnsembleSummary)),
+        .seed = seed,
+        .balls = ball_amnt,
+        .radius = radius,
+        .steps = steps
+    };
+    if (job.summaries == NULL) {
+        return 1;
+    }
+
+    // as many worlds to a batch as fit the caches, but enough batches to
+    // keep every thread busy
+    int grain = ENSEMBLE_BATCH_BYTES / ((ball_amnt + 1) * ENSEMBLE_BYTES_PER_BALL);
+    int share = (count + workerCount() - 1) / workerCount();
+    grain = clampInt(grain, 1, share);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    parallelFor(count, grain, runEnsembleTask, &job);
+    double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    FILE *file = path != NULL ? fopen(path, "w") : stdout;
+    if (file == NULL) {
+        free(job.summaries);
+        return 1;
+    }
+
+    int failed = 0;
+    double ball_steps = 0;
+    fprintf(file, "world,seed,balls,steps,energy,momentum_x,momentum_y,seconds\n");
+    for (int world = 0; world < count; world++) {
+        EnsembleSummary *summary = &job.summaries[world];
+        if (summary->failed) {
+            failed++;
+            continue;
+        }
+        fprintf(file, "%d,%u,%d,%ld,%.6f,%.6f,%.6f,%.6f\n", world, summary->seed, summary->balls, summary->steps,
+                summary->energy, summary->momentum_x, summary->momentum_y, summary->seconds);
+        ball_steps += (double) summary->balls * summary->steps;
+    }
+    bool written = !ferror(file);
+    if (path != NULL) {
+        written = fclose(file) == 0 && written;
+    }
+    free(job.summaries);
+
+    printf("Ran %d worlds of %d steps in %.3f s, %.1f world steps/s, %.0f ball steps/s, %d worlds to a batch\n",
+           count, steps, seconds, count * (double) steps / seconds, ball_steps / seconds, grain);
+    if (failed > 0) {
+        fprintf(stderr, "Could not allocate %d of the worlds!\n", failed);
+    }
+    return written && failed == 0 ? 0 : 1;
+}
+
+/*
+    Parses the name of a broad phase given on the command line.
+    Returns 0 on success and 1 if the name is unknown.
+*/
+int parseBroadPhase(const char *name, BroadPhase *out) {
+    if (strcmp(name, "grid") == 0) {
+        *out = BROADPHASE_GRID;
+    }
+    else if (strcmp(name, "sweep") == 0) {
+        *out = BROADPHASE_SWEEP;
+    }
+    else if (strcmp(name, "quadtree") == 0) {
+        *out = BROADPHASE_QUADTREE;
+    }
+    else if (strcmp(name, "hash") == 0) {
+        *out = BROADPHASE_HASH;
+    }
+    else if (strcmp(name, "hgrid") == 0) {
+        *out = BROADPHASE_HGRID;
+    }
+    else {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    With --autotune <file>, a broad phase and subspace size are picked at
+    startup by stepping the scene briefly under each candidate and keeping
+    the fastest. The file caches what was picked, one line per scene:
+    the number of balls, their radius and largest radius, the world size,
+    the number of threads, the engine, the mass model, the placement with
+    its clusters, spread, gap and speed, and the broad phase tried, or any
+    for all of them, followed by the broad phase and subspace size picked
+    for them. A scene already in the file is not tuned again, and lines
+    of any other shape are skipped.
+    Candidate sizes are multiples of the largest ball across, from
+    autotune_multiples, for the broad phases that go by subspaces.
+*/
+#define AUTOTUNE_WARMUP 3
+#define AUTOTUNE_STEPS 20
+
+const int autotune_multiples[] = { 1, 2, 3, 4, 6, 8 };
+
+typedef struct TuneKey {
+    int         balls;
+    int         radius;
+    int         max_radius;
+    int         width;
+    int         height;
+    int         threads;
+    const char* engine;
+    const char* mass;
+    char        placement[64];
+    int         phases;
+} TuneKey;
+
+/*
+    Returns the name of the broad phases tried for a key, -1 for all.
+*/
+const char* tunePhasesName(int phases) {
+    return phases < 0 ? "any" : broadphase_names[phases];
+}
+
+/*
+    Looks the scene up in the cache file. A missing file has no scenes.
+    Returns 0 if the scene was found, and 1 if not.
+*/
+int readTuneCache(const char *path, const TuneKey *key, BroadPhase *phase, int *size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 1;
+    }
+
+    char line[256];
+    int found = 1;
+    while (found != 0 && fgets(line, sizeof(line), file) != NULL) {
+        TuneKey entry;
+        char engine_name[16];
+        char mass_name[16];
+        char phases[16];
+        char name[16];
+        int entry_size;
+        if (sscanf(line, "%d %d %d %dx%d %d %15s %15s %63s %15s %15s %d", &entry.balls, &entry.radius,
+                   &entry.max_radius, &entry.width, &entry.height, &entry.threads, engine_name, mass_name,
+                   entry.placement, phases, name, &entry_size) == 12 &&
+            entry.balls == key->balls && entry.radius == key->radius && entry.max_radius == key->max_radius &&
+            entry.width == key->width && entry.height == key->height && entry.threads == key->threads &&
+            strcmp(engine_name, key->engine) == 0 && strcmp(mass_name, key->mass) == 0 &&
+            strcmp(entry.placement, key->placement) == 0 && strcmp(phases, tunePhasesName(key->phases)) == 0 &&
+            parseBroadPhase(name, phase) == 0 && entry_size > 0) {
+            *size = entry_size;
+            found = 0;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+/*
+    Appends the pick for the scene to the cache file.
+    Returns 0 on success and 1 if the file could not be written.
+*/
+int writeTuneCache(const char *path, const TuneKey *key, BroadPhase phase, int size) {
+    FILE *file = fopen(path, "a");
+    if (file == NULL) {
+        return 1;
+    }
+
+    fprintf(file, "%d %d %d %dx%d %d %s %s %s %s %s %d\n", key->balls, key->radius, key->max_radius, key->width,
+            key->height, key->threads, key->engine, key->mass, key->placement, tunePhasesName(key->phases),
+            broadphase_names[phase], size);
+    return fclose(file) != 0;
+}
+
+/*
+    Allocates what the current broad phase needs on the current grid, the
+    dense grid for all but the hash and the hierarchical grid, like main.
+    Returns 0 on success and 1 if an allocation failed.
+*/
+int initTuneCandidate(BallStore *balls, int amnt) {
+    if (broadphase == BROADPHASE_HASH) {
+        return initSpatialHash(amnt);
+    }
+    if (broadphase == BROADPHASE_HGRID) {
+        return initHierarchicalGrid(balls, amnt);
+    }
+    return initSubspaceGrid(amnt) != 0 || initSubspaceBuckets(amnt) != 0;
+}
+
+void freeTuneCandidate() {
+    if (broadphase == BROADPHASE_HASH) {
+        freeSpatialHash();
+    }
+    else if (broadphase == BROADPHASE_HGRID) {
+        freeHierarchicalGrid();
+    }
+    else {
+        freeSubspaceGrid();
+    }
+}
+
+/*
+    Steps a fresh copy of the scene under the current broad phase and grid,
+    placed again from the same random numbers, and returns how many seconds
+    a step took, or a negative number if the candidate could not be set up.
+*/
+double timeTuneCandidate(BallStore *balls, int amnt, int scene_amnt, int radius, unsigned int seed) {
+    balls->count = 0;
+    srand(seed);
+    scatterBalls(balls, scene_amnt, radius, NULL);
+    if (engine == ENGINE_FIXED) {
+        loadFixedState(balls);
+    }
+    selectCellKernel(uniformRadius(balls));
+
+    if (initTuneCandidate(balls, amnt) != 0 || initSweepOrder(amnt) != 0 || initQuadtree(amnt) != 0) {
+        return -1;
+    }
+
+    for (int step = 0; step < AUTOTUNE_WARMUP; step++) {
+        stepBalls(balls);
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int step = 0; step < AUTOTUNE_STEPS; step++) {
+        stepBalls(balls);
+    }
+    double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    freeTuneCandidate();
+    freeQuadtree();
+    free(sweepOrder);
+    return seconds / AUTOTUNE_STEPS;
+}
+
+/*
+    Picks the fastest broad phase and subspace size for the scene, or only
+    the fastest size with fixed_phase, from the cache file if it has the
+    scene and by timing every candidate otherwise, and leaves the broad
+    phase and the grid set to it. The grid itself is not allocated yet.
+    Returns 0 on success and 1 if a candidate could not be allocated.
+*/
+int autotune(const char *path, int amnt, int scene_amnt, int radius, unsigned int seed, bool fixed_phase) {
+    int largest = max_radius > radius ? max_radius : radius;
+    TuneKey key = {
+        .balls = scene_amnt,
+        .radius = radius,
+        .max_radius = largest,
+        .width = world_width,
+        .height = world_height,
+        .threads = workerCount(),
+        .engine = engine_names[engine],
+        .mass = mass_names[massModel],
+        .phases = fixed_phase ? (int) broadphase : -1
+    };
+    snprintf(key.placement, sizeof(key.placement), "%s:%d,%d,%d,%d", placement_names[placement],
+             placement_params.clusters, placement_params.spread, placement_params.gap, placement_params.speed);
+
+    // the size asked of configureSubspaces, which rounds it up to fit
+    BroadPhase best_phase = broadphase;
+    int best_size = 0;
+    if (readTuneCache(path, &key, &best_phase, &best_size) == 0) {
+        broadphase = best_phase;
+        configureSubspaces(best_size);
+        logInfo("Tuned by %s to the %s broad phase on %d pixel subspaces\n", path, broadphase_names[broadphase],
+                subspace_size_x);
+        return 0;
+    }
+
+    BallStore balls;
+    if (initBallStore(&balls, amnt) != 0 || (deterministic && initDeferredContacts(amnt) != 0) ||
+        (coloredContacts && initContactGraph(amnt) != 0)) {
+        return 1;
+    }
+
+    BroadPhase given = broadphase;
+    double best = -1;
+    for (int phase = BROADPHASE_GRID; phase <= BROADPHASE_HGRID; phase++) {
+        if (fixed_phase && phase != given) {
+            continue;
+        }
+
+        // only the grid and the hash go by the size of the subspaces
+        bool sized = phase == BROADPHASE_GRID || phase == BROADPHASE_HASH;
+        int last_x = 0;
+        int last_y = 0;
+        for (int m = 0; m < (int) SDL_arraysize(autotune_multiples); m++) {
+            int size = largest * 2 * (sized ? autotune_multiples[m] : subspace_balls);
+            configureSubspaces(size);
+            if (subspace_size_x == last_x && subspace_size_y == last_y) {
+                continue;
+            }
+            last_x = subspace_size_x;
+            last_y = subspace_size_y;
+
+            broadphase = phase;
+            double seconds = timeTuneCandidate(&balls, amnt, scene_amnt, radius, seed);
+            if (seconds < 0) {
+                return 1;
+            }
+            logInfo("The %s broad phase on %d pixel subspaces takes %.3f ms a step\n", broadphase_names[phase],
+                    subspace_size_x, seconds * 1000);
+            if (best < 0 || seconds < best) {
+                best = seconds;
+                best_phase = broadphase;
+                best_size = size;
+            }
+        }
+    }
+
+    freeBallStore(&balls);
+    if (deterministic) {
+        freeDeferredContacts();
+    }
+    if (coloredContacts) {
+        freeContactGraph();
+    }
+
+    broadphase = best_phase;
+    configureSubspaces(best_size);
+    logInfo("Tuned to the %s broad phase on %d pixel subspaces\n", broadphase_names[broadphase], subspace_size_x);
+    if (writeTuneCache(path, &key, broadphase, best_size) != 0) {
+        fprintf(stderr, "Could not cache the tuning in %s\n", path);
+    }
+    return 0;
+}
+
+/*
+    Parses the name of a render mode into out.
+    Returns 0 on success and 1 if the name is not a known render mode.
+*/
+int parseRenderMode(const char *name, RenderMode *out) {
+    if (strcmp(name, "points") == 0) {
+        *out = RENDER_POINTS;
+    }
+    else if (strcmp(name, "sprites") == 0) {
+        *out = RENDER_SPRITES;
+    }
+    else if (strcmp(name, "software") == 0) {
+        *out = RENDER_SOFTWARE;
+    }
+    else if (strcmp(name, "gl") == 0) {
+        *out = RENDER_GL;
+    }
+    else {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Parses the name of an engine mode into out.
+    Returns 0 on success and 1 if the name is not a known engine.
+*/
+int parseEngine(const char *name, EngineMode *out) {
+    if (strcmp(name, "real") == 0) {
+        *out = ENGINE_REAL;
+    }
+    else if (strcmp(name, "fixed") == 0) {
+        *out = ENGINE_FIXED;
+    }
+    else if (strcmp(name, "gpu") == 0) {
+        *out = ENGINE_GPU;
+    }
+    else {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Parses a placement, its name and then its parameters after a colon,
+    separated by commas, such as lattice:2,1. Parameters left out keep
+    their defaults. The parameters go to placement_params.
+    Returns 0 on success and 1 if the name is unknown or a parameter is
+    out of range.
+*/
+int parsePlacement(const char *spec, Placement *out) {
+    char name[16];
+    const char *colon = strchr(spec, ':');
+    size_t length = colon != NULL ? (size_t) (colon - spec) : strlen(spec);
+    if (length >= sizeof(name)) {
+        return 1;
+    }
+    memcpy(name, spec, length);
+    name[length] = '\0';
+
+    // the most parameters any placement takes
+    int values[2];
+    int value_count = 0;
+    if (colon != NULL) {
+        const char *at = colon + 1;
+        while (true) {
+            char *end;
+            long value = strtol(at, &end, 10);
+            if (end == at || value_count == 2 || value < 0 || value > WORLD_MAX_SIZE) {
+                return 1;
+            }
+            values[value_count++] = (int) value;
+            if (*end == '\0') {
+                break;
+            }
+            if (*end != ',') {
+                return 1;
+            }
+            at = end + 1;
+        }
+    }
+
+    PlacementParams params = {
+        .clusters = PLACEMENT_CLUSTERS,
+        .spread = PLACEMENT_SPREAD
+    };
+    int accepted = 0;
+    if (strcmp(name, "uniform") == 0) {
+        *out = PLACEMENT_UNIFORM;
+    }
+    else if (strcmp(name, "clustered") == 0) {
+        *out = PLACEMENT_CLUSTERED;
+        accepted = 2;
+        params.clusters = value_count > 0 ? values[0] : params.clusters;
+        params.spread = value_count > 1 ? values[1] : params.spread;
+        if (params.clusters < 1 || params.clusters > PLACEMENT_MAX_CLUSTERS || params.spread < 1) {
+            return 1;
+        }
+    }
+    else if (strcmp(name, "poisson") == 0) {
+        *out = PLACEMENT_POISSON;
+    }
+    else if (strcmp(name, "lattice") == 0) {
+        *out = PLACEMENT_LATTICE;
+        accepted = 2;
+        params.gap = value_count > 0 ? values[0] : PLACEMENT_LATTICE_GAP;
+        params.speed = value_count > 1 ? values[1] : PLACEMENT_LATTICE_SPEED;
+    }
+    else if (strcmp(name, "gas") == 0) {
+        *out = PLACEMENT_GAS;
+        accepted = 1;
+        params.speed = value_count > 0 ? values[0] : PLACEMENT_GAS_SPEED;
+    }
+    else if (strcmp(name, "fronts") == 0) {
+        *out = PLACEMENT_FRONTS;
+        accepted = 1;
+        params.speed = value_count > 0 ? values[0] : PLACEMENT_FRONTS_SPEED;
+    }
+    else {
+        return 1;
+    }
+
+    // a recording keeps the velocities in a byte
+    if (value_count > accepted || params.speed > SDL_MAX_SINT8) {
+        return 1;
+    }
+    placement_params = params;
+    return 0;
+}
+
+/*
+    With --config the options of a file go before those of the command
+    line, as CONFIG_MAX_ARGS arguments at most. A line holds one option
+    without its dashes and its value, and # starts a comment.
+*/
+#define CONFIG_MAX_ARGS 256
+#define CONFIG_LINE_SIZE 1024
+
+/*
+    Appends the arguments of the config file to args, from count on.
+    Returns 0 on success and 1 if the file could not be read or holds too
+    many arguments.
+*/
+int readConfig(const char *path, char **args, int *count) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open the config file %s!\n", path);
+        return 1;
+    }
+
+    char line[CONFIG_LINE_SIZE];
+    int number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        bool first = true;
+        for (char *token = strtok(line, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+            if (*count == CONFIG_MAX_ARGS) {
+                fprintf(stderr, "The config file %s has more than %d arguments!\n", path, CONFIG_MAX_ARGS);
+                fclose(file);
+                return 1;
+            }
+
+            // the first word of a line is the option, dashes or not
+            bool option = first && strncmp(token, "--", 2) != 0;
+            if (first && (strcmp(token, "config") == 0 || strcmp(token, "--config") == 0)) {
+                fprintf(stderr, "Line %d of %s: a config file cannot read another!\n", number, path);
+                fclose(file);
+                return 1;
+            }
+            first = false;
+
+            // kept for as long as the program runs, like argv
+            char *arg = malloc(strlen(token) + (option ? 3 : 1));
+            if (arg == NULL) {
+                fclose(file);
+                return 1;
+            }
+            sprintf(arg, option ? "--%s" : "%s", token);
+            args[(*count)++] = arg;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/*
+    Replaces the arguments with those of every --config file they name,
+    then the rest of them in order, so the command line has the last word.
+    Returns 0 on success and 1 if a config file could not be read.
+*/
+int loadConfig(int *argc, char ***argv) {
+    static char *args[CONFIG_MAX_ARGS + 1];
+    int count = 0;
+
+    bool found = false;
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp((*argv)[i], "--config") == 0 && i + 1 < *argc) {
+            found = true;
+            if (readConfig((*argv)[++i], args, &count) != 0) {
+                return 1;
+            }
+        }
+    }
+    if (!found) {
+        return 0;
+    }
+
+    // like the arguments of the file, kept for as long as the program runs
+    static char **merged;
+    merged = malloc(sizeof(char*) * (*argc + count + 1));
+    if (merged == NULL) {
+        return 1;
+    }
+    int merged_count = 0;
+    merged[merged_count++] = (*argv)[0];
+    for (int k = 0; k < count; k++) {
+        merged[merged_count++] = args[k];
+    }
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp((*argv)[i], "--config") == 0 && i + 1 < *argc) {
+            i++;
+            continue;
+        }
+        merged[merged_count++] = (*argv)[i];
+    }
+    merged[merged_count] = NULL;
+
+    *argc = merged_count;
+    *argv = merged;
+    return 0;
+}
+
+/*
+    Parses the name of a mass model into out.
+    Returns 0 on success and 1 if the name is not a known mass model.
+*/
+int parseMassModel(const char *name, MassModel *out) {
+    if (strcmp(name, "equal") == 0) {
+        *out = MASS_EQUAL;
+    }
+    else if (strcmp(name, "area") == 0) {
+        *out = MASS_AREA;
+    }
+    else {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Parses the name of a pacing mode into out.
+    Returns 0 on success and 1 if the name is not a known pacing mode.
+*/
+int parsePacing(const char *name, PacingMode *out) {
+    if (strcmp(name, "vsync") == 0) {
+        *out = PACING_VSYNC;
+    }
+    else if (strcmp(name, "precise") == 0) {
+        *out = PACING_PRECISE;
+    }
+    else if (strcmp(name, "uncapped") == 0) {
+        *out = PACING_UNCAPPED;
+    }
+    else {
+        return 1;
+    }
+    return 0;
+}
+
+// Left out when the core is compiled into another program, like the benchmark.
+#ifndef BALLS_NO_MAIN
+/*
+    Main function.
+    The intented usage is to provide two numerical arguments:
+    - Argument 1 is the number of balls to render on the screen.
+    - Argument 2 is the size of every ball (as a radius), or of the
+      smallest one with --max-radius.
+
+    Options may be given anywhere on the command line:
+    - --broadphase <grid|sweep|quadtree|hash|hgrid> picks the collision broad
+      phase (default grid). The hash keeps only the occupied subspaces, for
+      big, sparsely filled worlds. The hierarchical grid keeps one grid per
+      octave of ball sizes, for --max-radius; it does not support --ccd or
+      --events.
+    - --max-radius <radius> gives the balls random radii from <radius> up
+      to this one, instead of all the same.
+    - --mass <equal|area> makes every ball weigh the same, or as much as
+      its area, so large balls push small ones aside (default equal). The
+      fixed and gpu engines only bounce balls of equal mass.
+    - --incremental keeps the grid up to date incrementally instead of
+      rebuilding it every frame.
+    - --adaptive re-tunes the subspace size as the ball distribution changes.
+    - --binning <corners|center> lists every ball of the grid in each
+      subspace its corners reach, which is the default, or only in the one
+      of its center, testing every subspace against itself and four of its
+      eight neighbours so every pair comes up exactly once, on subspaces
+      as wide as the largest ball. It applies to the grid broad phase
+      without --incremental or --colored.
+    - --cell-block <cells> has the grid visit its subspaces in square blocks
+      of that many subspaces a side, up to 32, instead of row by row, so
+      the balls shared with the next row are reused while still cached.
+      It applies to the grid on one thread; 0 keeps the row order.
+    - --verlet <skin> has every ball keep a list of the balls within the
+      sum of their radii plus skin pixels, tests the lists in place of the
+      grid, and only rebuilds them once some ball has moved half the skin
+      since they were built. It pays off for dense scenes of slow balls,
+      and applies to the grid broad phase of the real engine on one thread.
+    - --sleep <speed> puts a ball to sleep once it has been slower than
+      speed pixels per step for 30 frames, leaving it out of the grid and
+      the integration until an awake ball faster than that touches it,
+      so piles at rest under --gravity and --drag cost next to nothing.
+      Slower balls rest on the sleepers as on a wall. The speed has to be
+      below the g / k a ball falls at, or balls fall asleep in mid air.
+      A headless run reports any ball left inside a sleeper at the end.
+      It renumbers the balls as they fall asleep and wake, so it applies
+      to the grid broad phase of the real engine like --verlet, and not
+      to --reorder, --interpolate or any option that writes the balls
+      out by their index. A recording is never made asleep, so --replay
+      does not take it either.
+    - --autotune <file> times the scene for a few steps under every broad
+      phase and several subspace sizes at startup and runs it on the
+      fastest, or only tries the sizes of the broad phase given with
+      --broadphase, --incremental or --colored. The pick is cached in the
+      file by the number of balls, their radii, the world size, the
+      threads, the engine, the mass model and the placement, so later
+      runs of the same scene skip the timing.
+    - --threads <count> runs the physics step on that many threads
+      (0 for one per core, default 1).
+    - --contacts remembers the pairs that touch from one step to the next,
+      so a pair still overlapping after its bounce is left to separate
+      instead of being bounced back together. It needs the real engine,
+      without --ccd, --events or --slab.
+    - --separate pushes overlapping balls apart as well as bouncing them,
+      and only bounces balls that are closing in, so a pair is bounced
+      once per contact. It needs the real engine, without --ccd or
+      --events.
+    - --gravity <g> pulls every ball down by g pixels per frame per frame,
+      and --drag <k> takes the fraction k of its speed away every frame.
+    - --attractor <x>,<y>,<strength>,<radius> pulls the balls within the
+      radius of the point x, y of the world towards it, by up to strength
+      pixels per frame per frame; a negative strength pushes them away.
+      It may be given up to FIELD_MAX_ATTRACTORS times. The force fields
+      need the real engine, without --events.
+    - --colored finds all contacts of a grid step before resolving any,
+      then resolves them in parallel in groups that share no ball, with
+      the same result on any number of threads.
+    - --deterministic finds all contacts of a step with any broad phase,
+      sorts them by their pair of balls and resolves them like --colored,
+      so a run is bitwise the same on any number of threads.
+    - --engine <real|fixed|gpu> runs the physics in the real type, in
+      deterministic Q16.16 fixed-point, or on the GPU with OpenGL compute
+      shaders, which needs --render gl (default real).
+    - --substeps <count> splits every frame of simulated time into that many
+      physics steps (default 1).
+    - --uncapped steps the physics as fast as it can between frames instead
+      of in simulated time.
+    - --ccd turns on continuous collision detection, which lets fast balls
+      take large steps without tunneling through each other.
+    - --events simulates the balls with the event-driven engine, which jumps
+      from one predicted collision to the next instead of testing every
+      frame. It is much faster when the balls are sparse.
+    - --render <points|sprites|software|gl> draws the balls as batches of
+      points, as textured quads of cached sprites, with the multithreaded
+      software rasterizer, or with one instanced OpenGL draw call (default
+      points).
+    - --hugepages backs the ball arrays with huge pages when the OS has some.
+    - --affinity pins the threads to CPUs, one physical core after the
+      other and one socket after the other, and has every thread allocate
+      its share of the balls on its own NUMA node. Slabs of a distributed
+      run split the NUMA nodes between them, neighbouring slabs on the
+      same node. It only works on Linux.
+    - --reorder <frames> sorts the balls into Morton order every that many
+      frames, for better cache locality (default 0, never).
+    - --filled draws the balls filled instead of as outlines, as batches
+      of horizontal spans. It applies to the points renderer.
+    - --simthread steps the simulation on its own thread, so a frame takes
+      as long as the slower of stepping and drawing instead of both.
+    - --pipeline adds a third thread to --simthread, which builds the
+      points of the balls from the newest snapshot while the main thread
+      draws the points built before. It applies to the points renderer
+      without --filled or --interpolate.
+    - --interpolate draws the balls between their last two physics steps,
+      by how far the clock is into the next one, so frames at the display
+      rate show smooth motion from physics at the tick rate. It works
+      with and without --simthread, but not with --uncapped, --headless,
+      --view or --engine gpu.
+    - --headless <steps> runs that many physics steps as fast as possible
+      without initializing video, then prints the steps per second.
+    - --ensemble <count> runs that many independent worlds of libbouncy for
+      the --headless steps instead of the one scene, in batches across the
+      threads, each placed from <number> <radius> like the scene, from a
+      random generator of its own seeded one above that of the world
+      before it, so a world does not match the scene of its seed. It
+      writes one CSV row summing up every world, to stdout or to the file
+      of --summary <file>. The worlds only bounce, on the plain grid of
+      the real engine.
+    - --stats <file> writes the narrow phase counters and the occupancy of
+      the grid after every step, as CSV or, for a .json file, as JSON. It
+      needs the grid broad phase.
+    - --latency <file> writes the 50th, 90th, 99th and 99.9th percentile
+      and the longest of the frame and step times every second, as CSV
+      rows of the second just past. The percentiles since the start are
+      printed on exit either way.
+    - --collisions <file> writes a CSV row for every step with how many
+      collision events it had, how many did not fit, and the total and
+      the largest impulse passed between balls. The gpu engine has no
+      events.
+    - --trace <file> records when every phase of a frame and every task of
+      the worker threads begins and ends, and writes it to the file as a
+      Chrome trace on exit or when T is pressed.
+    - --world <width>x<height> makes the world the balls bounce around in
+      larger than the window, in multiples of 100 pixels so the grid has
+      sizes to choose from. The camera then starts at zoom 1 over its
+      center, and only the balls on the screen are drawn.
+    - --placement <uniform|clustered|poisson|lattice|gas|fronts> spreads
+      the balls evenly over the screen, piles them up around a few
+      centers, or spreads them with Poisson-disk sampling so that none
+      overlap or start in a wall (default uniform). The other three are
+      stress patterns: lattice packs them edge to edge in a hexagonal
+      block, gas sends them all flying at one high speed, and fronts runs
+      two walls of them into each other. Parameters follow a colon, such
+      as clustered:<clusters>,<spread> (default 8,80), lattice:<gap>,<speed>
+      for the pixels between the balls and the speed they jitter at
+      (default 0,1), gas:<speed> (default 16) and fronts:<speed> (default
+      4), in pixels per step up to 127.
+    - --seed <number> seeds the random placement of the balls, so runs
+      with the same seed start out the same.
+    - --record <file> writes the initial balls, the steps of every frame
+      and the P and G inputs to the file. --replay <file> runs that exact
+      workload again, taking the balls, their radius, the substeps and the
+      size of the world from the recording, so <number> and <radius> can
+      be left out. It has to be given the engine, the broad phase, the
+      options that change how the contacts are resolved, --cell-balls,
+      --cell-block and the force fields the recording was made with.
+      Neither works with --simthread or --headless, and --record does not
+      work with --autotune.
+    - --load <file> starts from the balls of a scene file, mapped straight
+      into memory, with the world and the grid they were saved with, so
+      <number> and <radius> are left out.
+    - --save <file> is where S saves the scene (default balls.scene). A
+      headless run given --save saves the scene once its steps are done.
+    - --stream <file> writes the positions and velocities of all balls
+      after every step to the file, which may be a named pipe, on a thread
+      of its own. --quantize stores them as 16-bit integers instead of
+      floats, which halves the size of the stream. The balls are written
+      by their index, so it does not apply to --reorder.
+    - --share <file> publishes the positions, velocities, radii and masses
+      of all balls after every step to a shared memory file, such as one
+      under /dev/shm, which other processes can map and read in place.
+      The file describes its own layout and guards the arrays with a
+      seqlock, see share.h.
+    - --capture <file> records every frame the window shows to the file
+      as raw video, or with a pattern like frames/%05d.png as one PNG per
+      frame. The frames are encoded on a thread of its own, and dropped
+      when it falls CAPTURE_QUEUE_FRAMES frames behind.
+    - --publish <port> lets remote viewers connect to the port at any time
+      and sends them the quantized positions of the balls at the tick rate,
+      a keyframe of every ball every --keyframes frames (default 5 seconds
+      worth) and in between only the balls that moved.
+    - --view <host>:<port> opens the window on the balls a run started
+      with --publish sends, instead of simulating any itself, so <number>
+      and <radius> are left out.
+    - --slab <index>/<count> runs one of count processes, each simulating
+      one vertical slab of the world and handing balls to its neighbours
+      as they cross. Every slab but the last is given --listen <port> to
+      wait for its right neighbour on, and every slab but the first
+      --left <host>:<port> of its left neighbour. It needs --headless and
+      --seed, and runs the real engine on the grid or the hash only.
+    - --pacing <vsync|precise|uncapped> waits for the display, paces
+      frames precisely to the target rate, or draws frames back to back
+      (default precise).
+    - --fps <rate> sets the target frame rate of precise pacing (default
+      the tick rate). It does not change the speed of the simulation.
+    - --window <width>x<height> sets the size of the window, in multiples
+      of 100 pixels like --world, and with it of the world unless --world
+      is given (default SCREEN_WIDTH x SCREEN_HEIGHT).
+    - --tick-rate <rate> sets how many frames of simulated time pass every
+      second (default FPS). Velocities are in pixels per frame, so the
+      balls move faster with a higher rate.
+    - --cell-balls <count> sizes the subspaces of the grid count of the
+      largest balls across (default BALLS_PER_SUBSPACE), and sets the
+      subspace size --autotune starts from.
+    - --config <file> reads options from the file before those on the
+      command line, which override them. Every line is one option without
+      its dashes, followed by its value, and # starts a comment, so
+      "threads 4" is --threads 4.
+
+    While running, P pauses the simulation, G toggles the subspace grid
+    overlay, the arrow keys or dragging with the mouse pan the camera, the
+    mouse wheel zooms and Home resets it, V cycles through the pacing modes,
+    + and - change the target frame rate, S saves the scene, T writes out the
+    trace of --trace and Escape quits. Built with BALLS_PROFILE, H shows how
+    long every phase of a frame takes in the window title.
+*/
+int main(int argc, char* argv[]) {
+    bool running;
+
+#ifdef BALLS_TRACK_ALLOCATIONS
+    // before anything at all is allocated
+    if (trackAllocations() != 0) {
+        fprintf(stderr, "Could not track the allocations!\n");
+        return 1;
+    }
+#endif
+
+    // messages still in the log are written out on every way out of main
+    if (startLogger() == 0) {
+        atexit(stopLogger);
+    }
+
+    // Amount of balls to give in the simulation
+    int ball_amnt;
+    int radius;
+    int thread_count = 1;
+    const char *stats_path = NULL;
+    const char *summary_path = NULL;
+    const char *tune_path = NULL;
+    bool broadphase_given = false;
+    const char *trace_path = NULL;
+    const char *latency_path = NULL;
+    const char *collisions_path = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    const char *load_path = NULL;
+    const char *stream_path = NULL;
+    const char *capture_file = NULL;
+    const char *share_path = NULL;
+    int publish_port = 0;
+    const char *view_host = NULL;
+    int view_port = 0;
+    const char *left_host = NULL;
+    int left_port = 0;
+    int listen_port = 0;
+    bool save_given = false;
+    unsigned int seed = 0;
+    bool seeded = false;
+
+    bool world_given = false;
+    bool fps_given = false;
+    bool pipeline_given = false;
+
+    // the options of --config files come first, then the command line
+    if (loadConfig(&argc, &argv) != 0) {
+        return 1;
+    }
+
+    // Positional arguments, in order, with the options filtered out.
+    char *positional[2];
+    int positional_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--broadphase") == 0 && i + 1 < argc) {
+            if (parseBroadPhase(argv[++i], &broadphase) != 0) {
+                fprintf(stderr, "Unknown broad phase: %s\n", argv[i]);
+                return 1;
+            }
+            broadphase_given = true;
+        }
+        else if (strcmp(argv[i], "--max-radius") == 0 && i + 1 < argc) {
+            max_radius = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--mass") == 0 && i + 1 < argc) {
+            if (parseMassModel(argv[++i], &massModel) != 0) {
+                fprintf(stderr, "Unknown mass model: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--incremental") == 0) {
+            incrementalGrid = true;
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0) {
+            adaptiveGrid = true;
+        }
+        else if (strcmp(argv[i], "--binning") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "corners") == 0) {
+                centerBinning = false;
+            }
+            else if (strcmp(argv[i], "center") == 0) {
+                centerBinning = true;
+            }
+            else {
+                fprintf(stderr, "Unknown binning: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--verlet") == 0 && i + 1 < argc) {
+            verlet_skin = atof(argv[++i]);
+            if (verlet_skin <= 0) {
+                fprintf(stderr, "The skin of the neighbour lists must be positive!\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--sleep") == 0 && i + 1 < argc) {
+            sleep_speed = atof(argv[++i]);
+            if (sleep_speed <= 0) {
+                fprintf(stderr, "The speed balls fall asleep below must be positive!\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--cell-block") == 0 && i + 1 < argc) {
+            cell_block = atoi(argv[++i]);
+            if (cell_block < 0 || cell_block > CELL_BLOCK_MAX) {
+                fprintf(stderr, "The cell block must be 0 to %d subspaces!\n", CELL_BLOCK_MAX);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--autotune") == 0 && i + 1 < argc) {
+            tune_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--colored") == 0) {
+            coloredContacts = true;
+        }
+        else if (strcmp(argv[i], "--deterministic") == 0) {
+            deterministic = true;
+        }
+        else if (strcmp(argv[i], "--contacts") == 0) {
+            persistentContacts = true;
+        }
+        else if (strcmp(argv[i], "--separate") == 0) {
+            separateContacts = true;
+        }
+        else if (strcmp(argv[i], "--gravity") == 0 && i + 1 < argc) {
+            forceFields.gravity = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--drag") == 0 && i + 1 < argc) {
+            forceFields.drag = atof(argv[++i]);
+            if (forceFields.drag < 0) {
+                fprintf(stderr, "The drag cannot be negative!\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--attractor") == 0 && i + 1 < argc) {
+            double x, y, strength, field_radius;
+            if (sscanf(argv[++i], "%lf,%lf,%lf,%lf", &x, &y, &strength, &field_radius) != 4 || field_radius <= 0 ||
+                forceFields.attractorCount == FIELD_MAX_ATTRACTORS) {
+                fprintf(stderr, "An attractor is X,Y,STRENGTH,RADIUS with a positive radius, up to %d of them!\n",
+                    FIELD_MAX_ATTRACTORS);
+                return 1;
+            }
+            forceFields.attractors[forceFields.attractorCount++] = (Attractor) {
+                .x = x, .y = y, .strength = strength, .radius = field_radius
+            };
+        }
+        else if (strcmp(argv[i], "--substeps") == 0 && i + 1 < argc) {
+            substeps = atoi(argv[++i]);
+            if (substeps < 1) {
+                fprintf(stderr, "The number of substeps must be at least 1!\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--uncapped") == 0) {
+            uncapped = true;
+        }
+        else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+            headless_steps = atoi(argv[++i]);
+            if (headless_steps < 1) {
+                fprintf(stderr, "The number of headless steps must be at least 1!\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--ensemble") == 0 && i + 1 < argc) {
+            ensemble_count = atoi(argv[++i]);
+            if (ensemble_count < 1) {
+                fprintf(stderr, "The number of worlds must be at least 1!\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--summary") == 0 && i + 1 < argc) {
+            summary_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--world") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &world_width, &world_height) != 2 ||
+                world_width < 100 || world_height < 100 || world_width > WORLD_MAX_SIZE || world_height > WORLD_MAX_SIZE ||
+                world_width % 100 != 0 || world_height % 100 != 0) {
+                fprintf(stderr, "The world must be WIDTHxHEIGHT in multiples of 100 pixels, up to %d!\n", WORLD_MAX_SIZE);
+                return 1;
+            }
+            world_given = true;
+        }
+        else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &screen_width, &screen_height) != 2 ||
+                screen_width < 100 || screen_height < 100 || screen_width > WORLD_MAX_SIZE || screen_height > WORLD_MAX_SIZE ||
+                screen_width % 100 != 0 || screen_height % 100 != 0) {
+                fprintf(stderr, "The window must be WIDTHxHEIGHT in multiples of 100 pixels, up to %d!\n", WORLD_MAX_SIZE);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc) {
+            tick_rate = atoi(argv[++i]);
+            if (tick_rate < PACING_MIN_FPS || tick_rate > PACING_MAX_FPS) {
+                fprintf(stderr, "The tick rate must be between %d and %d!\n", PACING_MIN_FPS, PACING_MAX_FPS);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--cell-balls") == 0 && i + 1 < argc) {
+            subspace_balls = atoi(argv[++i]);
+            if (subspace_balls < 1 || subspace_balls > CELL_BALLS_MAX) {
+                fprintf(stderr, "A subspace must be 1 to %d balls across!\n", CELL_BALLS_MAX);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--placement") == 0 && i + 1 < argc) {
+            if (parsePlacement(argv[++i], &placement) != 0) {
+                fprintf(stderr, "Unknown placement or parameters: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 10);
+            seeded = true;
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+            stream_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--quantize") == 0) {
+            streamQuantized = true;
+        }
+        else if (strcmp(argv[i], "--share") == 0 && i + 1 < argc) {
+            share_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--publish") == 0 && i + 1 < argc) {
+            publish_port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--keyframes") == 0 && i + 1 < argc) {
+            publish_keyframes = atoi(argv[++i]);
+            if (publish_keyframes < 1) {
+                fprintf(stderr, "There must be at least 1 frame between keyframes!\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--view") == 0 && i + 1 < argc) {
+            view_host = argv[++i];
+            char *colon = strrchr(argv[i], ':');
+            if (colon == NULL || (view_port = atoi(colon + 1)) <= 0) {
+                fprintf(stderr, "The publisher to view must be HOST:PORT!\n");
+                return 1;
+            }
+            *colon = '\0';
+        }
+        else if (strcmp(argv[i], "--slab") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d/%d", &slab.index, &slab.count) != 2 ||
+                slab.count < 1 || slab.index < 0 || slab.index >= slab.count) {
+                fprintf(stderr, "The slab must be INDEX/COUNT, with the index counted from 0!\n");
+                return 1;
+            }
+            distributed = true;
+        }
+        else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--left") == 0 && i + 1 < argc) {
+            // the host may be an IPv6 address full of colons itself
+            left_host = argv[++i];
+            char *colon = strrchr(argv[i], ':');
+            if (colon == NULL || (left_port = atoi(colon + 1)) <= 0) {
+                fprintf(stderr, "The left neighbour must be HOST:PORT!\n");
+                return 1;
+            }
+            *colon = '\0';
+        }
+        else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            load_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save_path = argv[++i];
+            save_given = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+            latency_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--collisions") == 0 && i + 1 < argc) {
+            collisions_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--filled") == 0) {
+            filledBalls = true;
+        }
+        else if (strcmp(argv[i], "--simthread") == 0) {
+            simThread = true;
+        }
+        else if (strcmp(argv[i], "--pipeline") == 0) {
+            pipeline_given = true;
+        }
+        else if (strcmp(argv[i], "--interpolate") == 0) {
+            interpolate = true;
+        }
+        else if (strcmp(argv[i], "--ccd") == 0) {
+            continuousCollisions = true;
+        }
+        else if (strcmp(argv[i], "--events") == 0) {
+            eventDriven = true;
+        }
+        else if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc) {
+            if (parsePacing(argv[++i], &pacer.mode) != 0) {
+                fprintf(stderr, "Unknown pacing mode: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            pacer.target_fps = atoi(argv[++i]);
+            if (pacer.target_fps < PACING_MIN_FPS || pacer.target_fps > PACING_MAX_FPS) {
+                fprintf(stderr, "The frame rate must be between %d and %d!\n", PACING_MIN_FPS, PACING_MAX_FPS);
+                return 1;
+            }
+            fps_given = true;
+        }
+        else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+            if (parseRenderMode(argv[++i], &renderMode) != 0) {
+                fprintf(stderr, "Unknown render mode: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--hugepages") == 0) {
+            hugePages = true;
+        }
+        else if (strcmp(argv[i], "--affinity") == 0) {
+            affinity = true;
+        }
+        else if (strcmp(argv[i], "--reorder") == 0 && i + 1 < argc) {
+            reorder_interval = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            if (parseEngine(argv[++i], &engine) != 0) {
+                fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (positional_count < 2 && strncmp(argv[i], "--", 2) != 0) {
+            positional[positional_count++] = argv[i];
+        }
+        else {
+            positional_count = -1;
+            break;
+        }
+    }
+
+    // the world, the frame rate and the keyframes follow the window and
+    // the tick rate unless they were given themselves
+    if (!world_given) {
+        world_width = screen_width;
+        world_height = screen_height;
+    }
+    if (!fps_given) {
+        pacer.target_fps = tick_rate;
+    }
+    if (publish_keyframes == 0) {
+        publish_keyframes = 5 * tick_rate;
+    }
+
+    // a replay or a scene brings its own balls
+    bool replaying = replay_path != NULL && positional_count == 0;
+    bool loading = load_path != NULL && positional_count == 0;
+    bool viewing = view_host != NULL && positional_count == 0;
+    if (positional_count != 2 && !replaying && !loading && !viewing) {
+        fprintf(stderr, "Usage: %s <number> <radius> [--broadphase grid|sweep|quadtree|hash|hgrid] [--max-radius radius] [--mass equal|area] [--incremental] [--adaptive] [--binning corners|center] [--cell-block cells] [--verlet skin] [--sleep speed] [--autotune file] [--threads count] [--colored] [--deterministic] [--contacts] [--separate] [--gravity g] [--drag k] [--attractor x,y,strength,radius] [--engine real|fixed|gpu] [--reorder frames] [--hugepages] [--affinity] [--substeps count] [--uncapped] [--ccd] [--events] [--render points|sprites|software|gl] [--filled] [--simthread] [--pipeline] [--interpolate] [--headless steps] [--ensemble count] [--summary file] [--stats file] [--latency file] [--collisions file] [--trace file] [--world WIDTHxHEIGHT] [--placement uniform|clustered|poisson|lattice|gas|fronts[:params]] [--seed number] [--record file] [--replay file] [--load file] [--save file] [--stream file] [--quantize] [--share file] [--capture file] [--publish port] [--keyframes frames] [--view host:port] [--slab index/count] [--listen port] [--left host:port] [--pacing vsync|precise|uncapped] [--fps rate] [--window WIDTHxHEIGHT] [--tick-rate rate] [--cell-balls count] [--config file]\n", argv[0]);
+        return 1;
+    }
+    else if (!replaying && !loading && !viewing) {
+        ball_amnt = atoi(positional[0]);
+        radius = atoi(positional[1]);
+        if (max_radius != 0 && max_radius < radius) {
+            fprintf(stderr, "The largest radius must be at least <radius>!\n");
+            return 1;
+        }
+    }
+    else if (max_radius != 0 || massModel != MASS_EQUAL) {
+        fprintf(stderr, "--max-radius and --mass only apply to balls placed from <number> <radius>!\n");
+        return 1;
+    }
+
+    SceneHeader scene;
+    if (load_path != NULL) {
+        if (!loading || record_path != NULL || replay_path != NULL) {
+            fprintf(stderr, "A scene brings its own balls, it cannot be loaded with <number> <radius>, --record or --replay!\n");
+            return 1;
+        }
+        if (readSceneHeader(load_path, &scene) != 0) {
+            fprintf(stderr, "Could not load the scene %s!\n", load_path);
+            return 1;
+        }
+        ball_amnt = scene.count;
+        radius = scene.radius;
+    }
+
+    // the grid and everything sized by the radius go by the largest ball
+    int largest = max_radius > radius ? max_radius : radius;
+
+    if (record_path != NULL || replay_path != NULL) {
+        if (record_path != NULL && replay_path != NULL) {
+            fprintf(stderr, "--record and --replay cannot be used together!\n");
+            return 1;
+        }
+        if (simThread || headless_steps > 0) {
+            fprintf(stderr, "--record and --replay need the main loop to step the simulation!\n");
+            return 1;
+        }
+    }
+
+    if (view_host != NULL) {
+        if (!viewing || headless_steps > 0 || simThread || engine == ENGINE_GPU || distributed || publish_port > 0 ||
+            record_path != NULL || replay_path != NULL || load_path != NULL || stream_path != NULL || share_path != NULL) {
+            fprintf(stderr, "--view only draws the balls it is sent, without <number> <radius>, --headless, --simthread, --engine gpu, --slab, --publish, --record, --replay, --load, --stream or --share!\n");
+            return 1;
+        }
+        if (startView(view_host, view_port, &ball_amnt, &radius) != 0) {
+            fprintf(stderr, "Could not view the balls published at %s:%d!\n", view_host, view_port);
+            return 1;
+        }
+        logInfo("Viewing %d balls in a %d x %d world\n", ball_amnt, world_width, world_height);
+        largest = radius;
+    }
+
+    if (replay_path != NULL) {
+        if (startReplay(replay_path, &ball_amnt, &radius) != 0) {
+            fprintf(stderr, "Could not read the recording %s!\n", replay_path);
+            return 1;
+        }
+        if (!replayMatches()) {
+            fprintf(stderr, "The recording %s was made with the %s engine on the %s broad phase, and needs the same engine, broad phase, --verlet, --incremental, --adaptive, --binning, --ccd, --events, --contacts, --separate, --deterministic, --colored, --cell-balls, --cell-block, --gravity, --drag and --attractor to replay!\n",
+                    replay_path, recording.engine <= ENGINE_GPU ? engine_names[recording.engine] : "unknown",
+                    recording.broadphase <= BROADPHASE_HGRID ? broadphase_names[recording.broadphase] : "unknown");
+            return 1;
+        }
+        largest = radius;
+    }
+    else if (record_path != NULL) {
+        if (startRecording(record_path, ball_amnt, largest) != 0) {
+            fprintf(stderr, "Could not create the recording %s!\n", record_path);
+            return 1;
+        }
+    }
+
+    // Calculates the subspace size based on the assumption that each subspace
+    // will hold no more than a certian amount of balls.
+    // Binned by their centers, a ball only ever reaches the subspaces next
+    // to its own, and every neighbour is tested whole, so the subspaces are
+    // kept as small as that allows.
+
+
+    configureSubspaces(largest * 2 * (centerBinning ? 1 : subspace_balls));
+    if (load_path != NULL) {
+        applySceneHeader(&scene);
+    }
+    logInfo("Each subspace is %d pixels wide\n", subspace_size_x);
+    logInfo("Each subspace is %d pixels tall\n", subspace_size_y);
+
+    min_subspace_size = largest * 2;
+
+    if (engine == ENGINE_FIXED && (continuousCollisions || eventDriven)) {
+        fprintf(stderr, "The fixed engine does not support --ccd or --events!\n");
+        return 1;
+    }
+
+    // the gpu engine steps in the OpenGL context of the window, on its own
+    // grid, and only draws from the GPU
+    if (engine == ENGINE_GPU) {
+        if (renderMode != RENDER_GL || headless_steps > 0) {
+            fprintf(stderr, "The gpu engine needs --render gl and a window!\n");
+            return 1;
+        }
+        if (broadphase != BROADPHASE_GRID || incrementalGrid || adaptiveGrid || eventDriven || continuousCollisions ||
+            reorder_interval > 0 || simThread || stats_path != NULL || stream_path != NULL || share_path != NULL ||
+            publish_port > 0 || collisions_path != NULL) {
+            fprintf(stderr, "The gpu engine has its own grid, and does not support --broadphase, --incremental, --adaptive, --events, --ccd, --reorder, --simthread, --stats, --stream, --share, --publish or --collisions!\n");
+            return 1;
+        }
+    }
+
+    if (eventDriven && continuousCollisions) {
+        fprintf(stderr, "The event-driven engine is always continuous, --ccd does not apply to it!\n");
+        return 1;
+    }
+
+    if (persistentContacts && (engine != ENGINE_REAL || continuousCollisions || eventDriven || distributed)) {
+        fprintf(stderr, "--contacts needs the real engine, and does not apply to --ccd, --events or --slab!\n");
+        return 1;
+    }
+
+    if (separateContacts && (engine != ENGINE_REAL || continuousCollisions || eventDriven)) {
+        fprintf(stderr, "--separate needs the real engine, and does not apply to --ccd or --events!\n");
+        return 1;
+    }
+
+    if ((uniformFields() || forceFields.attractorCount > 0) && (engine != ENGINE_REAL || eventDriven)) {
+        fprintf(stderr, "The force fields need the real engine, and do not apply to --events!\n");
+        return 1;
+    }
+
+    if (coloredContacts && (broadphase != BROADPHASE_GRID || eventDriven || engine == ENGINE_GPU)) {
+        fprintf(stderr, "--colored needs the grid broad phase, and does not apply to --events or the gpu engine!\n");
+        return 1;
+    }
+
+    if (deterministic && (coloredContacts || eventDriven || engine == ENGINE_GPU)) {
+        fprintf(stderr, "--deterministic already colors the contacts, and does not apply to --events or the gpu engine!\n");
+        return 1;
+    }
+
+    if (centerBinning && (broadphase != BROADPHASE_GRID || incrementalGrid || coloredContacts || eventDriven ||
+                          continuousCollisions || distributed || engine == ENGINE_GPU)) {
+        fprintf(stderr, "--binning center needs the grid broad phase, and does not apply to --incremental, --colored, --events, --ccd, --slab or the gpu engine!\n");
+        return 1;
+    }
+
+    if (verlet_skin > 0 && (broadphase != BROADPHASE_GRID || engine != ENGINE_REAL || incrementalGrid || adaptiveGrid ||
+                            centerBinning || coloredContacts || deterministic || eventDriven || continuousCollisions ||
+                            distributed || stats_path != NULL || tune_path != NULL || ensemble_count > 0)) {
+        fprintf(stderr, "--verlet needs the grid broad phase and the real engine, and does not apply to --incremental, --adaptive, --binning center, --colored, --deterministic, --events, --ccd, --slab, --stats, --autotune or --ensemble!\n");
+        return 1;
+    }
+
+    if (sleep_speed > 0 && (broadphase != BROADPHASE_GRID || engine != ENGINE_REAL || incrementalGrid || adaptiveGrid ||
+                            coloredContacts || deterministic || persistentContacts || eventDriven ||
+                            continuousCollisions || distributed || verlet_skin > 0 || reorder_interval > 0 ||
+                            interpolate || stats_path != NULL || tune_path != NULL || ensemble_count > 0 ||
+                            stream_path != NULL || share_path != NULL || publish_port > 0 || record_path != NULL ||
+                            replay_path != NULL)) {
+        fprintf(stderr, "--sleep needs the grid broad phase and the real engine, and does not apply to --incremental, --adaptive, --colored, --deterministic, --contacts, --events, --ccd, --slab, --verlet, --reorder, --interpolate, --stats, --autotune, --ensemble, --stream, --share, --publish, --record or --replay!\n");
+        return 1;
+    }
 
+    // the stream writes the radii once and the balls by index after that
+    if (stream_path != NULL && reorder_interval > 0) {
+        fprintf(stderr, "--stream writes the balls by their index, and does not apply to --reorder!\n");
+        return 1;
+    }
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <number> <radius>\n", argv[0]);
+    if (broadphase == BROADPHASE_HGRID && (eventDriven || continuousCollisions)) {
+        fprintf(stderr, "The hierarchical grid does not support --events or --ccd!\n");
         return 1;
     }
-    else {
-        ball_amnt = atoi(argv[1]);
-        radius = atoi(argv[2]);
+
+    if (interpolate && (uncapped || headless_steps > 0 || viewing || engine == ENGINE_GPU)) {
+        fprintf(stderr, "--interpolate draws between steps kept to the clock, and does not apply to --uncapped, --headless, --view or --engine gpu!\n");
+        return 1;
     }
 
-    // Calculates the subspace size based on the assumption that each subspace
-    // will hold no more than a certian amount of balls.
+    if (pipeline_given && (!simThread || renderMode != RENDER_POINTS || filledBalls || interpolate ||
+                           publish_port > 0 || headless_steps > 0)) {
+        fprintf(stderr, "--pipeline builds the points of --simthread on a thread of its own for the points renderer, and does not apply to --filled, --interpolate, --publish or --headless!\n");
+        return 1;
+    }
 
+    if (capture_file != NULL && headless_steps > 0) {
+        fprintf(stderr, "--capture records the window, and does not apply to --headless!\n");
+        return 1;
+    }
 
-    subspace_size_x = (radius * 2 * BALLS_PER_SUBSPACE);
-    subspace_size_y = (radius * 2 * BALLS_PER_SUBSPACE);
-    while (SCREEN_WIDTH % subspace_size_x) {
-        subspace_size_x++;
+    // tuning steps a scene of its own, placed like the one to run
+    if (tune_path != NULL && (loading || viewing || replay_path != NULL || record_path != NULL ||
+                              engine == ENGINE_GPU || eventDriven || adaptiveGrid || persistentContacts ||
+                              distributed || stats_path != NULL || ensemble_count > 0)) {
+        fprintf(stderr, "--autotune tunes a scene placed from <number> <radius>, and does not apply to --replay, --record, --engine gpu, --events, --adaptive, --contacts, --slab, --stats or --ensemble!\n");
+        return 1;
     }
-    printf("Each subspace is %d pixels wide\n", subspace_size_x);
-    while (SCREEN_HEIGHT % subspace_size_y) {
-        subspace_size_y++;
+
+    // the worlds of an ensemble are those of libbouncy, which only bounce
+    if (summary_path != NULL && ensemble_count == 0) {
+        fprintf(stderr, "--summary needs --ensemble!\n");
+        return 1;
+    }
+    if (ensemble_count > 0) {
+        if (headless_steps == 0 || loading) {
+            fprintf(stderr, "--ensemble needs --headless and places its worlds from <number> <radius>!\n");
+            return 1;
+        }
+        if (broadphase != BROADPHASE_GRID || engine != ENGINE_REAL || incrementalGrid || adaptiveGrid ||
+            continuousCollisions || eventDriven || persistentContacts || separateContacts || coloredContacts ||
+            deterministic || uniformFields() || forceFields.attractorCount > 0 || substeps > 1 ||
+            reorder_interval > 0 || distributed || stats_path != NULL || save_given || stream_path != NULL ||
+            share_path != NULL || publish_port > 0 || collisions_path != NULL) {
+            fprintf(stderr, "--ensemble runs plain grid worlds of the real engine, without --broadphase, --engine, --incremental, --adaptive, --ccd, --events, --contacts, --separate, --colored, --deterministic, force fields, --substeps, --reorder, --slab, --stats, --save, --stream, --share, --publish or --collisions!\n");
+            return 1;
+        }
+    }
+
+    // the balls of the store come and go every step, which only the grid
+    // and the hash rebuilt from scratch can follow
+    int scene_amnt = ball_amnt;
+    if (distributed) {
+        if (headless_steps == 0 || !seeded) {
+            fprintf(stderr, "--slab needs --headless, and --seed so that every process places the same scene!\n");
+            return 1;
+        }
+        if ((broadphase != BROADPHASE_GRID && broadphase != BROADPHASE_HASH) || incrementalGrid || adaptiveGrid ||
+            eventDriven || continuousCollisions || engine == ENGINE_FIXED || reorder_interval > 0 ||
+            simThread || stream_path != NULL || share_path != NULL || publish_port > 0 || record_path != NULL ||
+            replay_path != NULL || load_path != NULL) {
+            fprintf(stderr, "--slab only runs the real engine on the grid or the hash, without --incremental, --adaptive, --reorder, --ccd, --events, --simthread, --stream, --share, --publish, --record, --replay or --load!\n");
+            return 1;
+        }
+        if (world_width / slab.count < 2 * subspace_size_x) {
+            fprintf(stderr, "The slabs must be at least two subspaces wide!\n");
+            return 1;
+        }
+        if ((slab.index < slab.count - 1 && listen_port <= 0) || (slab.index > 0 && left_host == NULL)) {
+            fprintf(stderr, "Every slab but the last needs --listen, and every slab but the first --left!\n");
+            return 1;
+        }
+
+        // room for the balls of the slab as placed, for the ghosts and for
+        // the balls crowding in later on
+        configureSlab();
+        srand(seed);
+        ball_amnt = scatterBalls(NULL, scene_amnt, radius, NULL) * SLAB_HEADROOM + SLAB_MIN_CAPACITY;
+        logInfo("Slab %d of %d owns x from %d to %d, with a halo of %d pixels\n",
+            slab.index, slab.count, slab.left_x, slab.right_x, subspace_size_x);
+
+        if (connectSlab(listen_port, left_host, left_port) != 0) {
+            fprintf(stderr, "Could not connect slab %d to its neighbours!\n", slab.index);
+            return 1;
+        }
+    }
+
+    if (stats_path != NULL) {
+        if (broadphase != BROADPHASE_GRID || eventDriven) {
+            fprintf(stderr, "--stats needs the grid broad phase!\n");
+            return 1;
+        }
+        if (openStats(stats_path) != 0) {
+            fprintf(stderr, "Could not open the stats file %s!\n", stats_path);
+            return 1;
+        }
+    }
+
+    // the event-driven engine keeps its lists on a fixed subspace grid
+    if (eventDriven) {
+        adaptiveGrid = false;
+    }
+
+    if (continuousCollisions) {
+        ccd_shift_x = calloc(ball_amnt + 1, sizeof(real));
+        ccd_shift_y = calloc(ball_amnt + 1, sizeof(real));
+        if (ccd_shift_x == NULL || ccd_shift_y == NULL) {
+            fprintf(stderr, "Could not allocate the continuous collision shifts!\n");
+            return 1;
+        }
+
+        overlapMask = overlapMaskSwept;
+        integrateBalls = integrateBallsSwept;
+        logInfo("Using the continuous narrow phase and integrator\n");
+    }
+    else if (engine == ENGINE_FIXED) {
+        overlapMask = overlapMaskFixed;
+        integrateBalls = integrateBallsFixed;
+        logInfo("Using the fixed-point narrow phase and integrator\n");
+    }
+    else if (engine != ENGINE_GPU) {
+        logInfo("Using the %s %s narrow phase\n", selectOverlapKernel(), REAL_NAME);
+        logInfo("Normalizing the contacts with the %s\n", MATH_NAME);
+        logInfo("Using the %s %s integrator\n", selectIntegrateKernel(), REAL_NAME);
+    }
+    if ((coloredContacts || deterministic) && plainResponse()) {
+        logInfo("Using the %s %s contact response\n", selectResponseKernel(), REAL_NAME);
+    }
+    if (engine != ENGINE_GPU && centerBinning) {
+        logInfo("Binning the balls by their centers\n");
+    }
+    else if (engine != ENGINE_GPU) {
+        logInfo("Using the %s subspace binning\n", selectBinKernel());
+    }
+
+    // started before the workers, which name their threads as they start
+    if (trace_path != NULL) {
+        if (startTrace(trace_path) != 0) {
+            fprintf(stderr, "Could not start the trace!\n");
+            return 1;
+        }
+        traceThreadName("main");
+    }
+
+    if (affinity) {
+        CpuTopology topology;
+        if (detectTopology(&topology) != 0) {
+            fprintf(stderr, "The layout of the CPUs is not known, pinning the threads in CPU order\n");
+        }
+
+        // consecutive slabs share a node, and with it a socket
+        int node = distributed ? slab.index * topology.nodes / slab.count : -1;
+        int *cpus = malloc(sizeof(int) * (topology.count + 1));
+        int count = cpus != NULL ? placementOrder(&topology, node, cpus) : 0;
+        if (count == 0 || placeWorkers(cpus, count) != 0) {
+            fprintf(stderr, "Could not place the threads on the CPUs!\n");
+            return 1;
+        }
+        logInfo("Pinning the threads to %d CPUs, of %d CPUs on %d packages and %d NUMA nodes\n",
+                count, topology.count, topology.packages, topology.nodes);
+        free(cpus);
+        freeTopology(&topology);
+    }
+
+    if (startWorkers(thread_count) != 0) {
+        fprintf(stderr, "Could not start the worker threads!\n");
+        return 1;
+    }
+
+    // the simulation thread pins itself once it runs
+    if (!simThread && pinWorkerThread() != 0) {
+        fprintf(stderr, "Could not pin the main thread!\n");
+    }
+
+    if (ensemble_count > 0) {
+        int failed = runEnsemble(ensemble_count, headless_steps, scene_amnt, radius,
+                                 seeded ? seed : (unsigned int) time(NULL), summary_path);
+        if (failed != 0) {
+            fprintf(stderr, "Could not run the ensemble or write its summaries!\n");
+        }
+        stopWorkers();
+        stopTrace();
+        return failed;
+    }
+
+    if (tune_path != NULL) {
+        bool fixed_phase = broadphase_given || incrementalGrid || coloredContacts || centerBinning;
+        if (autotune(tune_path, ball_amnt, scene_amnt, radius, seeded ? seed : 1, fixed_phase) != 0) {
+            fprintf(stderr, "Could not allocate the scene to tune!\n");
+            return 1;
+        }
+
+        // rand starts out as if seeded with 1
+        if (!seeded) {
+            srand(1);
+        }
+
+        // the steps timed while tuning are not those of the scene
+        resetLatencies();
+    }
+
+    // the spatial hash stands in for both grids, which hold every subspace
+    // of the world whether any ball is in it or not
+    bool dense_grid = ((broadphase != BROADPHASE_HASH && broadphase != BROADPHASE_HGRID) || eventDriven) && engine != ENGINE_GPU;
+    if (dense_grid && initSubspaceGrid(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the subspace grid!\n");
+        return 1;
+    }
+
+    if (dense_grid && initSubspaceBuckets(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the subspace buckets!\n");
+        return 1;
+    }
+
+    if (broadphase == BROADPHASE_HASH && initSpatialHash(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the spatial hash!\n");
+        return 1;
+    }
+
+    if (initSweepOrder(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the sweep order!\n");
+        return 1;
+    }
+
+    if (initQuadtree(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the quadtree!\n");
+        return 1;
+    }
+
+    if (verlet_skin > 0 && initVerletLists(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the neighbour lists!\n");
+        return 1;
+    }
+
+    if (sleep_speed > 0 && initSleepState(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the sleep state!\n");
+        return 1;
     }
-    printf("Each subspace is %d pixels tall\n", subspace_size_y);
 
-    subspace_count = (SCREEN_WIDTH / subspace_size_x) * (SCREEN_HEIGHT / subspace_size_y);
+    if (persistentContacts && initContactCache(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the contact cache!\n");
+        return 1;
+    }
+
+    if (deterministic && initDeferredContacts(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the deferred contacts!\n");
+        return 1;
+    }
+
+    if (coloredContacts && initContactGraph(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the contact graph!\n");
+        return 1;
+    }
 
-    subspaceTracker = malloc(sizeof(LinkedContainer*) * subspace_count);
+    if (reorder_interval > 0 && initBallReorder(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the ball reorder!\n");
+        return 1;
+    }
 
-    for (int i = 0; i < subspace_count; i++) {
-        subspaceTracker[i] = NULL;
+    BallStore balls;
+    if (load_path != NULL) {
+        if (loadScene(&balls, load_path, &scene) != 0) {
+            fprintf(stderr, "Could not load the scene %s!\n", load_path);
+            return 1;
+        }
+        logInfo("Loaded %d balls from %s\n", ball_amnt, load_path);
+    }
+    else if (initBallStore(&balls, ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the balls!\n");
+        return 1;
+    }
+    else if (affinity) {
+        touchBallStore(&balls);
     }
 
-    Ball* balls[ball_amnt];
+    // the OpenGL backend draws through the context of the renderer
+    if (renderMode == RENDER_GL) {
+        SDL_SetHint(SDL_HINT_RENDER_DRIVER, "opengl");
+    }
 
-    if (setup() != 0) {
+    if (headless_steps > 0) {
+        // no video at all, the physics runs straight after the balls are made
+        running = false;
+    }
+    else if (setup() != 0) {
         SDL_Quit();
         running = false;
         srand(time(NULL));
@@ -540,66 +12580,518 @@ int main(int argc, char* argv[]) {
         running = true;
     }
 
-    for (int i = 0; i < ball_amnt; i++) {
-        balls[i] = makeBall(
-            rand() % (SCREEN_WIDTH + 1), 
-            rand() % (SCREEN_HEIGHT + 1), 
-            radius
-            );
-        
-        balls[i]->dir.x = (rand() % 10) - 5;
-        balls[i]->dir.y = (rand() % 10) - 5;
+    if (seeded) {
+        srand(seed);
+    }
+
+    if (recording.mode == RECORDING_READ) {
+        if (replayBalls(&balls, ball_amnt) != 0) {
+            fprintf(stderr, "The balls of the recording are cut short or damaged!\n");
+            return 1;
+        }
+    }
+    else if (viewing) {
+        if (receiveView(&balls) != 0) {
+            fprintf(stderr, "The first keyframe of the publisher is damaged!\n");
+            return 1;
+        }
+    }
+    else if (load_path == NULL) {
+        scatterBalls(&balls, scene_amnt, radius, NULL);
+    }
+
+    if (recording.mode == RECORDING_WRITE) {
+        recordBalls(&balls);
+    }
+
+    // balls of different masses may also come from the neighbours of a slab
+    unequalMasses = hasUnequalMasses(&balls) || (distributed && massModel != MASS_EQUAL);
+    if (unequalMasses && (engine == ENGINE_FIXED || engine == ENGINE_GPU)) {
+        fprintf(stderr, "The fixed and gpu engines only bounce balls of equal mass!\n");
+        return 1;
+    }
+
+    // slabs with --max-radius get balls of other radii from their neighbours
+    if (engine != ENGINE_GPU) {
+        int uniform = distributed && largest > radius ? 0 : uniformRadius(&balls);
+        logInfo("Using the %s grid narrow phase\n", selectCellKernel(uniform));
+    }
+
+    // a scene of the fixed engine has its exact fixed-point state already
+    if (engine == ENGINE_FIXED && !(load_path != NULL && scene.engine == ENGINE_FIXED)) {
+        loadFixedState(&balls);
+    }
+
+    // the levels of the hierarchical grid follow the radii of the balls
+    if (broadphase == BROADPHASE_HGRID && initHierarchicalGrid(&balls, ball_amnt) != 0) {
+        fprintf(stderr, "Could not set up the hierarchical grid!\n");
+        return 1;
+    }
+
+    if (eventDriven) {
+        if (initEvents(ball_amnt) != 0) {
+            fprintf(stderr, "Could not allocate the event queue!\n");
+            return 1;
+        }
+        resetEvents(&balls);
+    }
+
+    if (stream_path != NULL && startStream(stream_path, &balls) != 0) {
+        fprintf(stderr, "Could not start the stream to %s!\n", stream_path);
+        return 1;
+    }
+
+    if (share_path != NULL) {
+        if (startShare(share_path, &balls, ball_amnt) != 0) {
+            fprintf(stderr, "Could not create the shared memory file %s!\n", share_path);
+            return 1;
+        }
+        publishShare(&balls);
+    }
+
+    if (publish_port > 0) {
+        if (startPublisher(publish_port, ball_amnt) != 0) {
+            fprintf(stderr, "Could not publish to viewers on port %d!\n", publish_port);
+            return 1;
+        }
+        logInfo("Publishing to viewers on port %d\n", publish_port);
+    }
+
+    if (running && renderMode == RENDER_SOFTWARE && initSoftwareRaster() != 0) {
+        fprintf(stderr, "Could not create the software rasterizer!\n");
+        return 1;
+    }
+
+    if (running && renderMode == RENDER_GL) {
+        if (initGLRenderer(ren, ball_amnt) != 0) {
+            return 1;
+        }
+        logInfo("Using the OpenGL renderer with %s instance buffer\n",
+            glPersistentMapping() ? "a persistently mapped" : "an uploaded");
+    }
+
+    if (running && capture_file != NULL && startFrameCapture(capture_file) != 0) {
+        fprintf(stderr, "Could not start capturing the frames to %s!\n", capture_file);
+        return 1;
+    }
+
+    if (running && engine == ENGINE_GPU) {
+        if (initGLCompute(ball_amnt, world_width, world_height, subspace_size_x, subspace_size_y) != 0) {
+            return 1;
+        }
+        if (uploadBallsGPU(&balls) != 0) {
+            fprintf(stderr, "Could not hand the balls to the GPU!\n");
+            return 1;
+        }
+        logInfo("Stepping the balls with OpenGL compute shaders\n");
+    }
+
+    step_dt = (real) 1 / substeps;
+    fixed_step_dt = FIXED_ONE / substeps;
+
+    // the accumulator and the step counters are in performance counter ticks
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 step_ticks = frequency / ((Uint64) tick_rate * substeps);
+    Uint64 accumulator = 0;
+    Uint64 last_time = SDL_GetPerformanceCounter();
+    Uint64 rate_start = last_time;
+    int rate_steps = 0;
+    int rate_frames = 0;
+    startPacing();
+
+    if (running) {
+        if (initCameraView(ball_amnt) != 0) {
+            fprintf(stderr, "Could not allocate the camera!\n");
+            return 1;
+        }
+        resetCamera();
+    }
+
+#ifdef BALLS_TRACK_ALLOCATIONS
+    AllocationStats rate_allocations = allocationStats();
+#endif
+
+    if (latency_path != NULL && openLatency(latency_path) != 0) {
+        fprintf(stderr, "Could not open the latency file %s!\n", latency_path);
+        return 1;
+    }
+
+    if (collisions_path != NULL && openCollisions(collisions_path) != 0) {
+        fprintf(stderr, "Could not open the collisions file %s!\n", collisions_path);
+        return 1;
+    }
+
+    if (headless_steps > 0) {
+        runHeadless(&balls, headless_steps);
+        if (save_given && saveScene(&balls) != 0) {
+            fprintf(stderr, "Could not save the scene to %s!\n", save_path);
+        }
+#ifdef BALLS_TRACK_ALLOCATIONS
+        AllocationStats allocations = allocationStats();
+        printf("%.2f allocations, %.0f bytes per step\n",
+            (double) (allocations.allocations - rate_allocations.allocations) / headless_steps,
+            (double) (allocations.bytes - rate_allocations.bytes) / headless_steps);
+#endif
+    }
+
+    if (running && interpolate && initInterpolation(ball_amnt) != 0) {
+        fprintf(stderr, "Could not allocate the interpolated positions!\n");
+        return 1;
+    }
+
+    if (running && simThread) {
+        if (initSnapshots(ball_amnt) != 0) {
+            fprintf(stderr, "Could not allocate the snapshots!\n");
+            return 1;
+        }
+        if (pipeline_given && startPipeline() != 0) {
+            fprintf(stderr, "Could not start the draw thread!\n");
+            return 1;
+        }
+        if (startSimulation(&balls) != 0) {
+            fprintf(stderr, "Could not start the simulation thread!\n");
+            return 1;
+        }
     }
 
     while (running) {
         SDL_Event e;
 
-        int delta = SDL_GetTicks();
+        if (isIdle()) {
+            // nothing on screen can change, so sleep until something happens
+            if (SDL_WaitEventTimeout(&e, IDLE_WAKE_MS)) {
+                handleEvent(&e, &running);
+                while (SDL_PollEvent(&e)) {
+                    handleEvent(&e, &running);
+                }
+            }
+
+            // the time spent idle is not simulated once the loop resumes
+            last_time = SDL_GetPerformanceCounter();
+            rate_start = last_time;
+            rate_steps = 0;
+            rate_frames = 0;
+            accumulator = 0;
+            startPacing();
+
+            // the simulation thread keeps its own previous positions
+            if (!simThread) {
+                interpolation.prev_count = 0;
+            }
+            continue;
+        }
 
         SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
         SDL_RenderClear(ren);
 
-        SDL_SetRenderDrawColor(ren, 255, 255, 255, 255);
-        for (int y = 0; y < SCREEN_HEIGHT; y+=subspace_size_y) {
-            SDL_RenderDrawLine(ren, 0, y, SCREEN_WIDTH, y);
+        if (!simThread && reorder_interval > 0 && ++reorder_frames >= reorder_interval) {
+            reorderBalls(&balls);
+            reorder_frames = 0;
+            interpolation.prev_count = 0;
+        }
+
+        // how far the clock is into the next step, with the balls drawn
+        // where they are unless the steps keep to the clock
+        real alpha = 1;
+
+        Uint64 now = SDL_GetPerformanceCounter();
+        accumulator += now - last_time;
+        recordLatency(&frameLatency, latencyNanoseconds(now - last_time));
+        snapshotLatency(false);
+        last_time = now;
+
+        // steps run by this frame, for the recording
+        int frame_steps = 0;
+
+        if (simThread) {
+            // the simulation thread paces itself
+            frame_steps = SDL_AtomicSet(&simulation.steps, 0);
+            rate_steps += frame_steps;
+        }
+        else if (viewing) {
+            // the publisher steps, the viewer only draws
+            if (receiveView(&balls) != 0) {
+                logInfo("The publisher is gone\n");
+                running = false;
+            }
+        }
+        else if (recording.mode == RECORDING_READ) {
+            // the recording decides, not the clock
+            if (replayFrame(&frame_steps) != 0) {
+                logInfo("The replay is over\n");
+                running = false;
+            }
+            for (int step = 0; step < frame_steps; step++) {
+                stepBalls(&balls);
+            }
+            rate_steps += frame_steps;
+            accumulator = 0;
+        }
+        else if (pause) {
+            accumulator = 0;
+            interpolation.prev_count = 0;
+        }
+        else if (uncapped) {
+            // step until the frame is used up, but at least once
+            Uint64 frame_end = now + framePeriod();
+            do {
+                stepBalls(&balls);
+                frame_steps++;
+            } while (SDL_GetPerformanceCounter() < frame_end);
+            rate_steps += frame_steps;
+            accumulator = 0;
         }
-        for (int x = 0; x < SCREEN_WIDTH; x+=subspace_size_x) {
-            SDL_RenderDrawLine(ren, x, 0, x, SCREEN_HEIGHT);
+        else {
+            int steps = 0;
+            while (accumulator >= step_ticks && steps < MAX_STEPS_PER_FRAME) {
+                if (interpolate) {
+                    rememberPositions(&balls);
+                }
+                stepBalls(&balls);
+                accumulator -= step_ticks;
+                steps++;
+            }
+            rate_steps += steps;
+            frame_steps = steps;
+            alpha = real_fmin((real) accumulator / step_ticks, 1);
+
+            // drop the time a slow machine can never catch up on
+            if (steps == MAX_STEPS_PER_FRAME) {
+                accumulator = 0;
+            }
+        }
+
+        now = SDL_GetPerformanceCounter();
+        if (now - rate_start >= frequency) {
+            char title[256];
+            int length = snprintf(title, sizeof(title), "Bouncy Balls - %.0f fps, %.0f steps/s",
+                (double) rate_frames * frequency / (now - rate_start),
+                (double) rate_steps * frequency / (now - rate_start));
+            if (capturing) {
+                CaptureStats stats;
+                captureStats(&stats);
+                length += snprintf(title + length, sizeof(title) - length, " | capture %d/%d queued, %u dropped",
+                    stats.depth, CAPTURE_QUEUE_FRAMES, stats.dropped);
+            }
+#ifdef BALLS_PROFILE
+            if (showProfile) {
+                length += snprintf(title + length, sizeof(title) - length, " | ms:");
+                formatProfile(title + length, sizeof(title) - length);
+            }
+#endif
+            (void) length;
+            SDL_SetWindowTitle(win, title);
+
+#ifdef BALLS_TRACK_ALLOCATIONS
+            AllocationStats allocations = allocationStats();
+            if (rate_frames > 0) {
+                logInfo("%.2f allocations, %.0f bytes per frame, %lld bytes live\n",
+                    (double) (allocations.allocations - rate_allocations.allocations) / rate_frames,
+                    (double) (allocations.bytes - rate_allocations.bytes) / rate_frames,
+                    (long long) allocations.live_bytes);
+            }
+            rate_allocations = allocations;
+#endif
+            rate_start = now;
+            rate_steps = 0;
+            rate_frames = 0;
+        }
+
+        BallStore *drawn;
+        BallStore *shown;
+        int size_x;
+        int size_y;
+        DrawList *list = NULL;
+        if (pipelined) {
+            // the draw thread has the snapshots, the balls are drawn from its list
+            list = takeDrawList();
+            drawn = NULL;
+            shown = NULL;
+            size_x = list != NULL ? list->subspace_size_x : subspace_size_x;
+            size_y = list != NULL ? list->subspace_size_y : subspace_size_y;
+        }
+        else if (simThread) {
+            Snapshot *snapshot = acquireSnapshot();
+            drawn = &snapshot->balls;
+            size_x = snapshot->subspace_size_x;
+            size_y = snapshot->subspace_size_y;
+
+            // the snapshot does not change between frames, the clock does
+            shown = drawn;
+            if (interpolate) {
+                real into = (real) (SDL_GetPerformanceCounter() - snapshot->due) / step_ticks;
+                shown = blendBalls(drawn->pos_x, drawn->pos_y, drawn->radius, drawn->count,
+                                   snapshot->prev_x, snapshot->prev_y, snapshot->prev_count, real_fmin(into, 1));
+            }
         }
+        else {
+            drawn = &balls;
+            size_x = subspace_size_x;
+            size_y = subspace_size_y;
+
+            shown = drawn;
+            if (interpolate) {
+                shown = blendBalls(balls.pos_x, balls.pos_y, balls.radius, balls.count,
+                                   interpolation.prev_x, interpolation.prev_y, interpolation.prev_count, alpha);
+            }
+        }
+
+        PROFILE_BEGIN(PHASE_DRAW);
+        if ((broadphase == BROADPHASE_GRID || broadphase == BROADPHASE_HASH) && showGrid) {
+            drawGridOverlay(size_x, size_y);
+        }
+        if (!cameraIsIdentity()) {
+            drawWorldBounds();
+        }
+
+        // the grid of the simulation thread is never complete to read from,
+        // and the gpu engine draws its balls where they are
+        if (engine == ENGINE_GPU) {
+            drawGLCompute(camera.x, camera.y, camera.zoom);
+        }
+        else if (pipelined) {
+            if (list != NULL) {
+                renderPoints(&list->points, 255, 255, 255);
+            }
+        }
+        else {
+            drawBalls(cameraBalls(shown, !simThread && gridCurrent));
+        }
+        PROFILE_END(PHASE_DRAW);
 
-        renderBallsImproved(ball_amnt, balls);
+        if (publisher.listener >= 0) {
+            publishFrame(drawn, frame_steps);
+        }
 
         while(SDL_PollEvent(&e)) {
-            switch (e.type) {
-                // quitting the game
-                case SDL_QUIT :
-                    running = false;
-                    break;
-                
-                // key pressed
-                case SDL_KEYDOWN :
-                    switch(e.key.keysym.sym) {
-                        case SDLK_ESCAPE :
-                            SDL_Event quit_event;
-                            quit_event.type = SDL_QUIT;
-                            SDL_PushEvent(&quit_event);
-                            break;
-                        case SDLK_p :
-                            pause = pause ? false : true;
-                    }
+            handleEvent(&e, &running);
+        }
+
+        if (saveRequested) {
+            if (simThread) {
+                SDL_AtomicSet(&simulation.save, 1);
             }
+            else if ((engine == ENGINE_GPU && downloadBallsGPU(&balls) != 0) || saveScene(&balls) != 0) {
+                fprintf(stderr, "Could not save the scene to %s!\n", save_path);
+            }
+            saveRequested = false;
+        }
+
+        if (recording.mode == RECORDING_READ) {
+            replayInputs();
+        }
+        else if (recording.mode == RECORDING_WRITE) {
+            recordFrame(frame_steps);
+        }
+
+        if (capturing) {
+            captureFrame();
         }
 
+        PROFILE_BEGIN(PHASE_PRESENT);
         SDL_RenderPresent(ren);
+        PROFILE_END(PHASE_PRESENT);
+        rate_frames++;
+        windowState.redraw = false;
 
-        delta = SDL_GetTicks() - delta;
-        if (FRAME_DELAY > delta) {
-            SDL_Delay(FRAME_DELAY - delta);
+        // the simulation thread keeps the averages of its own phases
+        profileFrame(simThread ? PHASE_DRAW : PHASE_ASSIGN, PHASE_COUNT);
+
+        // uncapped stepping already fills the frame
+        if (!uncapped) {
+            waitForNextFrame();
         }
     }
 
+    if (simThread && simulation.thread != NULL) {
+        stopSimulation();
+        stopPipeline();
+        freeSnapshots();
+    }
+
+    stopStream();
+    stopFrameCapture();
+    closeShare(&shareRegion);
+    if (publish_port > 0) {
+        stopPublisher();
+    }
+    if (viewing) {
+        stopView();
+    }
+    stopWorkers();
+    stopTrace();
+    stopRecording();
+    closeLatency();
+    closeCollisions();
+    printLatencies();
+
+    freeBallStore(&balls);
+    if (reorder_interval > 0) {
+        freeBallReorder();
+    }
+    closeStats();
+    if (distributed) {
+        closeSlab();
+    }
+    freeSubspaceGrid();
+    if (broadphase == BROADPHASE_HASH) {
+        freeSpatialHash();
+    }
+    if (broadphase == BROADPHASE_HGRID) {
+        freeHierarchicalGrid();
+    }
+    if (coloredContacts) {
+        freeContactGraph();
+    }
+    if (deterministic) {
+        freeDeferredContacts();
+    }
+    if (persistentContacts) {
+        freeContactCache();
+    }
+    if (verlet_skin > 0) {
+        freeVerletLists();
+    }
+    if (sleep_speed > 0) {
+        freeSleepState();
+    }
+    freeQuadtree();
+    free(sweepOrder);
+    free(ccd_shift_x);
+    free(ccd_shift_y);
+    if (eventDriven) {
+        freeEvents();
+    }
+    if (interpolate) {
+        freeInterpolation();
+    }
+    freePoints(&ballPoints);
+    freePoints(&hitPoints);
+    freeSpans(&ballSpans);
+    freeSprites();
+    freeGridOverlay();
+    if (headless_steps == 0) {
+        freeCameraView();
+    }
+    if (renderMode == RENDER_SOFTWARE) {
+        freeSoftwareRaster();
+    }
+    if (engine == ENGINE_GPU) {
+        freeGLCompute();
+    }
+    if (renderMode == RENDER_GL) {
+        freeGLRenderer();
+    }
+
     SDL_DestroyWindow(win);
     SDL_Quit();
 
+#ifdef BALLS_TRACK_ALLOCATIONS
+    // whatever is left now was never freed
+    stopLogger();
+    reportLeaks();
+#endif
+
     return 0;
-}
\ No newline at end of file
+}
+#endif
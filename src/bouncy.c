@@ -0,0 +1,475 @@
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_bits.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "arena.h"
+#include "bouncy.h"
+#include "memtrack.h"
+
+// The same grid sizing as the balls program: a subspace fits about
+// BOUNCY_BALLS_PER_SUBSPACE of the largest balls across.
+#define BOUNCY_BALLS_PER_SUBSPACE 4
+#define BOUNCY_CORNER_COUNT 4
+#define BOUNCY_OVERLAP_BATCH 32
+#define BOUNCY_OCCUPIED_WORDS(count) (((count) + 31) / 32)
+
+/*
+    Everything one world is made of. The balls are kept as structure of
+    arrays carved out of one arena, and the grid in compressed sparse row
+    form, rebuilt every step with a counting sort over the occupied
+    subspaces, just like the SubspaceGrid of the balls program.
+*/
+struct BouncyWorld {
+    int     width;
+    int     height;
+    int     subspace_size_x;
+    int     subspace_size_y;
+    int     subspace_count;
+    int     max_radius;
+    long    steps;
+    bool    unequal_masses;
+
+    int     count;
+    int     capacity;
+    double* pos_x;
+    double* pos_y;
+    double* dir_x;
+    double* dir_y;
+    int*    radius;
+    double* mass;
+    double* inv_mass;
+    int     (*subspaces)[BOUNCY_CORNER_COUNT];
+    Arena   arena;
+
+    int*    cell_start;
+    int*    cell_cursor;
+    int*    cell_balls;
+    Uint32* occupied;
+};
+
+/*
+    Returns the smallest size of at least the requested one that evenly
+    divides the extent of the world, and no larger than it.
+*/
+static int subspaceSize(int size, int extent) {
+    size = size < extent ? size : extent;
+    while (extent % size) {
+        size++;
+    }
+    return size;
+}
+
+/*
+    Returns the column or row of the subspace containing the coordinate,
+    keeping balls poking out of the world in the outermost subspaces.
+*/
+static int subspaceCell(double coordinate, int size, int cells) {
+    int n = (int) (coordinate / size);
+    return n < 0 ? 0 : (n >= cells ? cells - 1 : n);
+}
+
+/*
+    Recalculates the subspaces the corners of ball i are in.
+*/
+static void calculateSubspaces(BouncyWorld *world, int i) {
+    int spr = world->width / world->subspace_size_x;
+    int spc = world->height / world->subspace_size_y;
+    int col_left = subspaceCell(world->pos_x[i] - world->radius[i], world->subspace_size_x, spr);
+    int col_right = subspaceCell(world->pos_x[i] + world->radius[i], world->subspace_size_x, spr);
+    int row_up = subspaceCell(world->pos_y[i] - world->radius[i], world->subspace_size_y, spc);
+    int row_down = subspaceCell(world->pos_y[i] + world->radius[i], world->subspace_size_y, spc);
+
+    world->subspaces[i][0] = col_left + row_up * spr;
+    world->subspaces[i][1] = col_right + row_up * spr;
+    world->subspaces[i][2] = col_left + row_down * spr;
+    world->subspaces[i][3] = col_right + row_down * spr;
+}
+
+/*
+    Checks whether the corner at the given index falls into a subspace an
+    earlier corner of the same ball already covers.
+*/
+static bool isRepeatedCorner(const BouncyWorld *world, int i, int corner) {
+    for (int k = 0; k < corner; k++) {
+        if (world->subspaces[i][k] == world->subspaces[i][corner]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Rebuilds the grid from the current positions of the balls. Only the
+    subspaces occupied by the last step have anything to clear.
+*/
+static void assignSubspaces(BouncyWorld *world) {
+    int *start = world->cell_start;
+    int *cursor = world->cell_cursor;
+    int words = BOUNCY_OCCUPIED_WORDS(world->subspace_count);
+
+    for (int word = 0; word < words; word++) {
+        Uint32 bits = world->occupied[word];
+        while (bits != 0) {
+            int subspace = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+            bits &= bits - 1;
+            start[subspace] = 0;
+            cursor[subspace] = 0;
+        }
+        world->occupied[word] = 0;
+    }
+
+    // counting pass
+    for (int i = 0; i < world->count; i++) {
+        calculateSubspaces(world, i);
+        for (int j = 0; j < BOUNCY_CORNER_COUNT; j++) {
+            if (!isRepeatedCorner(world, i, j)) {
+                int subspace = world->subspaces[i][j];
+                cursor[subspace]++;
+                world->occupied[subspace / 32] |= 1u << (subspace % 32);
+            }
+        }
+    }
+
+    // prefix sum over the occupied subspaces
+    int offset = 0;
+    for (int word = 0; word < words; word++) {
+        Uint32 bits = world->occupied[word];
+        while (bits != 0) {
+            int subspace = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+            bits &= bits - 1;
+            start[subspace] = offset;
+            offset += cursor[subspace];
+            cursor[subspace] = start[subspace];
+        }
+    }
+
+    // scatter pass
+    for (int i = 0; i < world->count; i++) {
+        for (int j = 0; j < BOUNCY_CORNER_COUNT; j++) {
+            if (!isRepeatedCorner(world, i, j)) {
+                world->cell_balls[cursor[world->subspaces[i][j]]++] = i;
+            }
+        }
+    }
+}
+
+/*
+    Returns the subspace owning the pair of balls a and b: the one
+    containing the top-left corner of the overlap of their bounding boxes,
+    so a pair listed in several subspaces is only resolved once.
+*/
+static int pairOwner(const BouncyWorld *world, int a, int b) {
+    double left = fmax(world->pos_x[a] - world->radius[a], world->pos_x[b] - world->radius[b]);
+    double up = fmax(world->pos_y[a] - world->radius[a], world->pos_y[b] - world->radius[b]);
+
+    int spr = world->width / world->subspace_size_x;
+    int spc = world->height / world->subspace_size_y;
+    return subspaceCell(left, world->subspace_size_x, spr) + subspaceCell(up, world->subspace_size_y, spc) * spr;
+}
+
+/*
+    Returns a mask with bit k set when ball overlaps ball candidates[k], for
+    at most BOUNCY_OVERLAP_BATCH candidates.
+*/
+static Uint32 overlapMask(const BouncyWorld *world, int ball, const int *candidates, int count) {
+    double x = world->pos_x[ball];
+    double y = world->pos_y[ball];
+    int radius = world->radius[ball];
+
+    Uint32 mask = 0;
+    for (int k = 0; k < count; k++) {
+        int other = candidates[k];
+        double dx = world->pos_x[other] - x;
+        double dy = world->pos_y[other] - y;
+        double reach = radius + world->radius[other];
+
+        if (dx * dx + dy * dy < reach * reach) {
+            mask |= 1u << k;
+        }
+    }
+    return mask;
+}
+
+/*
+    Exchanges the velocities of balls a and b along the line between their
+    centers. While every ball has a mass of 1 they swap their components
+    along it, like in the balls program; otherwise the exchange is
+    weighted by the inverse masses, conserving momentum and energy.
+*/
+static void bounce(BouncyWorld *world, int a, int b) {
+    double dx = world->pos_x[b] - world->pos_x[a];
+    double dy = world->pos_y[b] - world->pos_y[a];
+    if (dx == 0 && dy == 0) {
+        return;
+    }
+
+    if (world->unequal_masses) {
+        double inv_a = world->inv_mass[a];
+        double inv_b = world->inv_mass[b];
+        double closing = (world->dir_x[a] - world->dir_x[b]) * dx + (world->dir_y[a] - world->dir_y[b]) * dy;
+        double k = 2 * closing / ((dx * dx + dy * dy) * (inv_a + inv_b));
+
+        world->dir_x[a] -= k * inv_a * dx;
+        world->dir_y[a] -= k * inv_a * dy;
+        world->dir_x[b] += k * inv_b * dx;
+        world->dir_y[b] += k * inv_b * dy;
+        return;
+    }
+
+    double length = sqrt(dx * dx + dy * dy);
+    double nx = dx / length;
+    double ny = dy / length;
+
+    double dir_ax = world->dir_x[a];
+    double dir_ay = world->dir_y[a];
+    double dir_bx = world->dir_x[b];
+    double dir_by = world->dir_y[b];
+    double scalar_product = (dir_ax * nx + dir_ay * ny) - (dir_bx * nx + dir_by * ny);
+
+    world->dir_x[a] = dir_ax - scalar_product * nx;
+    world->dir_y[a] = dir_ay - scalar_product * ny;
+    world->dir_x[b] = dir_bx + scalar_product * nx;
+    world->dir_y[b] = dir_by + scalar_product * ny;
+}
+
+/*
+    Resolves the collisions of every occupied subspace, in index order.
+*/
+static void collideBalls(BouncyWorld *world) {
+    for (int word = 0; word < BOUNCY_OCCUPIED_WORDS(world->subspace_count); word++) {
+        Uint32 bits = world->occupied[word];
+        while (bits != 0) {
+            int subspace = word * 32 + SDL_MostSignificantBitIndex32(bits & -bits);
+            bits &= bits - 1;
+
+            const int *cell = &world->cell_balls[world->cell_start[subspace]];
+            int depth = world->cell_cursor[subspace] - world->cell_start[subspace];
+            for (int m = 0; m < depth; m++) {
+                for (int first = m + 1; first < depth; first += BOUNCY_OVERLAP_BATCH) {
+                    int count = depth - first < BOUNCY_OVERLAP_BATCH ? depth - first : BOUNCY_OVERLAP_BATCH;
+                    Uint32 hits = overlapMask(world, cell[m], &cell[first], count);
+
+                    while (hits != 0) {
+                        int k = first + SDL_MostSignificantBitIndex32(hits & -hits);
+                        hits &= hits - 1;
+                        if (pairOwner(world, cell[m], cell[k]) == subspace) {
+                            bounce(world, cell[m], cell[k]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+    Moves every ball by its velocity and reflects it off the walls, putting
+    a ball past a wall back just inside of it.
+*/
+static void moveBalls(BouncyWorld *world) {
+    for (int i = 0; i < world->count; i++) {
+        double radius = world->radius[i];
+        double x = world->pos_x[i] + world->dir_x[i];
+        double y = world->pos_y[i] + world->dir_y[i];
+
+        bool hit_x = x - radius < 0 || x + radius > world->width;
+        double dir_x = hit_x ? -world->dir_x[i] : world->dir_x[i];
+        double wall_x = dir_x > 0 ? radius + 1 : world->width - radius - 1;
+
+        bool hit_y = y - radius < 0 || y + radius > world->height;
+        double dir_y = hit_y ? -world->dir_y[i] : world->dir_y[i];
+        double wall_y = dir_y > 0 ? radius + 1 : world->height - radius - 1;
+
+        world->pos_x[i] = hit_x ? wall_x : x;
+        world->pos_y[i] = hit_y ? wall_y : y;
+        world->dir_x[i] = dir_x;
+        world->dir_y[i] = dir_y;
+    }
+}
+
+/*
+    Returns whether the state can be that of a ball of the world.
+*/
+static bool validBall(const BouncyWorld *world, const BouncyBall *ball) {
+    return ball->radius >= 1 && ball->radius <= world->max_radius && ball->mass > 0 &&
+           isfinite(ball->x) && isfinite(ball->y) && isfinite(ball->dx) && isfinite(ball->dy);
+}
+
+/*
+    Stores the state into ball i. A world stays on the plain exchange for
+    equal masses until a ball of a mass other than 1 shows up.
+*/
+static void storeBall(BouncyWorld *world, int i, const BouncyBall *ball) {
+    world->pos_x[i] = ball->x;
+    world->pos_y[i] = ball->y;
+    world->dir_x[i] = ball->dx;
+    world->dir_y[i] = ball->dy;
+    world->radius[i] = ball->radius;
+    world->mass[i] = ball->mass;
+    world->inv_mass[i] = 1 / ball->mass;
+
+    if (ball->mass != 1) {
+        world->unequal_masses = true;
+    }
+}
+
+BouncyWorld* bouncyCreateWorld(int width, int height, int capacity, int max_radius) {
+    if (width <= 0 || height <= 0 || capacity < 0 || max_radius < 1) {
+        return NULL;
+    }
+
+    BouncyWorld *world = calloc(1, sizeof(BouncyWorld));
+    if (world == NULL) {
+        return NULL;
+    }
+
+    world->width = width;
+    world->height = height;
+    world->max_radius = max_radius;
+    world->capacity = capacity;
+    world->subspace_size_x = subspaceSize(max_radius * 2 * BOUNCY_BALLS_PER_SUBSPACE, width);
+    world->subspace_size_y = subspaceSize(max_radius * 2 * BOUNCY_BALLS_PER_SUBSPACE, height);
+    world->subspace_count = (width / world->subspace_size_x) * (height / world->subspace_size_y);
+
+    // keep the arrays non-empty so a world without balls is still valid
+    size_t n = capacity > 0 ? capacity : 1;
+    size_t size = 6 * arenaSize(sizeof(double) * n)
+                + arenaSize(sizeof(int) * n)
+                + arenaSize(sizeof(int[BOUNCY_CORNER_COUNT]) * n);
+    if (initArena(&world->arena, size, false) != 0) {
+        free(world);
+        return NULL;
+    }
+
+    world->pos_x = arenaAlloc(&world->arena, sizeof(double) * n);
+    world->pos_y = arenaAlloc(&world->arena, sizeof(double) * n);
+    world->dir_x = arenaAlloc(&world->arena, sizeof(double) * n);
+    world->dir_y = arenaAlloc(&world->arena, sizeof(double) * n);
+    world->radius = arenaAlloc(&world->arena, sizeof(int) * n);
+    world->mass = arenaAlloc(&world->arena, sizeof(double) * n);
+    world->inv_mass = arenaAlloc(&world->arena, sizeof(double) * n);
+    world->subspaces = arenaAlloc(&world->arena, sizeof(int[BOUNCY_CORNER_COUNT]) * n);
+
+    world->cell_start = calloc(world->subspace_count, sizeof(int));
+    world->cell_cursor = calloc(world->subspace_count, sizeof(int));
+    world->cell_balls = malloc(sizeof(int) * (n * BOUNCY_CORNER_COUNT));
+    world->occupied = calloc(BOUNCY_OCCUPIED_WORDS(world->subspace_count), sizeof(Uint32));
+    if (world->cell_start == NULL || world->cell_cursor == NULL || world->cell_balls == NULL ||
+        world->occupied == NULL) {
+        bouncyFreeWorld(world);
+        return NULL;
+    }
+
+    return world;
+}
+
+int bouncyAddBall(BouncyWorld *world, const BouncyBall *ball) {
+    if (world->count == world->capacity || !validBall(world, ball)) {
+        return -1;
+    }
+
+    int i = world->count++;
+    storeBall(world, i, ball);
+    return i;
+}
+
+void bouncyStep(BouncyWorld *world, int steps) {
+    for (int s = 0; s < steps; s++) {
+        assignSubspaces(world);
+        collideBalls(world);
+        moveBalls(world);
+        world->steps++;
+    }
+}
+
+int bouncyBallCount(const BouncyWorld *world) {
+    return world->count;
+}
+
+long bouncyStepCount(const BouncyWorld *world) {
+    return world->steps;
+}
+
+bool bouncyGetBall(const BouncyWorld *world, int i, BouncyBall *ball) {
+    if (i < 0 || i >= world->count) {
+        return false;
+    }
+
+    *ball = (BouncyBall) {
+        .x = world->pos_x[i],
+        .y = world->pos_y[i],
+        .dx = world->dir_x[i],
+        .dy = world->dir_y[i],
+        .radius = world->radius[i],
+        .mass = world->mass[i]
+    };
+    return true;
+}
+
+bool bouncySetBall(BouncyWorld *world, int i, const BouncyBall *ball) {
+    if (i < 0 || i >= world->count || !validBall(world, ball)) {
+        return false;
+    }
+
+    storeBall(world, i, ball);
+    return true;
+}
+
+bool bouncyGetArray(const BouncyWorld *world, BouncyField field, BouncyArray *array) {
+    const void *data;
+    switch (field) {
+        case BOUNCY_X :
+            data = world->pos_x;
+            break;
+
+        case BOUNCY_Y :
+            data = world->pos_y;
+            break;
+
+        case BOUNCY_DX :
+            data = world->dir_x;
+            break;
+
+        case BOUNCY_DY :
+            data = world->dir_y;
+            break;
+
+        case BOUNCY_RADIUS :
+            data = world->radius;
+            break;
+
+        case BOUNCY_MASS :
+            data = world->mass;
+            break;
+
+        default :
+            return false;
+    }
+
+    bool integer = field == BOUNCY_RADIUS;
+    *array = (BouncyArray) {
+        .data = data,
+        .type = integer ? BOUNCY_INT32 : BOUNCY_FLOAT64,
+        .stride = integer ? sizeof(int) : sizeof(double),
+        .length = world->count
+    };
+    return true;
+}
+
+void bouncyFreeWorld(BouncyWorld *world) {
+    if (world == NULL) {
+        return;
+    }
+
+    freeArena(&world->arena);
+    free(world->cell_start);
+    free(world->cell_cursor);
+    free(world->cell_balls);
+    free(world->occupied);
+    free(world);
+}
@@ -0,0 +1,119 @@
+#ifndef BOUNCY_H
+#define BOUNCY_H
+
+#include <stdbool.h>
+
+/*
+    libbouncy, the simulation core on its own, to be linked into other
+    programs (make libbouncy). Everything a world needs lives behind its
+    handle, so a process can run any number of worlds, each on its own
+    thread, without them knowing about each other. The library draws
+    nothing and has no main loop; the caller steps a world as often as it
+    likes and reads the balls back.
+    A world resolves its collisions on a flat uniform grid like the balls
+    program does by default, with balls of any radius and mass.
+    Calls on one world must not overlap, calls on different worlds may.
+*/
+typedef struct BouncyWorld BouncyWorld;
+
+/*
+    The state of one ball: its center, its velocity in pixels per step,
+    its radius and its mass.
+*/
+typedef struct BouncyBall {
+    double  x;
+    double  y;
+    double  dx;
+    double  dy;
+    int     radius;
+    double  mass;
+} BouncyBall;
+
+/*
+    Creates an empty world of the given size with room for capacity balls,
+    none of which may have a radius above max_radius, which sizes the
+    grid.
+    Returns NULL if the size is not positive or the world could not be
+    allocated.
+*/
+BouncyWorld* bouncyCreateWorld(int width, int height, int capacity, int max_radius);
+
+/*
+    Adds a ball to the world. The radius must be between 1 and the largest
+    radius the world was created with, and the mass positive.
+    Returns the index of the ball, or -1 if the world is full or the ball
+    is not valid.
+*/
+int bouncyAddBall(BouncyWorld *world, const BouncyBall *ball);
+
+/*
+    Advances the world by the given number of steps.
+*/
+void bouncyStep(BouncyWorld *world, int steps);
+
+/*
+    Returns the number of balls in the world.
+*/
+int bouncyBallCount(const BouncyWorld *world);
+
+/*
+    Returns the number of steps the world has taken since it was created.
+*/
+long bouncyStepCount(const BouncyWorld *world);
+
+/*
+    Copies the state of ball i into ball.
+    Returns false if there is no ball i.
+*/
+bool bouncyGetBall(const BouncyWorld *world, int i, BouncyBall *ball);
+
+/*
+    Replaces the state of ball i with that of ball, which must be as valid
+    as for bouncyAddBall.
+    Returns false if there is no ball i or the state is not valid.
+*/
+bool bouncySetBall(BouncyWorld *world, int i, const BouncyBall *ball);
+
+/*
+    The state arrays of a world, which can be read in place without
+    copying a ball at a time: ball i has its value of the field at byte
+    i * stride from data, as an element of the given type, for the
+    length balls of the world.
+*/
+typedef enum BouncyField {
+    BOUNCY_X,
+    BOUNCY_Y,
+    BOUNCY_DX,
+    BOUNCY_DY,
+    BOUNCY_RADIUS,
+    BOUNCY_MASS,
+    BOUNCY_FIELD_COUNT
+} BouncyField;
+
+typedef enum BouncyType {
+    BOUNCY_INT32,
+    BOUNCY_FLOAT64
+} BouncyType;
+
+typedef struct BouncyArray {
+    const void* data;
+    BouncyType  type;
+    int         stride;
+    int         length;
+} BouncyArray;
+
+/*
+    Describes the array of the given field in array. The memory stays where
+    it is for as long as the world lives, but its contents change with
+    every step and every ball added or set, and the length with every ball
+    added.
+    Returns false if there is no such field.
+*/
+bool bouncyGetArray(const BouncyWorld *world, BouncyField field, BouncyArray *array);
+
+/*
+    Releases the world and everything in it. NULL is ignored.
+*/
+void bouncyFreeWorld(BouncyWorld *world);
+
+#endif
@@ -0,0 +1,343 @@
+#include <SDL2/SDL.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "trace.h"
+
+// Longest stored deflate block, the most its 16-bit length can say.
+#define DEFLATE_STORED_MAX 65535
+
+/*
+    The buffers are handed back and forth through two semaphores like
+    those of --stream: empty counts the buffers the render loop may fill,
+    filled the ones the encoder may write. A buffer marked last tells the
+    encoder to stop.
+*/
+typedef struct CaptureBuffer {
+    Uint8   *pixels;
+    bool    last;
+} CaptureBuffer;
+
+static struct {
+    const char      *path;
+    bool            png;
+    FILE            *video;
+    int             width;
+    int             height;
+    CaptureBuffer   buffers[CAPTURE_QUEUE_FRAMES];
+    int             next;
+    SDL_sem         *empty;
+    SDL_sem         *filled;
+    SDL_Thread      *thread;
+    SDL_atomic_t    depth;
+    SDL_atomic_t    failed;
+    int             deepest;
+    Uint32          frames;
+    Uint32          dropped;
+
+    // owned by the encoder
+    Uint8           *rows;
+    Uint8           *encoded;
+    size_t          encoded_size;
+    Uint32          crc_table[256];
+} capture;
+
+/*
+    Returns whether the path is a pattern with exactly one %d, which may
+    have flags and a width like %05d, and no other conversion.
+*/
+static bool capturePattern(const char *path) {
+    int conversions = 0;
+    for (const char *c = strchr(path, '%'); c != NULL; c = strchr(c, '%')) {
+        c++;
+        while (*c >= '0' && *c <= '9') {
+            c++;
+        }
+        if (*c != 'd') {
+            return false;
+        }
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+static void buildCrcTable() {
+    for (Uint32 n = 0; n < 256; n++) {
+        Uint32 c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        capture.crc_table[n] = c;
+    }
+}
+
+static Uint32 updateCrc(Uint32 crc, const Uint8 *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        crc = capture.crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void putBigEndian(Uint8 *out, Uint32 value) {
+    out[0] = (Uint8) (value >> 24);
+    out[1] = (Uint8) (value >> 16);
+    out[2] = (Uint8) (value >> 8);
+    out[3] = (Uint8) value;
+}
+
+/*
+    Writes one PNG chunk, its length, type, data and CRC.
+    Returns whether the whole chunk was written.
+*/
+static bool writeChunk(FILE *file, const char *type, const Uint8 *data, Uint32 size) {
+    Uint8 length[4];
+    Uint8 crc[4];
+    putBigEndian(length, size);
+    putBigEndian(crc, updateCrc(updateCrc(0xFFFFFFFF, (const Uint8*) type, 4), data, size) ^ 0xFFFFFFFF);
+
+    return fwrite(length, 4, 1, file) == 1 && fwrite(type, 4, 1, file) == 1 &&
+        (size == 0 || fwrite(data, size, 1, file) == 1) && fwrite(crc, 4, 1, file) == 1;
+}
+
+/*
+    Converts a frame to rows of red, green and blue, each behind the byte
+    of a PNG filter when it is for a PNG.
+*/
+static void packRows(const Uint8 *pixels) {
+    Uint8 *out = capture.rows;
+    for (int y = 0; y < capture.height; y++) {
+        if (capture.png) {
+            // no filter, the rows are stored uncompressed anyway
+            *out++ = 0;
+        }
+        const Uint8 *in = pixels + (size_t) y * capture.width * 4;
+        for (int x = 0; x < capture.width; x++) {
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
+            out += 3;
+            in += 4;
+        }
+    }
+}
+
+static size_t packedSize() {
+    return (size_t) capture.height * ((capture.png ? 1 : 0) + (size_t) capture.width * 3);
+}
+
+/*
+    Wraps the packed rows in a zlib stream of stored deflate blocks. A
+    frame is written long before it could be compressed, and the files are
+    meant to be converted to video right after.
+*/
+static void deflateRows() {
+    size_t size = packedSize();
+    Uint8 *out = capture.encoded;
+
+    // deflate with a 32K window, no dictionary, the fastest level
+    *out++ = 0x78;
+    *out++ = 0x01;
+
+    Uint32 a = 1;
+    Uint32 b = 0;
+    for (size_t offset = 0; offset < size; offset += DEFLATE_STORED_MAX) {
+        size_t block = size - offset < DEFLATE_STORED_MAX ? size - offset : DEFLATE_STORED_MAX;
+        *out++ = offset + block == size ? 1 : 0;
+        out[0] = (Uint8) block;
+        out[1] = (Uint8) (block >> 8);
+        out[2] = (Uint8) ~block;
+        out[3] = (Uint8) (~block >> 8);
+        out += 4;
+        memcpy(out, capture.rows + offset, block);
+        out += block;
+
+        for (size_t i = 0; i < block; i++) {
+            a = (a + capture.rows[offset + i]) % 65521;
+            b = (b + a) % 65521;
+        }
+    }
+
+    putBigEndian(out, (b << 16) | a);
+    out += 4;
+    capture.encoded_size = out - capture.encoded;
+}
+
+/*
+    Writes the frame with the given number to its own PNG file.
+    Returns whether the whole file was written.
+*/
+static bool writePNG(Uint32 number) {
+    char path[1024];
+    snprintf(path, sizeof(path), capture.path, (int) number);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    deflateRows();
+
+    // 8-bit truecolor, no interlacing
+    Uint8 header[13];
+    putBigEndian(header, capture.width);
+    putBigEndian(header + 4, capture.height);
+    header[8] = 8;
+    header[9] = 2;
+    header[10] = 0;
+    header[11] = 0;
+    header[12] = 0;
+
+    static const Uint8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    bool written = fwrite(signature, sizeof(signature), 1, file) == 1 &&
+        writeChunk(file, "IHDR", header, sizeof(header)) &&
+        writeChunk(file, "IDAT", capture.encoded, (Uint32) capture.encoded_size) &&
+        writeChunk(file, "IEND", NULL, 0);
+    return fclose(file) == 0 && written;
+}
+
+/*
+    Main loop of the encoder thread, taking the buffers in the order they
+    were filled.
+*/
+static int captureMain(void *data) {
+    (void) data;
+    traceThreadName("capture");
+
+    for (Uint32 number = 0, index = 0; ; number++, index = (index + 1) % CAPTURE_QUEUE_FRAMES) {
+        SDL_SemWait(capture.filled);
+        CaptureBuffer *buffer = &capture.buffers[index];
+        if (buffer->last) {
+            break;
+        }
+
+        // after a failed write the frames are only thrown away
+        traceBegin("encode frame");
+        if (!SDL_AtomicGet(&capture.failed)) {
+            packRows(buffer->pixels);
+            bool written = capture.png ? writePNG(number) : fwrite(capture.rows, packedSize(), 1, capture.video) == 1;
+            if (!written) {
+                SDL_AtomicSet(&capture.failed, 1);
+            }
+        }
+        traceEnd("encode frame");
+
+        SDL_AtomicAdd(&capture.depth, -1);
+        SDL_SemPost(capture.empty);
+    }
+    return 0;
+}
+
+int startCapture(const char *path, int width, int height) {
+    memset(&capture, 0, sizeof(capture));
+    capture.path = path;
+    capture.width = width;
+    capture.height = height;
+    capture.png = strchr(path, '%') != NULL;
+
+    if (capture.png && !capturePattern(path)) {
+        return 1;
+    }
+    if (!capture.png) {
+        capture.video = fopen(path, "wb");
+        if (capture.video == NULL) {
+            return 1;
+        }
+    }
+    buildCrcTable();
+
+    size_t frame_size = (size_t) width * height * 4;
+    for (int b = 0; b < CAPTURE_QUEUE_FRAMES; b++) {
+        capture.buffers[b].pixels = malloc(frame_size);
+        if (capture.buffers[b].pixels == NULL) {
+            return 1;
+        }
+    }
+
+    // a zlib header, five bytes per stored block and the checksum
+    size_t packed = packedSize();
+    capture.rows = malloc(packed);
+    capture.encoded = malloc(2 + packed + 5 * (packed / DEFLATE_STORED_MAX + 1) + 4);
+    if (capture.rows == NULL || capture.encoded == NULL) {
+        return 1;
+    }
+
+    capture.empty = SDL_CreateSemaphore(CAPTURE_QUEUE_FRAMES);
+    capture.filled = SDL_CreateSemaphore(0);
+    if (capture.empty == NULL || capture.filled == NULL) {
+        return 1;
+    }
+
+    capture.thread = SDL_CreateThread(captureMain, "capture", NULL);
+    return capture.thread == NULL ? 1 : 0;
+}
+
+Uint8* beginCaptureFrame(bool wait) {
+    if (wait) {
+        SDL_SemWait(capture.empty);
+    }
+    else if (SDL_SemTryWait(capture.empty) != 0) {
+        capture.dropped++;
+        return NULL;
+    }
+    return capture.buffers[capture.next].pixels;
+}
+
+void endCaptureFrame() {
+    capture.buffers[capture.next].last = false;
+    capture.next = (capture.next + 1) % CAPTURE_QUEUE_FRAMES;
+    capture.frames++;
+
+    int depth = SDL_AtomicAdd(&capture.depth, 1) + 1;
+    if (depth > capture.deepest) {
+        capture.deepest = depth;
+    }
+    SDL_SemPost(capture.filled);
+}
+
+void captureStats(CaptureStats *stats) {
+    stats->frames = capture.frames;
+    stats->dropped = capture.dropped;
+    stats->depth = SDL_AtomicGet(&capture.depth);
+    stats->deepest = capture.deepest;
+    stats->failed = SDL_AtomicGet(&capture.failed);
+}
+
+int stopCapture() {
+    if (capture.thread != NULL) {
+        SDL_SemWait(capture.empty);
+        capture.buffers[capture.next].last = true;
+        SDL_SemPost(capture.filled);
+        SDL_WaitThread(capture.thread, NULL);
+    }
+
+    bool failed = SDL_AtomicGet(&capture.failed);
+    if (capture.video != NULL && fclose(capture.video) != 0) {
+        failed = true;
+    }
+
+    for (int b = 0; b < CAPTURE_QUEUE_FRAMES; b++) {
+        free(capture.buffers[b].pixels);
+    }
+    free(capture.rows);
+    free(capture.encoded);
+    if (capture.empty != NULL) {
+        SDL_DestroySemaphore(capture.empty);
+    }
+    if (capture.filled != NULL) {
+        SDL_DestroySemaphore(capture.filled);
+    }
+
+    // the counts stay for captureStats
+    capture.thread = NULL;
+    capture.video = NULL;
+    capture.rows = NULL;
+    capture.encoded = NULL;
+    capture.empty = NULL;
+    capture.filled = NULL;
+    for (int b = 0; b < CAPTURE_QUEUE_FRAMES; b++) {
+        capture.buffers[b].pixels = NULL;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <SDL2/SDL.h>
+
+#include <stdbool.h>
+
+/*
+    Records the frames on screen to a file without holding up the render
+    loop. The loop copies each frame into one of CAPTURE_QUEUE_FRAMES
+    buffers and an encoder thread of its own writes the full ones out.
+    When the encoder falls so far behind that every buffer is full, the
+    frame is dropped and counted rather than waited for.
+    A path with a %d in it, like frames/%05d.png, gets one PNG per frame,
+    numbered from 0. Any other path gets raw video, the frames one after
+    the other as rows of 8-bit red, green and blue from the top.
+    Frames are handed over as rows of 8-bit red, green, blue and alpha,
+    width * 4 bytes each, from the top.
+*/
+#define CAPTURE_QUEUE_FRAMES 4
+
+typedef struct CaptureStats {
+    Uint32  frames;
+    Uint32  dropped;
+    int     depth;
+    int     deepest;
+    bool    failed;
+} CaptureStats;
+
+/*
+    Opens the raw video file, or checks the pattern of the PNG files, and
+    starts the encoder thread for frames of the given size.
+    Returns 0 on success and 1 if anything could not be set up.
+*/
+int startCapture(const char *path, int width, int height);
+
+/*
+    Returns the buffer to copy the next frame into. If the queue is full
+    this waits for the encoder when asked to, and otherwise returns NULL
+    and the frame is dropped.
+*/
+Uint8* beginCaptureFrame(bool wait);
+
+/*
+    Hands the frame copied since beginCaptureFrame to the encoder.
+*/
+void endCaptureFrame();
+
+/*
+    Fills in the frames handed over and dropped so far, and how many are
+    queued now and were at most.
+*/
+void captureStats(CaptureStats *stats);
+
+/*
+    Lets the encoder write the frames still queued and stops it.
+    Returns 0 on success and 1 if a frame could not be written.
+*/
+int stopCapture();
+
+#endif
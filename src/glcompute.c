@@ -0,0 +1,500 @@
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_opengl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "glcompute.h"
+#include "glrender.h"
+#include "memtrack.h"
+
+// Invocations of one work group of the passes that run once per ball.
+#define BALL_GROUP_SIZE 256
+
+// Storage buffer bindings, as declared in the shared part of the shaders.
+#define STATE_BINDING 0
+#define NEXT_BINDING 1
+#define RADII_BINDING 2
+#define COUNTS_BINDING 3
+#define STARTS_BINDING 4
+#define ORDER_BINDING 5
+#define PARTNERS_BINDING 6
+
+/*
+    The passes of a step, in the order they run. Count counts the balls of
+    every cell, scan turns the counts into the start of every cell in the
+    order, scatter lists every ball in the slice of its cell, pick finds
+    the ball every ball bounces off, and collide bounces the pairs that
+    picked each other and moves every ball into the next state.
+*/
+typedef enum ComputePass {
+    PASS_COUNT,
+    PASS_SCAN,
+    PASS_SCATTER,
+    PASS_PICK,
+    PASS_COLLIDE,
+    PASS_TOTAL
+} ComputePass;
+
+/*
+    Every function is looked up through SDL, like those of the renderer.
+*/
+typedef const GLubyte* (APIENTRY *GetStringProc)(GLenum name);
+typedef void (APIENTRY *GetIntegervProc)(GLenum name, GLint *data);
+
+static struct {
+    GetStringProc                   GetString;
+    GetIntegervProc                 GetIntegerv;
+    PFNGLCREATESHADERPROC           CreateShader;
+    PFNGLSHADERSOURCEPROC           ShaderSource;
+    PFNGLCOMPILESHADERPROC          CompileShader;
+    PFNGLGETSHADERIVPROC            GetShaderiv;
+    PFNGLGETSHADERINFOLOGPROC       GetShaderInfoLog;
+    PFNGLDELETESHADERPROC           DeleteShader;
+    PFNGLCREATEPROGRAMPROC          CreateProgram;
+    PFNGLATTACHSHADERPROC           AttachShader;
+    PFNGLLINKPROGRAMPROC            LinkProgram;
+    PFNGLGETPROGRAMIVPROC           GetProgramiv;
+    PFNGLDELETEPROGRAMPROC          DeleteProgram;
+    PFNGLUSEPROGRAMPROC             UseProgram;
+    PFNGLGETUNIFORMLOCATIONPROC     GetUniformLocation;
+    PFNGLUNIFORM1IPROC              Uniform1i;
+    PFNGLUNIFORM2IPROC              Uniform2i;
+    PFNGLUNIFORM1FPROC              Uniform1f;
+    PFNGLUNIFORM2FPROC              Uniform2f;
+    PFNGLGENBUFFERSPROC             GenBuffers;
+    PFNGLDELETEBUFFERSPROC          DeleteBuffers;
+    PFNGLBINDBUFFERPROC             BindBuffer;
+    PFNGLBINDBUFFERBASEPROC         BindBufferBase;
+    PFNGLBUFFERDATAPROC             BufferData;
+    PFNGLBUFFERSUBDATAPROC          BufferSubData;
+    PFNGLGETBUFFERSUBDATAPROC       GetBufferSubData;
+    PFNGLCLEARBUFFERDATAPROC        ClearBufferData;
+    PFNGLDISPATCHCOMPUTEPROC        DispatchCompute;
+    PFNGLMEMORYBARRIERPROC          MemoryBarrier;
+} gl;
+
+/*
+    The uniforms every pass is given, looked up once per program.
+*/
+typedef struct PassUniforms {
+    GLint   count;
+    GLint   cells;
+    GLint   cell_size;
+    GLint   world;
+    GLint   dt;
+} PassUniforms;
+
+static struct {
+    bool            ready;
+    GLuint          programs[PASS_TOTAL];
+    PassUniforms    uniforms[PASS_TOTAL];
+    GLuint          states[2];
+    GLuint          radii;
+    GLuint          counts;
+    GLuint          starts;
+    GLuint          order;
+    GLuint          partners;
+    int             current;
+    int             capacity;
+    int             count;
+    int             columns;
+    int             rows;
+    float           cell_width;
+    float           cell_height;
+    float           world_width;
+    float           world_height;
+} glc;
+
+/*
+    The part every pass shares: the buffers and the uniforms, and the cell
+    of a center. The state is read from state and written to next, which
+    trade places after every step.
+*/
+static const char *shared_source =
+    "#version 430\n"
+    "layout(std430, binding = 0) buffer State { vec4 state[]; };\n"
+    "layout(std430, binding = 1) buffer Next { vec4 next[]; };\n"
+    "layout(std430, binding = 2) buffer Radii { float radii[]; };\n"
+    "layout(std430, binding = 3) buffer Counts { uint counts[]; };\n"
+    "layout(std430, binding = 4) buffer Starts { uint starts[]; };\n"
+    "layout(std430, binding = 5) buffer Order { uint order[]; };\n"
+    "layout(std430, binding = 6) buffer Partners { uint partners[]; };\n"
+    "uniform int count;\n"
+    "uniform ivec2 cells;\n"
+    "uniform vec2 cell_size;\n"
+    "uniform vec2 world;\n"
+    "uniform float dt;\n"
+    "ivec2 cellOf(vec2 center) {\n"
+    "    return clamp(ivec2(center / cell_size), ivec2(0), cells - 1);\n"
+    "}\n"
+    "uint cellIndex(ivec2 cell) {\n"
+    "    return uint(cell.x + cell.y * cells.x);\n"
+    "}\n";
+
+static const char *count_source =
+    "layout(local_size_x = 256) in;\n"
+    "void main() {\n"
+    "    uint i = gl_GlobalInvocationID.x;\n"
+    "    if (i < uint(count)) {\n"
+    "        atomicAdd(counts[cellIndex(cellOf(state[i].xy))], 1u);\n"
+    "    }\n"
+    "}\n";
+
+/*
+    One work group scans every cell. Each invocation sums a run of cells,
+    the sums of the runs are scanned in shared memory, and each invocation
+    then writes the starts of its own run. The counts are left as they
+    are for scatter to count back down to zero.
+*/
+static const char *scan_source =
+    "layout(local_size_x = 1024) in;\n"
+    "shared uint sums[1024];\n"
+    "void main() {\n"
+    "    uint t = gl_LocalInvocationID.x;\n"
+    "    uint total = uint(cells.x * cells.y);\n"
+    "    uint run = (total + 1023u) / 1024u;\n"
+    "    uint first = min(t * run, total);\n"
+    "    uint last = min(first + run, total);\n"
+    "    uint sum = 0u;\n"
+    "    for (uint c = first; c < last; c++) {\n"
+    "        sum += counts[c];\n"
+    "    }\n"
+    "    sums[t] = sum;\n"
+    "    memoryBarrierShared();\n"
+    "    barrier();\n"
+    "    for (uint step = 1u; step < 1024u; step <<= 1) {\n"
+    "        uint add = t >= step ? sums[t - step] : 0u;\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "        sums[t] += add;\n"
+    "        memoryBarrierShared();\n"
+    "        barrier();\n"
+    "    }\n"
+    "    uint start = sums[t] - sum;\n"
+    "    for (uint c = first; c < last; c++) {\n"
+    "        starts[c] = start;\n"
+    "        start += counts[c];\n"
+    "    }\n"
+    "    if (t == 1023u) {\n"
+    "        starts[total] = sums[t];\n"
+    "    }\n"
+    "}\n";
+
+static const char *scatter_source =
+    "layout(local_size_x = 256) in;\n"
+    "void main() {\n"
+    "    uint i = gl_GlobalInvocationID.x;\n"
+    "    if (i < uint(count)) {\n"
+    "        uint cell = cellIndex(cellOf(state[i].xy));\n"
+    "        order[starts[cell] + atomicAdd(counts[cell], 0xFFFFFFFFu) - 1u] = i;\n"
+    "    }\n"
+    "}\n";
+
+/*
+    Every ball picks the ball it overlaps the most among those it is still
+    closing in on, the lower index breaking ties, or none. The balls it can
+    touch are in the cells around its own, as a cell is at least as large
+    as any ball across.
+*/
+static const char *pick_source =
+    "layout(local_size_x = 256) in;\n"
+    "void main() {\n"
+    "    uint i = gl_GlobalInvocationID.x;\n"
+    "    if (i >= uint(count)) {\n"
+    "        return;\n"
+    "    }\n"
+    "    vec4 ball = state[i];\n"
+    "    float radius = radii[i];\n"
+    "    ivec2 home = cellOf(ball.xy);\n"
+    "    uint partner = 0xFFFFFFFFu;\n"
+    "    float closest = 0.0;\n"
+    "    for (int y = max(home.y - 1, 0); y <= min(home.y + 1, cells.y - 1); y++) {\n"
+    "        for (int x = max(home.x - 1, 0); x <= min(home.x + 1, cells.x - 1); x++) {\n"
+    "            uint cell = cellIndex(ivec2(x, y));\n"
+    "            for (uint k = starts[cell]; k < starts[cell + 1u]; k++) {\n"
+    "                uint j = order[k];\n"
+    "                vec4 other = state[j];\n"
+    "                vec2 n = other.xy - ball.xy;\n"
+    "                float reach = radius + radii[j];\n"
+    "                float distance = dot(n, n);\n"
+    "                if (j == i || distance >= reach * reach || distance == 0.0 || dot(ball.zw - other.zw, n) <= 0.0) {\n"
+    "                    continue;\n"
+    "                }\n"
+    "                float depth = reach - sqrt(distance);\n"
+    "                if (partner == 0xFFFFFFFFu || depth > closest || (depth == closest && j < partner)) {\n"
+    "                    partner = j;\n"
+    "                    closest = depth;\n"
+    "                }\n"
+    "            }\n"
+    "        }\n"
+    "    }\n"
+    "    partners[i] = partner;\n"
+    "}\n";
+
+/*
+    Two balls that picked each other bounce off each other as in bounce,
+    which keeps their momentum and energy exactly. Every ball takes part in
+    at most one bounce a step; the others it touches are picked again in
+    the steps that follow for as long as they keep closing in, where the
+    CPU engines resolve all of them within one step. A pair is bounced by
+    both of its invocations, each writing its own ball only, from the
+    directions both had at the start of the step.
+    The move and the walls follow integrateBallsScalar.
+*/
+static const char *collide_source =
+    "layout(local_size_x = 256) in;\n"
+    "void main() {\n"
+    "    uint i = gl_GlobalInvocationID.x;\n"
+    "    if (i >= uint(count)) {\n"
+    "        return;\n"
+    "    }\n"
+    "    vec4 ball = state[i];\n"
+    "    float radius = radii[i];\n"
+    "    vec2 dir = ball.zw;\n"
+    "    uint j = partners[i];\n"
+    "    if (j != 0xFFFFFFFFu && partners[j] == i) {\n"
+    "        vec4 other = state[j];\n"
+    "        vec2 n = normalize(other.xy - ball.xy);\n"
+    "        dir -= (dot(ball.zw, n) - dot(other.zw, n)) * n;\n"
+    "    }\n"
+    "    vec2 pos = ball.xy + dir * dt;\n"
+    "    bvec2 hit = bvec2(pos.x - radius < 0.0 || pos.x + radius > world.x,\n"
+    "                      pos.y - radius < 0.0 || pos.y + radius > world.y);\n"
+    "    dir = mix(dir, -dir, hit);\n"
+    "    vec2 wall = mix(world - radius - 1.0, vec2(radius + 1.0), greaterThan(dir, vec2(0.0)));\n"
+    "    next[i] = vec4(mix(pos, wall, hit), dir);\n"
+    "}\n";
+
+static void* glFunction(const char *name) {
+    return SDL_GL_GetProcAddress(name);
+}
+
+static int loadFunctions() {
+    gl.GetString = glFunction("glGetString");
+    gl.GetIntegerv = glFunction("glGetIntegerv");
+    gl.CreateShader = glFunction("glCreateShader");
+    gl.ShaderSource = glFunction("glShaderSource");
+    gl.CompileShader = glFunction("glCompileShader");
+    gl.GetShaderiv = glFunction("glGetShaderiv");
+    gl.GetShaderInfoLog = glFunction("glGetShaderInfoLog");
+    gl.DeleteShader = glFunction("glDeleteShader");
+    gl.CreateProgram = glFunction("glCreateProgram");
+    gl.AttachShader = glFunction("glAttachShader");
+    gl.LinkProgram = glFunction("glLinkProgram");
+    gl.GetProgramiv = glFunction("glGetProgramiv");
+    gl.DeleteProgram = glFunction("glDeleteProgram");
+    gl.UseProgram = glFunction("glUseProgram");
+    gl.GetUniformLocation = glFunction("glGetUniformLocation");
+    gl.Uniform1i = glFunction("glUniform1i");
+    gl.Uniform2i = glFunction("glUniform2i");
+    gl.Uniform1f = glFunction("glUniform1f");
+    gl.Uniform2f = glFunction("glUniform2f");
+    gl.GenBuffers = glFunction("glGenBuffers");
+    gl.DeleteBuffers = glFunction("glDeleteBuffers");
+    gl.BindBuffer = glFunction("glBindBuffer");
+    gl.BindBufferBase = glFunction("glBindBufferBase");
+    gl.BufferData = glFunction("glBufferData");
+    gl.BufferSubData = glFunction("glBufferSubData");
+    gl.GetBufferSubData = glFunction("glGetBufferSubData");
+    gl.ClearBufferData = glFunction("glClearBufferData");
+    gl.DispatchCompute = glFunction("glDispatchCompute");
+    gl.MemoryBarrier = glFunction("glMemoryBarrier");
+
+    void **functions = (void**) &gl;
+    for (void **function = functions; function <= (void**) &gl.MemoryBarrier; function++) {
+        if (*function == NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Returns whether the context can run compute shaders on storage
+    buffers, which came with OpenGL 4.3. The shaders are written in GLSL
+    4.30, so an older context is turned down even with the extensions.
+*/
+static bool hasCompute() {
+    int major = 0;
+    int minor = 0;
+    const char *version = (const char*) gl.GetString(GL_VERSION);
+    return version != NULL && sscanf(version, "%d.%d", &major, &minor) == 2 &&
+        (major > 4 || (major == 4 && minor >= 3));
+}
+
+static GLuint buildPass(const char *source, PassUniforms *uniforms) {
+    const char *sources[] = { shared_source, source };
+    GLuint shader = gl.CreateShader(GL_COMPUTE_SHADER);
+    gl.ShaderSource(shader, 2, sources, NULL);
+    gl.CompileShader(shader);
+
+    GLint compiled;
+    gl.GetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        char log[512];
+        gl.GetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Could not compile a compute shader: %s\n", log);
+        gl.DeleteShader(shader);
+        return 0;
+    }
+
+    GLuint program = gl.CreateProgram();
+    gl.AttachShader(program, shader);
+    gl.LinkProgram(program);
+    gl.DeleteShader(shader);
+
+    GLint linked;
+    gl.GetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        fprintf(stderr, "Could not link a compute shader!\n");
+        gl.DeleteProgram(program);
+        return 0;
+    }
+
+    uniforms->count = gl.GetUniformLocation(program, "count");
+    uniforms->cells = gl.GetUniformLocation(program, "cells");
+    uniforms->cell_size = gl.GetUniformLocation(program, "cell_size");
+    uniforms->world = gl.GetUniformLocation(program, "world");
+    uniforms->dt = gl.GetUniformLocation(program, "dt");
+    return program;
+}
+
+/*
+    Creates a buffer of size bytes, filled with zeros.
+*/
+static GLuint createBuffer(GLsizeiptr size) {
+    GLuint buffer;
+    gl.GenBuffers(1, &buffer);
+    gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    gl.BufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    gl.ClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return buffer;
+}
+
+int initGLCompute(int capacity, int world_width, int world_height, int cell_width, int cell_height) {
+    if (loadFunctions() != 0 || !hasCompute()) {
+        fprintf(stderr, "The gpu engine needs an OpenGL 4.3 context for its compute shaders!\n");
+        return 1;
+    }
+
+    const char *sources[PASS_TOTAL] = { count_source, scan_source, scatter_source, pick_source, collide_source };
+    for (int pass = 0; pass < PASS_TOTAL; pass++) {
+        glc.programs[pass] = buildPass(sources[pass], &glc.uniforms[pass]);
+        if (glc.programs[pass] == 0) {
+            return 1;
+        }
+    }
+
+    glc.capacity = capacity > 0 ? capacity : 1;
+    glc.columns = world_width / cell_width;
+    glc.rows = world_height / cell_height;
+    glc.cell_width = cell_width;
+    glc.cell_height = cell_height;
+    glc.world_width = world_width;
+    glc.world_height = world_height;
+
+    GLsizeiptr cells = (GLsizeiptr) glc.columns * glc.rows;
+    for (int k = 0; k < 2; k++) {
+        glc.states[k] = createBuffer((GLsizeiptr) glc.capacity * GL_COMPUTE_STATE_FLOATS * sizeof(float));
+    }
+    glc.radii = createBuffer((GLsizeiptr) glc.capacity * sizeof(float));
+    glc.counts = createBuffer(cells * sizeof(GLuint));
+    glc.starts = createBuffer((cells + 1) * sizeof(GLuint));
+    glc.order = createBuffer((GLsizeiptr) glc.capacity * sizeof(GLuint));
+    glc.partners = createBuffer((GLsizeiptr) glc.capacity * sizeof(GLuint));
+
+    glc.current = 0;
+    glc.count = 0;
+    glc.ready = true;
+    return 0;
+}
+
+void uploadGLCompute(const float *state, const float *radii, int count) {
+    glc.count = count;
+    glc.current = 0;
+
+    gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, glc.states[0]);
+    gl.BufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (GLsizeiptr) count * GL_COMPUTE_STATE_FLOATS * sizeof(float), state);
+    gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, glc.radii);
+    gl.BufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (GLsizeiptr) count * sizeof(float), radii);
+    gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void downloadGLCompute(float *state) {
+    gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, glc.states[glc.current]);
+    gl.GetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (GLsizeiptr) glc.count * GL_COMPUTE_STATE_FLOATS * sizeof(float), state);
+    gl.BindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+/*
+    Runs one pass over the given number of work groups, after the writes
+    of the pass before it.
+*/
+static void dispatchPass(ComputePass pass, GLuint groups, float dt) {
+    PassUniforms *uniforms = &glc.uniforms[pass];
+    gl.UseProgram(glc.programs[pass]);
+    gl.Uniform1i(uniforms->count, glc.count);
+    gl.Uniform2i(uniforms->cells, glc.columns, glc.rows);
+    gl.Uniform2f(uniforms->cell_size, glc.cell_width, glc.cell_height);
+    gl.Uniform2f(uniforms->world, glc.world_width, glc.world_height);
+    gl.Uniform1f(uniforms->dt, dt);
+
+    gl.DispatchCompute(groups, 1, 1);
+    gl.MemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void stepGLCompute(float dt) {
+    if (glc.count == 0) {
+        return;
+    }
+
+    // SDL_Renderer expects its own program to stay current
+    GLint program;
+    gl.GetIntegerv(GL_CURRENT_PROGRAM, &program);
+
+    gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, STATE_BINDING, glc.states[glc.current]);
+    gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, NEXT_BINDING, glc.states[1 - glc.current]);
+    gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, RADII_BINDING, glc.radii);
+    gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, COUNTS_BINDING, glc.counts);
+    gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, STARTS_BINDING, glc.starts);
+    gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, ORDER_BINDING, glc.order);
+    gl.BindBufferBase(GL_SHADER_STORAGE_BUFFER, PARTNERS_BINDING, glc.partners);
+
+    GLuint groups = (glc.count + BALL_GROUP_SIZE - 1) / BALL_GROUP_SIZE;
+    dispatchPass(PASS_COUNT, groups, dt);
+    dispatchPass(PASS_SCAN, 1, dt);
+    dispatchPass(PASS_SCATTER, groups, dt);
+    dispatchPass(PASS_PICK, groups, dt);
+    dispatchPass(PASS_COLLIDE, groups, dt);
+
+    // the next state is drawn from and may be read back
+    gl.MemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    glc.current = 1 - glc.current;
+
+    gl.UseProgram(program);
+}
+
+void drawGLCompute(float x, float y, float zoom) {
+    drawGLBuffers(glc.states[glc.current], GL_COMPUTE_STATE_FLOATS * sizeof(float), glc.radii, glc.count, x, y, zoom);
+}
+
+void freeGLCompute() {
+    if (!glc.ready) {
+        return;
+    }
+
+    for (int pass = 0; pass < PASS_TOTAL; pass++) {
+        gl.DeleteProgram(glc.programs[pass]);
+    }
+    gl.DeleteBuffers(2, glc.states);
+    gl.DeleteBuffers(1, &glc.radii);
+    gl.DeleteBuffers(1, &glc.counts);
+    gl.DeleteBuffers(1, &glc.starts);
+    gl.DeleteBuffers(1, &glc.order);
+    gl.DeleteBuffers(1, &glc.partners);
+    glc.ready = false;
+}
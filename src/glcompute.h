@@ -0,0 +1,52 @@
+#ifndef GLCOMPUTE_H
+#define GLCOMPUTE_H
+
+/*
+    A physics engine that keeps the balls on the GPU and steps them with
+    OpenGL compute shaders. Every step bins the balls into a grid with a
+    counting sort, then resolves the contacts of every ball against the
+    balls of the cells around it and moves it, all without the balls ever
+    leaving GPU memory. The balls are drawn straight from the same buffers
+    through the OpenGL renderer, whose context the engine shares.
+    Each ball is four floats of state, its center x and y and its direction
+    x and y, and one float of radius.
+*/
+#define GL_COMPUTE_STATE_FLOATS 4
+
+/*
+    Loads the OpenGL functions, builds the compute shaders and allocates
+    the buffers for capacity balls in a world of the given size, binned
+    into cells of the given size, which must be at least as large as the
+    largest ball across. Needs initGLRenderer to have succeeded first.
+    Returns 0 on success and 1 if the context has no compute shaders.
+*/
+int initGLCompute(int capacity, int world_width, int world_height, int cell_width, int cell_height);
+
+/*
+    Replaces the balls on the GPU with count balls, GL_COMPUTE_STATE_FLOATS
+    floats of state and one radius each.
+*/
+void uploadGLCompute(const float *state, const float *radii, int count);
+
+/*
+    Copies the state of the balls on the GPU back into state, waiting for
+    every step queued so far.
+*/
+void downloadGLCompute(float *state);
+
+/*
+    Queues one step of dt on the GPU.
+*/
+void stepGLCompute(float dt);
+
+/*
+    Draws the balls as a camera at x, y with the given zoom sees them.
+*/
+void drawGLCompute(float x, float y, float zoom);
+
+/*
+    Releases the shaders and the buffers of the engine.
+*/
+void freeGLCompute();
+
+#endif
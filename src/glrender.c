@@ -0,0 +1,561 @@
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_opengl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "glrender.h"
+#include "memtrack.h"
+
+// Frames the persistently mapped buffer is split into, so the CPU can write
+// one while the GPU still reads the others.
+#define GL_RING_FRAMES 3
+
+// Longest wait for the GPU to release a frame of the ring, in nanoseconds.
+#define GL_FENCE_TIMEOUT 1000000000
+
+// Attribute locations, kept off 0 which aliases gl_Vertex in compatibility
+// contexts, where SDL_Renderer still feeds the fixed-function arrays.
+#define CORNER_ATTRIBUTE 1
+#define CENTER_ATTRIBUTE 2
+#define SIZE_ATTRIBUTE 3
+
+/*
+    Every function is looked up through SDL, so the program does not have
+    to link against the OpenGL library itself.
+*/
+typedef const GLubyte* (APIENTRY *GetStringProc)(GLenum name);
+typedef void (APIENTRY *GetIntegervProc)(GLenum name, GLint *data);
+typedef GLboolean (APIENTRY *IsEnabledProc)(GLenum cap);
+typedef void (APIENTRY *CapabilityProc)(GLenum cap);
+typedef void (APIENTRY *ReadPixelsProc)(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format,
+                                        GLenum type, void *pixels);
+
+static struct {
+    GetStringProc                   GetString;
+    GetIntegervProc                 GetIntegerv;
+    IsEnabledProc                   IsEnabled;
+    CapabilityProc                  Enable;
+    CapabilityProc                  Disable;
+    CapabilityProc                  EnableClientState;
+    CapabilityProc                  DisableClientState;
+    PFNGLCREATESHADERPROC           CreateShader;
+    PFNGLSHADERSOURCEPROC           ShaderSource;
+    PFNGLCOMPILESHADERPROC          CompileShader;
+    PFNGLGETSHADERIVPROC            GetShaderiv;
+    PFNGLGETSHADERINFOLOGPROC       GetShaderInfoLog;
+    PFNGLDELETESHADERPROC           DeleteShader;
+    PFNGLCREATEPROGRAMPROC          CreateProgram;
+    PFNGLATTACHSHADERPROC           AttachShader;
+    PFNGLBINDATTRIBLOCATIONPROC     BindAttribLocation;
+    PFNGLLINKPROGRAMPROC            LinkProgram;
+    PFNGLGETPROGRAMIVPROC           GetProgramiv;
+    PFNGLDELETEPROGRAMPROC          DeleteProgram;
+    PFNGLUSEPROGRAMPROC             UseProgram;
+    PFNGLGETUNIFORMLOCATIONPROC     GetUniformLocation;
+    PFNGLUNIFORM2FPROC              Uniform2f;
+    PFNGLUNIFORM3FPROC              Uniform3f;
+    PFNGLGENBUFFERSPROC             GenBuffers;
+    PFNGLDELETEBUFFERSPROC          DeleteBuffers;
+    PFNGLBINDBUFFERPROC             BindBuffer;
+    PFNGLBUFFERDATAPROC             BufferData;
+    PFNGLBUFFERSUBDATAPROC          BufferSubData;
+    PFNGLVERTEXATTRIBPOINTERPROC    VertexAttribPointer;
+    PFNGLENABLEVERTEXATTRIBARRAYPROC    EnableVertexAttribArray;
+    PFNGLDISABLEVERTEXATTRIBARRAYPROC   DisableVertexAttribArray;
+    PFNGLVERTEXATTRIBDIVISORPROC    VertexAttribDivisor;
+    PFNGLDRAWARRAYSINSTANCEDPROC    DrawArraysInstanced;
+    PFNGLBUFFERSTORAGEPROC          BufferStorage;
+    PFNGLMAPBUFFERRANGEPROC         MapBufferRange;
+    PFNGLUNMAPBUFFERPROC            UnmapBuffer;
+    PFNGLFENCESYNCPROC              FenceSync;
+    PFNGLCLIENTWAITSYNCPROC         ClientWaitSync;
+    PFNGLDELETESYNCPROC             DeleteSync;
+    ReadPixelsProc                  ReadPixels;
+} gl;
+
+static struct {
+    SDL_Renderer*   renderer;
+    GLuint          program;
+    GLint           screen;
+    GLint           view;
+    GLuint          corners;
+    GLuint          instances;
+    int             capacity;
+    bool            persistent;
+    float*          mapped;
+    GLsync          fences[GL_RING_FRAMES];
+    int             frame;
+    float*          staging;
+} glr;
+
+/*
+    The pixel buffers frames are read back into, oldest first from first,
+    each with the fence of its read.
+*/
+static struct {
+    SDL_Renderer*   renderer;
+    int             width;
+    int             height;
+    GLuint          buffers[GL_READBACK_FRAMES];
+    GLsync          fences[GL_READBACK_FRAMES];
+    int             first;
+    int             pending;
+} readback;
+
+/*
+    Each instance covers the square around its ball, and the fragments that
+    are not on the one pixel wide outline are discarded. The view moves and
+    scales the world the way the camera does, so balls that are already in
+    screen coordinates are drawn with a view of 0, 0 and a zoom of 1.
+*/
+static const char *vertex_source =
+    "#version 120\n"
+    "attribute vec2 corner;\n"
+    "attribute vec2 center;\n"
+    "attribute float size;\n"
+    "uniform vec2 screen;\n"
+    "uniform vec3 view;\n"
+    "varying vec2 offset;\n"
+    "varying float radius;\n"
+    "void main() {\n"
+    "    radius = max(floor(size * view.z + 0.5), 1.0);\n"
+    "    vec2 pixel = (center - view.xy) * view.z + corner * radius;\n"
+    "    offset = corner;\n"
+    "    gl_Position = vec4(pixel.x / screen.x * 2.0 - 1.0, 1.0 - pixel.y / screen.y * 2.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *fragment_source =
+    "#version 120\n"
+    "varying vec2 offset;\n"
+    "varying float radius;\n"
+    "void main() {\n"
+    "    float distance = length(offset) * radius;\n"
+    "    if (distance > radius || distance < radius - 1.0) {\n"
+    "        discard;\n"
+    "    }\n"
+    "    gl_FragColor = vec4(1.0);\n"
+    "}\n";
+
+/*
+    Looks up an OpenGL function, trying the ARB name of an extension if the
+    core name is missing. Returns NULL if neither exists.
+*/
+static void* glFunction(const char *name, const char *arb_name) {
+    void *function = SDL_GL_GetProcAddress(name);
+    if (function == NULL && arb_name != NULL) {
+        function = SDL_GL_GetProcAddress(arb_name);
+    }
+    return function;
+}
+
+static int loadFunctions() {
+    gl.GetString = glFunction("glGetString", NULL);
+    gl.GetIntegerv = glFunction("glGetIntegerv", NULL);
+    gl.IsEnabled = glFunction("glIsEnabled", NULL);
+    gl.Enable = glFunction("glEnable", NULL);
+    gl.Disable = glFunction("glDisable", NULL);
+    gl.EnableClientState = glFunction("glEnableClientState", NULL);
+    gl.DisableClientState = glFunction("glDisableClientState", NULL);
+    gl.CreateShader = glFunction("glCreateShader", NULL);
+    gl.ShaderSource = glFunction("glShaderSource", NULL);
+    gl.CompileShader = glFunction("glCompileShader", NULL);
+    gl.GetShaderiv = glFunction("glGetShaderiv", NULL);
+    gl.GetShaderInfoLog = glFunction("glGetShaderInfoLog", NULL);
+    gl.DeleteShader = glFunction("glDeleteShader", NULL);
+    gl.CreateProgram = glFunction("glCreateProgram", NULL);
+    gl.AttachShader = glFunction("glAttachShader", NULL);
+    gl.BindAttribLocation = glFunction("glBindAttribLocation", NULL);
+    gl.LinkProgram = glFunction("glLinkProgram", NULL);
+    gl.GetProgramiv = glFunction("glGetProgramiv", NULL);
+    gl.DeleteProgram = glFunction("glDeleteProgram", NULL);
+    gl.UseProgram = glFunction("glUseProgram", NULL);
+    gl.GetUniformLocation = glFunction("glGetUniformLocation", NULL);
+    gl.Uniform2f = glFunction("glUniform2f", NULL);
+    gl.Uniform3f = glFunction("glUniform3f", NULL);
+    gl.GenBuffers = glFunction("glGenBuffers", NULL);
+    gl.DeleteBuffers = glFunction("glDeleteBuffers", NULL);
+    gl.BindBuffer = glFunction("glBindBuffer", NULL);
+    gl.BufferData = glFunction("glBufferData", NULL);
+    gl.BufferSubData = glFunction("glBufferSubData", NULL);
+    gl.VertexAttribPointer = glFunction("glVertexAttribPointer", NULL);
+    gl.EnableVertexAttribArray = glFunction("glEnableVertexAttribArray", NULL);
+    gl.DisableVertexAttribArray = glFunction("glDisableVertexAttribArray", NULL);
+    gl.VertexAttribDivisor = glFunction("glVertexAttribDivisor", "glVertexAttribDivisorARB");
+    gl.DrawArraysInstanced = glFunction("glDrawArraysInstanced", "glDrawArraysInstancedARB");
+    gl.BufferStorage = glFunction("glBufferStorage", NULL);
+    gl.MapBufferRange = glFunction("glMapBufferRange", NULL);
+    gl.UnmapBuffer = glFunction("glUnmapBuffer", NULL);
+    gl.FenceSync = glFunction("glFenceSync", NULL);
+    gl.ClientWaitSync = glFunction("glClientWaitSync", NULL);
+    gl.DeleteSync = glFunction("glDeleteSync", NULL);
+    gl.ReadPixels = glFunction("glReadPixels", NULL);
+
+    // everything up to the instanced draw is needed, the rest is optional
+    void **functions = (void**) &gl;
+    for (void **function = functions; function <= (void**) &gl.DrawArraysInstanced; function++) {
+        if (*function == NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Returns whether the context is at least the given OpenGL version.
+*/
+static bool glVersion(int major, int minor) {
+    int context_major = 0;
+    int context_minor = 0;
+    const char *version = (const char*) gl.GetString(GL_VERSION);
+    if (version == NULL || sscanf(version, "%d.%d", &context_major, &context_minor) != 2) {
+        return false;
+    }
+    return context_major > major || (context_major == major && context_minor >= minor);
+}
+
+static GLuint compileShader(GLenum type, const char *source) {
+    GLuint shader = gl.CreateShader(type);
+    gl.ShaderSource(shader, 1, &source, NULL);
+    gl.CompileShader(shader);
+
+    GLint compiled;
+    gl.GetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        char log[512];
+        gl.GetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Could not compile a shader: %s\n", log);
+        gl.DeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static int buildProgram() {
+    GLuint vertex = compileShader(GL_VERTEX_SHADER, vertex_source);
+    GLuint fragment = compileShader(GL_FRAGMENT_SHADER, fragment_source);
+    if (vertex == 0 || fragment == 0) {
+        return 1;
+    }
+
+    glr.program = gl.CreateProgram();
+    gl.AttachShader(glr.program, vertex);
+    gl.AttachShader(glr.program, fragment);
+    gl.BindAttribLocation(glr.program, CORNER_ATTRIBUTE, "corner");
+    gl.BindAttribLocation(glr.program, CENTER_ATTRIBUTE, "center");
+    gl.BindAttribLocation(glr.program, SIZE_ATTRIBUTE, "size");
+    gl.LinkProgram(glr.program);
+    gl.DeleteShader(vertex);
+    gl.DeleteShader(fragment);
+
+    GLint linked;
+    gl.GetProgramiv(glr.program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        fprintf(stderr, "Could not link the ball shaders!\n");
+        return 1;
+    }
+
+    glr.screen = gl.GetUniformLocation(glr.program, "screen");
+    glr.view = gl.GetUniformLocation(glr.program, "view");
+    return 0;
+}
+
+/*
+    Allocates the instance buffer, as a persistently mapped ring of frames
+    when the context has buffer storage (OpenGL 4.4), otherwise as a buffer
+    that is orphaned and refilled from a staging copy every frame.
+*/
+static int allocateInstances(int capacity) {
+    GLsizeiptr frame_size = (GLsizeiptr) capacity * GL_INSTANCE_FLOATS * sizeof(float);
+
+    gl.GenBuffers(1, &glr.instances);
+    gl.BindBuffer(GL_ARRAY_BUFFER, glr.instances);
+
+    glr.persistent = gl.BufferStorage != NULL && gl.MapBufferRange != NULL && gl.FenceSync != NULL
+        && (glVersion(4, 4) || SDL_GL_ExtensionSupported("GL_ARB_buffer_storage"));
+
+    if (glr.persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        gl.BufferStorage(GL_ARRAY_BUFFER, frame_size * GL_RING_FRAMES, NULL, flags);
+        glr.mapped = gl.MapBufferRange(GL_ARRAY_BUFFER, 0, frame_size * GL_RING_FRAMES, flags);
+        glr.persistent = glr.mapped != NULL;
+    }
+
+    if (!glr.persistent) {
+        gl.BufferData(GL_ARRAY_BUFFER, frame_size, NULL, GL_STREAM_DRAW);
+        glr.staging = malloc(frame_size);
+    }
+
+    gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    return glr.persistent || glr.staging != NULL ? 0 : 1;
+}
+
+int initGLRenderer(SDL_Renderer *renderer, int capacity) {
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(renderer, &info) != 0 || strcmp(info.name, "opengl") != 0) {
+        fprintf(stderr, "The OpenGL renderer needs the opengl render driver!\n");
+        return 1;
+    }
+
+    if (loadFunctions() != 0) {
+        fprintf(stderr, "The OpenGL context does not support instancing!\n");
+        return 1;
+    }
+
+    if (!glVersion(3, 3) && !SDL_GL_ExtensionSupported("GL_ARB_instanced_arrays")) {
+        fprintf(stderr, "The OpenGL context does not support instanced arrays!\n");
+        return 1;
+    }
+
+    glr.renderer = renderer;
+    glr.capacity = capacity;
+
+    if (buildProgram() != 0) {
+        return 1;
+    }
+
+    static const float corners[] = { -1, -1, 1, -1, -1, 1, 1, 1 };
+    gl.GenBuffers(1, &glr.corners);
+    gl.BindBuffer(GL_ARRAY_BUFFER, glr.corners);
+    gl.BufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+    gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+
+    return allocateInstances(capacity);
+}
+
+float* beginGLInstances() {
+    if (!glr.persistent) {
+        return glr.staging;
+    }
+
+    GLsync fence = glr.fences[glr.frame];
+    if (fence != NULL) {
+        gl.ClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_FENCE_TIMEOUT);
+        gl.DeleteSync(fence);
+        glr.fences[glr.frame] = NULL;
+    }
+    return glr.mapped + (size_t) glr.frame * glr.capacity * GL_INSTANCE_FLOATS;
+}
+
+/*
+    Draws count balls whose centers are two floats every center_stride bytes
+    of the centers buffer, starting at center_offset, and whose radii are
+    one float every radius_stride bytes of the radii buffer.
+*/
+static void drawBallBuffers(GLuint centers, size_t center_offset, GLsizei center_stride,
+                            GLuint radii, size_t radius_offset, GLsizei radius_stride,
+                            int count, float view_x, float view_y, float zoom) {
+    // draws queued on the SDL_Renderer have to reach the context first
+    SDL_RenderFlush(glr.renderer);
+
+    // SDL_Renderer caches its own state, so everything touched is put back
+    GLint program;
+    gl.GetIntegerv(GL_CURRENT_PROGRAM, &program);
+    GLboolean blend = gl.IsEnabled(GL_BLEND);
+    GLboolean vertex_array = gl.IsEnabled(GL_VERTEX_ARRAY);
+    GLboolean color_array = gl.IsEnabled(GL_COLOR_ARRAY);
+    GLboolean texture_array = gl.IsEnabled(GL_TEXTURE_COORD_ARRAY);
+    gl.Disable(GL_BLEND);
+    gl.DisableClientState(GL_VERTEX_ARRAY);
+    gl.DisableClientState(GL_COLOR_ARRAY);
+    gl.DisableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    gl.UseProgram(glr.program);
+    int width;
+    int height;
+    SDL_GetRendererOutputSize(glr.renderer, &width, &height);
+    gl.Uniform2f(glr.screen, width, height);
+    gl.Uniform3f(glr.view, view_x, view_y, zoom);
+
+    gl.BindBuffer(GL_ARRAY_BUFFER, centers);
+    gl.VertexAttribPointer(CENTER_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, center_stride, (const void*) center_offset);
+    gl.EnableVertexAttribArray(CENTER_ATTRIBUTE);
+    gl.VertexAttribDivisor(CENTER_ATTRIBUTE, 1);
+
+    gl.BindBuffer(GL_ARRAY_BUFFER, radii);
+    gl.VertexAttribPointer(SIZE_ATTRIBUTE, 1, GL_FLOAT, GL_FALSE, radius_stride, (const void*) radius_offset);
+    gl.EnableVertexAttribArray(SIZE_ATTRIBUTE);
+    gl.VertexAttribDivisor(SIZE_ATTRIBUTE, 1);
+
+    gl.BindBuffer(GL_ARRAY_BUFFER, glr.corners);
+    gl.VertexAttribPointer(CORNER_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+    gl.EnableVertexAttribArray(CORNER_ATTRIBUTE);
+
+    gl.DrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+
+    gl.DisableVertexAttribArray(CORNER_ATTRIBUTE);
+    gl.DisableVertexAttribArray(CENTER_ATTRIBUTE);
+    gl.DisableVertexAttribArray(SIZE_ATTRIBUTE);
+    gl.VertexAttribDivisor(CENTER_ATTRIBUTE, 0);
+    gl.VertexAttribDivisor(SIZE_ATTRIBUTE, 0);
+    gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    gl.UseProgram(program);
+
+    if (blend) {
+        gl.Enable(GL_BLEND);
+    }
+    if (vertex_array) {
+        gl.EnableClientState(GL_VERTEX_ARRAY);
+    }
+    if (color_array) {
+        gl.EnableClientState(GL_COLOR_ARRAY);
+    }
+    if (texture_array) {
+        gl.EnableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+}
+
+void drawGLInstances(int count) {
+    GLsizei stride = GL_INSTANCE_FLOATS * sizeof(float);
+    size_t offset = 0;
+
+    if (glr.persistent) {
+        offset = (size_t) glr.frame * glr.capacity * stride;
+    }
+    else {
+        gl.BindBuffer(GL_ARRAY_BUFFER, glr.instances);
+        gl.BufferData(GL_ARRAY_BUFFER, (GLsizeiptr) glr.capacity * stride, NULL, GL_STREAM_DRAW);
+        gl.BufferSubData(GL_ARRAY_BUFFER, 0, (GLsizeiptr) count * stride, glr.staging);
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    drawBallBuffers(glr.instances, offset, stride, glr.instances, offset + 2 * sizeof(float), stride, count, 0, 0, 1);
+
+    if (glr.persistent) {
+        glr.fences[glr.frame] = gl.FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glr.frame = (glr.frame + 1) % GL_RING_FRAMES;
+    }
+}
+
+void drawGLBuffers(unsigned int centers, int stride, unsigned int radii, int count, float x, float y, float zoom) {
+    drawBallBuffers(centers, 0, stride, radii, 0, sizeof(float), count, x, y, zoom);
+}
+
+void freeGLRenderer() {
+    if (glr.renderer == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < GL_RING_FRAMES; i++) {
+        if (glr.fences[i] != NULL) {
+            gl.DeleteSync(glr.fences[i]);
+        }
+    }
+
+    if (glr.persistent) {
+        gl.BindBuffer(GL_ARRAY_BUFFER, glr.instances);
+        gl.UnmapBuffer(GL_ARRAY_BUFFER);
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    gl.DeleteBuffers(1, &glr.instances);
+    gl.DeleteBuffers(1, &glr.corners);
+    gl.DeleteProgram(glr.program);
+    free(glr.staging);
+    glr.renderer = NULL;
+}
+
+bool glPersistentMapping() {
+    return glr.persistent;
+}
+
+int startGLReadback(SDL_Renderer *renderer, int width, int height) {
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(renderer, &info) != 0 || strcmp(info.name, "opengl") != 0) {
+        return 1;
+    }
+
+    // the instancing of initGLRenderer is not needed to read back
+    loadFunctions();
+    if (gl.ReadPixels == NULL || gl.GenBuffers == NULL || gl.BindBuffer == NULL || gl.BufferData == NULL ||
+        gl.MapBufferRange == NULL || gl.UnmapBuffer == NULL || gl.FenceSync == NULL ||
+        gl.ClientWaitSync == NULL || gl.DeleteSync == NULL || gl.DeleteBuffers == NULL) {
+        return 1;
+    }
+
+    readback.renderer = renderer;
+    readback.width = width;
+    readback.height = height;
+    readback.first = 0;
+    readback.pending = 0;
+
+    gl.GenBuffers(GL_READBACK_FRAMES, readback.buffers);
+    for (int i = 0; i < GL_READBACK_FRAMES; i++) {
+        gl.BindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffers[i]);
+        gl.BufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr) width * height * 4, NULL, GL_STREAM_READ);
+        readback.fences[i] = NULL;
+    }
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return 0;
+}
+
+void readGLFrame() {
+    if (readback.pending == GL_READBACK_FRAMES) {
+        takeGLFrame(NULL);
+    }
+
+    // draws queued on the SDL_Renderer have to reach the frame first
+    SDL_RenderFlush(readback.renderer);
+
+    int index = (readback.first + readback.pending) % GL_READBACK_FRAMES;
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffers[index]);
+    gl.ReadPixels(0, 0, readback.width, readback.height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    readback.fences[index] = gl.FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.pending++;
+}
+
+int pendingGLFrames() {
+    return readback.pending;
+}
+
+void takeGLFrame(Uint8 *pixels) {
+    if (readback.pending == 0) {
+        return;
+    }
+
+    int index = readback.first;
+    gl.ClientWaitSync(readback.fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, GL_FENCE_TIMEOUT);
+    gl.DeleteSync(readback.fences[index]);
+    readback.fences[index] = NULL;
+    readback.first = (readback.first + 1) % GL_READBACK_FRAMES;
+    readback.pending--;
+
+    if (pixels == NULL) {
+        return;
+    }
+
+    size_t pitch = (size_t) readback.width * 4;
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffers[index]);
+    const Uint8 *mapped = gl.MapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr) pitch * readback.height,
+                                            GL_MAP_READ_BIT);
+    if (mapped != NULL) {
+        // OpenGL has the bottom row first
+        for (int y = 0; y < readback.height; y++) {
+            memcpy(pixels + (size_t) y * pitch, mapped + (size_t) (readback.height - 1 - y) * pitch, pitch);
+        }
+        gl.UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    else {
+        memset(pixels, 0, pitch * readback.height);
+    }
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void stopGLReadback() {
+    if (readback.renderer == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < GL_READBACK_FRAMES; i++) {
+        if (readback.fences[i] != NULL) {
+            gl.DeleteSync(readback.fences[i]);
+            readback.fences[i] = NULL;
+        }
+    }
+    gl.DeleteBuffers(GL_READBACK_FRAMES, readback.buffers);
+    readback.pending = 0;
+    readback.renderer = NULL;
+}
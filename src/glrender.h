@@ -0,0 +1,98 @@
+#ifndef GLRENDER_H
+#define GLRENDER_H
+
+#include <SDL2/SDL.h>
+
+#include <stdbool.h>
+
+/*
+    An OpenGL backend that draws every ball with one instanced draw call.
+    Each ball is one instance of a screen-space quad, described by three
+    floats: its center x, its center y and its radius. The outline is cut
+    out of the quad by the fragment shader, so the cost of a frame on the
+    CPU is only writing the instances.
+    The backend draws through the OpenGL context of an SDL_Renderer created
+    with the opengl driver, so it can be mixed with the other SDL_Render
+    calls of a frame.
+*/
+#define GL_INSTANCE_FLOATS 3
+
+/*
+    Loads the OpenGL functions, builds the shaders and allocates room for
+    capacity instances. When the driver supports it the instance buffer is
+    persistently mapped, otherwise it is uploaded every frame.
+    Returns 0 on success and 1 if the renderer does not run on an OpenGL
+    context with instancing.
+*/
+int initGLRenderer(SDL_Renderer *renderer, int capacity);
+
+/*
+    Returns the memory the instances of the next frame are to be written to,
+    GL_INSTANCE_FLOATS floats per ball, with room for the capacity given to
+    initGLRenderer. Waits if the GPU is still reading that part of the
+    buffer from an earlier frame.
+*/
+float* beginGLInstances();
+
+/*
+    Draws the first count instances written since beginGLInstances.
+*/
+void drawGLInstances(int count);
+
+/*
+    Draws count balls straight from OpenGL buffers that live on the GPU,
+    such as those of the compute engine: the center of ball i is the first
+    two floats at byte i * stride of the centers buffer, and its radius is
+    float i of the radii buffer. The balls are in world coordinates and are
+    seen by a camera at x, y with the given zoom.
+*/
+void drawGLBuffers(unsigned int centers, int stride, unsigned int radii, int count, float x, float y, float zoom);
+
+/*
+    Releases the shaders and the buffers of the backend.
+*/
+void freeGLRenderer();
+
+/*
+    Returns whether the instance buffer is persistently mapped.
+*/
+bool glPersistentMapping();
+
+/*
+    Reads frames back from an SDL_Renderer with the opengl driver without
+    waiting for them: every frame is copied into the next of a ring of
+    GL_READBACK_FRAMES pixel buffers on the GPU, and taken out of the ring
+    only once the frames after it were drawn, when the copy has long
+    finished. This does not need initGLRenderer.
+    Returns 0 on success and 1 if the renderer does not run on an OpenGL
+    context with pixel buffers and fences.
+*/
+#define GL_READBACK_FRAMES 3
+
+int startGLReadback(SDL_Renderer *renderer, int width, int height);
+
+/*
+    Starts reading the frame drawn so far into the ring, throwing away the
+    oldest frame of the ring if it is full. To be called before the frame
+    is presented.
+*/
+void readGLFrame();
+
+/*
+    Returns the number of frames in the ring.
+*/
+int pendingGLFrames();
+
+/*
+    Takes the oldest frame out of the ring, waiting for it if needed, and
+    copies it into pixels as rows of 8-bit red, green, blue and alpha
+    from the top, or throws it away if pixels is NULL.
+*/
+void takeGLFrame(Uint8 *pixels);
+
+/*
+    Releases the ring, with the frames still in it.
+*/
+void stopGLReadback();
+
+#endif
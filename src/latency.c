@@ -0,0 +1,120 @@
+#include <SDL2/SDL.h>
+
+#include <string.h>
+
+#include "latency.h"
+
+/*
+    Returns the bucket counting the given number of nanoseconds.
+*/
+static int latencyBucket(Uint64 ns) {
+    if (ns >= (Uint64) 1 << LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    if (ns < 2 * LATENCY_SUB_BUCKETS) {
+        return (int) ns;
+    }
+
+    // the top LATENCY_PRECISION_BITS + 1 bits pick the bucket
+    int top = 63 - __builtin_clzll(ns);
+    int shift = top - LATENCY_PRECISION_BITS;
+    int mantissa = (int) (ns >> shift) - LATENCY_SUB_BUCKETS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + mantissa;
+}
+
+/*
+    Returns the highest number of nanoseconds the bucket counts.
+*/
+static Uint64 latencyBucketValue(int bucket) {
+    if (bucket < 2 * LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    Uint64 mantissa = bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void recordLatency(LatencyHistogram *histogram, Uint64 ns) {
+    int bucket = latencyBucket(ns);
+
+    SDL_AtomicLock(&histogram->lock);
+    histogram->counts[bucket]++;
+    histogram->count++;
+    if (ns > histogram->max) {
+        histogram->max = ns;
+    }
+    SDL_AtomicUnlock(&histogram->lock);
+}
+
+void resetLatency(LatencyHistogram *histogram) {
+    SDL_AtomicLock(&histogram->lock);
+    memset(histogram->counts, 0, sizeof(histogram->counts));
+    histogram->count = 0;
+    histogram->max = 0;
+    SDL_AtomicUnlock(&histogram->lock);
+}
+
+/*
+    Returns the value below which the given fraction of the count of the
+    counts lies.
+*/
+static Uint64 latencyPercentile(const Uint64 *counts, Uint64 count, double fraction) {
+    // the rank of the value, counting from 1
+    Uint64 rank = (Uint64) (fraction * count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    Uint64 seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += counts[bucket];
+        if (seen >= rank) {
+            return latencyBucketValue(bucket);
+        }
+    }
+    return latencyBucketValue(LATENCY_BUCKETS - 1);
+}
+
+void summarizeLatency(LatencyHistogram *histogram, LatencyHistogram *since, LatencySummary *summary) {
+    Uint64 counts[LATENCY_BUCKETS];
+    Uint64 count;
+    Uint64 max;
+
+    SDL_AtomicLock(&histogram->lock);
+    memcpy(counts, histogram->counts, sizeof(counts));
+    count = histogram->count;
+    max = histogram->max;
+    SDL_AtomicUnlock(&histogram->lock);
+
+    if (since != NULL) {
+        Uint64 interval_max = 0;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            Uint64 total = counts[bucket];
+            counts[bucket] -= since->counts[bucket];
+            since->counts[bucket] = total;
+            if (counts[bucket] > 0) {
+                interval_max = latencyBucketValue(bucket);
+            }
+        }
+
+        Uint64 total = count;
+        count -= since->count;
+        since->count = total;
+        since->max = max;
+        max = interval_max < max ? interval_max : max;
+    }
+
+    *summary = (LatencySummary) { .count = count, .max = count > 0 ? max : 0 };
+    if (count == 0) {
+        return;
+    }
+
+    // the bucket of the longest time reaches past it
+    Uint64 *percentiles[] = { &summary->p50, &summary->p90, &summary->p99, &summary->p999 };
+    double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (int k = 0; k < 4; k++) {
+        Uint64 value = latencyPercentile(counts, count, fractions[k]);
+        *percentiles[k] = value < max ? value : max;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <SDL2/SDL.h>
+
+/*
+    Histograms of durations in nanoseconds, laid out like HdrHistogram:
+    below 2 * LATENCY_SUB_BUCKETS every nanosecond has a bucket of its
+    own, and above that every power of two is split into
+    LATENCY_SUB_BUCKETS buckets, so a value is counted within 1 part in
+    LATENCY_SUB_BUCKETS of what it was, at any magnitude. Values of
+    2^LATENCY_MAX_BITS nanoseconds (about 18 minutes) and more are
+    counted in the last bucket.
+    One thread may record while another summarizes, recording only takes
+    a spin lock for an increment.
+*/
+#define LATENCY_PRECISION_BITS 6
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_PRECISION_BITS)
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_PRECISION_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct LatencyHistogram {
+    Uint64          counts[LATENCY_BUCKETS];
+    Uint64          count;
+    Uint64          max;
+    SDL_SpinLock    lock;
+} LatencyHistogram;
+
+/*
+    Percentiles of a histogram in nanoseconds. Every percentile is the
+    highest value its bucket stands for; the max is exact over the whole
+    histogram and the highest such value over an interval.
+*/
+typedef struct LatencySummary {
+    Uint64  count;
+    Uint64  p50;
+    Uint64  p90;
+    Uint64  p99;
+    Uint64  p999;
+    Uint64  max;
+} LatencySummary;
+
+/*
+    Counts one duration.
+*/
+void recordLatency(LatencyHistogram *histogram, Uint64 ns);
+
+/*
+    Forgets every duration counted.
+*/
+void resetLatency(LatencyHistogram *histogram);
+
+/*
+    Summarizes the whole histogram, or with since only what it counted
+    after since was last passed here, since then becoming a copy of the
+    histogram for the next interval. since starts out zeroed.
+*/
+void summarizeLatency(LatencyHistogram *histogram, LatencyHistogram *since, LatencySummary *summary);
+
+#endif
@@ -0,0 +1,162 @@
+#include <SDL2/SDL.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+
+#include "log.h"
+#include "memtrack.h"
+
+// Entries in the ring, a power of two.
+#define LOG_CAPACITY 1024
+#define LOG_MESSAGE_SIZE 240
+#define LOG_FLUSH_MS 100
+
+/*
+    One message slot. The sequence number says whose turn the slot is: it
+    equals the ticket of the writer allowed to fill it, becomes ticket + 1
+    once the message is complete, and ticket + LOG_CAPACITY once the reader
+    has written it out and the slot is free for the next lap.
+*/
+typedef struct LogEntry {
+    SDL_atomic_t    sequence;
+    LogLevel        level;
+    char            text[LOG_MESSAGE_SIZE];
+} LogEntry;
+
+static LogEntry logRing[LOG_CAPACITY];
+static SDL_atomic_t logHead;
+static int logTail;
+static SDL_atomic_t logDropped;
+
+static SDL_Thread *logThread;
+static SDL_sem *logWake;
+static SDL_atomic_t logQuitting;
+static bool logStarted = false;
+
+static const char *level_names[] = { "debug", "info", "warning", "error" };
+
+static void writeMessage(LogLevel level, const char *text) {
+    if (level == LOG_INFO) {
+        fputs(text, stdout);
+    }
+    else {
+        fprintf(stderr, "%s: %s", level_names[level], text);
+    }
+}
+
+/*
+    Writes out every complete message, in the order they were logged.
+    Only ever runs on one thread at a time.
+*/
+static void drainLog(void) {
+    while (true) {
+        LogEntry *entry = &logRing[logTail & (LOG_CAPACITY - 1)];
+        if (SDL_AtomicGet(&entry->sequence) != logTail + 1) {
+            break;
+        }
+
+        writeMessage(entry->level, entry->text);
+        SDL_AtomicSet(&entry->sequence, logTail + LOG_CAPACITY);
+        logTail++;
+    }
+    fflush(stdout);
+
+    int dropped = SDL_AtomicSet(&logDropped, 0);
+    if (dropped > 0) {
+        fprintf(stderr, "warning: the log was full, %d messages were dropped\n", dropped);
+    }
+}
+
+static int logMain(void *data) {
+    while (!SDL_AtomicGet(&logQuitting)) {
+        SDL_SemWaitTimeout(logWake, LOG_FLUSH_MS);
+        drainLog();
+    }
+    return 0;
+}
+
+int startLogger(void) {
+    for (int i = 0; i < LOG_CAPACITY; i++) {
+        SDL_AtomicSet(&logRing[i].sequence, i);
+    }
+    SDL_AtomicSet(&logHead, 0);
+    SDL_AtomicSet(&logQuitting, 0);
+    logTail = 0;
+
+    logWake = SDL_CreateSemaphore(0);
+    if (logWake == NULL) {
+        return 1;
+    }
+
+    logThread = SDL_CreateThread(logMain, "log", NULL);
+    if (logThread == NULL) {
+        SDL_DestroySemaphore(logWake);
+        return 1;
+    }
+
+    logStarted = true;
+    return 0;
+}
+
+void stopLogger(void) {
+    if (!logStarted) {
+        return;
+    }
+
+    SDL_AtomicSet(&logQuitting, 1);
+    SDL_SemPost(logWake);
+    SDL_WaitThread(logThread, NULL);
+    SDL_DestroySemaphore(logWake);
+    logStarted = false;
+
+    drainLog();
+}
+
+void logMessage(LogLevel level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+
+    if (!logStarted) {
+        char text[LOG_MESSAGE_SIZE];
+        vsnprintf(text, sizeof(text), format, args);
+        writeMessage(level, text);
+        va_end(args);
+        return;
+    }
+
+    // claim a ticket; the slot of a ticket is free once its sequence caught up
+    int ticket = SDL_AtomicGet(&logHead);
+    LogEntry *entry;
+    while (true) {
+        entry = &logRing[ticket & (LOG_CAPACITY - 1)];
+        int lag = (int) ((Uint32) SDL_AtomicGet(&entry->sequence) - (Uint32) ticket);
+
+        if (lag == 0) {
+            if (SDL_AtomicCAS(&logHead, ticket, ticket + 1)) {
+                break;
+            }
+            ticket = SDL_AtomicGet(&logHead);
+        }
+        else if (lag < 0) {
+            // the reader is a whole lap behind
+            SDL_AtomicIncRef(&logDropped);
+            va_end(args);
+            return;
+        }
+        else {
+            ticket = SDL_AtomicGet(&logHead);
+        }
+    }
+
+    entry->level = level;
+    vsnprintf(entry->text, sizeof(entry->text), format, args);
+    va_end(args);
+
+    SDL_AtomicSet(&entry->sequence, ticket + 1);
+
+    // a burst of messages wakes the writer before the ring fills up
+    if ((ticket & (LOG_CAPACITY / 2 - 1)) == 0) {
+        SDL_SemPost(logWake);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+    A leveled logger that never does I/O on the thread that logs. Messages
+    are formatted into a fixed ring of entries that any thread can append
+    to without locking, and a background thread writes them out every
+    LOG_FLUSH_MS milliseconds, whenever half the ring has filled, and once
+    more when the logger stops. When the ring is full, messages are dropped
+    and counted rather than waited for.
+    Debug messages are compiled out unless built with -DBALLS_DEBUG
+    (make DEBUG=1).
+*/
+typedef enum LogLevel {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR
+} LogLevel;
+
+/*
+    Starts the thread that writes out the ring.
+    Returns 0 on success and 1 if the thread could not be created, in which
+    case messages are written out directly.
+*/
+int startLogger(void);
+
+/*
+    Writes out every message still in the ring and stops the thread.
+*/
+void stopLogger(void);
+
+/*
+    Logs a printf-style message. Info messages go to stdout and the other
+    levels to stderr, prefixed with their level.
+*/
+void logMessage(LogLevel level, const char *format, ...);
+
+#ifdef BALLS_DEBUG
+#define logDebug(...) logMessage(LOG_DEBUG, __VA_ARGS__)
+#else
+#define logDebug(...) ((void) 0)
+#endif
+
+#define logInfo(...) logMessage(LOG_INFO, __VA_ARGS__)
+#define logWarning(...) logMessage(LOG_WARNING, __VA_ARGS__)
+#define logError(...) logMessage(LOG_ERROR, __VA_ARGS__)
+
+#endif
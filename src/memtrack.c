@@ -0,0 +1,141 @@
+#include <SDL2/SDL.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+#include "memtrack.h"
+
+#ifdef BALLS_TRACK_ALLOCATIONS
+
+#include <SDL2/SDL_test_memory.h>
+
+/*
+    Every block carries its size in front of it, so a free knows how many
+    bytes leave the heap. The header keeps the block aligned for any type.
+*/
+#define BLOCK_HEADER 16
+
+static SDL_malloc_func nextMalloc;
+static SDL_calloc_func nextCalloc;
+static SDL_realloc_func nextRealloc;
+static SDL_free_func nextFree;
+
+static SDL_SpinLock statsLock;
+static AllocationStats stats;
+
+static void countAllocation(size_t size) {
+    SDL_AtomicLock(&statsLock);
+    stats.allocations++;
+    stats.bytes += size;
+    stats.live_blocks++;
+    stats.live_bytes += size;
+    if (stats.live_bytes > stats.peak_bytes) {
+        stats.peak_bytes = stats.live_bytes;
+    }
+    SDL_AtomicUnlock(&statsLock);
+}
+
+static void countFree(size_t size) {
+    SDL_AtomicLock(&statsLock);
+    stats.live_blocks--;
+    stats.live_bytes -= size;
+    SDL_AtomicUnlock(&statsLock);
+}
+
+static void* trackedMalloc(size_t size) {
+    char *block = nextMalloc(size + BLOCK_HEADER);
+    if (block == NULL) {
+        return NULL;
+    }
+    *(size_t*) block = size;
+    countAllocation(size);
+    return block + BLOCK_HEADER;
+}
+
+static void* trackedCalloc(size_t count, size_t size) {
+    if (size != 0 && count > (SIZE_MAX - BLOCK_HEADER) / size) {
+        return NULL;
+    }
+
+    char *block = nextCalloc(1, count * size + BLOCK_HEADER);
+    if (block == NULL) {
+        return NULL;
+    }
+    *(size_t*) block = count * size;
+    countAllocation(count * size);
+    return block + BLOCK_HEADER;
+}
+
+static void* trackedRealloc(void *memory, size_t size) {
+    if (memory == NULL) {
+        return trackedMalloc(size);
+    }
+
+    char *old_block = (char*) memory - BLOCK_HEADER;
+    size_t old_size = *(size_t*) old_block;
+
+    char *block = nextRealloc(old_block, size + BLOCK_HEADER);
+    if (block == NULL) {
+        return NULL;
+    }
+    *(size_t*) block = size;
+
+    // a reallocation counts as a new allocation of the new size
+    countFree(old_size);
+    countAllocation(size);
+    return block + BLOCK_HEADER;
+}
+
+static void trackedFree(void *memory) {
+    if (memory == NULL) {
+        return;
+    }
+
+    char *block = (char*) memory - BLOCK_HEADER;
+    countFree(*(size_t*) block);
+    nextFree(block);
+}
+
+int trackAllocations(void) {
+    if (SDLTest_TrackAllocations() != 0) {
+        return 1;
+    }
+
+    // counted on top of the tracking, which then sees the headers too
+    SDL_GetMemoryFunctions(&nextMalloc, &nextCalloc, &nextRealloc, &nextFree);
+    return SDL_SetMemoryFunctions(trackedMalloc, trackedCalloc, trackedRealloc, trackedFree) == 0 ? 0 : 1;
+}
+
+AllocationStats allocationStats(void) {
+    SDL_AtomicLock(&statsLock);
+    AllocationStats copy = stats;
+    SDL_AtomicUnlock(&statsLock);
+    return copy;
+}
+
+void reportLeaks(void) {
+    AllocationStats now = allocationStats();
+
+    printf("Allocated %lld times, %lld bytes in all, with at most %lld bytes at once\n",
+        (long long) now.allocations, (long long) now.bytes, (long long) now.peak_bytes);
+#if !defined(_WIN32)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        printf("Peak resident memory: %ld KiB\n", usage.ru_maxrss);
+    }
+#endif
+
+    if (now.live_blocks > 0) {
+        printf("Leaked %lld blocks, %lld bytes:\n", (long long) now.live_blocks, (long long) now.live_bytes);
+        SDLTest_LogAllocations();
+    }
+    else {
+        printf("No leaks\n");
+    }
+}
+
+#endif
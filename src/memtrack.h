@@ -0,0 +1,57 @@
+#ifndef MEMTRACK_H
+#define MEMTRACK_H
+
+/*
+    Allocation tracking, built in with -DBALLS_TRACK_ALLOCATIONS
+    (make TRACK_ALLOCATIONS=1) and compiled out entirely otherwise.
+    The sources include this header after the system headers, so in a
+    tracking build every malloc, calloc, realloc and free goes through the
+    SDL memory functions. Those are tracked by SDLTest_TrackAllocations,
+    which lists whatever is left over at exit, and counted on top of that,
+    so the program can report the allocations and bytes of every frame and
+    the peak size of the heap.
+*/
+#ifdef BALLS_TRACK_ALLOCATIONS
+
+#include <SDL2/SDL.h>
+
+#include <stdlib.h>
+
+#define malloc SDL_malloc
+#define calloc SDL_calloc
+#define realloc SDL_realloc
+#define free SDL_free
+
+/*
+    Totals since tracking started. Allocations and bytes only ever grow,
+    so the difference between two samples is the churn in between.
+*/
+typedef struct AllocationStats {
+    Sint64  allocations;
+    Sint64  bytes;
+    Sint64  live_blocks;
+    Sint64  live_bytes;
+    Sint64  peak_bytes;
+} AllocationStats;
+
+/*
+    Starts tracking. It must run before anything is allocated through SDL,
+    as the very first thing in main.
+    Returns 0 on success and 1 if the memory functions could not be replaced.
+*/
+int trackAllocations(void);
+
+/*
+    Returns the totals so far. Any thread may call it.
+*/
+AllocationStats allocationStats(void);
+
+/*
+    Prints the blocks still allocated, with the peak sizes of the heap and
+    of the resident memory. Meant to run last, after SDL_Quit.
+*/
+void reportLeaks(void);
+
+#endif
+
+#endif
@@ -0,0 +1,365 @@
+#include <SDL2/SDL.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#if !defined(_WIN32)
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#include "net.h"
+#include "memtrack.h"
+
+// How long netConnect keeps retrying, in milliseconds.
+#define NET_CONNECT_TIMEOUT_MS 30000
+#define NET_CONNECT_RETRY_MS 100
+
+void netReserve(NetBuffer *buffer, size_t size) {
+    if (size <= buffer->capacity) {
+        return;
+    }
+
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+
+    char *grown = realloc(buffer->data, capacity);
+    if (grown == NULL) {
+        fprintf(stderr, "Could not grow a network buffer!\n");
+        exit(1);
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+}
+
+void netAppend(NetBuffer *buffer, const void *data, size_t size) {
+    netReserve(buffer, buffer->size + size);
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+void netFree(NetBuffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
+
+#if !defined(_WIN32)
+
+// a viewer hanging up must not take the whole program down with SIGPIPE
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/*
+    Puts a fresh connection into the mode netExchange expects: without
+    blocking, and with every message sent as soon as it is written.
+*/
+static int prepareSocket(int peer) {
+    int on = 1;
+    setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    int flags = fcntl(peer, F_GETFL, 0);
+    if (flags < 0 || fcntl(peer, F_SETFL, flags | O_NONBLOCK) != 0) {
+        close(peer);
+        return -1;
+    }
+    return peer;
+}
+
+int netAccept(int port) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((Uint16) port);
+
+    if (bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 1) != 0) {
+        close(listener);
+        return -1;
+    }
+
+    int peer = accept(listener, NULL, NULL);
+    close(listener);
+    return peer < 0 ? -1 : prepareSocket(peer);
+}
+
+int netListen(int port) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((Uint16) port);
+
+    int flags = fcntl(listener, F_GETFL, 0);
+    if (bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 4) != 0 ||
+        flags < 0 || fcntl(listener, F_SETFL, flags | O_NONBLOCK) != 0) {
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+int netPoll(int listener) {
+    int peer = accept(listener, NULL, NULL);
+    return peer < 0 ? -1 : prepareSocket(peer);
+}
+
+int netConnect(const char *host, int port) {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addresses;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) {
+        return -1;
+    }
+
+    // the neighbour may still be starting up, so give it some time
+    int peer = -1;
+    for (int waited = 0; peer < 0 && waited < NET_CONNECT_TIMEOUT_MS; waited += NET_CONNECT_RETRY_MS) {
+        for (struct addrinfo *a = addresses; a != NULL && peer < 0; a = a->ai_next) {
+            peer = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (peer >= 0 && connect(peer, a->ai_addr, a->ai_addrlen) != 0) {
+                close(peer);
+                peer = -1;
+            }
+        }
+        if (peer < 0) {
+            SDL_Delay(NET_CONNECT_RETRY_MS);
+        }
+    }
+
+    freeaddrinfo(addresses);
+    return peer < 0 ? -1 : prepareSocket(peer);
+}
+
+void netClose(int peer) {
+    if (peer >= 0) {
+        close(peer);
+    }
+}
+
+int netSend(int peer, NetBuffer *buffer) {
+    size_t sent = 0;
+    while (sent < buffer->size) {
+        ssize_t n = send(peer, buffer->data + sent, buffer->size - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno != EINTR) {
+                return 1;
+            }
+            continue;
+        }
+        sent += n;
+    }
+
+    memmove(buffer->data, buffer->data + sent, buffer->size - sent);
+    buffer->size -= sent;
+    return 0;
+}
+
+int netReceive(int peer, NetBuffer *buffer) {
+    for (;;) {
+        netReserve(buffer, buffer->size + 4096);
+        ssize_t n = read(peer, buffer->data + buffer->size, buffer->capacity - buffer->size);
+        if (n == 0) {
+            return 1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno != EINTR) {
+                return 1;
+            }
+            continue;
+        }
+        buffer->size += n;
+    }
+}
+
+/*
+    How far the exchange with one peer got: the bytes of the size prefix
+    and the message sent so far, and the same for the message received.
+*/
+typedef struct NetTransfer {
+    Uint64  send_size;
+    Uint64  recv_size;
+    size_t  sent;
+    size_t  received;
+} NetTransfer;
+
+#define NET_PREFIX sizeof(Uint64)
+
+int netExchange(const int *peers, NetBuffer *send, NetBuffer *received, int count) {
+    NetTransfer transfers[2];
+    struct pollfd polls[2];
+    if (count > 2) {
+        return 1;
+    }
+
+    for (int k = 0; k < count; k++) {
+        transfers[k] = (NetTransfer) { .send_size = SDL_SwapLE64(send[k].size) };
+        received[k].size = 0;
+    }
+
+    for (;;) {
+        int waiting = 0;
+        for (int k = 0; k < count; k++) {
+            if (peers[k] < 0) {
+                continue;
+            }
+
+            NetTransfer *t = &transfers[k];
+            bool sending = t->sent < NET_PREFIX + send[k].size;
+            bool receiving = t->received < NET_PREFIX || t->received < NET_PREFIX + t->recv_size;
+            if (sending || receiving) {
+                polls[waiting].fd = peers[k];
+                polls[waiting].events = (sending ? POLLOUT : 0) | (receiving ? POLLIN : 0);
+                polls[waiting].revents = 0;
+                waiting++;
+            }
+        }
+        if (waiting == 0) {
+            return 0;
+        }
+
+        if (poll(polls, waiting, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+
+        for (int p = 0; p < waiting; p++) {
+            int k = polls[p].fd == peers[0] ? 0 : 1;
+            NetTransfer *t = &transfers[k];
+            if (polls[p].revents & (POLLERR | POLLNVAL)) {
+                return 1;
+            }
+
+            if (polls[p].revents & POLLOUT) {
+                // the size prefix first, then the message
+                const char *from = t->sent < NET_PREFIX ? (const char*) &t->send_size + t->sent : send[k].data + (t->sent - NET_PREFIX);
+                size_t left = t->sent < NET_PREFIX ? NET_PREFIX - t->sent : NET_PREFIX + send[k].size - t->sent;
+                ssize_t n = write(polls[p].fd, from, left);
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    return 1;
+                }
+                t->sent += n > 0 ? n : 0;
+            }
+
+            if (polls[p].revents & (POLLIN | POLLHUP)) {
+                char *to;
+                size_t left;
+                bool prefix = t->received < NET_PREFIX;
+                if (prefix) {
+                    to = (char*) &t->recv_size + t->received;
+                    left = NET_PREFIX - t->received;
+                }
+                else {
+                    to = received[k].data + (t->received - NET_PREFIX);
+                    left = NET_PREFIX + t->recv_size - t->received;
+                }
+
+                ssize_t n = read(polls[p].fd, to, left);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    // the peer hung up in the middle of the exchange
+                    return 1;
+                }
+                t->received += n > 0 ? n : 0;
+
+                // a read never runs past the prefix, which gives the size
+                if (prefix && t->received == NET_PREFIX) {
+                    t->recv_size = SDL_SwapLE64(t->recv_size);
+                    netReserve(&received[k], t->recv_size);
+                    received[k].size = t->recv_size;
+                }
+            }
+        }
+    }
+}
+
+#else
+
+int netAccept(int port) {
+    (void) port;
+    return -1;
+}
+
+int netConnect(const char *host, int port) {
+    (void) host;
+    (void) port;
+    return -1;
+}
+
+int netListen(int port) {
+    (void) port;
+    return -1;
+}
+
+int netPoll(int listener) {
+    (void) listener;
+    return -1;
+}
+
+void netClose(int peer) {
+    (void) peer;
+}
+
+int netSend(int peer, NetBuffer *buffer) {
+    (void) peer;
+    (void) buffer;
+    return 1;
+}
+
+int netReceive(int peer, NetBuffer *buffer) {
+    (void) peer;
+    (void) buffer;
+    return 1;
+}
+
+int netExchange(const int *peers, NetBuffer *send, NetBuffer *received, int count) {
+    (void) peers;
+    (void) send;
+    (void) received;
+    (void) count;
+    return 1;
+}
+
+#endif
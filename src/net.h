@@ -0,0 +1,93 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+
+/*
+    Connections between the processes of a distributed run, and between a
+    run and its remote viewers, over plain TCP sockets. Every process talks
+    to its neighbours only, and every message is a block of bytes prefixed
+    with its size. The bytes themselves are sent as they are, so all
+    processes must run on machines of the same byte order.
+    The sockets only exist on POSIX systems; elsewhere every call fails.
+*/
+
+/*
+    A growable block of bytes to send or to receive into.
+*/
+typedef struct NetBuffer {
+    char    *data;
+    size_t  size;
+    size_t  capacity;
+} NetBuffer;
+
+/*
+    Waits for one connection on the given port and returns it, or -1 if
+    none could be accepted.
+*/
+int netAccept(int port);
+
+/*
+    Connects to the given host and port, retrying for a while in case the
+    other process has not started listening yet. Returns the connection,
+    or -1 if it could not be made.
+*/
+int netConnect(const char *host, int port);
+
+/*
+    Starts listening on the given port without waiting for anyone, for
+    netPoll to take the connections from. Returns the listening socket, or
+    -1 if the port could not be listened on.
+*/
+int netListen(int port);
+
+/*
+    Takes a connection that is waiting on a socket from netListen, without
+    waiting if there is none. Returns the connection, or -1 if there was
+    none.
+*/
+int netPoll(int listener);
+
+/*
+    Closes a connection. Does nothing for -1.
+*/
+void netClose(int peer);
+
+/*
+    Makes room for at least size bytes in the buffer, keeping its contents.
+    Exits the program if the memory runs out.
+*/
+void netReserve(NetBuffer *buffer, size_t size);
+
+/*
+    Appends size bytes to the buffer.
+*/
+void netAppend(NetBuffer *buffer, const void *data, size_t size);
+
+void netFree(NetBuffer *buffer);
+
+/*
+    Sends as much of the buffer to the peer as it takes without waiting,
+    and drops what was sent from the front of the buffer.
+    Returns 0 on success, even if some of the buffer is left, and 1 if the
+    connection failed.
+*/
+int netSend(int peer, NetBuffer *buffer);
+
+/*
+    Appends whatever the peer sent and has arrived to the buffer, without
+    waiting for more.
+    Returns 0 on success, even if nothing arrived, and 1 if the connection
+    failed or was closed.
+*/
+int netReceive(int peer, NetBuffer *buffer);
+
+/*
+    Sends send[k] to peers[k] and receives one message from every peer into
+    received[k], for count peers at once, so that no two processes can
+    wait on each other to read. Peers of -1 are skipped.
+    Returns 0 on success and 1 if a connection failed.
+*/
+int netExchange(const int *peers, NetBuffer *send, NetBuffer *received, int count);
+
+#endif
@@ -0,0 +1,119 @@
+#include <SDL2/SDL.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "share.h"
+
+// Every array of the shared file starts on a cache line of its own.
+#define SHARE_ALIGNMENT 64
+
+static Uint32 shareTypeSize(ShareType type) {
+    return type == SHARE_FLOAT64 ? 8 : 4;
+}
+
+static Uint64 shareAlign(Uint64 size) {
+    return (size + SHARE_ALIGNMENT - 1) & ~(Uint64) (SHARE_ALIGNMENT - 1);
+}
+
+#if !defined(_WIN32)
+
+int openShare(ShareRegion *region, const char *path, const char *const *names, const ShareType *types,
+              int count, int capacity) {
+    if (count > SHARE_MAX_ARRAYS) {
+        return 1;
+    }
+
+    // the header first, then the arrays one after the other
+    Uint64 size = shareAlign(sizeof(ShareHeader));
+    Uint64 offsets[SHARE_MAX_ARRAYS];
+    for (int k = 0; k < count; k++) {
+        offsets[k] = size;
+        size += shareAlign((Uint64) shareTypeSize(types[k]) * (capacity > 0 ? capacity : 1));
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return 1;
+    }
+    if (ftruncate(fd, (off_t) size) != 0) {
+        close(fd);
+        return 1;
+    }
+
+    void *block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED) {
+        return 1;
+    }
+
+    region->header = block;
+    region->size = size;
+
+    ShareHeader *header = region->header;
+    header->version = SHARE_VERSION;
+    header->array_count = count;
+    for (int k = 0; k < count; k++) {
+        ShareArray *array = &header->arrays[k];
+        snprintf(array->name, SHARE_NAME_SIZE, "%s", names[k]);
+        array->offset = offsets[k];
+        array->type = types[k];
+        array->stride = shareTypeSize(types[k]);
+        array->length = 0;
+        array->capacity = capacity;
+    }
+
+    // readers check the magic last, once the rest of the header is there
+    SDL_MemoryBarrierRelease();
+    header->magic = SHARE_MAGIC;
+    return 0;
+}
+
+void closeShare(ShareRegion *region) {
+    if (region->header != NULL) {
+        munmap(region->header, region->size);
+    }
+    region->header = NULL;
+    region->size = 0;
+}
+
+#else
+
+int openShare(ShareRegion *region, const char *path, const char *const *names, const ShareType *types,
+              int count, int capacity) {
+    (void) region;
+    (void) path;
+    (void) names;
+    (void) types;
+    (void) count;
+    (void) capacity;
+    return 1;
+}
+
+void closeShare(ShareRegion *region) {
+    region->header = NULL;
+    region->size = 0;
+}
+
+#endif
+
+void* shareArray(ShareRegion *region, int k) {
+    return (char*) region->header + region->header->arrays[k].offset;
+}
+
+void beginShareWrite(ShareRegion *region) {
+    SDL_AtomicAdd(&region->header->sequence, 1);
+    SDL_MemoryBarrierRelease();
+}
+
+void endShareWrite(ShareRegion *region) {
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicAdd(&region->header->sequence, 1);
+}
@@ -0,0 +1,97 @@
+#ifndef SHARE_H
+#define SHARE_H
+
+#include <SDL2/SDL.h>
+
+#include <stddef.h>
+
+/*
+    State published to other processes through a shared memory file, which
+    they map and read in place without copying anything out of it.
+    The file starts with a ShareHeader describing every array that follows
+    it by name, offset, element type, stride and length, so a reader can
+    wrap each one as it is, e.g. with numpy.frombuffer or a typed pointer.
+    All fields are in the byte order of the writing machine.
+
+    The header holds a sequence counter that works as a seqlock: it is odd
+    while the writer updates the arrays and even once they are consistent
+    again. A reader loads the counter, waits while it is odd, reads what it
+    needs, and loads the counter again; if it changed in between, the
+    writer was at work and the read has to be repeated.
+*/
+#define SHARE_MAGIC 0x48534242
+#define SHARE_VERSION 1
+#define SHARE_MAX_ARRAYS 8
+#define SHARE_NAME_SIZE 16
+
+typedef enum ShareType {
+    SHARE_INT32,
+    SHARE_FLOAT32,
+    SHARE_FLOAT64
+} ShareType;
+
+/*
+    An array of the shared file: length elements of the given type, each
+    stride bytes after the previous one, starting offset bytes into the
+    file.
+*/
+typedef struct ShareArray {
+    char    name[SHARE_NAME_SIZE];
+    Uint64  offset;
+    Uint32  type;
+    Uint32  stride;
+    Uint32  length;
+    Uint32  capacity;
+} ShareArray;
+
+typedef struct ShareHeader {
+    Uint32          magic;
+    Uint32          version;
+    SDL_atomic_t    sequence;
+    Uint32          array_count;
+    Uint64          step;
+    Uint32          world_width;
+    Uint32          world_height;
+    ShareArray      arrays[SHARE_MAX_ARRAYS];
+} ShareHeader;
+
+/*
+    A shared file mapped by its writer.
+*/
+typedef struct ShareRegion {
+    ShareHeader*    header;
+    size_t          size;
+} ShareRegion;
+
+/*
+    Creates the shared file at the given path, replacing what was there,
+    with room for count arrays of the given names and types of capacity
+    elements each, and maps it. The arrays start out empty and are packed
+    one after the other, each aligned to 64 bytes.
+    Returns 0 on success and 1 if the file could not be created or mapped,
+    which is always the case on Windows.
+*/
+int openShare(ShareRegion *region, const char *path, const char *const *names, const ShareType *types,
+              int count, int capacity);
+
+/*
+    Returns where array k of the shared file starts.
+*/
+void* shareArray(ShareRegion *region, int k);
+
+/*
+    Makes the sequence odd before the arrays are written.
+*/
+void beginShareWrite(ShareRegion *region);
+
+/*
+    Makes the sequence even again once the arrays are written.
+*/
+void endShareWrite(ShareRegion *region);
+
+/*
+    Unmaps the shared file. The file itself stays for readers to find.
+*/
+void closeShare(ShareRegion *region);
+
+#endif
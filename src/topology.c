@@ -0,0 +1,215 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "topology.h"
+#include "memtrack.h"
+
+/*
+    Orders CPUs for placement: by node, then package, then sibling, so all
+    the first hardware threads of a package come before its second ones.
+*/
+static int comparePlacement(const void *a, const void *b) {
+    const CpuInfo *x = a;
+    const CpuInfo *y = b;
+    if (x->node != y->node) {
+        return x->node < y->node ? -1 : 1;
+    }
+    if (x->package != y->package) {
+        return x->package < y->package ? -1 : 1;
+    }
+    if (x->sibling != y->sibling) {
+        return x->sibling < y->sibling ? -1 : 1;
+    }
+    if (x->core != y->core) {
+        return x->core < y->core ? -1 : 1;
+    }
+    return x->cpu < y->cpu ? -1 : (x->cpu > y->cpu);
+}
+
+/*
+    Returns how many distinct values of the field the CPUs have, for a
+    field at the given offset into CpuInfo.
+*/
+static int countDistinct(const CpuTopology *topology, size_t field) {
+    int distinct = 0;
+    for (int i = 0; i < topology->count; i++) {
+        int value = *(const int*) ((const char*) &topology->cpus[i] + field);
+        int k = 0;
+        while (k < i && *(const int*) ((const char*) &topology->cpus[k] + field) != value) {
+            k++;
+        }
+        distinct += k == i;
+    }
+    return distinct;
+}
+
+/*
+    Fills the topology with the given number of CPUs of a core each, all on
+    one package and node.
+*/
+static int flatTopology(CpuTopology *topology, int count) {
+    topology->cpus = calloc(count, sizeof(CpuInfo));
+    topology->count = topology->cpus != NULL ? count : 0;
+    topology->packages = 1;
+    topology->nodes = 1;
+    for (int i = 0; i < topology->count; i++) {
+        topology->cpus[i].cpu = i;
+        topology->cpus[i].core = i;
+    }
+    return 1;
+}
+
+#if defined(__linux__)
+
+/*
+    Reads an integer from a sysfs file of the given CPU.
+    Returns the fallback if the file is missing.
+*/
+static int readCpuValue(int cpu, const char *name, int fallback) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return fallback;
+    }
+    int value;
+    if (fscanf(file, "%d", &value) != 1) {
+        value = fallback;
+    }
+    fclose(file);
+    return value;
+}
+
+/*
+    Returns the NUMA node of the given CPU, which sysfs shows as a nodeN
+    entry in the directory of the CPU, or 0 on a machine without nodes.
+*/
+static int readCpuNode(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1) {
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+int detectTopology(CpuTopology *topology) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return flatTopology(topology, SDL_GetCPUCount());
+    }
+
+    topology->cpus = calloc(CPU_COUNT(&allowed), sizeof(CpuInfo));
+    if (topology->cpus == NULL) {
+        return flatTopology(topology, SDL_GetCPUCount());
+    }
+
+    topology->count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        CpuInfo *info = &topology->cpus[topology->count++];
+        info->cpu = cpu;
+        info->package = readCpuValue(cpu, "physical_package_id", 0);
+        info->core = readCpuValue(cpu, "core_id", cpu);
+        info->node = readCpuNode(cpu);
+    }
+
+    for (int i = 0; i < topology->count; i++) {
+        CpuInfo *info = &topology->cpus[i];
+        for (int k = 0; k < i; k++) {
+            info->sibling += topology->cpus[k].package == info->package && topology->cpus[k].core == info->core;
+        }
+    }
+
+    topology->packages = countDistinct(topology, offsetof(CpuInfo, package));
+    topology->nodes = countDistinct(topology, offsetof(CpuInfo, node));
+    return 0;
+}
+
+int pinThread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    // a pid of 0 is the calling thread, not the whole process
+    return sched_setaffinity(0, sizeof(set), &set) != 0;
+}
+
+#else
+
+int detectTopology(CpuTopology *topology) {
+    return flatTopology(topology, SDL_GetCPUCount());
+}
+
+int pinThread(int cpu) {
+    (void) cpu;
+    return 1;
+}
+
+#endif
+
+int placementOrder(const CpuTopology *topology, int node, int *cpus) {
+    CpuInfo *order = malloc(sizeof(CpuInfo) * (topology->count > 0 ? topology->count : 1));
+    if (order == NULL) {
+        return 0;
+    }
+
+    // the node-th lowest node id, as node ids need not be consecutive
+    int id = -1;
+    if (node >= 0) {
+        for (int i = 0; i < topology->count; i++) {
+            order[i] = topology->cpus[i];
+        }
+        qsort(order, topology->count, sizeof(CpuInfo), comparePlacement);
+        for (int i = 0, seen = 0; i < topology->count; i++) {
+            if (i == 0 || order[i].node != order[i - 1].node) {
+                if (seen++ == node % topology->nodes) {
+                    id = order[i].node;
+                    break;
+                }
+            }
+        }
+    }
+
+    int count = 0;
+    for (int i = 0; i < topology->count; i++) {
+        if (id < 0 || topology->cpus[i].node == id) {
+            order[count++] = topology->cpus[i];
+        }
+    }
+
+    qsort(order, count, sizeof(CpuInfo), comparePlacement);
+    for (int i = 0; i < count; i++) {
+        cpus[i] = order[i].cpu;
+    }
+    free(order);
+    return count;
+}
+
+void freeTopology(CpuTopology *topology) {
+    free(topology->cpus);
+    topology->cpus = NULL;
+    topology->count = 0;
+}
@@ -0,0 +1,61 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+/*
+    The layout of the processors the process may run on: the package
+    (socket) every logical CPU sits in, its physical core, and its NUMA
+    node. Threads pinned to CPUs of one node keep the caches of their cores
+    and the memory of their node, instead of being moved across the
+    machine by the scheduler and finding their data on the far side of it.
+    The layout is read from sysfs, so it is only known on Linux.
+*/
+typedef struct CpuInfo {
+    int     cpu;
+    int     package;
+    int     core;
+    int     node;
+    // how many CPUs of the same core come before this one, 0 for the
+    // first hardware thread of every core
+    int     sibling;
+} CpuInfo;
+
+typedef struct CpuTopology {
+    CpuInfo*    cpus;
+    int         count;
+    int         packages;
+    int         nodes;
+} CpuTopology;
+
+/*
+    Reads the layout of the CPUs the process may run on.
+    Returns 0 on success and 1 if the layout could not be read, which is
+    always the case outside of Linux. The topology then holds
+    SDL_GetCPUCount CPUs of one core each, all on one package and node.
+*/
+int detectTopology(CpuTopology *topology);
+
+/*
+    Fills cpus with the CPUs to place threads on, in order, and returns
+    how many there are. With a node of 0 or more only the CPUs of the
+    node-th NUMA node are given, counting from the lowest node id and
+    wrapping around; a negative node gives them all. The CPUs
+    come grouped by node and package, so threads next to each other in the
+    order share a socket, and within a package every physical core comes
+    once before any core comes a second time.
+    cpus must have room for every CPU of the topology.
+*/
+int placementOrder(const CpuTopology *topology, int node, int *cpus);
+
+/*
+    Pins the calling thread to the given CPU.
+    Returns 0 on success and 1 if it could not be pinned, which is always
+    the case outside of Linux.
+*/
+int pinThread(int cpu);
+
+/*
+    Releases the CPUs of the topology.
+*/
+void freeTopology(CpuTopology *topology);
+
+#endif
@@ -0,0 +1,173 @@
+#include <SDL2/SDL.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "trace.h"
+#include "memtrack.h"
+
+// Threads that can record; the events of any further thread are dropped.
+#define TRACE_MAX_THREADS 64
+
+typedef struct TraceRecord {
+    const char  *name;
+    Uint64      ticks;
+    char        phase;
+} TraceRecord;
+
+/*
+    The events of one thread. Only the owner writes to it; the count is
+    published after every event, so a writer on another thread reads only
+    complete events.
+*/
+typedef struct TraceBuffer {
+    TraceRecord     *events;
+    SDL_atomic_t    count;
+    SDL_atomic_t    dropped;
+    void            *name;
+} TraceBuffer;
+
+bool tracing = false;
+
+static const char *tracePath;
+static Uint64 traceStart;
+static SDL_TLSID traceSlot;
+static TraceBuffer traceBuffers[TRACE_MAX_THREADS];
+static SDL_atomic_t traceThreads;
+
+int startTrace(const char *path) {
+    traceSlot = SDL_TLSCreate();
+    if (traceSlot == 0) {
+        return 1;
+    }
+
+    tracePath = path;
+    traceStart = SDL_GetPerformanceCounter();
+    SDL_AtomicSet(&traceThreads, 0);
+    tracing = true;
+    return 0;
+}
+
+/*
+    Returns the buffer of the calling thread, claiming one the first time,
+    or NULL if every buffer is taken.
+*/
+static TraceBuffer* threadBuffer(void) {
+    TraceBuffer *buffer = SDL_TLSGet(traceSlot);
+    if (buffer != NULL) {
+        return buffer->events != NULL ? buffer : NULL;
+    }
+
+    int index = SDL_AtomicAdd(&traceThreads, 1);
+    if (index >= TRACE_MAX_THREADS) {
+        SDL_AtomicAdd(&traceThreads, -1);
+        return NULL;
+    }
+
+    // writeTrace may see the buffer from here on, but reads none of its
+    // events before the first count is published
+    buffer = &traceBuffers[index];
+    buffer->events = malloc(sizeof(TraceRecord) * TRACE_CAPACITY);
+    SDL_AtomicSet(&buffer->count, 0);
+    SDL_AtomicSet(&buffer->dropped, 0);
+    SDL_TLSSet(traceSlot, buffer, NULL);
+
+    if (buffer->events == NULL) {
+        fprintf(stderr, "Could not allocate a trace buffer, the events of a thread are left out!\n");
+        return NULL;
+    }
+    return buffer;
+}
+
+void traceThreadName(const char *name) {
+    if (!tracing) {
+        return;
+    }
+
+    TraceBuffer *buffer = threadBuffer();
+    if (buffer != NULL) {
+        SDL_AtomicSetPtr(&buffer->name, (void*) name);
+    }
+}
+
+void traceEvent(const char *name, char phase) {
+    TraceBuffer *buffer = threadBuffer();
+    if (buffer == NULL) {
+        return;
+    }
+
+    int count = SDL_AtomicGet(&buffer->count);
+    if (count == TRACE_CAPACITY) {
+        SDL_AtomicIncRef(&buffer->dropped);
+        return;
+    }
+
+    buffer->events[count] = (TraceRecord) { .name = name, .ticks = SDL_GetPerformanceCounter(), .phase = phase };
+    SDL_AtomicSet(&buffer->count, count + 1);
+}
+
+int writeTrace(void) {
+    if (!tracing) {
+        return 0;
+    }
+
+    FILE *file = fopen(tracePath, "w");
+    if (file == NULL) {
+        return 1;
+    }
+
+    double frequency = SDL_GetPerformanceFrequency();
+    int threads = SDL_AtomicGet(&traceThreads);
+    if (threads > TRACE_MAX_THREADS) {
+        threads = TRACE_MAX_THREADS;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    int dropped = 0;
+
+    for (int tid = 0; tid < threads; tid++) {
+        TraceBuffer *buffer = &traceBuffers[tid];
+        int count = SDL_AtomicGet(&buffer->count);
+        dropped += SDL_AtomicGet(&buffer->dropped);
+
+        const char *name = SDL_AtomicGetPtr(&buffer->name);
+        if (name != NULL) {
+            fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",\n", tid, name);
+            first = false;
+        }
+
+        for (int i = 0; i < count; i++) {
+            TraceRecord *event = &buffer->events[i];
+            fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f}",
+                first ? "" : ",\n", event->name, event->phase, tid, (event->ticks - traceStart) * 1e6 / frequency);
+            first = false;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    if (dropped > 0) {
+        fprintf(stderr, "The trace buffers were full, %d events were dropped\n", dropped);
+    }
+    return 0;
+}
+
+void stopTrace(void) {
+    if (!tracing) {
+        return;
+    }
+
+    if (writeTrace() != 0) {
+        fprintf(stderr, "Could not write the trace to %s!\n", tracePath);
+    }
+
+    tracing = false;
+    for (int tid = 0; tid < TRACE_MAX_THREADS; tid++) {
+        free(traceBuffers[tid].events);
+        traceBuffers[tid].events = NULL;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+/*
+    Begin and end events of the frame phases and the worker tasks, written
+    out in the Chrome trace_event JSON format, which chrome://tracing and
+    Perfetto both open.
+    Every thread records into a buffer of its own, claimed the first time
+    it records, so recording an event takes no lock and touches no memory
+    shared with other threads. A buffer holds TRACE_CAPACITY events; once
+    it is full, the events of that thread are dropped and counted.
+    While tracing is off, recording an event is a single test.
+*/
+#define TRACE_CAPACITY (1 << 18)
+
+extern bool tracing;
+
+/*
+    Starts recording, to be written to the given path.
+    Returns 0 on success and 1 if the per-thread storage could not be set up.
+*/
+int startTrace(const char *path);
+
+/*
+    Writes out every event recorded so far, replacing the file written by
+    the previous call. Threads may keep recording while it runs.
+    Returns 0 on success and 1 if the file could not be written.
+*/
+int writeTrace(void);
+
+/*
+    Writes out the trace one last time and frees the buffers. Every thread
+    that recorded must be done by then.
+*/
+void stopTrace(void);
+
+/*
+    Names the calling thread in the trace.
+*/
+void traceThreadName(const char *name);
+
+/*
+    Records that the calling thread began or ended the named span. The
+    name must outlive the trace.
+*/
+void traceEvent(const char *name, char phase);
+
+#define traceBegin(name) do { if (tracing) traceEvent(name, 'B'); } while (0)
+#define traceEnd(name) do { if (tracing) traceEvent(name, 'E'); } while (0)
+
+#endif
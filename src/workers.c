@@ -0,0 +1,276 @@
+#include <SDL2/SDL.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "workers.h"
+#include "memtrack.h"
+#include "topology.h"
+#include "trace.h"
+
+/*
+    A range of indices waiting to be run.
+*/
+typedef struct TaskRange {
+    int     begin;
+    int     end;
+} TaskRange;
+
+/*
+    The tasks of one thread. The owner pops from the back, thieves steal
+    from the front, and both sides take the spin lock, which is only ever
+    held for a couple of instructions.
+*/
+typedef struct WorkerDeque {
+    SDL_SpinLock    lock;
+    TaskRange*      tasks;
+    int             capacity;
+    int             head;
+    int             tail;
+} WorkerDeque;
+
+/*
+    The job currently being run by the pool.
+*/
+typedef struct WorkerJob {
+    WorkerTask      task;
+    void*           data;
+} WorkerJob;
+
+SDL_Thread **workerThreads;
+WorkerDeque *workerDeques;
+int worker_count = 1;
+
+WorkerJob workerJob;
+SDL_sem *jobStarted;
+SDL_sem *jobFinished;
+bool workersQuitting = false;
+
+// Held for the length of a job, so threads outside the pool can share it.
+SDL_mutex *jobLock;
+
+// The CPUs the threads are pinned to, or NULL to leave them to the OS.
+int *workerCpus;
+int worker_cpu_count = 0;
+
+/*
+    Takes the newest task from the back of the thread's own deque.
+*/
+bool popTask(WorkerDeque *deque, TaskRange *out) {
+    bool found = false;
+
+    SDL_AtomicLock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *out = deque->tasks[--deque->tail];
+        found = true;
+    }
+    SDL_AtomicUnlock(&deque->lock);
+
+    return found;
+}
+
+/*
+    Takes the oldest task from the front of another thread's deque.
+*/
+bool stealTask(WorkerDeque *deque, TaskRange *out) {
+    bool found = false;
+
+    SDL_AtomicLock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *out = deque->tasks[deque->head++];
+        found = true;
+    }
+    SDL_AtomicUnlock(&deque->lock);
+
+    return found;
+}
+
+/*
+    Runs tasks for the given thread until no deque has any left.
+    No task ever spawns new ones, so once a full sweep over the other
+    deques comes up empty, all remaining work is already being run.
+*/
+void runWorkerJob(int self) {
+    TaskRange range;
+
+    while (true) {
+        if (popTask(&workerDeques[self], &range)) {
+            traceBegin("task");
+            workerJob.task(range.begin, range.end, workerJob.data);
+            traceEnd("task");
+            continue;
+        }
+
+        bool stolen = false;
+        for (int k = 1; k < worker_count && !stolen; k++) {
+            stolen = stealTask(&workerDeques[(self + k) % worker_count], &range);
+        }
+
+        if (!stolen) {
+            break;
+        }
+        traceBegin("stolen task");
+        workerJob.task(range.begin, range.end, workerJob.data);
+        traceEnd("stolen task");
+    }
+}
+
+/*
+    Main loop of a worker thread: sleep until a job starts, help run it,
+    and report back when there is nothing left to take.
+*/
+int workerMain(void *data) {
+    int self = (int) (intptr_t) data;
+    traceThreadName("worker");
+    if (workerCpus != NULL && pinThread(workerCpus[self % worker_cpu_count]) != 0) {
+        fprintf(stderr, "Could not pin worker %d to CPU %d\n", self, workerCpus[self % worker_cpu_count]);
+    }
+
+    while (true) {
+        SDL_SemWait(jobStarted);
+        if (workersQuitting) {
+            break;
+        }
+
+        runWorkerJob(self);
+        SDL_SemPost(jobFinished);
+    }
+
+    return 0;
+}
+
+int placeWorkers(const int *cpus, int count) {
+    workerCpus = malloc(sizeof(int) * count);
+    if (workerCpus == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        workerCpus[i] = cpus[i];
+    }
+    worker_cpu_count = count;
+    return 0;
+}
+
+int pinWorkerThread(void) {
+    return workerCpus != NULL ? pinThread(workerCpus[0]) : 0;
+}
+
+int startWorkers(int count) {
+    if (count <= 0) {
+        count = workerCpus != NULL ? worker_cpu_count : SDL_GetCPUCount();
+    }
+
+    worker_count = count;
+    jobStarted = SDL_CreateSemaphore(0);
+    jobFinished = SDL_CreateSemaphore(0);
+    jobLock = SDL_CreateMutex();
+    workerThreads = malloc(sizeof(SDL_Thread*) * count);
+    workerDeques = calloc(count, sizeof(WorkerDeque));
+
+    if (jobStarted == NULL || jobFinished == NULL || jobLock == NULL ||
+        workerThreads == NULL || workerDeques == NULL) {
+        return 1;
+    }
+
+    // the calling thread is worker 0 and takes part in every job
+    for (int i = 1; i < count; i++) {
+        workerThreads[i] = SDL_CreateThread(workerMain, "worker", (void*) (intptr_t) i);
+        if (workerThreads[i] == NULL) {
+            printf("Worker thread could not be created! SDL_Error: %s\n", SDL_GetError());
+            worker_count = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void stopWorkers(void) {
+    workersQuitting = true;
+    for (int i = 1; i < worker_count; i++) {
+        SDL_SemPost(jobStarted);
+    }
+    for (int i = 1; i < worker_count; i++) {
+        SDL_WaitThread(workerThreads[i], NULL);
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        free(workerDeques[i].tasks);
+    }
+    free(workerDeques);
+    free(workerThreads);
+    SDL_DestroySemaphore(jobStarted);
+    SDL_DestroySemaphore(jobFinished);
+    SDL_DestroyMutex(jobLock);
+    free(workerCpus);
+    workerCpus = NULL;
+    worker_cpu_count = 0;
+    worker_count = 1;
+}
+
+int workerCount(void) {
+    return worker_count;
+}
+
+void parallelFor(int count, int grain, WorkerTask task, void *data) {
+    if (count <= 0) {
+        return;
+    }
+    if (grain < 1) {
+        grain = 1;
+    }
+
+    // without helpers there is nothing to schedule
+    if (worker_count == 1) {
+        task(0, count, data);
+        return;
+    }
+
+    SDL_LockMutex(jobLock);
+
+    workerJob.task = task;
+    workerJob.data = data;
+
+    // deal out contiguous blocks of tasks, one block per thread, so every
+    // thread starts on nearby indices and only steals once it runs out
+    int task_count = (count + grain - 1) / grain;
+    int per_worker = (task_count + worker_count - 1) / worker_count;
+
+    for (int w = 0; w < worker_count; w++) {
+        WorkerDeque *deque = &workerDeques[w];
+
+        if (deque->capacity < per_worker) {
+            deque->tasks = realloc(deque->tasks, sizeof(TaskRange) * per_worker);
+            if (deque->tasks == NULL) {
+                fprintf(stderr, "Could not grow the task deque!\n");
+                exit(1);
+            }
+            deque->capacity = per_worker;
+        }
+
+        deque->head = 0;
+        deque->tail = 0;
+
+        // pushed in reverse so the owner pops its block front to back
+        int first = w * per_worker;
+        int last = first + per_worker < task_count ? first + per_worker : task_count;
+        for (int t = last - 1; t >= first; t--) {
+            int begin = t * grain;
+            int end = begin + grain < count ? begin + grain : count;
+            deque->tasks[deque->tail++] = (TaskRange) { .begin = begin, .end = end };
+        }
+    }
+
+    for (int i = 1; i < worker_count; i++) {
+        SDL_SemPost(jobStarted);
+    }
+
+    runWorkerJob(0);
+
+    for (int i = 1; i < worker_count; i++) {
+        SDL_SemWait(jobFinished);
+    }
+
+    SDL_UnlockMutex(jobLock);
+}
@@ -0,0 +1,64 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/*
+    A pool of persistent worker threads built on SDL_Thread, scheduling
+    work by work stealing.
+    The threads are created once at startup and sleep on a semaphore
+    between jobs. Every thread owns a deque of tasks: it pops work from
+    the back of its own deque, and once that runs dry it steals from the
+    front of the other threads' deques, so uneven tasks still balance out.
+*/
+
+/*
+    A unit of parallel work, covering the indices from begin up to (but not
+    including) end. It runs on whichever thread pops or steals it.
+*/
+typedef void (*WorkerTask)(int begin, int end, void *data);
+
+/*
+    Starts the pool with the given total number of threads, the calling
+    thread included. A count of 0 uses one thread per CPU core, or per CPU
+    given to placeWorkers.
+    Returns 0 on success and 1 if the threads could not be created.
+*/
+int startWorkers(int count);
+
+/*
+    Has the threads of the pool pinned to the given CPUs, thread i to
+    cpus[i % count], so a thread keeps working from the caches and memory
+    next to it. Must be called before startWorkers, which pins the helper
+    threads as they start; the thread that will call parallelFor pins
+    itself with pinWorkerThread.
+    Returns 0 on success and 1 if the CPUs could not be stored.
+*/
+int placeWorkers(const int *cpus, int count);
+
+/*
+    Pins the calling thread to the CPU of worker 0, which is whatever
+    thread calls parallelFor. Does nothing unless placeWorkers was called.
+    Returns 0 on success and 1 if the thread could not be pinned.
+*/
+int pinWorkerThread(void);
+
+/*
+    Wakes every worker up one last time and waits for them to exit.
+*/
+void stopWorkers(void);
+
+/*
+    Returns the total number of threads in the pool, the calling thread
+    included.
+*/
+int workerCount(void);
+
+/*
+    Splits the indices from 0 up to count into tasks of grain indices each,
+    runs them on every thread of the pool, and returns once all of them
+    are done. The calling thread works on the job too.
+    Any thread may call it; jobs from different threads run one after the
+    other.
+*/
+void parallelFor(int count, int grain, WorkerTask task, void *data);
+
+#endif